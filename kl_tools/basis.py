@@ -14,6 +14,7 @@ from scipy.special import eval_hermitenorm, genlaguerre, factorial, gamma
 
 import utils
 import likelihood
+import numba_basis
 from transformation import transform_coords
 
 import ipdb
@@ -167,6 +168,27 @@ class Basis(object):
         else:
             return self.convolve_basis_func(bfunc)
 
+    def get_basis_funcs(self, x, y):
+        '''
+        Return all N basis functions evaluated at (x,y) positions, as
+        the columns of a (len(x), N) array
+
+        x: numpy.ndarray (1D)
+            X positions to evaluate basis at
+        y: numpy.ndarray (1D)
+            Y positions to evaluate basis at
+        '''
+
+        if self.is_complex is True:
+            funcs = np.zeros((len(x), self.N), dtype=np.complex128)
+        else:
+            funcs = np.zeros((len(x), self.N))
+
+        for n in range(self.N):
+            funcs[:,n] = self.get_basis_func(n, x, y)
+
+        return funcs
+
     def render_im(self, theta_pars, coefficients, im_shape=None):
         '''
         Render image given transformation parameters andbasis coefficients
@@ -756,6 +778,30 @@ class ShapeletBasis(Basis):
 
         return
 
+    def get_basis_funcs(self, x, y):
+        '''
+        Return all N shapelet basis functions evaluated at (x,y) positions,
+        as the columns of a (len(x), N) array. Uses the compiled kernel in
+        numba_basis.py
+
+        x: numpy.ndarray (1D)
+            X positions to evaluate basis at
+        y: numpy.ndarray (1D)
+            Y positions to evaluate basis at
+        '''
+
+        funcs = numba_basis.eval_shapelet_design(
+            np.ascontiguousarray(x, dtype=float),
+            np.ascontiguousarray(y, dtype=float),
+            self.beta, self.Nmax, self.nx_of_n, self.ny_of_n
+            )
+
+        if self.psf is not None:
+            for n in range(self.N):
+                funcs[:,n] = self.convolve_basis_func(funcs[:,n])
+
+        return funcs
+
     def _setup_nxny_grid(self):
         '''
         We define here the mapping between the nth basis
@@ -784,6 +830,14 @@ class ShapeletBasis(Basis):
                 x -= 1
                 y += 1
 
+        # the inverse mapping, for the compiled kernels
+        self.nx_of_n = np.zeros(self.N, dtype=np.int64)
+        self.ny_of_n = np.zeros(self.N, dtype=np.int64)
+        for Nx in range(nmax+1):
+            for Ny in range(nmax+1-Nx):
+                n = int(self.ngrid[Nx, Ny])
+                self.nx_of_n[n], self.ny_of_n[n] = Nx, Ny
+
         return
 
     @staticmethod
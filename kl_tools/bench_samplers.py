@@ -0,0 +1,634 @@
+# This is to ensure that numpy doesn't have
+# OpenMP optimizations clobber our own multiprocessing
+import os
+os.environ['MKL_NUM_THREADS'] = '1'
+os.environ['NUMEXPR_NUM_THREADS'] = '1'
+os.environ['OMP_NUM_THREADS'] = '1'
+
+import numpy as np
+import json
+import subprocess
+import tempfile
+from datetime import datetime
+from time import time
+from argparse import ArgumentParser
+from astropy.units import Unit
+import schwimmbad
+
+import utils
+import priors
+import mocks
+import numba_isa
+from parameters import Pars
+from likelihood import LogPosterior, LogPrior
+from mcmc import build_mcmc_runner, ENSEMBLE_RUNNERS
+
+import ipdb
+
+'''
+A benchmark of the samplers in mcmc.py on a fixed set of mock posteriors
+from mocks.setup_likelihood_test(), so that the sampler & parallelism
+settings of a production run can be chosen from data. For each sampler
+we measure the effective samples per second & per likelihood call, the
+time to reach a target split-Rhat (MCMC samplers only) and the scaling
+of the wall time with the pool size.
+
+The dimensionality is set by sampling the first ndim parameters of
+BENCH_PARS w/ the rest fixed at their true values. The multimodal
+version of each posterior is exactly bimodal with equal mass in each
+mode, built by reflecting the likelihood about the prior center of
+theta_int. The fraction of samples in the reflected mode should be 0.5
+
+Results are written to a JSON report w/ a schema version, the git
+commit & the compiled kernel ISA; see write_report()
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('-samplers', type=str, nargs='+',
+                    default=['zeus', 'emcee', 'native', 'poco', 'nested'],
+                    help='Which samplers to benchmark')
+parser.add_argument('-ndims', type=int, nargs='+', default=[3, 5, 7],
+                    help='Posterior dimensionalities')
+parser.add_argument('-pool_sizes', type=int, nargs='+', default=[1, 2, 4],
+                    help='Pool sizes for the parallel scaling test')
+parser.add_argument('-nsteps', type=int, default=500,
+                    help='Number of steps for the MCMC samplers')
+parser.add_argument('-nwalkers', type=int, default=None,
+                    help='Walkers (or particles / live points). Defaults ' +\
+                    'to a per-sampler multiple of ndim')
+parser.add_argument('-target_rhat', type=float, default=1.01,
+                    help='The split-Rhat that counts as converged')
+parser.add_argument('-Nx', type=int, default=20,
+                    help='Size of the mock datacube slices')
+parser.add_argument('-outdir', type=str, default=None,
+                    help='Report directory. Defaults to the test dir')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+# the version of the report schema; bump when it changes
+REPORT_VERSION = 1
+
+# sampled in this order as ndim increases
+BENCH_PARS = ['sini', 'vcirc', 'theta_int', 'g1', 'g2', 'rscale', 'v0']
+
+# the parameter that is reflected for the multimodal posteriors
+REFLECT_PAR = 'theta_int'
+
+# walkers / particles / live points per dimension
+WALKERS_PER_DIM = {
+    'zeus': 4, 'emcee': 4, 'native': 4, 'poco': 50, 'nested': 50
+    }
+
+class SubspacePosterior(object):
+    '''
+    A LogPosterior over a subset of its sampled parameters, w/ the rest
+    fixed. Has the same interface as LogPosterior for the runners
+
+    Defined as a class so that it can be pickled for the pools
+    '''
+
+    def __init__(self, log_posterior, pars, theta0, reflect=None):
+        '''
+        log_posterior: LogPosterior
+            The posterior over all parameters
+        pars: Pars
+            The subset of parameters that is sampled. Must only have
+            priors for these
+        theta0: np.ndarray
+            The full parameter vector, giving the fixed values
+        reflect: (str, float)
+            A parameter & center to reflect the likelihood about, making
+            it bimodal. The prior of the parameter must be symmetric
+            about the center
+        '''
+
+        full_order = log_posterior.parameters.sampled.pars_order
+        pars_order = pars.sampled.pars_order
+
+        self.log_posterior = log_posterior
+        self.log_prior = LogPrior(pars)
+        self.theta0 = np.array(theta0, dtype=float)
+        self.indices = np.empty(len(pars_order), dtype=int)
+        for name, indx in pars_order.items():
+            self.indices[indx] = full_order[name]
+
+        if reflect is not None:
+            self.reflect = (pars_order[reflect[0]], reflect[1])
+        else:
+            self.reflect = None
+
+        return
+
+    def _full_loglike(self, theta, datavector):
+        full = self.theta0.copy()
+        full[self.indices] = theta
+
+        return self.log_posterior.log_likelihood(full, datavector)
+
+    def log_likelihood(self, theta, datavector):
+        theta = np.asarray(theta)
+        loglike = self._full_loglike(theta, datavector)
+
+        if self.reflect is not None:
+            indx, cen = self.reflect
+            mirror = theta.copy()
+            mirror[indx] = 2.*cen - theta[indx]
+            loglike = np.logaddexp(
+                loglike, self._full_loglike(mirror, datavector)
+                ) - np.log(2.)
+
+        return loglike
+
+    def __call__(self, theta, datavector, pars):
+        logprior = self.log_prior(theta)
+
+        if logprior == -np.inf:
+            return -np.inf, (-np.inf, -np.inf)
+
+        loglike = self.log_likelihood(theta, datavector)
+
+        return logprior + loglike, (logprior, loglike)
+
+class BenchmarkProblem(object):
+    '''
+    A mock datacube & posterior of a given dimensionality
+    '''
+
+    def __init__(self, ndim, multimodal=False, Nx=20, seed=42):
+        '''
+        ndim: int
+            The number of sampled parameters; see BENCH_PARS
+        multimodal: bool
+            Set to reflect the posterior about the prior center of
+            REFLECT_PAR
+        Nx: int
+            The size of the (square) datacube slices
+        seed: int
+            The mock noise seed
+        '''
+
+        if (ndim < 1) or (ndim > len(BENCH_PARS)):
+            raise ValueError(f'ndim must be between 1 & {len(BENCH_PARS)}!')
+
+        names = BENCH_PARS[:ndim]
+        if (multimodal is True) and (REFLECT_PAR not in names):
+            raise ValueError(f'Multimodal problems must sample {REFLECT_PAR}!')
+
+        self.ndim = ndim
+        self.multimodal = multimodal
+
+        self.true_pars = {
+            'g1': 0.025,
+            'g2': -0.0125,
+            'theta_int': np.pi / 6.,
+            'sini': 0.7,
+            'v0': 5.,
+            'vcirc': 200.,
+            'rscale': 3.,
+            }
+
+        all_priors = {
+            'g1': priors.GaussPrior(0., 0.1),
+            'g2': priors.GaussPrior(0., 0.1),
+            'theta_int': priors.UniformPrior(0., np.pi),
+            'sini': priors.UniformPrior(0., 1.),
+            'v0': priors.UniformPrior(0, 20),
+            'vcirc': priors.GaussPrior(200, 20),
+            'rscale': priors.UniformPrior(0, 10),
+            }
+
+        meta = {
+            'units': {'v_unit': Unit('km/s'), 'r_unit': Unit('kpc')},
+            'priors': all_priors,
+            'intensity': {'type': 'inclined_exp', 'flux': 3.8e4, 'hlr': 3.5},
+            'velocity': {'model': 'centered'},
+            'run_options': {'native': True},
+            }
+
+        datacube_pars = {
+            'Nx': Nx,
+            'Ny': Nx,
+            'pix_scale': 0.5,
+            'true_flux': 3.8e4,
+            'true_hlr': 3.5,
+            'v_model': 'centered',
+            'v_unit': Unit('km/s'),
+            'r_unit': Unit('kpc'),
+            'z': 0.3,
+            'R': 5000.,
+            'sky_sigma': 0.5,
+            }
+
+        np.random.seed(seed)
+        self.datacube, _, _ = mocks.setup_likelihood_test(
+            self.true_pars, datacube_pars
+            )
+
+        full_pars = Pars(list(self.true_pars.keys()), meta)
+        log_posterior = LogPosterior(full_pars, self.datacube,
+                                     likelihood='datacube')
+        theta0 = full_pars.pars2theta(self.true_pars)
+
+        sub_meta = dict(meta)
+        sub_meta['priors'] = {name: all_priors[name] for name in names}
+        self.pars = Pars(names, sub_meta)
+
+        if multimodal is True:
+            reflect = (REFLECT_PAR, all_priors[REFLECT_PAR].cen)
+        else:
+            reflect = None
+        self.reflect = reflect
+
+        self.posterior = SubspacePosterior(
+            log_posterior, self.pars, theta0, reflect=reflect
+            )
+
+        return
+
+    @property
+    def name(self):
+        mode = 'bimodal' if self.multimodal is True else 'unimodal'
+        return f'{self.ndim}d-{mode}'
+
+    def build_runner(self, sampler, nwalkers=None):
+        '''
+        sampler: str
+            A registered runner type; see mcmc.RUNNER_TYPES
+        nwalkers: int
+            Walkers, particles or live points. Defaults to
+            WALKERS_PER_DIM * ndim
+        '''
+
+        if nwalkers is None:
+            nwalkers = WALKERS_PER_DIM[sampler] * self.ndim
+            # the ensemble samplers need an even number
+            nwalkers = max(nwalkers, 2*self.ndim + 2)
+
+        post = self.posterior
+        if sampler in ENSEMBLE_RUNNERS:
+            args = [nwalkers, self.ndim, post, self.datacube, self.pars]
+        else:
+            args = [nwalkers, self.ndim, post.log_likelihood, post.log_prior,
+                    self.datacube, self.pars]
+
+        return build_mcmc_runner(sampler, args, {})
+
+    def mode_fraction(self, samples):
+        '''
+        The fraction of samples in the reflected mode. Should be ~0.5
+        for a multimodal problem
+        '''
+
+        if self.reflect is None:
+            return None
+
+        indx = self.pars.sampled.pars_order[self.reflect[0]]
+        true = self.true_pars[self.reflect[0]]
+        cen = self.reflect[1]
+
+        mirrored = np.sign(samples[:,indx] - cen) != np.sign(true - cen)
+
+        return float(np.mean(mirrored))
+
+def integrated_autocorr_time(chain, c=5.):
+    '''
+    The integrated autocorrelation time of each parameter of an ensemble
+    chain, using the walker-averaged autocorrelation function & the
+    automated windowing of Sokal (1989)
+
+    chain: np.ndarray
+        The (nsteps, nwalkers, ndim) chain
+
+    returns: np.ndarray
+        The (ndim,) autocorrelation times
+    '''
+
+    nsteps, nwalkers, ndim = chain.shape
+
+    # the next power of 2 for the zero-padded FFT
+    n = 1 << (2*nsteps - 1).bit_length()
+
+    tau = np.empty(ndim)
+    for d in range(ndim):
+        x = chain[:,:,d] - np.mean(chain[:,:,d], axis=0)
+        f = np.fft.rfft(x, n=n, axis=0)
+        acf = np.fft.irfft(f * np.conjugate(f), n=n, axis=0)[:nsteps]
+        acf = np.mean(acf, axis=1)
+
+        if acf[0] <= 0:
+            # a constant chain
+            tau[d] = np.inf
+            continue
+        acf /= acf[0]
+
+        taus = 2.*np.cumsum(acf) - 1.
+        window = np.arange(nsteps) < c*taus
+        M = np.argmin(window) if not np.all(window) else nsteps - 1
+        tau[d] = taus[M]
+
+    return tau
+
+def compute_ess(chain=None, samples=None, logwt=None):
+    '''
+    The effective number of samples, from an ensemble chain (w/ the
+    worst-mixing parameter), importance weights (Kish) or else the
+    number of samples
+
+    chain: np.ndarray
+        The (nsteps, nwalkers, ndim) chain of an MCMC sampler
+    samples: np.ndarray
+        The (nsamples, ndim) samples
+    logwt: np.ndarray
+        The (nsamples,) log importance weights of the samples
+    '''
+
+    if chain is not None:
+        nsteps, nwalkers, _ = chain.shape
+        tau = np.max(integrated_autocorr_time(chain))
+        return float(nsteps * nwalkers / max(tau, 1.))
+
+    elif logwt is not None:
+        w = np.exp(logwt - np.max(logwt))
+        return float(np.sum(w)**2 / np.sum(w**2))
+
+    elif samples is not None:
+        return float(len(samples))
+
+    else:
+        raise ValueError('Must pass one of chain, samples or logwt!')
+
+def split_rhat(chain):
+    '''
+    The split-Rhat of each parameter, treating each walker as a chain
+    & discarding the first half of the steps
+
+    chain: np.ndarray
+        The (nsteps, nwalkers, ndim) chain
+    '''
+
+    nsteps = chain.shape[0]
+    half = chain[nsteps//2:]
+    n = half.shape[0] // 2
+
+    if n < 2:
+        return np.full(chain.shape[2], np.inf)
+
+    chains = np.concatenate([half[:n], half[n:2*n]], axis=1)
+
+    W = np.mean(np.var(chains, axis=0, ddof=1), axis=0)
+    B = n * np.var(np.mean(chains, axis=0), axis=0, ddof=1)
+
+    with np.errstate(divide='ignore', invalid='ignore'):
+        rhat = np.sqrt(((n - 1.) / n * W + B / n) / W)
+
+    return rhat
+
+def time_to_rhat(chain, wall_time, target=1.01, Ncheck=20):
+    '''
+    An estimate of the wall time needed to reach a split-Rhat below the
+    target for all parameters, assuming a constant time per step
+
+    returns: float, None
+        None if the target was never reached
+    '''
+
+    nsteps = chain.shape[0]
+
+    for t in np.linspace(nsteps/Ncheck, nsteps, Ncheck).astype(int):
+        if np.all(split_rhat(chain[:t]) < target):
+            return float(wall_time * t / nsteps)
+
+    return None
+
+def get_pool(size):
+    if size == 1:
+        return schwimmbad.SerialPool()
+    else:
+        return schwimmbad.MultiPool(processes=size)
+
+def run_benchmark(problem, sampler, pool_size=1, nsteps=500, nwalkers=None,
+                  target_rhat=1.01):
+    '''
+    Run one sampler on one problem & measure its efficiency
+
+    returns: dict
+    '''
+
+    runner = problem.build_runner(sampler, nwalkers=nwalkers)
+
+    # only the MCMC samplers take a fixed number of steps
+    if sampler in ENSEMBLE_RUNNERS:
+        run_steps = nsteps
+    else:
+        run_steps = None
+
+    start = time()
+    runner.run(get_pool(pool_size), nsteps=run_steps, vb=False,
+               queue_size=pool_size)
+    wall_time = time() - start
+
+    ncall = runner.get_ncall()
+
+    chain = None
+    if sampler in ENSEMBLE_RUNNERS:
+        chain = runner.sampler.get_chain()
+        # discard the first half as burn-in for the ESS
+        ess = compute_ess(chain=chain[chain.shape[0]//2:])
+        samples = chain[chain.shape[0]//2:].reshape(-1, problem.ndim)
+        t_rhat = time_to_rhat(chain, wall_time, target=target_rhat)
+    elif sampler == 'nested':
+        results = runner.sampler.results
+        ess = compute_ess(logwt=results.logwt)
+        samples = runner.get_samples()
+        t_rhat = None
+    else:
+        samples = runner.get_particles()
+        ess = compute_ess(samples=np.unique(samples, axis=0))
+        t_rhat = None
+
+    result = {
+        'sampler': sampler,
+        'problem': problem.name,
+        'ndim': problem.ndim,
+        'multimodal': problem.multimodal,
+        'nwalkers': runner.nwalkers,
+        'pool_size': pool_size,
+        'wall_time': wall_time,
+        'ncall': ncall,
+        'ess': ess,
+        'ess_per_sec': ess / wall_time,
+        'ess_per_call': ess / max(ncall, 1),
+        'time_to_rhat': t_rhat,
+        'mode_fraction': problem.mode_fraction(samples),
+        }
+
+    return result
+
+def get_git_hash():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'], cwd=utils.get_module_dir(),
+            stderr=subprocess.DEVNULL
+            ).decode().strip()
+    except (subprocess.CalledProcessError, OSError):
+        return None
+
+def write_report(outdir, results, scaling, settings):
+    '''
+    Write a versioned JSON report of the benchmark
+
+    outdir: str
+        The report directory
+    results: list
+        The run_benchmark() dicts
+    scaling: list
+        The parallel scaling dicts
+    settings: dict
+        The benchmark settings
+
+    returns: str
+        The report filename
+    '''
+
+    utils.make_dir(outdir)
+
+    created = datetime.now()
+    report = {
+        'report_version': REPORT_VERSION,
+        'created': created.isoformat(),
+        'git_hash': get_git_hash(),
+        'kernel_isa': numba_isa.get_kernel_isa(),
+        'settings': settings,
+        'results': results,
+        'scaling': scaling,
+        }
+
+    stamp = created.strftime('%Y%m%d-%H%M%S')
+    outfile = os.path.join(
+        outdir, f'bench-samplers-v{REPORT_VERSION}-{stamp}.json'
+        )
+    with open(outfile, 'w') as f:
+        json.dump(report, f, indent=2)
+
+    return outfile
+
+def run_all(args):
+    '''
+    Run the full benchmark & write the report
+    '''
+
+    settings = {k: v for k, v in vars(args).items() if k != 'test'}
+
+    results = []
+    for ndim in args.ndims:
+        for multimodal in [False, True]:
+            if (multimodal is True) and (REFLECT_PAR not in BENCH_PARS[:ndim]):
+                continue
+            problem = BenchmarkProblem(ndim, multimodal=multimodal, Nx=args.Nx)
+            for sampler in args.samplers:
+                print(f'Benchmarking {sampler} on {problem.name}')
+                res = run_benchmark(
+                    problem, sampler, nsteps=args.nsteps,
+                    nwalkers=args.nwalkers, target_rhat=args.target_rhat
+                    )
+                print(f'{sampler}: {res["ess_per_sec"]:.2f} ESS/s, ' +\
+                      f'{res["ess_per_call"]:.4f} ESS/call')
+                results.append(res)
+
+    # parallel scaling on the largest unimodal problem
+    problem = BenchmarkProblem(max(args.ndims), Nx=args.Nx)
+    scaling = []
+    for sampler in args.samplers:
+        base_time = None
+        for size in args.pool_sizes:
+            print(f'Benchmarking {sampler} w/ a pool of size {size}')
+            res = run_benchmark(
+                problem, sampler, pool_size=size, nsteps=args.nsteps,
+                nwalkers=args.nwalkers, target_rhat=args.target_rhat
+                )
+            if base_time is None:
+                base_time = res['wall_time'] * args.pool_sizes[0]
+            scaling.append({
+                'sampler': sampler,
+                'problem': problem.name,
+                'pool_size': size,
+                'wall_time': res['wall_time'],
+                'ess_per_sec': res['ess_per_sec'],
+                'speedup': base_time / res['wall_time'],
+                })
+
+    outdir = args.outdir
+    if outdir is None:
+        outdir = os.path.join(utils.TEST_DIR, 'bench-samplers')
+
+    outfile = write_report(outdir, results, scaling, settings)
+    print(f'Wrote benchmark report to {outfile}')
+
+    return outfile
+
+def main(args):
+    '''
+    For now, just used for testing the diagnostics
+    '''
+
+    print('Testing autocorrelation time & ESS')
+    # AR(1) chains have tau = (1 + rho) / (1 - rho)
+    rho, nsteps, nwalkers = 0.8, 20000, 8
+    x = np.zeros((nsteps, nwalkers, 1))
+    noise = np.random.randn(nsteps, nwalkers)
+    for i in range(1, nsteps):
+        x[i,:,0] = rho*x[i-1,:,0] + noise[i]
+    tau = integrated_autocorr_time(x)[0]
+    assert np.isclose(tau, (1.+rho) / (1.-rho), rtol=0.1)
+    assert np.isclose(compute_ess(chain=x), nsteps*nwalkers/tau)
+
+    logwt = np.log(np.array([1., 1., 1., 1.]))
+    assert np.isclose(compute_ess(logwt=logwt), 4.)
+    assert np.isclose(compute_ess(logwt=np.array([0., -np.inf])), 1.)
+
+    print('Testing split-Rhat')
+    iid = np.random.randn(1000, 8, 2)
+    assert np.all(split_rhat(iid) < 1.01)
+    stuck = iid + np.arange(8)[None,:,None]
+    assert np.all(split_rhat(stuck) > 1.5)
+    assert time_to_rhat(iid, 10.) <= 10.
+    assert time_to_rhat(stuck, 10.) is None
+
+    print('Testing benchmark problems')
+    problem = BenchmarkProblem(3, multimodal=True, Nx=12)
+    post = problem.posterior
+    theta = problem.pars.pars2theta(
+        {name: problem.true_pars[name] for name in BENCH_PARS[:3]}
+        )
+    mirror = theta.copy()
+    mirror[2] = np.pi - theta[2]
+    assert np.isclose(post.log_likelihood(theta, problem.datacube),
+                      post.log_likelihood(mirror, problem.datacube))
+    assert problem.mode_fraction(np.array([theta, mirror])) == 0.5
+    logpost, (logprior, loglike) = post(theta, problem.datacube, problem.pars)
+    assert np.isclose(logpost, logprior + loglike)
+
+    print('Testing the report')
+    outdir = tempfile.mkdtemp()
+    outfile = write_report(outdir, [{'sampler': 'test'}], [], {'ndims': [3]})
+    with open(outfile, 'r') as f:
+        report = json.load(f)
+    assert report['report_version'] == REPORT_VERSION
+    assert report['kernel_isa'] == numba_isa.get_kernel_isa()
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
+    else:
+        run_all(args)
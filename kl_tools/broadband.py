@@ -0,0 +1,268 @@
+import numpy as np
+import os
+from argparse import ArgumentParser
+import galsim as gs
+
+import utils
+import gaussmix
+from datavector import DataVector
+from cube import DataCube, setup_simple_bandpasses
+
+import ipdb
+
+'''
+This file defines a composite datavector of a DataCube along with a
+higher resolution broadband image of the same object, which has its own
+PSF, pixel scale, and position offset.
+
+The broadband image only constrains the shape of the intensity map, not
+the kinematics, so the intensity basis can be fit to it instead of to the
+(noisy) stacked datacube. See intensity.ImageBasisIntensityMap and
+likelihood.CubeImageLikelihood
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class BroadbandImage(DataVector):
+    '''
+    A single broadband image. Has just enough of the DataCube interface
+    (Nx, Ny, pix_scale, get_psf(), stack()) for an intensity basis to be
+    fit to it
+    '''
+
+    def __init__(self, image, pix_scale, psf=None, weights=None,
+                 offset=(0., 0.)):
+        '''
+        image: np.ndarray
+            The (Nx, Ny) image
+        pix_scale: float
+            The image pixel scale, in arcsec
+        psf: galsim.GSObject
+            The image PSF
+        weights: float, np.ndarray
+            The inverse-sigma weight map of the image. Defaults to 1
+        offset: tuple
+            The (x,y) position of the image center relative to the
+            datacube center, in arcsec
+        '''
+
+        image = np.asarray(image, dtype=float)
+        if len(image.shape) != 2:
+            raise ValueError('image must be 2D!')
+
+        if not isinstance(pix_scale, (int, float)):
+            raise TypeError('pix_scale must be an int or float!')
+
+        if psf is not None:
+            utils.check_type(psf, 'psf', gs.GSObject)
+
+        if weights is None:
+            weights = 1.
+        if isinstance(weights, (int, float)):
+            weights = weights * np.ones(image.shape)
+        elif weights.shape != image.shape:
+            raise ValueError('weights must have the same shape as image!')
+
+        self.image = image
+        self.pix_scale = pix_scale
+        self.psf = psf
+        self.weights = weights
+        self.offset = tuple(float(o) for o in offset)
+
+        self.Nx, self.Ny = image.shape
+        self.shape = image.shape
+
+        self._psf_mix_cache = {}
+
+        return
+
+    def get_psf(self, wavelength=None, wav_unit=None):
+        return self.psf
+
+    def get_psf_mixture(self, K=3):
+        '''
+        Return the K-component MoG approximation of the image PSF, in
+        arcsec; see gaussmix.fit_psf_mixture(). The fit draws the PSF, so
+        it is cached for the current PSF & pixel scale
+
+        K: int
+            The number of components
+        '''
+
+        if self.psf is None:
+            return None
+
+        # the PSF is held in the cache so that its id can't be reused
+        key = (id(self.psf), self.pix_scale, K)
+        cached = self._psf_mix_cache.get(key, None)
+        if (cached is None) or (cached[0] is not self.psf):
+            mixture = gaussmix.fit_psf_mixture(self.psf, self.pix_scale, K=K)
+            cached = (self.psf, mixture)
+            self._psf_mix_cache[key] = cached
+
+        return cached[1]
+
+    def get_continuum(self):
+        # broadband images have no separate continuum template
+        return None
+
+    def stack(self):
+        return self.image
+
+    def cube_to_image_coords(self, X, Y, cube_pix_scale):
+        '''
+        Map datacube pixel positions to image pixel positions
+
+        X, Y: np.ndarray
+            The positions relative to the datacube center, in datacube
+            pixels
+        cube_pix_scale: float
+            The datacube pixel scale, in arcsec
+        '''
+
+        x = (X * cube_pix_scale - self.offset[0]) / self.pix_scale
+        y = (Y * cube_pix_scale - self.offset[1]) / self.pix_scale
+
+        return x, y
+
+class CubeImageDataVector(DataVector):
+    '''
+    A DataCube & BroadbandImage of the same object
+
+    For everything but the intensity map, this behaves like the datacube
+    '''
+
+    def __init__(self, datacube, image):
+        '''
+        datacube: DataCube
+            The datacube, truncated to desired lambda bounds
+        image: BroadbandImage
+            The broadband image
+        '''
+
+        utils.check_type(datacube, 'datacube', DataCube)
+        utils.check_type(image, 'image', BroadbandImage)
+
+        self.cube = datacube
+        self.image = image
+
+        return
+
+    @property
+    def pars(self):
+        return self.cube.pars
+
+    @property
+    def shape(self):
+        return self.cube.shape
+
+    @property
+    def Nspec(self):
+        return self.cube.Nspec
+
+    @property
+    def Nx(self):
+        return self.cube.Nx
+
+    @property
+    def Ny(self):
+        return self.cube.Ny
+
+    @property
+    def pix_scale(self):
+        return self.cube.pix_scale
+
+    @property
+    def lambdas(self):
+        return self.cube.lambdas
+
+    @property
+    def lambda_unit(self):
+        return self.cube.lambda_unit
+
+    @property
+    def data(self):
+        return self.cube.data
+
+    @property
+    def weights(self):
+        return self.cube.weights
+
+    def get_sed(self, line_index=None, line_pars_update=None):
+        return self.cube.get_sed(
+            line_index=line_index, line_pars_update=line_pars_update
+            )
+
+    def get_psf(self, wavelength=None, wav_unit=None):
+        return self.cube.get_psf(wavelength=wavelength, wav_unit=wav_unit)
+
+    def has_chromatic_psf(self):
+        return self.cube.has_chromatic_psf()
+
+    def get_psf_transfer(self, indx):
+        return self.cube.get_psf_transfer(indx)
+
+    def get_inv_cov_list(self):
+        return self.cube.get_inv_cov_list()
+
+    def get_continuum(self):
+        return self.cube.get_continuum()
+
+    def get_continuum_model(self):
+        return self.cube.get_continuum_model()
+
+    def stack(self):
+        return self.cube.stack()
+
+def main(args):
+    '''
+    For now, just used for testing the coordinate mapping
+    '''
+
+    bandpasses = setup_simple_bandpasses(500, 505, 1)
+    cube = DataCube(
+        data=np.zeros((5, 20, 20)),
+        pars={'pix_scale': 0.5, 'bandpasses': bandpasses}
+        )
+
+    print('Testing cube to image coordinates')
+    image = BroadbandImage(
+        np.zeros((80, 80)), 0.125, psf=gs.Gaussian(fwhm=0.2),
+        offset=(0.25, -0.5)
+        )
+    X, Y = utils.build_map_grid(cube.Nx, cube.Ny)
+    x, y = image.cube_to_image_coords(X, Y, cube.pix_scale)
+    assert np.allclose(x, 4*X - 2)
+    assert np.allclose(y, 4*Y + 4)
+
+    print('Testing CubeImageDataVector')
+    composite = CubeImageDataVector(cube, image)
+    assert composite.shape == cube.shape
+    assert composite.image.get_psf() is image.psf
+
+    print('Testing the cached PSF mixture')
+    image.psf = gs.Moffat(beta=3., fwhm=0.3)
+    mixture = image.get_psf_mixture(K=3)
+    assert image.get_psf_mixture(K=3) is mixture
+    assert image.get_psf_mixture(K=2) is not mixture
+    image.psf = gs.Moffat(beta=3., fwhm=0.4)
+    assert image.get_psf_mixture(K=3) is not mixture
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
@@ -0,0 +1,822 @@
+import numpy as np
+import os
+import json
+from argparse import ArgumentParser
+import matplotlib.pyplot as plt
+
+import utils
+
+import ipdb
+
+'''
+This file contains an out-of-core store for ensemble chains, & plots
+built from it in bounded memory. A store is a directory of .npy chunks
+(one per append, e.g. per sampler checkpoint) of shape (Nsteps, Nwalkers,
+Ndim), w/ an index in meta.json. Chunks are only ever read as memory
+maps, a block of steps at a time.
+
+The corner plot is drawn from 1D & 2D histograms that are accumulated
+block by block, the trace plot from quantiles of the walkers in bins of
+steps, & the autocorrelation from the walkers in groups. None of these
+load the full chain, so they run at about the speed the store is read
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class ChainStore(object):
+    '''
+    A directory of memory-mapped chain chunks
+    '''
+
+    _meta_file = 'meta.json'
+
+    def __init__(self, directory, nwalkers=None, ndim=None, names=None):
+        '''
+        directory: str
+            The store directory. Opened if it has a store, else created
+        nwalkers: int
+            The number of walkers. Needed to create a store
+        ndim: int
+            The number of sampled dimensions. Needed to create a store
+        names: list
+            The parameter names, in sampled order. Optional
+        '''
+
+        self.directory = directory
+        meta_file = os.path.join(directory, self._meta_file)
+
+        if os.path.exists(meta_file):
+            with open(meta_file, 'r') as f:
+                meta = json.load(f)
+            for key, val in {'nwalkers': nwalkers, 'ndim': ndim}.items():
+                if (val is not None) and (val != meta[key]):
+                    raise ValueError(f'The store at {directory} has ' +\
+                                     f'{key}={meta[key]}, not {val}!')
+            if (names is not None) and (list(names) != meta['names']):
+                raise ValueError(f'The store at {directory} has different ' +\
+                                 'parameter names!')
+        else:
+            if (nwalkers is None) or (ndim is None):
+                raise ValueError('Must pass nwalkers & ndim to create a ' +\
+                                 'new chain store!')
+            if (names is not None) and (len(names) != ndim):
+                raise ValueError('Must have one name per dimension!')
+            utils.make_dir(directory)
+            meta = {
+                'nwalkers': int(nwalkers),
+                'ndim': int(ndim),
+                'names': list(names) if names is not None else None,
+                'chunks': [],
+                'has_log_prob': None,
+                }
+
+        self.meta = meta
+
+        # an opened store is only written to on append
+        if not os.path.exists(meta_file):
+            self._write_meta()
+
+        return
+
+    def _write_meta(self):
+        # replaced atomically, so a crash mid-write keeps the old index
+        meta_file = os.path.join(self.directory, self._meta_file)
+        tmp_file = meta_file + '.tmp'
+        with open(tmp_file, 'w') as f:
+            json.dump(self.meta, f)
+        os.replace(tmp_file, meta_file)
+
+        return
+
+    @property
+    def nwalkers(self):
+        return self.meta['nwalkers']
+
+    @property
+    def ndim(self):
+        return self.meta['ndim']
+
+    @property
+    def names(self):
+        names = self.meta['names']
+        if names is None:
+            names = [f'theta_{i}' for i in range(self.ndim)]
+        return names
+
+    @property
+    def nsteps(self):
+        return int(np.sum(self.meta['chunks']))
+
+    @property
+    def has_log_prob(self):
+        return self.meta['has_log_prob'] is True
+
+    def _chunk_file(self, i, kind='chain'):
+        return os.path.join(self.directory, f'{kind}-{i:05d}.npy')
+
+    def append(self, chain, log_prob=None):
+        '''
+        chain: np.ndarray
+            The (Nsteps, Nwalkers, Ndim) new steps
+        log_prob: np.ndarray
+            The (Nsteps, Nwalkers) log probs of the new steps. Must be
+            passed for every append or none
+        '''
+
+        chain = np.asarray(chain, dtype=float)
+        shape = (self.nwalkers, self.ndim)
+        if (chain.ndim != 3) or (chain.shape[1:] != shape):
+            raise ValueError(f'chain must have shape (Nsteps, {shape[0]}, ' +\
+                             f'{shape[1]}); got {chain.shape}!')
+
+        has_log_prob = log_prob is not None
+        if self.meta['has_log_prob'] is None:
+            self.meta['has_log_prob'] = has_log_prob
+        elif self.meta['has_log_prob'] != has_log_prob:
+            raise ValueError('log_prob must be passed for every append ' +\
+                             'or none!')
+
+        i = len(self.meta['chunks'])
+        np.save(self._chunk_file(i), chain)
+        if has_log_prob is True:
+            log_prob = np.asarray(log_prob, dtype=float)
+            if log_prob.shape != chain.shape[:2]:
+                raise ValueError(f'log_prob must have shape {chain.shape[:2]}!')
+            np.save(self._chunk_file(i, 'log_prob'), log_prob)
+
+        self.meta['chunks'].append(int(chain.shape[0]))
+        self._write_meta()
+
+        return
+
+    def iter_blocks(self, start=0, stop=None, max_steps=1000, kind='chain'):
+        '''
+        Iterate over memory-mapped blocks of steps
+
+        start, stop: int
+            The step range
+        max_steps: int
+            The max number of steps per block
+        kind: str
+            One of 'chain' or 'log_prob'
+
+        yields: (int, np.ndarray)
+            The first step of the block & the block of steps
+        '''
+
+        if (kind == 'log_prob') and (self.has_log_prob is False):
+            raise ValueError('The store has no log probs!')
+
+        if stop is None:
+            stop = self.nsteps
+
+        offset = 0
+        for i, n in enumerate(self.meta['chunks']):
+            lo, hi = max(start, offset), min(stop, offset + n)
+            if lo < hi:
+                data = np.load(self._chunk_file(i, kind), mmap_mode='r')
+                for s in range(lo, hi, max_steps):
+                    e = min(s + max_steps, hi)
+                    yield s, data[s-offset:e-offset]
+            offset += n
+
+        return
+
+    def iter_samples(self, discard=0, thin=1, max_steps=1000):
+        '''
+        Iterate over flattened blocks of samples
+
+        discard: int
+            The number of steps to discard, from 0:discard
+        thin: int
+            Keep every thin-th step after discard
+
+        yields: np.ndarray
+            The (Nblock*Nwalkers, Ndim) samples
+        '''
+
+        for s, block in self.iter_blocks(start=discard, max_steps=max_steps):
+            # thin on the global step index
+            first = (-(s - discard)) % thin
+            block = np.asarray(block[first::thin])
+            if len(block) > 0:
+                yield block.reshape(-1, self.ndim)
+
+        return
+
+    def get_chain(self, flat=False, discard=0, thin=1):
+        '''
+        Load the chain into memory, as for the samplers. Only for stores
+        that fit in memory
+
+        returns: np.ndarray
+        '''
+        return self._get('chain', flat, discard, thin)
+
+    def get_log_prob(self, flat=False, discard=0, thin=1):
+        return self._get('log_prob', flat, discard, thin)
+
+    def _get(self, kind, flat, discard, thin):
+        blocks = [np.array(block) for s, block in
+                  self.iter_blocks(start=discard, kind=kind)]
+        if len(blocks) == 0:
+            shape = (0, self.nwalkers)
+            if kind == 'chain':
+                shape += (self.ndim,)
+            values = np.empty(shape)
+        else:
+            values = np.concatenate(blocks)[::thin]
+
+        if flat is True:
+            values = values.reshape((-1,) + values.shape[2:])
+
+        return values
+
+    def read_walkers(self, indx=None, start=0, walkers=None):
+        '''
+        The series of a group of walkers
+
+        indx: int
+            The parameter index. Defaults to all parameters
+        start: int
+            The first step
+        walkers: slice
+            The walkers. Defaults to all
+
+        returns: np.ndarray
+            The (Nsteps, Nwalkers) series, or (Nsteps, Nwalkers, Ndim)
+            if indx is None
+        '''
+
+        if walkers is None:
+            walkers = slice(None)
+        if indx is None:
+            indx = slice(None)
+
+        blocks = [np.array(block[:, walkers, indx])
+                  for s, block in self.iter_blocks(start=start)]
+
+        return np.concatenate(blocks)
+
+def iter_samples(store, discard=0, thin=1, max_steps=1000, derived=None):
+    '''
+    As ChainStore.iter_samples(), w/ derived parameters appended
+
+    derived: function
+        Maps a (Nsamples, Ndim) block of samples to the (Nsamples,) or
+        (Nsamples, Nderived) derived parameters. Optional
+    '''
+
+    for samples in store.iter_samples(discard, thin, max_steps):
+        if derived is not None:
+            samples = np.column_stack([samples, derived(samples)])
+        yield samples
+
+    return
+
+def get_ranges(store, discard=0, thin=1, max_steps=1000, derived=None):
+    '''
+    The (min, max) of each parameter, in one pass over the store
+
+    derived: function
+        See iter_samples()
+
+    returns: np.ndarray
+        The (Ndim, 2) ranges, w/ a row per derived parameter appended
+    '''
+
+    ranges = None
+    for samples in iter_samples(store, discard, thin, max_steps, derived):
+        if ranges is None:
+            ranges = np.empty((samples.shape[1], 2))
+            ranges[:,0], ranges[:,1] = np.inf, -np.inf
+        ranges[:,0] = np.minimum(ranges[:,0], np.min(samples, axis=0))
+        ranges[:,1] = np.maximum(ranges[:,1], np.max(samples, axis=0))
+
+    if (ranges is None) or (not np.all(np.isfinite(ranges))):
+        raise ValueError('No samples in the store after discard!')
+
+    # a parameter that never moved still needs a finite bin width
+    flat = ranges[:,1] <= ranges[:,0]
+    ranges[flat,0] -= 0.5
+    ranges[flat,1] += 0.5
+
+    return ranges
+
+class BinnedChainStats(object):
+    '''
+    1D & 2D histograms of every parameter (pair), along w/ the mean &
+    variance, accumulated from blocks of samples
+    '''
+
+    def __init__(self, ranges, bins=50):
+        '''
+        ranges: np.ndarray
+            The (Ndim, 2) histogram range of each parameter
+        bins: int
+            The number of bins per parameter
+        '''
+
+        ranges = np.array(ranges, dtype=float)
+        if (ranges.ndim != 2) or (ranges.shape[1] != 2):
+            raise ValueError('ranges must have shape (Ndim, 2)!')
+        if np.any(ranges[:,1] <= ranges[:,0]):
+            raise ValueError('Each range must be increasing!')
+
+        self.ranges = ranges
+        self.bins = bins
+        self.ndim = len(ranges)
+
+        self.edges = np.array([np.linspace(lo, hi, bins+1)
+                               for lo, hi in ranges])
+
+        self.hist1d = np.zeros((self.ndim, bins))
+        # only i > j is filled, w/ rows along parameter i
+        self.hist2d = np.zeros((self.ndim, self.ndim, bins, bins))
+
+        self.n = 0
+        self.noutside = np.zeros(self.ndim, dtype=int)
+        self._mean = np.zeros(self.ndim)
+        self._M2 = np.zeros(self.ndim)
+
+        return
+
+    def update(self, samples):
+        '''
+        samples: np.ndarray
+            The (Nsamples, Ndim) block of samples
+        '''
+
+        samples = np.atleast_2d(samples)
+        n = len(samples)
+        if n == 0:
+            return
+
+        # merge the block mean & variance (Chan et al.)
+        mean = np.mean(samples, axis=0)
+        M2 = np.sum((samples - mean)**2, axis=0)
+        delta = mean - self._mean
+        total = self.n + n
+        self._mean += delta * n / total
+        self._M2 += M2 + delta**2 * self.n * n / total
+        self.n = total
+
+        lo, hi = self.ranges[:,0], self.ranges[:,1]
+        indx = np.floor((samples - lo) / (hi - lo) * self.bins).astype(int)
+        # the upper edge is in the last bin
+        indx[samples == hi] = self.bins - 1
+        inside = (indx >= 0) & (indx < self.bins)
+        self.noutside += np.sum(~inside, axis=0)
+
+        B = self.bins
+        for i in range(self.ndim):
+            self.hist1d[i] += np.bincount(indx[inside[:,i], i], minlength=B)
+            for j in range(i):
+                both = inside[:,i] & inside[:,j]
+                flat = indx[both, i]*B + indx[both, j]
+                self.hist2d[i,j] += np.bincount(
+                    flat, minlength=B*B
+                    ).reshape(B, B)
+
+        return
+
+    @property
+    def mean(self):
+        return self._mean.copy()
+
+    @property
+    def std(self):
+        if self.n < 2:
+            return np.zeros(self.ndim)
+        return np.sqrt(self._M2 / (self.n - 1))
+
+    def quantiles(self, q):
+        '''
+        Quantiles from the 1D histograms, interpolated within bins
+
+        q: list
+            The quantiles, in [0, 1]
+
+        returns: np.ndarray
+            The (Nq, Ndim) quantiles
+        '''
+
+        q = np.atleast_1d(q)
+        out = np.empty((len(q), self.ndim))
+        for i in range(self.ndim):
+            cdf = np.concatenate([[0.], np.cumsum(self.hist1d[i])])
+            cdf /= max(cdf[-1], 1.)
+            out[:,i] = np.interp(q, cdf, self.edges[i])
+
+        return out
+
+def compute_binned_stats(store, discard=0, thin=1, bins=50, ranges=None,
+                         max_steps=1000, derived=None):
+    '''
+    Accumulate the histograms of a store. Takes a first pass for the
+    ranges if they are not passed
+
+    derived: function
+        See iter_samples(). The derived parameters are binned after
+        the sampled ones
+
+    returns: BinnedChainStats
+    '''
+
+    if ranges is None:
+        ranges = get_ranges(store, discard, thin, max_steps, derived)
+
+    stats = BinnedChainStats(ranges, bins=bins)
+    for samples in iter_samples(store, discard, thin, max_steps, derived):
+        stats.update(samples)
+
+    return stats
+
+def compute_binned_trace(store, nbins=200, quantiles=(0.025, 0.16, 0.5,
+                                                      0.84, 0.975),
+                         max_steps=1000):
+    '''
+    Quantiles of the walkers over bins of steps, for a trace plot. Bins
+    w/ more than max_steps steps are read w/ a stride
+
+    returns: dict
+        steps: The (Nbins,) center step of each bin
+        quantiles: The (Nbins, Nq, Ndim) walker quantiles
+        mean: The (Nbins, Ndim) walker means
+    '''
+
+    nsteps = store.nsteps
+    if nsteps == 0:
+        raise ValueError('The store is empty!')
+
+    edges = np.unique(np.linspace(0, nsteps, nbins+1).astype(int))
+
+    centers, qs, means = [], [], []
+    for lo, hi in zip(edges[:-1], edges[1:]):
+        stride = max((hi - lo) // max_steps, 1)
+        blocks = [np.asarray(block[::stride]) for s, block in
+                  store.iter_blocks(lo, hi, max_steps=hi-lo)]
+        samples = np.concatenate(blocks).reshape(-1, store.ndim)
+
+        centers.append(0.5*(lo + hi))
+        qs.append(np.quantile(samples, quantiles, axis=0))
+        means.append(np.mean(samples, axis=0))
+
+    return {
+        'steps': np.array(centers),
+        'quantile_levels': np.array(quantiles),
+        'quantiles': np.array(qs),
+        'mean': np.array(means),
+        }
+
+def compute_autocorr(store, discard=0, max_lag=None, walker_block=16, c=5.):
+    '''
+    The walker-averaged autocorrelation function of each parameter & its
+    integrated time, w/ the automated windowing of Sokal (1989). Reads
+    all parameters for one group of walkers at a time, so the store is
+    read once
+
+    discard: int
+        The number of steps to discard, from 0:discard
+    max_lag: int
+        The largest lag returned. Defaults to all
+    walker_block: int
+        The number of walkers read at once
+
+    returns: (acf, tau)
+        The (Ndim, Nlags) autocorrelation & (Ndim,) integrated times
+    '''
+
+    n = store.nsteps - discard
+    if n < 2:
+        raise ValueError('Need at least 2 steps after discard!')
+    if max_lag is None:
+        max_lag = n
+
+    nfft = 2**int(np.ceil(np.log2(2*n)))
+
+    totals = np.zeros((store.ndim, n))
+    for w in range(0, store.nwalkers, walker_block):
+        x = store.read_walkers(None, discard, slice(w, w+walker_block))
+        x = x - np.mean(x, axis=0)
+        for i in range(store.ndim):
+            f = np.fft.rfft(x[:,:,i], n=nfft, axis=0)
+            totals[i] += np.sum(
+                np.fft.irfft(f * np.conjugate(f), axis=0)[:n], axis=1
+                )
+
+    acf = np.zeros((store.ndim, min(max_lag, n)))
+    tau = np.zeros(store.ndim)
+    for i in range(store.ndim):
+        total = totals[i]
+        if total[0] > 0:
+            rho = total / total[0]
+        else:
+            rho = np.zeros(n)
+            rho[0] = 1.
+
+        taus = 2.*np.cumsum(rho) - 1.
+        window = np.arange(n) >= c*taus
+        m = np.argmax(window) if np.any(window) else n - 1
+
+        acf[i] = rho[:acf.shape[1]]
+        tau[i] = taus[m]
+
+    return acf, tau
+
+def _credible_thresholds(hist, levels):
+    '''
+    The histogram values that enclose each credible level
+    '''
+
+    values = np.sort(hist.ravel())[::-1]
+    cdf = np.cumsum(values)
+    if cdf[-1] == 0:
+        return None
+    cdf /= cdf[-1]
+
+    thresholds = [values[min(np.searchsorted(cdf, level), len(values)-1)]
+                  for level in levels]
+
+    thresholds = np.unique(thresholds)
+    if len(thresholds) < len(levels):
+        return None
+
+    return thresholds
+
+def _finish_plot(outfile, show, close, size=None):
+    if size is not None:
+        plt.gcf().set_size_inches(size)
+
+    plt.tight_layout()
+
+    if outfile is not None:
+        plt.savefig(outfile, bbox_inches='tight', dpi=300)
+
+    if show is True:
+        plt.show()
+
+    if close is True:
+        plt.close()
+
+    return
+
+def plot_binned_corner(stats, names=None, reference=None,
+                       levels=(0.393, 0.865), show=True, close=True,
+                       outfile=None, size=None, title=None):
+    '''
+    A corner plot from binned histograms
+
+    stats: BinnedChainStats
+        The accumulated histograms
+    names: list
+        The parameter names
+    reference: list
+        Reference values to plot, such as true or MAP values
+    levels: list
+        The credible levels of the 2D contours; the default is the 1 &
+        2 sigma levels of a 2D Gaussian
+    '''
+
+    ndim = stats.ndim
+    if names is None:
+        names = [f'theta_{i}' for i in range(ndim)]
+    if size is None:
+        size = (2.5*ndim, 2.5*ndim)
+
+    centers = 0.5*(stats.edges[:,1:] + stats.edges[:,:-1])
+    median = stats.quantiles([0.16, 0.5, 0.84])
+
+    fig, axs = plt.subplots(ndim, ndim, squeeze=False)
+    for i in range(ndim):
+        for j in range(ndim):
+            ax = axs[i,j]
+            if j > i:
+                ax.axis('off')
+                continue
+
+            if i == j:
+                ax.stairs(stats.hist1d[i], stats.edges[i], color='k')
+                for val in median[:,i]:
+                    ax.axvline(val, c='k', ls='--', lw=1)
+                ax.set_yticks([])
+                lo, mid, hi = median[:,i]
+                ax.set_title(f'{names[i]} = {mid:.3f}' +\
+                             f'$^{{+{hi-mid:.3f}}}_{{-{mid-lo:.3f}}}$')
+                if reference is not None:
+                    ax.axvline(reference[i], c='tab:blue', lw=2)
+            else:
+                hist = stats.hist2d[i,j]
+                ax.pcolormesh(stats.edges[j], stats.edges[i], hist,
+                              cmap='Greys')
+                thresholds = _credible_thresholds(hist, levels)
+                if thresholds is not None:
+                    ax.contour(centers[j], centers[i], hist,
+                               levels=thresholds, colors='k',
+                               linewidths=1)
+                if reference is not None:
+                    ax.axvline(reference[j], c='tab:blue', lw=2)
+                    ax.axhline(reference[i], c='tab:blue', lw=2)
+
+            if i == ndim - 1:
+                ax.set_xlabel(names[j])
+            else:
+                ax.set_xticklabels([])
+            if (j == 0) and (i > 0):
+                ax.set_ylabel(names[i])
+            elif j > 0:
+                ax.set_yticklabels([])
+
+    if title is not None:
+        plt.suptitle(title, fontsize=18)
+
+    _finish_plot(outfile, show, close, size=size)
+
+    return
+
+def plot_binned_trace(trace, names=None, reference=None, show=True,
+                      close=True, outfile=None, size=None):
+    '''
+    A trace plot of walker quantile bands over bins of steps
+
+    trace: dict
+        See compute_binned_trace()
+    '''
+
+    q = trace['quantiles']
+    ndim = q.shape[2]
+    if names is None:
+        names = [f'theta_{i}' for i in range(ndim)]
+    if size is None:
+        size = (2*ndim, 1.25*ndim)
+
+    Nq = q.shape[1]
+    steps = trace['steps']
+
+    fig, axs = plt.subplots(ndim, 1, sharex=True, squeeze=False)
+    for i in range(ndim):
+        ax = axs[i,0]
+        # nested bands from the outer quantiles in
+        for k in range(Nq // 2):
+            ax.fill_between(steps, q[:,k,i], q[:,Nq-1-k,i], color='tab:blue',
+                            alpha=0.2 + 0.2*k, lw=0)
+        ax.plot(steps, trace['mean'][:,i], c='k', lw=1)
+        if reference is not None:
+            ax.axhline(reference[i], lw=2, c='k', ls='--')
+        ax.set_ylabel(names[i])
+
+    axs[-1,0].set_xlabel('Step')
+
+    _finish_plot(outfile, show, close, size=size)
+
+    return
+
+def plot_autocorr(acf, tau, names=None, show=True, close=True, outfile=None,
+                  size=None):
+    '''
+    The autocorrelation function of each parameter
+
+    acf, tau: np.ndarray
+        See compute_autocorr()
+    '''
+
+    ndim = acf.shape[0]
+    if names is None:
+        names = [f'theta_{i}' for i in range(ndim)]
+
+    fig, ax = plt.subplots()
+    lags = np.arange(acf.shape[1])
+    for i in range(ndim):
+        ax.plot(lags, acf[i], label=f'{names[i]} ($\\tau$ = {tau[i]:.1f})')
+    ax.axhline(0, c='k', lw=1)
+    ax.set_xscale('log')
+    ax.set_xlabel('Lag')
+    ax.set_ylabel('Autocorrelation')
+    ax.legend()
+
+    _finish_plot(outfile, show, close, size=size)
+
+    return
+
+def main(args):
+    '''
+    For now, just used for testing the store & binned statistics
+    '''
+
+    import tempfile
+
+    show = args.show
+
+    outdir = os.path.join(utils.TEST_DIR, 'chainstore')
+    utils.make_dir(outdir)
+
+    print('Writing an AR(1) chain in chunks')
+    np.random.seed(42)
+    nwalkers, ndim, nsteps = 20, 3, 3000
+    rho = 0.9
+    cov = np.array([[1., 0.6, 0.], [0.6, 1., 0.], [0., 0., 4.]])
+    L = np.linalg.cholesky(cov)
+    x = np.random.randn(nwalkers, ndim).dot(L.T)
+    chain = np.empty((nsteps, nwalkers, ndim))
+    for n in range(nsteps):
+        eps = np.random.randn(nwalkers, ndim).dot(L.T)
+        x = rho*x + np.sqrt(1. - rho**2)*eps
+        chain[n] = x
+    log_prob = -0.5*np.sum(chain**2, axis=2)
+
+    directory = os.path.join(tempfile.mkdtemp(), 'store')
+    names = ['a', 'b', 'c']
+    store = ChainStore(directory, nwalkers, ndim, names=names)
+    for s in range(0, nsteps, 700):
+        store.append(chain[s:s+700], log_prob[s:s+700])
+
+    try:
+        store.append(chain[:10])
+        raise AssertionError('A missing log_prob was not caught!')
+    except ValueError:
+        pass
+
+    # reopened from disk, w/o rewriting the index
+    meta_file = os.path.join(directory, ChainStore._meta_file)
+    mtime = os.stat(meta_file).st_mtime_ns
+    store = ChainStore(directory)
+    assert os.stat(meta_file).st_mtime_ns == mtime
+    assert store.nsteps == nsteps
+    assert store.names == names
+    assert np.allclose(store.get_chain(discard=100, thin=7),
+                       chain[100::7])
+    assert np.allclose(store.get_log_prob(flat=True), log_prob.reshape(-1))
+    thinned = np.concatenate(list(
+        store.iter_samples(discard=100, thin=7, max_steps=333)
+        ))
+    assert np.allclose(thinned, chain[100::7].reshape(-1, ndim))
+    assert np.allclose(store.read_walkers(1, 50, slice(3, 9)),
+                       chain[50:, 3:9, 1])
+    assert np.allclose(store.read_walkers(start=50, walkers=slice(3, 9)),
+                       chain[50:, 3:9])
+
+    print('Testing the binned statistics')
+    discard = 200
+    samples = chain[discard:].reshape(-1, ndim)
+    stats = compute_binned_stats(store, discard=discard, bins=40,
+                                 max_steps=250)
+    assert stats.n == len(samples)
+    assert np.allclose(stats.mean, np.mean(samples, axis=0))
+    assert np.allclose(stats.std, np.std(samples, axis=0, ddof=1))
+    assert np.all(stats.noutside == 0)
+    for i in range(ndim):
+        hist, _ = np.histogram(samples[:,i], bins=stats.edges[i])
+        assert np.allclose(stats.hist1d[i], hist)
+    hist, _, _ = np.histogram2d(samples[:,1], samples[:,0],
+                                bins=[stats.edges[1], stats.edges[0]])
+    assert np.allclose(stats.hist2d[1,0], hist)
+    q = stats.quantiles([0.16, 0.5, 0.84])
+    assert np.allclose(q, np.quantile(samples, [0.16, 0.5, 0.84], axis=0),
+                       atol=0.05*np.sqrt(np.diag(cov)))
+
+    product = lambda samples: samples[:,0] * samples[:,1]
+    stats_d = compute_binned_stats(store, discard=discard, bins=40,
+                                   max_steps=250, derived=product)
+    assert stats_d.ndim == ndim + 1
+    assert np.allclose(stats_d.hist1d[:ndim], stats.hist1d)
+    assert np.allclose(stats_d.mean[-1], np.mean(samples[:,0]*samples[:,1]))
+
+    print('Testing the binned trace & autocorrelation')
+    trace = compute_binned_trace(store, nbins=50, max_steps=20)
+    assert trace['quantiles'].shape == (50, 5, ndim)
+    assert np.all(np.diff(trace['quantiles'], axis=1) >= 0)
+
+    acf, tau = compute_autocorr(store, discard=discard, max_lag=100,
+                                walker_block=6)
+    assert acf.shape == (ndim, 100)
+    assert np.allclose(acf[:,0], 1.)
+    # for AR(1), tau = (1 + rho) / (1 - rho)
+    expected = (1. + rho) / (1. - rho)
+    assert np.all(np.abs(tau - expected) < 0.2*expected)
+
+    print('Testing the binned plots')
+    plot_binned_corner(stats, names=names, reference=[0., 0., 0.],
+                       show=show, outfile=os.path.join(outdir, 'corner.png'))
+    plot_binned_trace(trace, names=names, show=show,
+                      outfile=os.path.join(outdir, 'trace.png'))
+    plot_autocorr(acf, tau, names=names, show=show,
+                  outfile=os.path.join(outdir, 'autocorr.png'))
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
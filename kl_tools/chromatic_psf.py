@@ -0,0 +1,372 @@
+import numpy as np
+from argparse import ArgumentParser
+import astropy.units as u
+import galsim as gs
+
+import utils
+
+import ipdb
+
+'''
+This file contains wavelength-dependent PSF models for datacubes, along
+with the helper functions needed to convolve a datacube slice by one via
+a precomputed transfer function (the FFT of the pixelized PSF)
+
+A ChromaticPSF can be passed to DataCube.set_psf() in place of a
+galsim.GSObject. The datacube then caches a transfer function per slice
+(or per wavelength bin, see tf_tolerance), so that no PSF objects need
+to be built during sampling
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class ChromaticPSF(object):
+    '''
+    Base class for a PSF that changes with wavelength
+    '''
+
+    def __init__(self, wav_unit, tf_tolerance=None):
+        '''
+        wav_unit: astropy.units.Unit, str
+            The wavelength unit that the PSF is defined in
+        tf_tolerance: float
+            Slices whose center wavelengths are within this tolerance (in
+            wav_unit) share a transfer function. If None, each slice gets
+            its own
+        '''
+
+        self.wav_unit = u.Unit(wav_unit)
+
+        if tf_tolerance is not None:
+            if not isinstance(tf_tolerance, (int, float)):
+                raise TypeError('tf_tolerance must be an int or float!')
+            if tf_tolerance <= 0:
+                raise ValueError('tf_tolerance must be positive!')
+        self.tf_tolerance = tf_tolerance
+
+        return
+
+    def get_psf(self, wavelength, wav_unit=None):
+        '''
+        Return the (achromatic) galsim PSF at the given wavelength
+
+        wavelength: float
+            The wavelength of the PSF
+        wav_unit: astropy.units.Unit
+            The unit of the passed wavelength. Defaults to self.wav_unit
+        '''
+
+        if wav_unit is not None:
+            wavelength = (wavelength * u.Unit(wav_unit)).to(self.wav_unit).value
+
+        return self._get_psf(wavelength)
+
+    def _get_psf(self, wavelength):
+        '''
+        Each subclass must define how to build the PSF at a wavelength
+        given in self.wav_unit
+        '''
+        raise NotImplementedError('Must use a ChromaticPSF subclass ' +\
+                                  'that implements _get_psf()!')
+
+    def get_bin(self, wavelength):
+        '''
+        The key of the wavelength bin for transfer function caching
+
+        wavelength: float
+            The wavelength, in self.wav_unit
+        '''
+
+        if self.tf_tolerance is None:
+            return wavelength
+
+        return int(np.round(wavelength / self.tf_tolerance))
+
+    def get_bin_wavelength(self, key):
+        '''
+        The wavelength to evaluate the PSF at for a given bin key
+        '''
+
+        if self.tf_tolerance is None:
+            return key
+
+        return key * self.tf_tolerance
+
+class ParametricChromaticPSF(ChromaticPSF):
+    '''
+    A Gaussian or Moffat PSF with a FWHM that follows a power law in
+    wavelength, FWHM(lam) = fwhm_ref * (lam / lambda_ref)**exponent
+
+    The default exponent of -0.2 is that of Kolmogorov seeing. A general
+    FWHM(lam) can be passed as fwhm_func instead
+    '''
+
+    _profiles = ['gaussian', 'moffat']
+
+    def __init__(self, wav_unit, fwhm_ref=None, lambda_ref=None,
+                 exponent=-0.2, fwhm_func=None, profile='gaussian',
+                 moffat_beta=2.5, tf_tolerance=None):
+        '''
+        wav_unit: astropy.units.Unit, str
+            The wavelength unit for lambda_ref & fwhm_func
+        fwhm_ref: float
+            The FWHM at lambda_ref, in arcsec
+        lambda_ref: float
+            The reference wavelength
+        exponent: float
+            The power law index of FWHM(lam)
+        fwhm_func: callable
+            FWHM(lam) in arcsec for lam in wav_unit. Overrides the power
+            law if passed
+        profile: str
+            The PSF profile; one of _profiles
+        moffat_beta: float
+            The Moffat beta parameter, if relevant
+        tf_tolerance: float
+            See ChromaticPSF
+        '''
+
+        super(ParametricChromaticPSF, self).__init__(
+            wav_unit, tf_tolerance=tf_tolerance
+            )
+
+        if fwhm_func is None:
+            if (fwhm_ref is None) or (lambda_ref is None):
+                raise ValueError('Must pass both fwhm_ref & lambda_ref if ' +\
+                                 'fwhm_func is not set!')
+        elif not callable(fwhm_func):
+            raise TypeError('fwhm_func must be callable!')
+
+        if profile not in self._profiles:
+            raise ValueError(f'profile must be one of {self._profiles}!')
+
+        self.fwhm_ref = fwhm_ref
+        self.lambda_ref = lambda_ref
+        self.exponent = exponent
+        self.fwhm_func = fwhm_func
+        self.profile = profile
+        self.moffat_beta = moffat_beta
+
+        return
+
+    def fwhm(self, wavelength):
+        '''
+        The FWHM (in arcsec) at a wavelength in self.wav_unit
+        '''
+
+        if self.fwhm_func is not None:
+            return self.fwhm_func(wavelength)
+
+        return self.fwhm_ref * (wavelength / self.lambda_ref)**self.exponent
+
+    def _get_psf(self, wavelength):
+
+        fwhm = self.fwhm(wavelength)
+
+        if self.profile == 'gaussian':
+            return gs.Gaussian(fwhm=fwhm)
+        else:
+            return gs.Moffat(beta=self.moffat_beta, fwhm=fwhm)
+
+class ImageChromaticPSF(ChromaticPSF):
+    '''
+    A PSF given by a set of images at reference wavelengths. In between
+    them, the PSF is the linear interpolation of the two nearest images;
+    outside of them, it is the nearest image
+    '''
+
+    def __init__(self, wav_unit, images, wavelengths, pix_scale,
+                 tf_tolerance=None):
+        '''
+        wav_unit: astropy.units.Unit, str
+            The unit of the reference wavelengths
+        images: list of np.ndarray's
+            The PSF images at each reference wavelength
+        wavelengths: list of floats
+            The reference wavelengths
+        pix_scale: float
+            The pixel scale of the PSF images, in arcsec
+        tf_tolerance: float
+            See ChromaticPSF
+        '''
+
+        super(ImageChromaticPSF, self).__init__(
+            wav_unit, tf_tolerance=tf_tolerance
+            )
+
+        if len(images) != len(wavelengths):
+            raise ValueError('Must pass one PSF image per wavelength!')
+        if len(images) == 0:
+            raise ValueError('Must pass at least one PSF image!')
+
+        isort = np.argsort(wavelengths)
+        self.wavelengths = np.array(wavelengths, dtype=float)[isort]
+
+        # normalize to unit flux so that interpolation preserves flux
+        self.images = []
+        for i in isort:
+            im = np.array(images[i], dtype=float)
+            self.images.append(im / np.sum(im))
+
+        self.pix_scale = pix_scale
+
+        return
+
+    def _get_psf(self, wavelength):
+
+        lams = self.wavelengths
+
+        if wavelength <= lams[0]:
+            im = self.images[0]
+        elif wavelength >= lams[-1]:
+            im = self.images[-1]
+        else:
+            k = np.searchsorted(lams, wavelength)
+            t = (wavelength - lams[k-1]) / (lams[k] - lams[k-1])
+            im = (1.-t) * self.images[k-1] + t * self.images[k]
+
+        return gs.InterpolatedImage(
+            gs.Image(im, scale=self.pix_scale), normalization='flux'
+            )
+
+def build_transfer_function(psf, shape, pix_scale, pad=True):
+    '''
+    Precompute the transfer function of a PSF for convolving an image of
+    the given shape. The image is zero-padded to twice its size so that
+    the FFT convolution is not circular, unless pad is False
+
+    psf: galsim.GSObject
+        The PSF at the slice wavelength
+    shape: tuple
+        The (Nx, Ny) image shape
+    pix_scale: float
+        The image pixel scale
+    pad: bool
+        Set to False for a circular transfer function on the (Nx, Ny)
+        grid itself. This is only accurate if the image is ~0 near its
+        edges, but is what a Fourier space chi2 needs
+
+    returns: np.ndarray
+        The (complex) rfft2 of the padded & centered PSF kernel
+    '''
+
+    Nx, Ny = shape
+
+    # odd kernel sizes so that the PSF is centered on a pixel
+    if pad is True:
+        Px, Py = 2*Nx, 2*Ny
+        Kx, Ky = 2*Nx - 1, 2*Ny - 1
+    else:
+        Px, Py = Nx, Ny
+        Kx, Ky = Nx - 1 + (Nx % 2), Ny - 1 + (Ny % 2)
+
+    # NOTE: galsim arrays are (y,x); see _compute_slice_model()
+    kernel = psf.drawImage(
+        nx=Ky, ny=Kx, scale=pix_scale, method='no_pixel'
+        ).array
+    kernel = kernel / np.sum(kernel)
+
+    # move the kernel center to (0,0) of the padded grid
+    padded = np.zeros((Px, Py))
+    padded[:Kx, :Ky] = kernel
+    padded = np.roll(padded, (-(Kx//2), -(Ky//2)), axis=(0, 1))
+
+    return np.fft.rfft2(padded)
+
+def convolve_transfer(image, transfer):
+    '''
+    Convolve an image by a PSF given by its transfer function from
+    build_transfer_function()
+
+    image: np.ndarray (2D)
+        The (Nx, Ny) image to convolve
+    transfer: np.ndarray (2D)
+        The transfer function for the image shape
+    '''
+
+    Nx, Ny = image.shape
+
+    conv = np.fft.irfft2(
+        np.fft.rfft2(image, s=(2*Nx, 2*Ny)) * transfer, s=(2*Nx, 2*Ny)
+        )
+
+    return conv[:Nx, :Ny]
+
+def main(args):
+    '''
+    For now, just used for testing the PSF models & transfer functions
+    '''
+
+    print('Testing ParametricChromaticPSF')
+    cpsf = ParametricChromaticPSF('nm', fwhm_ref=0.8, lambda_ref=700.)
+    assert np.isclose(cpsf.fwhm(700.), 0.8)
+    assert cpsf.fwhm(900.) < cpsf.fwhm(500.)
+    assert np.isclose(
+        cpsf.fwhm(7000.*u.AA.to(u.nm)), cpsf.fwhm(700.)
+        )
+    cpsf.get_psf(7000., wav_unit=u.AA)
+
+    print('Testing wavelength binning')
+    cpsf = ParametricChromaticPSF(
+        'nm', fwhm_ref=0.8, lambda_ref=700., tf_tolerance=0.5
+        )
+    assert cpsf.get_bin(700.1) == cpsf.get_bin(699.9)
+    assert cpsf.get_bin(700.1) != cpsf.get_bin(701.1)
+
+    print('Testing transfer function convolution of a point source')
+    Nx, Ny = 31, 31
+    pix_scale = 0.2
+    psf = gs.Gaussian(fwhm=0.8)
+    tf = build_transfer_function(psf, (Nx, Ny), pix_scale)
+
+    image = np.zeros((Nx, Ny))
+    image[Nx//2, Ny//2] = 1.
+    conv = convolve_transfer(image, tf)
+
+    assert np.isclose(np.sum(conv), 1., rtol=1e-3)
+    # should still be centered on the same pixel
+    assert np.unravel_index(np.argmax(conv), conv.shape) == (Nx//2, Ny//2)
+    # and symmetric
+    assert np.allclose(conv, conv[::-1, ::-1])
+
+    print('Testing transfer function convolution is linear & not circular')
+    image = np.zeros((Nx, Ny))
+    image[0, 0] = 1.
+    conv = convolve_transfer(image, tf)
+    assert np.isclose(conv[-1, -1], 0.)
+
+    print('Testing circular transfer function')
+    tf = build_transfer_function(psf, (Nx, Ny), pix_scale, pad=False)
+    assert tf.shape == (Nx, Ny//2 + 1)
+    image = np.zeros((Nx, Ny))
+    image[Nx//2, Ny//2] = 1.
+    circ = np.fft.irfft2(np.fft.rfft2(image) * tf, s=(Nx, Ny))
+    assert np.allclose(circ, convolve_transfer(
+        image, build_transfer_function(psf, (Nx, Ny), pix_scale)
+        ), atol=1e-6)
+
+    print('Testing ImageChromaticPSF')
+    X, Y = utils.build_map_grid(21, 21)
+    ims = [np.exp(-0.5*(X**2 + Y**2)/s**2) for s in [1., 2.]]
+    ipsf = ImageChromaticPSF('nm', ims, [600., 800.], pix_scale)
+    ipsf.get_psf(700.)
+    ipsf.get_psf(500.)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
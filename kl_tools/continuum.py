@@ -0,0 +1,335 @@
+import numpy as np
+from numpy.polynomial import legendre
+from argparse import ArgumentParser
+
+import ipdb
+
+'''
+This file contains a low-rank model for the wavelength-dependent
+continuum underneath an emission line. Rather than a single
+lambda-independent image (see DataCube.set_continuum()), the continuum
+of each pixel is a sum of a few smooth spectral templates
+
+    C(lambda, x, y) = sum_t A_t(x, y) T_t(lambda)
+
+The templates are found once at preprocessing time from the side-bands
+around the line: each pixel's side-band spectrum is fit by a low-order
+Legendre series in lambda, and the templates are the leading principal
+components of those series across the pixels. The side-band fit of the
+amplitudes A_t(x, y) is kept along with its Fisher matrix, which is
+used as a Gaussian prior on the amplitudes when they are marginalized
+analytically in the likelihood. See DataCubeLikelihood._log_likelihood()
+and numba_likelihood._compute_chi2_continuum()
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class ContinuumModel(object):
+    '''
+    A set of spectral templates with per-pixel amplitudes
+    '''
+
+    def __init__(self, coefs, lrange, amps, fisher, explained=None):
+        '''
+        coefs: np.ndarray
+            The (Ntemplates, order+1) Legendre coefficients of each template
+        lrange: tuple
+            The (lmin, lmax) wavelengths mapped to [-1, 1] by the Legendre
+            series, in the lambda unit of the datacube
+        amps: np.ndarray
+            The (Nx, Ny, Ntemplates) side-band fit of the amplitudes
+        fisher: np.ndarray
+            The (Nx, Ny, Ntemplates, Ntemplates) Fisher matrix of the
+            side-band amplitude fit
+        explained: np.ndarray
+            The fraction of the side-band variance explained by each
+            template. Optional
+        '''
+
+        coefs = np.atleast_2d(coefs)
+        Nt = coefs.shape[0]
+
+        if amps.shape[-1] != Nt:
+            raise ValueError(f'amps must have {Nt} templates in the last ' +\
+                             f'axis; got shape {amps.shape}!')
+        if fisher.shape != amps.shape + (Nt,):
+            raise ValueError(f'fisher must have shape {amps.shape + (Nt,)}; ' +\
+                             f'got {fisher.shape}!')
+        if lrange[1] <= lrange[0]:
+            raise ValueError('lrange must be increasing!')
+
+        self.coefs = coefs
+        self.lrange = (float(lrange[0]), float(lrange[1]))
+        self.amps = amps
+        self.fisher = fisher
+        self.explained = explained
+
+        return
+
+    @property
+    def Ntemplates(self):
+        return self.coefs.shape[0]
+
+    @property
+    def shape(self):
+        '''
+        The (Nx, Ny) slice shape the amplitudes are defined on
+        '''
+        return self.amps.shape[:2]
+
+    def _eval(self, lam):
+        lmin, lmax = self.lrange
+        x = 2. * (np.asarray(lam) - lmin) / (lmax - lmin) - 1.
+
+        return legendre.legvander(x, self.coefs.shape[1]-1).dot(self.coefs.T)
+
+    def templates(self, lambdas):
+        '''
+        The templates averaged over each slice, using Simpson's rule
+        (exact for series up to cubic order)
+
+        lambdas: np.ndarray
+            The (Nspec, 2) slice bounds
+
+        returns: np.ndarray
+            The (Nspec, Ntemplates) templates
+        '''
+
+        lambdas = np.asarray(lambdas, dtype=float)
+        lblue, lred = lambdas[:,0], lambdas[:,1]
+
+        return (self._eval(lblue) + 4.*self._eval((lblue+lred)/2.) +
+                self._eval(lred)) / 6.
+
+    def render(self, lambdas, amps=None):
+        '''
+        The continuum cube for the given slices
+
+        lambdas: np.ndarray
+            The (Nspec, 2) slice bounds
+        amps: np.ndarray
+            The (Nx, Ny, Ntemplates) amplitudes. Defaults to the
+            side-band fit
+
+        returns: np.ndarray
+            The (Nspec, Nx, Ny) continuum
+        '''
+
+        if amps is None:
+            amps = self.amps
+
+        return np.einsum('st,xyt->sxy', self.templates(lambdas), amps)
+
+    def get_marginal_setup(self, lambdas, weights):
+        '''
+        What the likelihood needs to marginalize over the amplitudes of
+        a datacube with the given slices & weights. The amplitudes are
+        marginalized about the side-band fit, with the side-band Fisher
+        matrix as a Gaussian prior
+
+        lambdas: np.ndarray
+            The (Nspec, 2) slice bounds
+        weights: np.ndarray
+            The (Nspec, Nx, Ny) weight maps, as in DataCube.weights
+
+        returns: (templates, cont, finv)
+            The (Nspec, Ntemplates) templates, the (Nspec, Nx, Ny)
+            continuum of the side-band fit and the (Nx, Ny, Ntemplates,
+            Ntemplates) inverse of the posterior Fisher matrices
+        '''
+
+        if weights.shape[1:] != self.shape:
+            raise ValueError(f'Continuum model shape {self.shape} does ' +\
+                             'not match the datacube slices of shape ' +\
+                             f'{weights.shape[1:]}!')
+
+        templates = self.templates(lambdas)
+        cont = self.render(lambdas)
+
+        fisher = self.fisher + np.einsum(
+            'st,sxy,su->xytu', templates, weights**2, templates
+            )
+        finv = np.linalg.pinv(fisher, hermitian=True)
+
+        return templates, cont, np.ascontiguousarray(finv)
+
+def _fit_series(basis, data, w2):
+    '''
+    Per-pixel weighted least squares of a linear basis
+
+    basis: np.ndarray
+        The (Nspec, Nb) basis evaluated on each slice
+    data: np.ndarray
+        The (Nspec, Npix) data
+    w2: np.ndarray
+        The (Nspec, Npix) inverse variances
+
+    returns: (coefs, fisher)
+        The (Npix, Nb) coefficients & (Npix, Nb, Nb) Fisher matrices
+    '''
+
+    fisher = np.einsum('sb,sp,sc->pbc', basis, w2, basis)
+    proj = np.einsum('sb,sp->pb', basis, w2*data)
+
+    coefs = np.einsum('pbc,pc->pb', np.linalg.pinv(fisher, hermitian=True), proj)
+
+    return coefs, fisher
+
+def fit_continuum_model(datacube, lmin_line, lmax_line, lmin_cont, lmax_cont,
+                        Ntemplates=2, order=3):
+    '''
+    Fit a low-rank continuum model to the side-bands of an emission line,
+    [lmin_cont, lmin_line] & [lmax_line, lmax_cont]. The datacube must
+    not yet be truncated to the line
+
+    datacube: DataCube
+        The datacube to fit
+    lmin_line, lmax_line: float
+        The wavelength bounds of the line, in the lambda unit of the cube
+    lmin_cont, lmax_cont: float
+        The outer wavelength bounds of the side-bands
+    Ntemplates: int
+        The number of spectral templates
+    order: int
+        The order of the Legendre series fit to each side-band spectrum
+
+    returns: ContinuumModel
+    '''
+
+    if not (lmin_cont < lmin_line < lmax_line < lmax_cont):
+        raise ValueError('Must have lmin_cont < lmin_line < lmax_line ' +\
+                         '< lmax_cont!')
+    if (Ntemplates < 1) or (Ntemplates > order+1):
+        raise ValueError(f'Ntemplates must be between 1 and order+1 = ' +\
+                         f'{order+1}!')
+
+    lambdas = np.array(datacube.lambdas, dtype=float)
+    lblue, lred = lambdas[:,0], lambdas[:,1]
+
+    side = ((lblue >= lmin_cont) & (lred <= lmin_line)) | \
+           ((lblue >= lmax_line) & (lred <= lmax_cont))
+
+    Nside = np.sum(side)
+    if Nside < order+1:
+        raise ValueError(f'Only {Nside} side-band slices; need at least ' +\
+                         f'order+1 = {order+1}!')
+
+    Nx, Ny = datacube.Nx, datacube.Ny
+    data = datacube.data[side].reshape(Nside, Nx*Ny)
+    w2 = datacube.weights[side].reshape(Nside, Nx*Ny)**2
+
+    lrange = (lmin_cont, lmax_cont)
+
+    # the Legendre series of each pixel's side-band spectrum
+    series = ContinuumModel(
+        np.eye(order+1), lrange,
+        np.zeros((Nx, Ny, order+1)), np.zeros((Nx, Ny, order+1, order+1))
+        )
+    basis = series.templates(lambdas[side])
+    coefs, fisher = _fit_series(basis, data, w2)
+
+    # the principal components across pixels, down-weighting noisy ones
+    norm = np.sqrt(np.trace(fisher, axis1=1, axis2=2))
+    norm /= max(np.max(norm), np.finfo(float).tiny)
+    U, S, Vt = np.linalg.svd(norm[:,None] * coefs, full_matrices=False)
+
+    explained = S**2 / max(np.sum(S**2), np.finfo(float).tiny)
+
+    # then the amplitudes of the chosen templates
+    model = ContinuumModel(
+        Vt[:Ntemplates], lrange,
+        np.zeros((Nx, Ny, Ntemplates)),
+        np.zeros((Nx, Ny, Ntemplates, Ntemplates)),
+        explained=explained[:Ntemplates]
+        )
+    amps, fisher = _fit_series(model.templates(lambdas[side]), data, w2)
+
+    model.amps = amps.reshape(Nx, Ny, Ntemplates)
+    model.fisher = fisher.reshape(Nx, Ny, Ntemplates, Ntemplates)
+
+    return model
+
+def main(args):
+    '''
+    For now, just used for testing the fit
+    '''
+
+    from cube import DataCube
+
+    print('Building a mock cube with a sloped continuum & a break')
+    Nspec, Nx, Ny = 60, 12, 10
+    lambdas = [(l, l+0.5) for l in np.arange(850., 880., 0.5)]
+    lam = np.mean(lambdas, axis=1)
+    x = (lam - 865.) / 15.
+
+    # two spectral shapes with different spatial profiles
+    shape1 = 1. + 0.3*x
+    shape2 = np.tanh(4.*x)
+    X, Y = np.meshgrid(np.arange(Nx), np.arange(Ny), indexing='ij')
+    amp1 = 10. * np.exp(-((X-6.)**2 + (Y-5.)**2) / 20.)
+    amp2 = 3. * np.exp(-((X-4.)**2 + (Y-6.)**2) / 8.)
+    cont = shape1[:,None,None]*amp1 + shape2[:,None,None]*amp2
+
+    sigma = 0.05
+    np.random.seed(42)
+    data = cont + sigma*np.random.randn(Nspec, Nx, Ny)
+    weights = np.ones((Nspec, Nx, Ny)) / sigma
+
+    dc = DataCube(
+        data, weights=weights,
+        pars={'pix_scale': 0.5,
+              'bandpasses': {'lambda_blue': 850., 'lambda_red': 880.,
+                             'dlambda': 0.5, 'unit': 'nm'}}
+        )
+
+    print('Fitting a low-rank continuum model')
+    model = fit_continuum_model(dc, 860., 870., 850., 880., Ntemplates=2,
+                                order=5)
+    assert model.shape == (Nx, Ny)
+    assert model.Ntemplates == 2
+    assert np.sum(model.explained) > 0.99
+
+    # the model should predict the continuum under the line
+    line = (lam > 860.) & (lam < 870.)
+    line_lambdas = np.array(lambdas)[line]
+    pred = model.render(line_lambdas)
+    resid = pred - cont[line]
+    assert np.sqrt(np.mean(resid**2)) < 0.1*np.max(amp2)
+
+    # better than a lambda-independent side-band average
+    flat = np.mean(data[~line], axis=0)
+    assert np.mean(resid**2) < np.mean((flat - cont[line])**2)
+
+    print('Testing the marginalization setup')
+    templates, cont_line, finv = model.get_marginal_setup(
+        line_lambdas, weights[line]
+        )
+    assert templates.shape == (np.sum(line), 2)
+    assert np.allclose(cont_line, pred)
+    fisher = model.fisher[3,4] + \
+        templates.T.dot(templates * weights[line][:,3,4,None]**2)
+    assert np.allclose(finv[3,4].dot(fisher), np.eye(2))
+
+    print('Testing bad side-bands')
+    try:
+        fit_continuum_model(dc, 851., 879., 850., 880., order=5)
+        raise AssertionError('Too few side-band slices was not caught!')
+    except ValueError:
+        pass
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
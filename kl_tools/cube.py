@@ -14,6 +14,7 @@ from argparse import ArgumentParser
 import utils
 import parameters
 from datavector import DataVector
+from chromatic_psf import ChromaticPSF, build_transfer_function
 
 import ipdb
 
@@ -291,10 +292,15 @@ class DataCube(DataVector):
             self.masks = np.zeros(self.shape)
 
         self._continuum_template = None
+        self._continuum_model = None
 
         # only create slice list when requested, to save time in MCMC sampling
         self.slice_list = None
 
+        # PSF transfer functions per slice (or wavelength bin), only
+        # built for chromatic PSFs. See get_psf_transfer()
+        self._psf_tf_cache = {}
+
         return
 
     def _check_shape_params(self):
@@ -404,20 +410,26 @@ class DataCube(DataVector):
 
     def set_psf(self, psf):
         '''
-        psf: galsim.GSObject
-            A PSF model for the datacube
-
-        NOTE: This assumes the psf is achromatic for now!
+        psf: galsim.GSObject, ChromaticPSF
+            A PSF model for the datacube. Can be wavelength-dependent if
+            passed as a ChromaticPSF
         '''
 
         if psf is not None:
-            if not isinstance(psf, galsim.GSObject):
-                raise TypeError('psf must be a galsim.GSObject!')
+            if not isinstance(psf, (galsim.GSObject, ChromaticPSF)):
+                raise TypeError('psf must be a galsim.GSObject or a ' +\
+                                'ChromaticPSF!')
 
         self.pars['psf'] = psf
 
+        # any cached transfer functions are for the old PSF
+        self._psf_tf_cache = {}
+
         return
 
+    def has_chromatic_psf(self):
+        return isinstance(self.get_psf(), ChromaticPSF)
+
     def get_psf(self, wavelength=None, wav_unit=None):
         '''
         Return the PSF of the datacube at the desired wavelength.
@@ -431,14 +443,51 @@ class DataCube(DataVector):
             to using the unit of the stored PSF in CubePars
         '''
 
-        # TODO: Implement the rest!
-
         if 'psf' in self.pars:
-            return self.pars['psf']
+            psf = self.pars['psf']
         else:
             # raise AttributeError('There is no PSF stored in datacube pars!')
             return None
 
+        if (wavelength is None) or (not isinstance(psf, ChromaticPSF)):
+            return psf
+
+        if wav_unit is None:
+            wav_unit = self.lambda_unit
+
+        return psf.get_psf(wavelength, wav_unit=wav_unit)
+
+    def get_psf_transfer(self, indx):
+        '''
+        Return the transfer function of the (chromatic) PSF for the given
+        slice, for use with chromatic_psf.convolve_transfer(). These are
+        computed once per slice, or per wavelength bin if the PSF has a
+        tf_tolerance, and then cached
+
+        indx: int
+            The slice index
+        '''
+
+        psf = self.get_psf()
+
+        if not isinstance(psf, ChromaticPSF):
+            raise AttributeError('PSF transfer functions are only ' +\
+                                 'cached for a ChromaticPSF!')
+
+        # slice center, in the PSF wavelength unit
+        lam = np.mean(self.lambdas[indx])
+        lam = (lam * self.lambda_unit).to(psf.wav_unit).value
+
+        key = psf.get_bin(lam)
+
+        if key not in self._psf_tf_cache:
+            slice_psf = psf.get_psf(psf.get_bin_wavelength(key))
+            self._psf_tf_cache[key] = build_transfer_function(
+                slice_psf, (self.Nx, self.Ny), self.pix_scale
+                )
+
+        return self._psf_tf_cache[key]
+
     @property
     def data(self):
         return self._data
@@ -573,6 +622,32 @@ class DataCube(DataVector):
 
         return
 
+    def get_continuum_model(self):
+        '''
+        The low-rank, wavelength-dependent continuum model, or None if
+        it has not been set. See continuum.ContinuumModel
+        '''
+
+        return self._continuum_model
+
+    def set_continuum_model(self, model):
+        '''
+        Set a low-rank continuum model. The likelihood will then
+        marginalize over its per-pixel template amplitudes
+
+        model: continuum.ContinuumModel
+            A continuum model w/ amplitudes on the datacube slice grid.
+            Can be None to remove it
+        '''
+
+        if (model is not None) and (model.shape != self.shape[1:]):
+            raise ValueError('Continuum model must have the same ' +\
+                             'dimensions as the datacube slice!')
+
+        self._continuum_model = model
+
+        return
+
     def copy(self):
         return deepcopy(self)
 
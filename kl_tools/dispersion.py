@@ -0,0 +1,204 @@
+import numpy as np
+from argparse import ArgumentParser
+
+import ipdb
+
+'''
+This file contains models for the intrinsic (e.g. turbulent) velocity
+dispersion of the emitting gas. The dispersion broadens the line profile
+of each pixel, in quadrature with the instrumental width set by R. See
+numba_likelihood._compute_model_cube_dispersion() for the model cube, &
+DataCubeLikelihood._get_native_setup() & _native_sigma() in likelihood.py
+for how a model is set up & evaluated
+
+The dispersion is given in the same unit as the velocity model (v_unit),
+and radial profiles use the disk plane radius in the same (pixel) units
+as rscale. Each model parameter can either be sampled, or fixed in the
+dispersion meta pars, e.g.
+
+    'dispersion': {'model': 'exponential', 'sigma0': 20., 'rsigma': 4.}
+
+with sigma1 sampled
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class DispersionModel(object):
+    '''
+    Base class for a velocity dispersion model
+    '''
+
+    # the model parameters; must be set by each subclass
+    _pars = []
+
+    # whether the dispersion depends on the disk plane radius
+    radial = False
+
+    def __init__(self, model_pars):
+        '''
+        model_pars: dict
+            The fixed values of any model parameters that are not sampled
+        '''
+
+        self.fixed = {}
+        for name in self._pars:
+            if name in model_pars:
+                val = model_pars[name]
+                if not isinstance(val, (int, float)):
+                    raise TypeError(f'{name} must be an int or float!')
+                self.fixed[name] = float(val)
+
+        return
+
+    @property
+    def pars(self):
+        return list(self._pars)
+
+    def get_pars(self, theta_pars):
+        '''
+        The model parameters for a sample; sampled values take priority
+        over fixed ones
+
+        theta_pars: dict
+            The sampled pars
+        '''
+
+        pars = {}
+        for name in self._pars:
+            if name in theta_pars:
+                pars[name] = theta_pars[name]
+            elif name in self.fixed:
+                pars[name] = self.fixed[name]
+            else:
+                raise KeyError(f'Dispersion parameter {name} must be ' +\
+                               'either sampled or set in the dispersion ' +\
+                               'meta pars!')
+
+        return pars
+
+    def sampled_pars(self, pars_order):
+        '''
+        The model parameters that are sampled
+        '''
+        return [p for p in self._pars if p in pars_order]
+
+    def eval(self, theta_pars, r, out):
+        '''
+        Evaluate the dispersion, writing it to out
+
+        theta_pars: dict
+            The sampled pars
+        r: np.ndarray
+            The disk plane radius of each pixel. Only used if radial
+        out: np.ndarray
+            The buffer the dispersion map is written to
+        '''
+
+        return self._eval(self.get_pars(theta_pars), r, out)
+
+    def _eval(self, pars, r, out):
+        raise NotImplementedError('Must use a DispersionModel subclass ' +\
+                                  'that implements _eval()!')
+
+class ConstantDispersion(DispersionModel):
+    '''
+    sigma(r) = sigma0
+    '''
+
+    _pars = ['sigma0']
+
+    def _eval(self, pars, r, out):
+        out[:] = pars['sigma0']
+
+        return out
+
+class ExponentialDispersion(DispersionModel):
+    '''
+    sigma(r) = sigma0 + sigma1 * exp(-r / rsigma)
+
+    i.e. a dispersion floor sigma0 plus a central excess
+    '''
+
+    _pars = ['sigma0', 'sigma1', 'rsigma']
+
+    radial = True
+
+    def _eval(self, pars, r, out):
+        np.multiply(r, -1. / pars['rsigma'], out=out)
+        np.exp(out, out=out)
+        out *= pars['sigma1']
+        out += pars['sigma0']
+
+        return out
+
+def get_dispersion_types():
+    return DISPERSION_TYPES
+
+# NOTE: This is where you must register a new model
+DISPERSION_TYPES = {
+    'default': ConstantDispersion,
+    'constant': ConstantDispersion,
+    'exponential': ExponentialDispersion,
+    }
+
+def build_dispersion_model(name, model_pars):
+    '''
+    name: str
+        Name of dispersion model type
+    model_pars: dict
+        The fixed model parameters
+    '''
+
+    name = name.lower()
+
+    if name in DISPERSION_TYPES.keys():
+        model = DISPERSION_TYPES[name](model_pars)
+    else:
+        raise ValueError(f'{name} is not a registered dispersion model!')
+
+    return model
+
+def main(args):
+    '''
+    For now, just used for testing the models
+    '''
+
+    r = np.linspace(0., 10., 11)
+    out = np.empty_like(r)
+
+    print('Testing constant dispersion')
+    model = build_dispersion_model('constant', {'sigma0': 30.})
+    model.eval({}, r, out)
+    assert np.allclose(out, 30.)
+    model.eval({'sigma0': 10.}, r, out)
+    assert np.allclose(out, 10.)
+
+    print('Testing exponential dispersion')
+    model = build_dispersion_model('exponential', {'sigma0': 20., 'rsigma': 2.})
+    assert model.sampled_pars(['g1', 'sigma1']) == ['sigma1']
+    model.eval({'sigma1': 50.}, r, out)
+    assert np.allclose(out, 20. + 50.*np.exp(-r/2.))
+
+    print('Testing missing parameters')
+    try:
+        model.eval({}, r, out)
+        raise AssertionError('Missing parameter was not caught!')
+    except KeyError:
+        pass
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
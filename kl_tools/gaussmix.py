@@ -0,0 +1,379 @@
+import numpy as np
+# must come before any kernel is compiled
+import numba_isa
+from numba import njit
+from scipy.optimize import nnls, minimize
+from argparse import ArgumentParser
+import galsim as gs
+
+import utils
+import transformation as transform
+from slit import EXP_HLR_FACTOR, eval_inclined_exp
+
+import ipdb
+
+'''
+This file contains the pieces of a mixture-of-Gaussians (MoG) surface
+brightness model: a MoG approximation of an exponential disk, a MoG fit
+to a (galsim) PSF, the analytic plane transformations of each component,
+and a compiled kernel that renders a mixture on a pixel grid.
+
+As every transformation between the disk & obs planes is linear, a
+Gaussian component with mean mu and covariance C in the disk plane is a
+Gaussian with mean M mu and covariance M C M^T in the obs plane, for
+M = source2cen * gal2source * disk2gal. Convolution by a MoG PSF just
+adds covariances, and the pixel response is approximated by adding the
+variance of a unit boxcar (1/12) along each axis. Rendering then costs
+one exponential per pixel per component, with no FFTs.
+See intensity.GaussianMixtureIntensityMap
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+# variance of a unit pixel boxcar
+PIXEL_VARIANCE = 1. / 12.
+
+class GaussianMixture(object):
+    '''
+    A set of 2D Gaussian components, each normalized to its flux
+    '''
+
+    def __init__(self, flux, mean, cov):
+        '''
+        flux: np.ndarray
+            The (K,) component fluxes
+        mean: np.ndarray
+            The (K, 2) component means
+        cov: np.ndarray
+            The (K, 2, 2) component covariances
+        '''
+
+        flux = np.atleast_1d(np.asarray(flux, dtype=float))
+        mean = np.asarray(mean, dtype=float).reshape(-1, 2)
+        cov = np.asarray(cov, dtype=float).reshape(-1, 2, 2)
+
+        if not (len(flux) == len(mean) == len(cov)):
+            raise ValueError('flux, mean, and cov must have the same ' +\
+                             'number of components!')
+
+        self.flux = flux
+        self.mean = mean
+        self.cov = cov
+
+        return
+
+    @property
+    def K(self):
+        return len(self.flux)
+
+    def __add__(self, other):
+        return GaussianMixture(
+            np.concatenate([self.flux, other.flux]),
+            np.concatenate([self.mean, other.mean]),
+            np.concatenate([self.cov, other.cov])
+            )
+
+    def transform(self, M, shift=(0., 0.)):
+        '''
+        The mixture under the linear map x -> M x + shift
+        '''
+
+        mean = self.mean.dot(M.T) + np.asarray(shift)
+        cov = np.einsum('ij,kjl,ml->kim', M, self.cov, M)
+
+        return GaussianMixture(self.flux.copy(), mean, cov)
+
+    def convolve(self, other):
+        '''
+        The convolution of two mixtures, with K1*K2 components
+        '''
+
+        flux = np.outer(self.flux, other.flux).ravel()
+        mean = (self.mean[:,np.newaxis] + other.mean[np.newaxis]).reshape(-1, 2)
+        cov = (self.cov[:,np.newaxis] + other.cov[np.newaxis]).reshape(-1, 2, 2)
+
+        return GaussianMixture(flux, mean, cov)
+
+    def add_variance(self, var):
+        '''
+        Add an isotropic variance to every component, e.g. the pixel
+        response
+        '''
+
+        cov = self.cov.copy()
+        cov[:,0,0] += var
+        cov[:,1,1] += var
+
+        return GaussianMixture(self.flux.copy(), self.mean.copy(), cov)
+
+    def render(self, x, y, out=None):
+        '''
+        Evaluate the mixture at positions (x,y), in flux per unit area of
+        the same units as the means & covariances
+
+        x, y: np.ndarray (2D)
+            The positions
+        out: np.ndarray (2D)
+            The buffer to write to
+        '''
+
+        if out is None:
+            out = np.empty(x.shape)
+
+        _render_mixture(x, y, self.flux, self.mean, self.cov, out)
+
+        return out
+
+@njit(cache=True)
+def _render_mixture(x, y, flux, mean, cov, out):
+    '''
+    Fill out with the sum of the normalized Gaussian components at each
+    (x,y) position
+
+    x, y: np.ndarray (2D)
+        The positions
+    flux: np.ndarray
+        The (K,) component fluxes
+    mean: np.ndarray
+        The (K, 2) component means
+    cov: np.ndarray
+        The (K, 2, 2) component covariances
+    out: np.ndarray (2D)
+        The buffer the rendered mixture is written to
+    '''
+
+    K = len(flux)
+
+    # the inverse covariance & normalization of each component
+    a = np.empty(K)
+    b = np.empty(K)
+    c = np.empty(K)
+    norm = np.empty(K)
+    for k in range(K):
+        det = cov[k,0,0]*cov[k,1,1] - cov[k,0,1]*cov[k,1,0]
+        a[k] = cov[k,1,1] / det
+        b[k] = -0.5 * (cov[k,0,1] + cov[k,1,0]) / det
+        c[k] = cov[k,0,0] / det
+        norm[k] = flux[k] / (2.*np.pi*np.sqrt(det))
+
+    N1, N2 = x.shape
+    for i in range(N1):
+        for j in range(N2):
+            val = 0.
+            for k in range(K):
+                dx = x[i,j] - mean[k,0]
+                dy = y[i,j] - mean[k,1]
+                chi2 = a[k]*dx*dx + 2.*b[k]*dx*dy + c[k]*dy*dy
+                val += norm[k] * np.exp(-0.5*chi2)
+            out[i,j] = val
+
+    return out
+
+# the MoG exponential profile approximations for each K, for a unit scale
+# radius; see get_exponential_mixture()
+_EXP_MIXTURES = {}
+
+def get_exponential_mixture(K=6):
+    '''
+    A K-component (concentric, circular) MoG approximation to a unit
+    scale radius exponential profile, normalized to unit flux. The
+    amplitudes are a non-negative least squares fit to the profile
+    (weighted by area) for a given set of variances, which are in turn
+    optimized. Fit once per K
+
+    returns: (amps, variances)
+    '''
+
+    if not isinstance(K, int):
+        raise TypeError('K must be an int!')
+    if K < 1:
+        raise ValueError('K must be positive!')
+
+    if K in _EXP_MIXTURES:
+        return _EXP_MIXTURES[K]
+
+    r = np.linspace(0., 10., 2001)[1:]
+    w = np.sqrt(r)
+    target = w * np.exp(-r) / (2.*np.pi)
+
+    def design(log_var):
+        var = np.exp(log_var)
+        return w[:,np.newaxis] * np.exp(-0.5 * r[:,np.newaxis]**2 / var) / \
+            (2.*np.pi * var)
+
+    def fit(log_var):
+        try:
+            return nnls(design(log_var), target)
+        except RuntimeError:
+            return None, np.inf
+
+    log_var = minimize(
+        lambda lv: fit(lv)[1], np.log(np.logspace(-3, 1.3, K)),
+        method='Nelder-Mead',
+        options={'maxiter': 2000*K, 'xatol': 1e-6, 'fatol': 1e-12}
+        ).x
+
+    amps = fit(log_var)[0]
+    amps /= np.sum(amps)
+
+    keep = amps > 0
+    _EXP_MIXTURES[K] = (amps[keep], np.exp(log_var[keep]))
+
+    return _EXP_MIXTURES[K]
+
+def fit_psf_mixture(psf, pix_scale, K=3, N=None):
+    '''
+    Approximate a (galsim) PSF by K concentric, circular Gaussians w/ a
+    non-negative least squares fit to its drawn (no pixel) image
+
+    psf: galsim.GSObject
+        The PSF
+    pix_scale: float
+        The pixel scale to draw the PSF at, in arcsec
+    K: int
+        The number of components
+    N: int
+        The size of the drawn image. Defaults to ~8 FWHM
+
+    returns: GaussianMixture
+        The PSF mixture, in arcsec
+    '''
+
+    if isinstance(psf, gs.Gaussian):
+        var = psf.sigma**2
+        return GaussianMixture([1.], [[0., 0.]], [np.diag([var, var])])
+
+    try:
+        fwhm = psf.calculateFWHM()
+    except Exception:
+        fwhm = 1.
+
+    if N is None:
+        N = 2 * int(np.ceil(4. * fwhm / pix_scale)) + 1
+
+    image = psf.drawImage(nx=N, ny=N, scale=pix_scale, method='no_pixel').array
+    image = image / np.sum(image)
+
+    X, Y = utils.build_map_grid(N, N)
+    r2 = ((X**2 + Y**2) * pix_scale**2).ravel()
+
+    sigma0 = fwhm / (2. * np.sqrt(2. * np.log(2.)))
+    variances = sigma0**2 * np.logspace(-1, 1, K)
+
+    design = np.exp(-0.5 * r2[:,np.newaxis] / variances) / \
+        (2.*np.pi * variances) * pix_scale**2
+
+    amps, _ = nnls(design, image.ravel())
+    amps /= np.sum(amps)
+
+    keep = amps > 0
+    cov = np.array([np.diag([v, v]) for v in variances[keep]])
+
+    return GaussianMixture(amps[keep], np.zeros((np.sum(keep), 2)), cov)
+
+def inclined_exp_mixture(flux, hlr, K=6):
+    '''
+    The disk plane MoG approximation of an exponential disk
+
+    flux: float
+        The total flux
+    hlr: float
+        The half-light radius
+    K: int
+        The number of components
+    '''
+
+    amps, variances = get_exponential_mixture(K)
+    rd = hlr / EXP_HLR_FACTOR
+
+    cov = np.array([np.diag([v, v]) for v in variances]) * rd**2
+
+    return GaussianMixture(flux * amps, np.zeros((len(amps), 2)), cov)
+
+def get_disk2obs_matrix(theta_pars):
+    '''
+    The linear map from disk to obs plane positions (w/o the offset);
+    see transformation.py
+    '''
+
+    return transform._transform_source2cen(theta_pars).dot(
+        transform._transform_gal2source(theta_pars).dot(
+            transform._transform_disk2gal(theta_pars)
+            )
+        )
+
+def main(args):
+    '''
+    For now, just used for testing the mixtures
+    '''
+
+    print('Testing exponential mixture')
+    amps, variances = get_exponential_mixture(6)
+    assert np.isclose(np.sum(amps), 1.)
+    X, Y = utils.build_map_grid(201, 201)
+    dx = 0.1
+    X, Y = X*dx, Y*dx
+    exp_mog = GaussianMixture(
+        amps, np.zeros((len(amps), 2)),
+        [np.diag([v, v]) for v in variances]
+        )
+    im = exp_mog.render(X, Y)
+    truth = np.exp(-np.sqrt(X**2 + Y**2)) / (2.*np.pi)
+    # outside of the cusp
+    outer = np.sqrt(X**2 + Y**2) > 0.5
+    assert np.allclose(im[outer], truth[outer], atol=5e-3*np.max(truth))
+    assert np.isclose(np.sum(im)*dx**2, 1., rtol=1e-2)
+
+    print('Testing transformation & flux conservation')
+    pars = {'g1': 0.05, 'g2': -0.1, 'theta_int': 0.3, 'sini': 0.6}
+    M = get_disk2obs_matrix(pars)
+    obs = exp_mog.transform(M, shift=(0.5, -1.))
+    im = obs.render(X, Y)
+    assert np.isclose(np.sum(im)*dx**2, 1., rtol=1e-2)
+
+    # obs plane positions map back to the right disk plane radius
+    xd, yd = transform.transform_coords(X, Y, 'obs', 'disk', pars)
+    single = GaussianMixture([1.], [[0., 0.]], [np.eye(2)])
+    im = single.transform(M).render(X, Y)
+    det = np.linalg.det(M)
+    truth = np.exp(-0.5*(xd**2 + yd**2)) / (2.*np.pi * det)
+    assert np.allclose(im, truth)
+
+    print('Testing analytic PSF convolution')
+    psf = fit_psf_mixture(gs.Gaussian(fwhm=1.), 0.1)
+    conv = single.convolve(psf)
+    sigma = 1. / (2. * np.sqrt(2. * np.log(2.)))
+    assert np.allclose(conv.cov[0], (1. + sigma**2) * np.eye(2))
+
+    print('Testing inclined exponential mixture')
+    pars = {'g1': 0.05, 'g2': -0.1, 'theta_int': 0.3, 'sini': 0.5}
+    mog = inclined_exp_mixture(10., 1.).transform(get_disk2obs_matrix(pars))
+    im = mog.render(X, Y)
+    truth = eval_inclined_exp(pars, X/dx, Y/dx, 10., 1., dx)
+    # outside of the cusp
+    outer = np.sqrt(X**2 + Y**2) > 0.3
+    assert np.allclose(im[outer], truth[outer], atol=5e-3*np.max(truth))
+    assert np.isclose(np.sum(im), np.sum(truth), rtol=1e-3)
+
+    print('Testing PSF mixture fit')
+    psf = fit_psf_mixture(gs.Moffat(beta=3., fwhm=1.), 0.1)
+    assert np.isclose(np.sum(psf.flux), 1.)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
@@ -0,0 +1,306 @@
+import numpy as np
+import os
+from argparse import ArgumentParser
+from scipy.sparse import csr_matrix
+
+import utils
+from datavector import DataVector
+from cube import DataCube, setup_simple_bandpasses
+
+import ipdb
+
+'''
+This file defines a datavector for slitless (grism) spectroscopy, where
+each observed (dispersed) image is a linear operator applied to the model
+datacube: every slice is shifted along the dispersion direction by an
+amount set by its wavelength, and all slices are summed on the detector.
+
+The operator for each dispersion angle only depends on the instrument
+configuration and the model cube layout, so it is built once as a sparse
+matrix. Projecting the model cube through it then costs about as much as
+building the cube itself. See likelihood.GrismLikelihood
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class GrismConfig(object):
+    '''
+    The dispersion configuration for a single grism exposure
+    '''
+
+    def __init__(self, angle, dispersion, lambda_ref, offset=None,
+                 shape=None):
+        '''
+        angle: float
+            The dispersion angle, in radians, counter-clockwise from the
+            model x-axis (array axis 0)
+        dispersion: float
+            The wavelength interval per detector pixel, in the model cube
+            wavelength unit
+        lambda_ref: float
+            The wavelength that lands on the undispersed position, in the
+            model cube wavelength unit
+        offset: tuple
+            The (x,y) detector pixel position of model pixel (0,0) at
+            lambda_ref. If None, it is set so the full trace of the model
+            cube fits on the detector
+        shape: tuple
+            The (Nx,Ny) shape of the dispersed image. If None, it is set
+            to the bounding box of the full trace
+        '''
+
+        for name, val in {'angle': angle, 'dispersion': dispersion,
+                          'lambda_ref': lambda_ref}.items():
+            if not isinstance(val, (int, float)):
+                raise TypeError(f'{name} must be an int or float!')
+
+        if dispersion <= 0:
+            raise ValueError('dispersion must be positive!')
+
+        self.angle = float(angle)
+        self.dispersion = float(dispersion)
+        self.lambda_ref = float(lambda_ref)
+        self.offset = offset
+        self.shape = shape
+
+        return
+
+    def get_trace_shifts(self, lambdas):
+        '''
+        The (x,y) detector pixel shift of each slice relative to lambda_ref
+
+        lambdas: np.ndarray
+            The slice center wavelengths
+        '''
+
+        s = (np.asarray(lambdas) - self.lambda_ref) / self.dispersion
+
+        return s * np.cos(self.angle), s * np.sin(self.angle)
+
+def build_dispersion_operator(cube_shape, lambdas, config):
+    '''
+    Build the sparse (Npix_det, Nspec*Nx*Ny) dispersion & trace operator
+    that maps a flattened model cube to a flattened dispersed image. Each
+    model pixel is split bilinearly between the 4 nearest detector pixels
+
+    cube_shape: tuple
+        The (Nspec, Nx, Ny) model cube shape
+    lambdas: list of tuples
+        The (blue, red) wavelength bounds of each slice
+    config: GrismConfig
+        The dispersion configuration
+
+    returns: (csr_matrix, (det_Nx, det_Ny), (offset_x, offset_y))
+    '''
+
+    Nspec, Nx, Ny = cube_shape
+
+    lam_cen = np.mean(np.array(lambdas), axis=1)
+    sx, sy = config.get_trace_shifts(lam_cen)
+
+    # set the detector frame to hold the full trace, if not given
+    if config.offset is None:
+        offset = (-np.floor(np.min(sx)), -np.floor(np.min(sy)))
+    else:
+        offset = config.offset
+
+    if config.shape is None:
+        det_Nx = int(np.ceil(offset[0] + Nx - 1 + np.max(sx))) + 1
+        det_Ny = int(np.ceil(offset[1] + Ny - 1 + np.max(sy))) + 1
+    else:
+        det_Nx, det_Ny = config.shape
+
+    I, J = np.meshgrid(np.arange(Nx), np.arange(Ny), indexing='ij')
+    I = I.reshape(Nx*Ny)
+    J = J.reshape(Nx*Ny)
+
+    rows, cols, vals = [], [], []
+    for k in range(Nspec):
+        fi = I + offset[0] + sx[k]
+        fj = J + offset[1] + sy[k]
+
+        i0 = np.floor(fi).astype(int)
+        j0 = np.floor(fj).astype(int)
+        ti = fi - i0
+        tj = fj - j0
+
+        col = k*Nx*Ny + np.arange(Nx*Ny)
+
+        for di, dj, w in [(0, 0, (1.-ti)*(1.-tj)),
+                          (1, 0, ti*(1.-tj)),
+                          (0, 1, (1.-ti)*tj),
+                          (1, 1, ti*tj)]:
+            i = i0 + di
+            j = j0 + dj
+
+            # flux that falls off the detector is lost
+            good = (i >= 0) & (i < det_Nx) & (j >= 0) & (j < det_Ny) & (w > 0)
+
+            rows.append((i*det_Ny + j)[good])
+            cols.append(col[good])
+            vals.append(w[good])
+
+    op = csr_matrix(
+        (np.concatenate(vals), (np.concatenate(rows), np.concatenate(cols))),
+        shape=(det_Nx*det_Ny, Nspec*Nx*Ny)
+        )
+
+    return op, (det_Nx, det_Ny), offset
+
+class GrismDataVector(DataVector):
+    '''
+    One or more dispersed grism images of an object, e.g. a roll-angle
+    pair, fit jointly with a common model cube
+
+    The model cube layout (shape, pixel scale, wavelength slices, PSF, and
+    emission lines) is defined by a template DataCube. Its stack() is the
+    direct image, which is what intensity map bases are fit to
+    '''
+
+    def __init__(self, template, images, configs, weights=None):
+        '''
+        template: DataCube
+            The model cube template. Its data should be the direct image
+            (in any slice split) if an intensity basis is to be fit to it
+        images: list of np.ndarray's
+            The dispersed image for each configuration
+        configs: list of GrismConfig's
+            The dispersion configuration of each image
+        weights: list of (float, np.ndarray)
+            The inverse-sigma weight map of each dispersed image.
+            Defaults to 1
+        '''
+
+        utils.check_type(template, 'template', DataCube)
+
+        if len(images) != len(configs):
+            raise ValueError('Must pass one GrismConfig per image!')
+        if len(images) == 0:
+            raise ValueError('Must pass at least one dispersed image!')
+
+        if weights is None:
+            weights = len(images) * [1.]
+        if len(weights) != len(images):
+            raise ValueError('Must pass one weight map per image!')
+
+        self.template = template
+        self.configs = configs
+        self.Nimages = len(images)
+
+        self.operators = []
+        self.images = []
+        self.weights = []
+
+        for i, config in enumerate(configs):
+            utils.check_type(config, 'config', GrismConfig)
+
+            op, det_shape, offset = build_dispersion_operator(
+                template.shape, template.lambdas, config
+                )
+
+            image = np.asarray(images[i], dtype=float)
+            if image.shape != det_shape:
+                raise ValueError(f'Dispersed image {i} has shape ' +\
+                                 f'{image.shape}, but its configuration ' +\
+                                 f'gives {det_shape}!')
+
+            weight = weights[i]
+            if isinstance(weight, (int, float)):
+                weight = weight * np.ones(det_shape)
+            elif weight.shape != det_shape:
+                raise ValueError(f'Weight map {i} must have shape ' +\
+                                 f'{det_shape}!')
+
+            self.operators.append(op)
+            self.images.append(image)
+            self.weights.append(weight)
+
+        return
+
+    def disperse(self, model, indx):
+        '''
+        Project a (Nspec, Nx, Ny) model cube onto the dispersed image of
+        the given configuration
+
+        model: np.ndarray
+            The model cube, in the template layout
+        indx: int
+            The image / configuration index
+        '''
+
+        shape = self.images[indx].shape
+
+        return self.operators[indx].dot(model.reshape(-1)).reshape(shape)
+
+    def stack(self):
+        return self.template.stack()
+
+def main(args):
+    '''
+    For now, just used for testing the dispersion operators
+    '''
+
+    Nspec, Nx, Ny = 6, 20, 20
+    dlam = 1.
+
+    bandpasses = setup_simple_bandpasses(500, 500 + Nspec*dlam, dlam)
+    pars = {'pix_scale': 0.5, 'bandpasses': bandpasses}
+
+    cube = np.random.rand(Nspec, Nx, Ny)
+    template = DataCube(data=cube.copy(), pars=pars)
+    lam_cen = np.mean(np.array(template.lambdas), axis=1)
+
+    print('Testing integer-pixel dispersion along x')
+    config = GrismConfig(0., dlam, lam_cen[0])
+    op, det_shape, offset = build_dispersion_operator(
+        cube.shape, template.lambdas, config
+        )
+    dispersed = op.dot(cube.reshape(-1)).reshape(det_shape)
+
+    truth = np.zeros(det_shape)
+    for k in range(Nspec):
+        truth[k:k+Nx, :Ny] += cube[k]
+    assert np.allclose(dispersed, truth)
+
+    print('Testing flux conservation for a non-integer angle')
+    config = GrismConfig(np.pi/5, 0.7*dlam, lam_cen[2])
+    op, det_shape, offset = build_dispersion_operator(
+        cube.shape, template.lambdas, config
+        )
+    dispersed = op.dot(cube.reshape(-1))
+    assert np.isclose(np.sum(dispersed), np.sum(cube))
+
+    print('Testing GrismDataVector w/ a roll-angle pair')
+    configs = [GrismConfig(0., dlam, lam_cen[0]),
+               GrismConfig(np.pi/2, dlam, lam_cen[0])]
+    images = []
+    for c in configs:
+        op, det_shape, offset = build_dispersion_operator(
+            cube.shape, template.lambdas, c
+            )
+        images.append(np.zeros(det_shape))
+    grism = GrismDataVector(template, images, configs)
+    assert grism.disperse(cube, 0).shape == (Nx+Nspec-1, Ny)
+    assert grism.disperse(cube, 1).shape == (Nx, Ny+Nspec-1)
+    assert np.allclose(grism.disperse(cube, 1), grism.disperse(
+        np.transpose(cube, (0, 2, 1)), 0).T
+        )
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
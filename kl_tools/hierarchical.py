@@ -0,0 +1,537 @@
+import numpy as np
+import os
+import math
+# must come before any kernel is compiled
+import numba_isa
+from numba import njit
+from scipy.special import logsumexp
+from scipy.optimize import minimize
+from argparse import ArgumentParser
+import emcee
+
+import utils
+
+import ipdb
+
+'''
+This file contains a hierarchical combination of per-galaxy chains into
+an ensemble shear. Each object was fit w/ an interim prior on its shear
+g_i = (g1, g2); its shear is modeled as drawn from a population
+
+    g_i ~ N(gamma, sigma_g^2 I)
+
+w/ a shared shear gamma & scatter sigma_g (e.g. from shear variation
+across the field or unmodeled shape noise). Marginalizing over each g_i
+is done by importance weighting its posterior samples against the
+population, w/ the interim prior divided out
+
+    log L(gamma, sigma_g) = sum_i log( 1/N_i sum_k
+                                 N(g_ik | gamma, sigma_g) / pi_i(g_ik) )
+
+Only the shear samples & their interim log priors are needed, so the
+datacubes are never touched. The chains are padded into (Nobj, Nmax)
+arrays & the sums over all objects are done in one compiled kernel
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+SHEAR_PARS = ['g1', 'g2']
+
+@njit(cache=True)
+def _log_marginals(g, log_interim, g1, g2, sigma, out):
+    '''
+    The log sum over each object's samples of the population density over
+    the interim prior, w/o temporaries. Samples w/ an infinite
+    log_interim are padding & are skipped
+
+    g: np.ndarray
+        The (Nobj, Nmax, 2) shear samples
+    log_interim: np.ndarray
+        The (Nobj, Nmax) interim log priors
+    out: np.ndarray
+        The (Nobj,) output
+    '''
+
+    Nobj, Nmax = log_interim.shape
+    inv_var = 1. / (sigma*sigma)
+    log_norm = -math.log(2.*math.pi*sigma*sigma)
+
+    for i in range(Nobj):
+        # a running log-sum-exp
+        vmax = -np.inf
+        total = 0.
+        for k in range(Nmax):
+            if log_interim[i,k] == np.inf:
+                continue
+            d1 = g[i,k,0] - g1
+            d2 = g[i,k,1] - g2
+            v = -0.5*(d1*d1 + d2*d2)*inv_var - log_interim[i,k]
+            if v <= vmax:
+                total += math.exp(v - vmax)
+            else:
+                total = total*math.exp(vmax - v) + 1.
+                vmax = v
+        out[i] = vmax + math.log(total) + log_norm
+
+    return out
+
+def extract_shear_samples(samples, pars, shear_pars=SHEAR_PARS):
+    '''
+    The shear samples of a per-object chain & their interim log priors
+
+    samples: np.ndarray
+        The (Nsamples, Ndim) flat chain, in sampled order
+    pars: Pars
+        The sampled & meta pars the chain was run with
+    shear_pars: list
+        The names of the shear components
+
+    returns: (g, log_interim)
+        The (Nsamples, 2) shear samples & (Nsamples,) interim log priors
+    '''
+
+    samples = np.atleast_2d(samples)
+    pars_order = pars.sampled.pars_order
+    meta_priors = pars.meta['priors']
+
+    g = np.empty((len(samples), len(shear_pars)))
+    log_interim = np.zeros(len(samples))
+    for i, name in enumerate(shear_pars):
+        if name not in pars_order:
+            raise KeyError(f'{name} is not a sampled parameter!')
+        g[:,i] = samples[:, pars_order[name]]
+
+        # a missing prior is flat
+        if name in meta_priors:
+            prior = meta_priors[name]
+            log_interim += np.array([prior(x, log=True) for x in g[:,i]])
+
+    return g, log_interim
+
+def save_object_chain(outfile, samples, pars, obj_id=None,
+                      shear_pars=SHEAR_PARS, overwrite=False):
+    '''
+    Save what the hierarchical inference needs from a per-object chain
+
+    outfile: str
+        The .npz file to write
+    samples: np.ndarray
+        The (Nsamples, Ndim) flat chain, in sampled order
+    pars: Pars
+        The sampled & meta pars the chain was run with
+    obj_id: str, int
+        The object ID. Defaults to the file name
+    overwrite: bool
+        Set to overwrite an existing file
+    '''
+
+    if (os.path.exists(outfile)) and (overwrite is False):
+        raise OSError(f'{outfile} already exists and overwrite is False!')
+
+    if obj_id is None:
+        obj_id = os.path.splitext(os.path.basename(outfile))[0]
+
+    g, log_interim = extract_shear_samples(samples, pars, shear_pars)
+
+    np.savez(outfile, g=g, log_interim=log_interim, obj_id=str(obj_id))
+
+    return
+
+class ObjectChains(object):
+    '''
+    The shear samples of many objects, padded into (Nobj, Nmax) arrays
+    '''
+
+    def __init__(self, g_list, log_interim_list, obj_ids=None,
+                 max_samples=None, seed=None):
+        '''
+        g_list: list
+            The (N_i, 2) shear samples of each object
+        log_interim_list: list
+            The (N_i,) interim log priors of each object's samples
+        obj_ids: list
+            The object IDs. Optional
+        max_samples: int
+            If set, objects w/ more samples are randomly thinned to this
+            many
+        seed: int
+            The seed for the thinning
+        '''
+
+        if len(g_list) != len(log_interim_list):
+            raise ValueError('Must have the interim priors of each object!')
+        if len(g_list) == 0:
+            raise ValueError('Must pass at least one object!')
+
+        rng = np.random.default_rng(seed)
+
+        Nobj = len(g_list)
+        counts = []
+        for i in range(Nobj):
+            g = np.atleast_2d(g_list[i])
+            if g.shape[1] != 2:
+                raise ValueError(f'Object {i} shear samples must have ' +\
+                                 f'shape (N, 2); got {g.shape}!')
+            if len(log_interim_list[i]) != len(g):
+                raise ValueError(f'Object {i} must have one interim prior ' +\
+                                 'per sample!')
+            counts.append(len(g))
+
+        counts = np.array(counts)
+        if max_samples is not None:
+            counts = np.minimum(counts, max_samples)
+
+        Nmax = np.max(counts)
+        self.g = np.zeros((Nobj, Nmax, 2))
+        self.log_interim = np.zeros((Nobj, Nmax))
+        self.mask = np.zeros((Nobj, Nmax), dtype=bool)
+
+        for i in range(Nobj):
+            g = np.atleast_2d(g_list[i])
+            log_interim = np.asarray(log_interim_list[i], dtype=float)
+            if counts[i] < len(g):
+                indx = rng.choice(len(g), size=counts[i], replace=False)
+                g, log_interim = g[indx], log_interim[indx]
+
+            n = counts[i]
+            self.g[i,:n] = g
+            self.log_interim[i,:n] = log_interim
+            self.mask[i,:n] = np.isfinite(log_interim)
+
+        self.counts = np.sum(self.mask, axis=1)
+        if np.any(self.counts == 0):
+            bad = np.where(self.counts == 0)[0]
+            raise ValueError(f'Objects {bad} have no samples w/ a finite ' +\
+                             'interim prior!')
+
+        if obj_ids is None:
+            obj_ids = list(range(Nobj))
+        self.obj_ids = list(obj_ids)
+
+        return
+
+    @classmethod
+    def from_files(cls, files, max_samples=None, seed=None):
+        '''
+        files: list
+            The .npz files written by save_object_chain()
+        '''
+
+        g_list, log_interim_list, obj_ids = [], [], []
+        for f in files:
+            with np.load(f) as chain:
+                g_list.append(chain['g'])
+                log_interim_list.append(chain['log_interim'])
+                obj_ids.append(str(chain['obj_id']))
+
+        return cls(g_list, log_interim_list, obj_ids=obj_ids,
+                   max_samples=max_samples, seed=seed)
+
+    @property
+    def Nobj(self):
+        return self.g.shape[0]
+
+    def __len__(self):
+        return self.Nobj
+
+class HierarchicalShear(object):
+    '''
+    The posterior of the shared shear & population scatter, given the
+    per-object chains
+    '''
+
+    def __init__(self, chains, hyperpriors, sigma_g=None):
+        '''
+        chains: ObjectChains
+            The per-object shear samples
+        hyperpriors: dict
+            The priors.Prior of each hyperparameter; g1, g2 & (unless
+            fixed) sigma_g
+        sigma_g: float
+            Set to fix the population scatter rather than sample it
+        '''
+
+        utils.check_type(chains, 'chains', ObjectChains)
+
+        self.chains = chains
+
+        self.hyper_pars = ['g1', 'g2']
+        if sigma_g is None:
+            self.hyper_pars.append('sigma_g')
+        elif sigma_g <= 0:
+            raise ValueError('sigma_g must be positive!')
+        self.sigma_g = sigma_g
+
+        for name in self.hyper_pars:
+            if name not in hyperpriors:
+                raise KeyError(f'Must pass a hyperprior for {name}!')
+        self.hyperpriors = hyperpriors
+
+        # the padded samples never contribute
+        self._log_interim = np.where(
+            chains.mask, chains.log_interim, np.inf
+            )
+        self._log_counts = np.log(chains.counts)
+        self._out = np.empty(chains.Nobj)
+
+        return
+
+    @property
+    def ndim(self):
+        return len(self.hyper_pars)
+
+    def _unpack(self, alpha):
+        gamma = np.array(alpha[:2], dtype=float)
+        if self.sigma_g is None:
+            sigma = float(alpha[2])
+        else:
+            sigma = self.sigma_g
+
+        return gamma, sigma
+
+    def _log_terms(self, alpha):
+        '''
+        The (Nobj, Nmax) log importance weights of each sample
+        '''
+
+        gamma, sigma = self._unpack(alpha)
+
+        r2 = np.sum((self.chains.g - gamma)**2, axis=2)
+        log_pop = -0.5*r2/sigma**2 - np.log(2.*np.pi*sigma**2)
+
+        return log_pop - self._log_interim
+
+    def log_prior(self, alpha):
+        logprior = 0.
+        for i, name in enumerate(self.hyper_pars):
+            logprior += self.hyperpriors[name](alpha[i], log=True)
+
+        return logprior
+
+    def log_likelihood_per_object(self, alpha):
+        '''
+        returns: np.ndarray
+            The (Nobj,) log marginal likelihood of each object
+        '''
+
+        gamma, sigma = self._unpack(alpha)
+        if sigma <= 0:
+            return np.full(self.chains.Nobj, -np.inf)
+
+        _log_marginals(
+            self.chains.g, self._log_interim, gamma[0], gamma[1], sigma,
+            self._out
+            )
+
+        return self._out - self._log_counts
+
+    def log_likelihood(self, alpha):
+        return np.sum(self.log_likelihood_per_object(alpha))
+
+    def __call__(self, alpha):
+        '''
+        The log posterior of the hyperparameters
+
+        alpha: np.ndarray
+            The hyperparameters, in the order of hyper_pars
+        '''
+
+        logprior = self.log_prior(alpha)
+        if not np.isfinite(logprior):
+            return -np.inf
+
+        return logprior + self.log_likelihood(alpha)
+
+    def object_ess(self, alpha):
+        '''
+        The effective number of each object's samples that contribute at
+        the given hyperparameters. Small values mean that the population
+        is narrower than what the chains resolve, & the sums are noisy
+
+        returns: np.ndarray
+            The (Nobj,) effective sample sizes
+        '''
+
+        log_terms = self._log_terms(alpha)
+
+        return np.exp(
+            2.*logsumexp(log_terms, axis=1) - logsumexp(2.*log_terms, axis=1)
+            )
+
+    def start(self):
+        '''
+        A starting guess from the interim-weighted mean of the samples
+        '''
+
+        mask = self.chains.mask
+        g = self.chains.g
+
+        means = np.array([
+            np.mean(g[i, mask[i]], axis=0) for i in range(self.chains.Nobj)
+            ])
+        gamma = np.mean(means, axis=0)
+
+        alpha = list(gamma)
+        if self.sigma_g is None:
+            alpha.append(max(np.std(means), 1e-3))
+
+        return np.array(alpha)
+
+    def find_MAP(self, start=None):
+        '''
+        returns: np.ndarray
+            The maximum a posteriori hyperparameters
+        '''
+
+        if start is None:
+            start = self.start()
+
+        result = minimize(
+            lambda alpha: -self(alpha), start, method='Nelder-Mead',
+            options={'xatol': 1e-6, 'fatol': 1e-6, 'maxiter': 5000}
+            )
+
+        return result.x
+
+    def sample(self, nwalkers=32, nsteps=2000, start=None, pool=None,
+               progress=False):
+        '''
+        Sample the hyperparameter posterior w/ emcee. As the likelihood is
+        summed over all objects in one compiled kernel, a serial run is
+        usually fastest
+
+        nwalkers: int
+            The number of walkers
+        nsteps: int
+            The number of steps
+        start: np.ndarray
+            The center of the initial walker ball. Defaults to the MAP
+        pool: schwimmbad pool
+            Optional pool for the walkers
+
+        returns: emcee.EnsembleSampler
+        '''
+
+        if start is None:
+            start = self.find_MAP()
+
+        scale = 1e-3 * np.maximum(np.abs(start), 1e-2)
+        p0 = start + scale * np.random.randn(nwalkers, self.ndim)
+        if self.sigma_g is None:
+            p0[:,2] = np.abs(p0[:,2])
+
+        sampler = emcee.EnsembleSampler(nwalkers, self.ndim, self, pool=pool)
+        sampler.run_mcmc(p0, nsteps, progress=progress)
+
+        return sampler
+
+def main(args):
+    '''
+    For now, just used for testing the hierarchical combination
+    '''
+
+    import tempfile
+    from time import time
+    import priors
+    from parameters import Pars
+
+    print('Building mock per-object chains')
+    np.random.seed(42)
+    gamma = np.array([0.02, -0.01])
+    sigma_g = 0.03
+    Nobj, Nsamples, noise = 3000, 200, 0.02
+
+    # each object's shear posterior is Gaussian about a noisy estimate;
+    # w/ a flat interim prior the samples are drawn from it directly
+    g_true = gamma + sigma_g*np.random.randn(Nobj, 2)
+    g_obs = g_true + noise*np.random.randn(Nobj, 2)
+    g_list = [g_obs[i] + noise*np.random.randn(Nsamples, 2)
+              for i in range(Nobj)]
+    log_interim_list = [np.zeros(Nsamples) for i in range(Nobj)]
+
+    chains = ObjectChains(g_list, log_interim_list)
+    hyperpriors = {
+        'g1': priors.UniformPrior(-0.5, 0.5),
+        'g2': priors.UniformPrior(-0.5, 0.5),
+        'sigma_g': priors.UniformPrior(0., 0.5),
+        }
+    model = HierarchicalShear(chains, hyperpriors)
+
+    # against the vectorized numpy sums
+    alpha = np.array([0.01, 0., 0.05])
+    assert np.allclose(
+        model.log_likelihood_per_object(alpha),
+        logsumexp(model._log_terms(alpha), axis=1) - np.log(Nsamples)
+        )
+
+    start = time()
+    model(alpha)
+    print(f'One evaluation over {Nobj} objects took ' +\
+          f'{1e3*(time()-start):.1f} ms')
+
+    print('Testing the MAP against the truth')
+    alpha = model.find_MAP()
+    err = np.sqrt(sigma_g**2 + 2*noise**2) / np.sqrt(Nobj)
+    assert np.all(np.abs(alpha[:2] - gamma) < 4*err)
+    assert abs(alpha[2] - sigma_g) < 0.1*sigma_g
+    assert np.median(model.object_ess(alpha)) > 50
+
+    print('Testing a fixed scatter & the interim prior')
+    # a Gaussian interim prior on each sample is divided back out
+    interim = priors.GaussPrior(0., 0.05)
+    pars = Pars(['g1', 'g2', 'sini'],
+                {'priors': {'g1': interim, 'g2': interim}})
+    samples = np.column_stack([g_list[0], np.random.rand(Nsamples)])
+    g, log_interim = extract_shear_samples(samples, pars)
+    assert np.allclose(g, g_list[0])
+    assert np.allclose(
+        log_interim,
+        [interim(x, log=True) + interim(y, log=True) for x, y in g]
+        )
+
+    fixed = HierarchicalShear(chains, hyperpriors, sigma_g=sigma_g)
+    assert fixed.ndim == 2
+    assert np.isclose(fixed.log_likelihood(alpha[:2]),
+                      model.log_likelihood(np.append(alpha[:2], sigma_g)))
+
+    print('Testing saving & loading chains')
+    outdir = tempfile.mkdtemp()
+    files = []
+    for i in range(5):
+        outfile = os.path.join(outdir, f'obj-{i}.npz')
+        samples = np.column_stack([g_list[i], np.random.rand(Nsamples)])
+        save_object_chain(outfile, samples, pars)
+        files.append(outfile)
+    loaded = ObjectChains.from_files(files, max_samples=50, seed=1)
+    assert loaded.obj_ids == [f'obj-{i}' for i in range(5)]
+    assert loaded.g.shape == (5, 50, 2)
+    assert np.all(loaded.counts == 50)
+
+    try:
+        save_object_chain(files[0], samples, pars)
+        raise AssertionError('Overwriting a chain was not caught!')
+    except OSError:
+        pass
+
+    print('Testing hyperparameter sampling')
+    sampler = model.sample(nwalkers=12, nsteps=50, start=alpha)
+    chain = sampler.get_chain(flat=True, discard=25)
+    assert chain.shape == (25*12, 3)
+    assert np.all(chain[:,2] > 0)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
@@ -1,6 +1,7 @@
 import numpy as np
 import os
 import time
+from copy import copy
 from abc import abstractmethod
 import matplotlib.pyplot as plt
 from mpl_toolkits.axes_grid1 import make_axes_locatable
@@ -10,9 +11,11 @@ from galsim.angle import Angle, radians
 
 import utils
 import basis
+import gaussmix
 import likelihood
 import parameters
 from transformation import transform_coords, TransformableImage
+from chromatic_psf import ChromaticPSF
 
 import ipdb
 
@@ -145,7 +148,7 @@ class InclinedExponential(IntensityMap):
     testing anyway
     '''
 
-    def __init__(self, datacube, flux, hlr):
+    def __init__(self, datacube, flux, hlr, scale_h_over_r=None):
         '''
         datacube: DataCube
             While this implementation will not use the datacube
@@ -154,6 +157,10 @@ class InclinedExponential(IntensityMap):
             Object flux
         hlr: float
             Object half-light radius (in pixels)
+        scale_h_over_r: float
+            The disk scale height over scale radius. If None, uses the
+            galsim default. Should match the hz of a thick disk
+            velocity model
         '''
 
         nx, ny = datacube.Nx, datacube.Ny
@@ -166,6 +173,7 @@ class InclinedExponential(IntensityMap):
 
         self.flux = flux
         self.hlr = hlr
+        self.scale_h_over_r = scale_h_over_r
 
         self.pix_scale = datacube.pix_scale
 
@@ -191,9 +199,15 @@ class InclinedExponential(IntensityMap):
 
         inc = Angle(np.arcsin(theta_pars['sini']), radians)
 
-        gal = gs.InclinedExponential(
-            inc, flux=self.flux, half_light_radius=self.hlr
-        )
+        if self.scale_h_over_r is None:
+            gal = gs.InclinedExponential(
+                inc, flux=self.flux, half_light_radius=self.hlr
+            )
+        else:
+            gal = gs.InclinedExponential(
+                inc, flux=self.flux, half_light_radius=self.hlr,
+                scale_h_over_r=self.scale_h_over_r
+            )
 
         # Only add knots if a psf is provided
         # NOTE: no longer workds due to psf conovlution
@@ -305,6 +319,12 @@ class BasisIntensityMap(IntensityMap):
             # in datacube pars
             self.psf = datacube.get_psf()
 
+            # the basis is fit to the stacked image, so use the PSF at
+            # the mean wavelength of the stack
+            if isinstance(self.psf, ChromaticPSF):
+                lam = np.mean(datacube.lambdas)
+                self.psf = datacube.get_psf(wavelength=lam)
+
         # One way to handle the emission line continuum is to build
         # a template function from the datacube
         try:
@@ -400,6 +420,287 @@ class BasisIntensityMap(IntensityMap):
 
         return
 
+class ImageBasisIntensityMap(IntensityMap):
+    '''
+    An intensity map whose basis is fit to a separate broadband image
+    (with its own PSF, pixel scale, and offset) instead of the stacked
+    datacube, and then rendered on the datacube grid without any PSF.
+    Requires a broadband.CubeImageDataVector
+
+    If the basis is defined in the obs plane, the fit does not depend on
+    the sample and is only done once. The overall amplitude is set by the
+    flux of the stacked datacube unless flux_scale is passed, as the
+    broadband image & emission line fluxes are not comparable
+
+    NOTE: Any x0, y0 offsets in theta_pars are applied in image pixels
+    for the basis fit
+    '''
+
+    def __init__(self, datacube, basis_type='default', basis_kwargs=None,
+                 flux_scale=None):
+        '''
+        datacube: CubeImageDataVector
+            The datacube & broadband image
+        basis_type: str
+            Name of basis type to use
+        basis_kwargs: dict
+            Dictionary of kwargs needed to construct basis. The pix_scale
+            & psf are taken from the broadband image if not set
+        flux_scale: float
+            The ratio of the datacube to broadband image flux. If None,
+            set so that the imap has the flux of the stacked datacube
+        '''
+
+        if not hasattr(datacube, 'image'):
+            raise TypeError('ImageBasisIntensityMap requires a datavector ' +\
+                            'with a broadband image!')
+
+        nx, ny = datacube.Nx, datacube.Ny
+        super(ImageBasisIntensityMap, self).__init__('image_basis', nx, ny)
+
+        if basis_kwargs is None:
+            basis_kwargs = {'plane': 'obs'}
+
+        self.broadband = datacube.image
+        self.flux_scale = flux_scale
+
+        # fits the basis on the broadband image grid, w/ its PSF
+        self.image_map = BasisIntensityMap(
+            self.broadband, basis_type=basis_type, basis_kwargs=basis_kwargs
+            )
+        self.fitter = self.image_map.fitter
+
+        # the same basis w/o the PSF, to render the intrinsic imap
+        self.intrinsic_basis = copy(self.fitter.basis)
+        self.intrinsic_basis.psf = None
+
+        self.is_static = self.image_map.is_static
+
+        # image pixel positions of the datacube pixel centers
+        X, Y = utils.build_map_grid(nx, ny)
+        self.image_coords = self.broadband.cube_to_image_coords(
+            X, Y, datacube.pix_scale
+            )
+        self.pix_area_ratio = (datacube.pix_scale / self.broadband.pix_scale)**2
+
+        # chi2 of the broadband image fit; see CubeImageLikelihood
+        self.image_chi2 = None
+
+        return
+
+    def get_basis(self):
+        return self.fitter.basis
+
+    def _render(self, theta_pars, datacube, pars):
+
+        self.image_map.render(theta_pars, self.broadband, pars, redo=True)
+
+        resid = (self.broadband.image - self.fitter.mle_im) * \
+            self.broadband.weights
+        self.image_chi2 = np.sum(resid**2)
+
+        basis = self.intrinsic_basis
+        coeff = self.fitter.mle_coefficients[:basis.N]
+
+        X, Y = transform_coords(
+            self.image_coords[0], self.image_coords[1], 'obs', basis.plane,
+            theta_pars
+            )
+        funcs = basis.get_basis_funcs(
+            X.reshape(self.nx*self.ny), Y.reshape(self.nx*self.ny)
+            )
+
+        image = funcs.dot(coeff).reshape(self.nx, self.ny)
+        if basis.is_complex is True:
+            image = image.real
+
+        # flux per broadband pixel -> per datacube pixel
+        image *= self.pix_area_ratio
+
+        if self.flux_scale is not None:
+            image *= self.flux_scale
+        else:
+            total = np.sum(image)
+            if total != 0:
+                image *= np.sum(datacube.stack()) / total
+
+        self.image = image
+        self.continuum = None
+
+        return
+
+class GaussianMixtureIntensityMap(IntensityMap):
+    '''
+    An inclined exponential disk plus any number of Gaussian clumps, all
+    rendered analytically as a mixture of Gaussians; see gaussmix.py
+
+    The clumps are set by a flat dict of clump{k}_x, clump{k}_y (the disk
+    plane position, in arcsec), clump{k}_sigma (in arcsec), and
+    clump{k}_flux values, so that any of them can be 'sampled'
+
+    If the datavector has a broadband image (see
+    broadband.CubeImageDataVector), the mixture is also convolved by a
+    MoG approximation of the image PSF and compared to the image; see
+    CubeImageLikelihood. The datacube imap itself is rendered w/o the
+    PSF, as it is applied to the model datacube
+    '''
+
+    def __init__(self, datacube, flux, hlr, clumps=None, Nexp=6,
+                 image_flux_ratio=1., Npsf=3):
+        '''
+        datacube: DataCube
+            Only used for shape info & the broadband image, if present
+        flux: float
+            The disk flux
+        hlr: float
+            The face-on disk half-light radius, in arcsec
+        clumps: dict
+            The clump{k}_{x, y, sigma, flux} pars of each clump
+        Nexp: int
+            The number of components in the exponential disk mixture
+        image_flux_ratio: float
+            The ratio of the broadband image to datacube flux
+        Npsf: int
+            The number of components in the image PSF mixture
+        '''
+
+        nx, ny = datacube.Nx, datacube.Ny
+        super(GaussianMixtureIntensityMap, self).__init__('mog', nx, ny)
+
+        for name, val in {'flux': flux, 'hlr': hlr}.items():
+            if not isinstance(val, (float, int)):
+                raise TypeError(f'{name} must be a float or int!')
+
+        self.flux = flux
+        self.hlr = hlr
+        self.Nexp = Nexp
+        self.clumps = self._parse_clumps(clumps)
+        self.image_flux_ratio = image_flux_ratio
+
+        self.pix_scale = datacube.pix_scale
+
+        X, Y = utils.build_map_grid(nx, ny)
+        self.X = X * self.pix_scale
+        self.Y = Y * self.pix_scale
+
+        # the broadband image grid & PSF mixture, in arcsec
+        self.broadband = getattr(datacube, 'image', None)
+        if self.broadband is not None:
+            ps = self.broadband.pix_scale
+            Xi, Yi = utils.build_map_grid(self.broadband.Nx, self.broadband.Ny)
+            self.image_coords = (
+                Xi*ps + self.broadband.offset[0],
+                Yi*ps + self.broadband.offset[1]
+                )
+            # fit once per PSF, as the imap is rebuilt for each sample
+            self.image_psf = self.broadband.get_psf_mixture(K=Npsf)
+
+        # chi2 of the broadband image; see CubeImageLikelihood
+        self.image_chi2 = None
+
+        self.is_static = False
+
+        return
+
+    @staticmethod
+    def _parse_clumps(clumps):
+        '''
+        Turn the flat clump{k}_{field} dict into a list of clump dicts
+        '''
+
+        if clumps is None:
+            return []
+
+        fields = ['x', 'y', 'sigma', 'flux']
+
+        parsed = {}
+        for key, val in clumps.items():
+            try:
+                name, field = key.split('_')
+                k = int(name.replace('clump', ''))
+            except ValueError:
+                raise ValueError(f'{key} is not a valid clump par! Must ' +\
+                                 'be clump{k}_{field}')
+            if field not in fields:
+                raise ValueError(f'{field} is not a valid clump field! ' +\
+                                 f'Must be one of {fields}')
+            parsed.setdefault(k, {})[field] = val
+
+        clump_list = []
+        for k in sorted(parsed):
+            for field in fields:
+                if field not in parsed[k]:
+                    raise KeyError(f'clump{k}_{field} must be set!')
+            clump_list.append(parsed[k])
+
+        return clump_list
+
+    def get_mixture(self, theta_pars):
+        '''
+        The obs plane mixture for the sampled pars, in arcsec
+        '''
+
+        disk = gaussmix.inclined_exp_mixture(self.flux, self.hlr, K=self.Nexp)
+
+        for clump in self.clumps:
+            var = clump['sigma']**2
+            disk = disk + gaussmix.GaussianMixture(
+                [clump['flux']], [[clump['x'], clump['y']]],
+                [np.diag([var, var])]
+                )
+
+        M = gaussmix.get_disk2obs_matrix(theta_pars)
+
+        # centroid offsets are in pixels
+        if 'x0' in theta_pars:
+            shift = (theta_pars['x0'] * self.pix_scale,
+                     theta_pars['y0'] * self.pix_scale)
+        else:
+            shift = (0., 0.)
+
+        return disk.transform(M, shift=shift)
+
+    def render_convolved(self, theta_pars, psf, x, y, pix_scale):
+        '''
+        Render the mixture convolved by a PSF mixture at positions (x,y)
+
+        theta_pars: dict
+            The sampled pars
+        psf: gaussmix.GaussianMixture
+            The PSF mixture, in arcsec. Can be None
+        x, y: np.ndarray
+            The pixel positions, in arcsec
+        pix_scale: float
+            The pixel scale, in arcsec
+
+        returns: np.ndarray
+            The flux in each pixel
+        '''
+
+        mog = self.get_mixture(theta_pars)
+        if psf is not None:
+            mog = mog.convolve(psf)
+        mog = mog.add_variance(gaussmix.PIXEL_VARIANCE * pix_scale**2)
+
+        return mog.render(x, y) * pix_scale**2
+
+    def _render(self, theta_pars, datacube, pars):
+
+        self.image = self.render_convolved(
+            theta_pars, None, self.X, self.Y, self.pix_scale
+            )
+        self.continuum = None
+
+        if self.broadband is not None:
+            model = self.image_flux_ratio * self.render_convolved(
+                theta_pars, self.image_psf, self.image_coords[0],
+                self.image_coords[1], self.broadband.pix_scale
+                )
+            resid = (self.broadband.image - model) * self.broadband.weights
+            self.image_chi2 = np.sum(resid**2)
+
+        return
+
 def get_intensity_types():
     return INTENSITY_TYPES
 
@@ -408,6 +709,8 @@ INTENSITY_TYPES = {
     'default': BasisIntensityMap,
     'basis': BasisIntensityMap,
     'inclined_exp': InclinedExponential,
+    'image_basis': ImageBasisIntensityMap,
+    'mog': GaussianMixtureIntensityMap,
     }
 
 def build_intensity_map(name, datacube, kwargs):
@@ -539,8 +842,7 @@ class IntensityMapFitter(object):
         else:
             self.design_mat = np.zeros((Ndata, Nbasis))
 
-        for n in range(self.basis.N):
-            self.design_mat[:,n] = self.basis.get_basis_func(n, x, y)
+        self.design_mat[:,:self.basis.N] = self.basis.get_basis_funcs(x, y)
 
         # handle continuum template separately
         if self.continuum_template is not None:
@@ -958,6 +1260,18 @@ def main(args):
     imap.render(true_pars, datacube, mcmc_pars)
     imap.plot_fit(datacube, outfile=outfile, show=show)
 
+    #---------------------------------------------------------
+    # Mixture of gaussians w/ a clump
+
+    print('Rendering mixture of gaussians imap w/ a clump')
+    clumps = {'clump0_x': 1., 'clump0_y': -1., 'clump0_sigma': 0.5,
+              'clump0_flux': 0.1*true_flux}
+    mog = GaussianMixtureIntensityMap(
+        datacube, flux=true_flux, hlr=true_hlr, clumps=clumps
+        )
+    mog_im = mog.render(true_pars, datacube, mcmc_pars)
+    assert np.isclose(np.sum(mog_im), 1.1*true_flux, rtol=1e-2)
+
     #---------------------------------------------------------
     # Fits to incined exp + knots
     # NOTE: this no longer works due to how psf is now handled
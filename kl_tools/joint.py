@@ -0,0 +1,559 @@
+import numpy as np
+from collections import OrderedDict
+from argparse import ArgumentParser
+
+import utils
+from parameters import Pars
+from likelihood import LogPrior, build_likelihood_model
+
+import ipdb
+
+'''
+This file contains a joint posterior for several galaxies in one field
+that share a shear, e.g. for group or cluster lensing. Each galaxy has
+its own datacube & Pars; the joint parameters are the shared (g1, g2)
+followed by each galaxy's other (nuisance) parameters, named
+'{name}_{i}' for galaxy i
+
+The joint log likelihood is the sum of the per-galaxy terms. Each term
+is cached on its galaxy's parameters, so that a block update of one
+galaxy's nuisance parameters only evaluates that galaxy's term & the
+cost per Gibbs sweep grows linearly w/ the number of galaxies. Terms
+that do need evaluating are run in parallel across a pool:
+    - a schwimmbad pool (cores or MPI ranks); each galaxy's likelihood
+      & datacube are shipped w/ its task
+    - a workerpool.WarmPool or WorkerClient; each galaxy is registered
+      once & stays resident on the workers
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+SHARED_PARS = ['g1', 'g2']
+
+class JointPars(object):
+    '''
+    The layout of the joint parameters of several galaxies
+    '''
+
+    def __init__(self, pars_list, shared=SHARED_PARS):
+        '''
+        pars_list: list
+            The Pars of each galaxy. Each must sample the shared pars
+        shared: list
+            The names of the shared parameters. Their priors are taken
+            from the first galaxy
+        '''
+
+        if len(pars_list) == 0:
+            raise ValueError('Must pass the pars of at least one galaxy!')
+
+        for i, pars in enumerate(pars_list):
+            utils.check_type(pars, f'pars_list[{i}]', Pars)
+            for name in shared:
+                if name not in pars.sampled.pars_order:
+                    raise KeyError(f'Galaxy {i} does not sample the ' +\
+                                   f'shared parameter {name}!')
+
+        self.pars_list = pars_list
+        self.shared = list(shared)
+
+        names = list(shared)
+        joint_priors = {}
+        for name in shared:
+            if name in pars_list[0].meta['priors']:
+                joint_priors[name] = pars_list[0].meta['priors'][name]
+
+        # the joint index of each galaxy parameter, in its sampled order
+        self.galaxy_indx = []
+        self.galaxy_blocks = []
+        for i, pars in enumerate(pars_list):
+            pars_order = pars.sampled.pars_order
+            indx = np.empty(len(pars_order), dtype=int)
+            block = []
+            for name, j in pars_order.items():
+                if name in shared:
+                    indx[j] = shared.index(name)
+                else:
+                    joint_name = f'{name}_{i}'
+                    indx[j] = len(names)
+                    block.append(len(names))
+                    names.append(joint_name)
+                    if name in pars.meta['priors']:
+                        joint_priors[joint_name] = pars.meta['priors'][name]
+            self.galaxy_indx.append(indx)
+            self.galaxy_blocks.append(np.array(block, dtype=int))
+
+        self.names = names
+        self.shared_block = np.arange(len(shared))
+
+        # so that the joint posterior can be run w/ the mcmc.py runners
+        self.pars = Pars(names, {'priors': joint_priors})
+
+        return
+
+    @property
+    def ndim(self):
+        return len(self.names)
+
+    @property
+    def ngalaxies(self):
+        return len(self.pars_list)
+
+    def split(self, theta):
+        '''
+        The parameters of each galaxy, in its own sampled order
+
+        theta: np.ndarray
+            The joint parameters
+
+        returns: list
+        '''
+
+        theta = np.asarray(theta, dtype=float)
+
+        return [theta[indx] for indx in self.galaxy_indx]
+
+    def join(self, thetas):
+        '''
+        The joint parameters from those of each galaxy. The shared pars
+        are taken from the first galaxy
+
+        thetas: list
+            The parameters of each galaxy, in its own sampled order
+        '''
+
+        theta = np.empty(self.ndim)
+        for indx, theta_i in reversed(list(zip(self.galaxy_indx, thetas))):
+            theta[indx] = theta_i
+
+        return theta
+
+def _eval_term(task):
+    '''
+    A per-galaxy log likelihood; the map function for schwimmbad pools
+    '''
+
+    loglike, datacube, theta = task
+
+    return loglike(theta, datacube)
+
+class JointPosterior(object):
+    '''
+    The log posterior of several galaxies w/ shared shear. Has the call
+    signature of LogPosterior, so can be sampled w/ the mcmc.py runners
+    '''
+
+    def __init__(self, joint_pars, datacubes, likelihood='datacube',
+                 pool=None, cache_size=3):
+        '''
+        joint_pars: JointPars
+            The joint parameter layout
+        datacubes: list
+            The datacube of each galaxy, truncated to desired lambda bounds
+        likelihood: str
+            The registered likelihood type of every galaxy
+        pool: schwimmbad pool, WarmPool, WorkerClient
+            The pool the per-galaxy terms are evaluated in. Runs serially
+            if None
+        cache_size: int
+            The number of parameter sets whose term is cached per galaxy.
+            At least 3 keeps the current state through a rejected shared
+            & a rejected block proposal in the same sweep
+        '''
+
+        utils.check_type(joint_pars, 'joint_pars', JointPars)
+
+        if len(datacubes) != joint_pars.ngalaxies:
+            raise ValueError(f'Must pass {joint_pars.ngalaxies} datacubes; ' +\
+                             f'got {len(datacubes)}!')
+        if cache_size < 1:
+            raise ValueError('cache_size must be positive!')
+
+        self.joint_pars = joint_pars
+        self.datacubes = list(datacubes)
+        self.likelihood = likelihood
+        self.cache_size = cache_size
+
+        self.log_prior = LogPrior(joint_pars.pars)
+        self.loglikes = [
+            build_likelihood_model(likelihood, pars, datacube)
+            for pars, datacube in zip(joint_pars.pars_list, self.datacubes)
+            ]
+
+        self.pool = None
+        self.handles = None
+        self.set_pool(pool)
+
+        self._cache = [OrderedDict() for i in range(self.ngalaxies)]
+
+        # the number of per-galaxy term evaluations
+        self.nterms = np.zeros(self.ngalaxies, dtype=int)
+
+        return
+
+    @property
+    def ngalaxies(self):
+        return self.joint_pars.ngalaxies
+
+    @property
+    def ndim(self):
+        return self.joint_pars.ndim
+
+    def set_pool(self, pool):
+        '''
+        Galaxies are registered w/ a WarmPool or WorkerClient, so that
+        each worker only receives its datacube once
+        '''
+
+        self.pool = pool
+        self.handles = None
+
+        if (pool is not None) and hasattr(pool, 'loglike_each'):
+            self.handles = [
+                pool.register(datacube, pars, self.likelihood)
+                for pars, datacube in zip(
+                    self.joint_pars.pars_list, self.datacubes
+                    )
+                ]
+
+        return
+
+    def _evaluate(self, galaxies, thetas):
+        '''
+        The log likelihood terms of the given galaxies, in parallel if
+        there is a pool
+        '''
+
+        if len(galaxies) == 0:
+            return np.array([])
+
+        if self.handles is not None:
+            return self.pool.loglike_each(
+                [self.handles[i] for i in galaxies], thetas
+                )
+
+        tasks = [(self.loglikes[i], self.datacubes[i], theta)
+                 for i, theta in zip(galaxies, thetas)]
+
+        if (self.pool is None) or (len(tasks) == 1):
+            return np.array([_eval_term(task) for task in tasks])
+
+        return np.array(list(self.pool.map(_eval_term, tasks)))
+
+    def log_likelihood_terms(self, theta):
+        '''
+        The log likelihood of each galaxy. Only the galaxies whose
+        parameters are not cached are evaluated
+
+        theta: np.ndarray
+            The joint parameters
+
+        returns: np.ndarray
+            The (Ngalaxies,) log likelihood terms
+        '''
+
+        thetas = self.joint_pars.split(theta)
+
+        terms = np.empty(self.ngalaxies)
+        missing, keys = [], []
+        for i, theta_i in enumerate(thetas):
+            key = theta_i.tobytes()
+            cache = self._cache[i]
+            if key in cache:
+                cache.move_to_end(key)
+                terms[i] = cache[key]
+            else:
+                missing.append(i)
+                keys.append(key)
+
+        values = self._evaluate(missing, [thetas[i] for i in missing])
+
+        for i, key, value in zip(missing, keys, values):
+            cache = self._cache[i]
+            cache[key] = value
+            if len(cache) > self.cache_size:
+                cache.popitem(last=False)
+            terms[i] = value
+            self.nterms[i] += 1
+
+        return terms
+
+    def log_likelihood(self, theta):
+        return np.sum(self.log_likelihood_terms(theta))
+
+    def __call__(self, theta, *args):
+        '''
+        Natural log of the joint posterior. Extra args (e.g. the datacube
+        & pars passed by the KLens runners) are ignored
+
+        theta: np.ndarray
+            The joint parameters
+
+        returns: (logpost, (logprior, loglike))
+        '''
+
+        logprior = self.log_prior(theta)
+
+        if logprior == -np.inf:
+            return -np.inf, (-np.inf, -np.inf)
+
+        loglike = self.log_likelihood(theta)
+
+        return logprior + loglike, (logprior, loglike)
+
+    def clear_cache(self):
+        for cache in self._cache:
+            cache.clear()
+
+        return
+
+    def __getstate__(self):
+        # pools & their handles belong to this process; a copy shipped
+        # to a worker evaluates its terms serially
+        state = self.__dict__.copy()
+        state['pool'] = None
+        state['handles'] = None
+        state['_cache'] = [OrderedDict() for i in range(self.ngalaxies)]
+
+        return state
+
+class BlockGibbsSampler(object):
+    '''
+    Metropolis-within-Gibbs over the shared block & each galaxy's
+    nuisance block of a JointPosterior. A shared update evaluates every
+    galaxy's term, while each galaxy update only evaluates its own
+    '''
+
+    # the acceptance rate the proposal scales are adapted to
+    target_acceptance = 0.3
+
+    def __init__(self, posterior, scales):
+        '''
+        posterior: JointPosterior
+            The joint posterior
+        scales: np.ndarray
+            The (Ndim,) initial proposal scale of each joint parameter
+        '''
+
+        utils.check_type(posterior, 'posterior', JointPosterior)
+
+        scales = np.asarray(scales, dtype=float)
+        if scales.shape != (posterior.ndim,):
+            raise ValueError(f'scales must have shape ({posterior.ndim},)!')
+        if np.any(scales <= 0):
+            raise ValueError('scales must be positive!')
+
+        self.posterior = posterior
+        self.scales = scales
+
+        joint_pars = posterior.joint_pars
+        self.blocks = [joint_pars.shared_block] + [
+            block for block in joint_pars.galaxy_blocks if len(block) > 0
+            ]
+
+        self.chain = None
+        self.lnprob = None
+        self.acceptance = None
+
+        return
+
+    def run(self, start, nsteps, adapt=None, seed=None, progress=False):
+        '''
+        start: np.ndarray
+            The starting joint parameters
+        nsteps: int
+            The number of sweeps over all blocks
+        adapt: int
+            The number of initial sweeps w/ adapted proposal scales.
+            Defaults to nsteps // 2; these should be discarded
+        seed: int
+            The random seed
+
+        returns: np.ndarray
+            The (nsteps, Ndim) chain
+        '''
+
+        if adapt is None:
+            adapt = nsteps // 2
+
+        rng = np.random.default_rng(seed)
+
+        theta = np.array(start, dtype=float)
+        lp = self.posterior(theta)[0]
+        if not np.isfinite(lp):
+            raise ValueError('The start has a non-finite log posterior!')
+
+        Nblocks = len(self.blocks)
+        log_factors = np.zeros(Nblocks)
+        accepted = np.zeros(Nblocks, dtype=int)
+
+        self.chain = np.empty((nsteps, len(theta)))
+        self.lnprob = np.empty(nsteps)
+
+        for step in range(nsteps):
+            for b, block in enumerate(self.blocks):
+                proposal = theta.copy()
+                proposal[block] += np.exp(log_factors[b]) * \
+                    self.scales[block] * rng.standard_normal(len(block))
+
+                lp_new = self.posterior(proposal)[0]
+
+                accept = np.log(rng.random()) < lp_new - lp
+                if accept:
+                    theta, lp = proposal, lp_new
+
+                if step < adapt:
+                    rate = float(accept) - self.target_acceptance
+                    log_factors[b] += rate / np.sqrt(step + 1.)
+                else:
+                    accepted[b] += accept
+
+            self.chain[step] = theta
+            self.lnprob[step] = lp
+
+            if (progress is True) and ((step+1) % max(nsteps//10, 1) == 0):
+                print(f'Step {step+1}/{nsteps}')
+
+        self.acceptance = accepted / max(nsteps - adapt, 1)
+        self.scale_factors = np.exp(log_factors)
+
+        return self.chain
+
+def main(args):
+    '''
+    For now, just used for testing the joint posterior
+    '''
+
+    import schwimmbad
+    from astropy.units import Unit
+    import priors
+    import mocks
+
+    print('Building mock galaxies w/ a shared shear')
+    shear = {'g1': 0.03, 'g2': -0.02}
+    nuisance = [
+        {'theta_int': np.pi/6., 'sini': 0.7, 'vcirc': 200.},
+        {'theta_int': np.pi/3., 'sini': 0.5, 'vcirc': 150.},
+        {'theta_int': 2.,       'sini': 0.8, 'vcirc': 250.},
+        ]
+
+    pars_list, datacubes, true_thetas = [], [], []
+    for i, gal in enumerate(nuisance):
+        true_pars = dict(shear, v0=5., rscale=3., **gal)
+        meta = {
+            'units': {'v_unit': Unit('km/s'), 'r_unit': Unit('kpc')},
+            'priors': {
+                'g1': priors.GaussPrior(0., 0.1),
+                'g2': priors.GaussPrior(0., 0.1),
+                'theta_int': priors.UniformPrior(0., np.pi),
+                'sini': priors.UniformPrior(0., 1.),
+                'v0': priors.UniformPrior(0, 20),
+                'vcirc': priors.GaussPrior(200, 50),
+                'rscale': priors.UniformPrior(0, 10),
+                },
+            'intensity': {'type': 'inclined_exp', 'flux': 3.8e4, 'hlr': 3.5},
+            'velocity': {'model': 'centered'},
+            'run_options': {'native': True},
+            }
+        datacube_pars = {
+            'Nx': 12,
+            'Ny': 12,
+            'pix_scale': 0.5,
+            'true_flux': 3.8e4,
+            'true_hlr': 3.5,
+            'v_model': 'centered',
+            'v_unit': Unit('km/s'),
+            'r_unit': Unit('kpc'),
+            'z': 0.3,
+            'R': 5000.,
+            'sky_sigma': 0.5,
+            }
+
+        datacube, _, _ = mocks.setup_likelihood_test(true_pars, datacube_pars)
+
+        # the galaxies need not sample their pars in the same order
+        names = list(true_pars.keys())
+        if i == 1:
+            names = names[::-1]
+        pars = Pars(names, meta)
+
+        pars_list.append(pars)
+        datacubes.append(datacube)
+        true_thetas.append(pars.pars2theta(true_pars))
+
+    print('Testing the joint layout')
+    joint_pars = JointPars(pars_list)
+    assert joint_pars.ndim == 2 + 3*5
+    assert joint_pars.names[:2] == ['g1', 'g2']
+    assert 'vcirc_2' in joint_pars.names
+    theta0 = joint_pars.join(true_thetas)
+    for theta_i, true_i in zip(joint_pars.split(theta0), true_thetas):
+        assert np.allclose(theta_i, true_i)
+    assert theta0[joint_pars.names.index('sini_1')] == 0.5
+
+    print('Testing the joint posterior against the per-galaxy terms')
+    posterior = JointPosterior(joint_pars, datacubes)
+    logpost, (logprior, loglike) = posterior(theta0, datacubes, joint_pars.pars)
+    expected = [
+        build_likelihood_model('datacube', pars, datacube)(theta_i, datacube)
+        for pars, datacube, theta_i in zip(pars_list, datacubes, true_thetas)
+        ]
+    assert np.isclose(loglike, np.sum(expected))
+    assert np.isclose(logpost, logprior + loglike)
+    assert np.all(posterior.nterms == 1)
+
+    print('Testing that block updates touch only their galaxy')
+    theta = theta0.copy()
+    theta[joint_pars.names.index('vcirc_1')] += 5.
+    posterior(theta)
+    assert np.all(posterior.nterms == [1, 2, 1])
+
+    # the rejected proposal is cached w/ the current state
+    posterior(theta0)
+    assert np.all(posterior.nterms == [1, 2, 1])
+
+    theta[0] += 0.01
+    posterior(theta)
+    assert np.all(posterior.nterms == [2, 3, 2])
+
+    print('Testing the terms in a pool')
+    with schwimmbad.MultiPool(processes=2) as pool:
+        pooled = JointPosterior(joint_pars, datacubes, pool=pool)
+        assert np.isclose(pooled.log_likelihood(theta0), loglike)
+        assert np.allclose(pooled.log_likelihood_terms(theta),
+                           posterior.log_likelihood_terms(theta))
+
+    print('Testing the block sampler')
+    base_scales = {'g1': 0.005, 'g2': 0.005, 'theta_int': 0.05, 'sini': 0.02,
+                   'v0': 0.5, 'vcirc': 5., 'rscale': 0.1}
+    scales = joint_pars.join([
+        pars.pars2theta(base_scales) for pars in pars_list
+        ])
+    posterior.nterms[:] = 0
+    sampler = BlockGibbsSampler(posterior, scales)
+    nsteps = 20
+    chain = sampler.run(theta0, nsteps, adapt=10, seed=42)
+    assert chain.shape == (nsteps, joint_pars.ndim)
+    assert np.all(np.isfinite(sampler.lnprob))
+    assert np.all((sampler.acceptance >= 0) & (sampler.acceptance <= 1))
+
+    # each sweep evaluates every term for the shared update, & one more
+    # per galaxy for its own block
+    assert np.all(posterior.nterms <= 2*nsteps + 1)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
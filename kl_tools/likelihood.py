@@ -6,6 +6,7 @@ from time import time
 from scipy.interpolate import interp1d
 import scipy
 from astropy.units import Unit
+import astropy.constants as const
 from argparse import ArgumentParser
 import galsim as gs
 from galsim.angle import Angle, radians
@@ -15,10 +16,18 @@ from numba import njit
 import utils
 import priors
 import intensity
+import numba_likelihood as nlike
+import numba_transformation as numba_transform
 from parameters import Pars, MetaPars
 # import parameters
-from velocity import VelocityMap
+from velocity import VelocityMap, LOSKernel, get_harmonic_orders, \
+    get_harmonic_pars
 from cube import DataVector, DataCube
+from chromatic_psf import ChromaticPSF, convolve_transfer, \
+    build_transfer_function
+from pipeline import Stage, StagePipeline
+from slit import eval_inclined_exp
+from dispersion import build_dispersion_model
 
 import ipdb
 
@@ -188,6 +197,31 @@ class LogPrior(LogBase):
 
         return logprior
 
+    def prior_transform(self, u):
+        '''
+        Map a point in the unit cube to the sampled parameters through
+        the inverse CDF of each prior, as needed by nested samplers
+
+        u: np.ndarray
+            A point in the unit cube, in sampled order
+
+        returns: np.ndarray
+            theta, in sampled order
+        '''
+
+        pars_order = self.parameters.sampled.pars_order
+
+        if len(self.priors) != len(pars_order):
+            raise KeyError('Every sampled parameter needs a prior for the ' +\
+                           'prior transform!')
+
+        theta = np.empty(len(u))
+        for name, prior in self.priors.items():
+            indx = pars_order[name]
+            theta[indx] = prior.ppf(u[indx])
+
+        return theta
+
 class LogLikelihood(LogBase):
 
     def __init__(self, parameters, datavector):
@@ -302,6 +336,15 @@ class LogLikelihood(LogBase):
 
         vmodel = theta_pars.copy()
 
+        # velocity model pars that are fixed rather than sampled, e.g.
+        # the hz of a thick disk
+        try:
+            for name, val in meta_pars['velocity'].items():
+                if (name != 'model') and (name not in vmodel):
+                    vmodel[name] = val
+        except KeyError:
+            pass
+
         for name in ['r_unit', 'v_unit']:
             if name in meta_pars['units']:
                 vmodel[name] = Unit(meta_pars['units'][name])
@@ -401,16 +444,69 @@ class DataCubeLikelihood(LogLikelihood):
     An implementation of a LogLikelihood for a DataCube datavector
     '''
 
+    # velocity models that the compiled likelihood path can evaluate
+    _native_vmodels = ['default', 'centered', 'offset', 'thick', 'harmonic']
+
+    # whether the run option fourier_chi2 can be used; only if the
+    # model from _setup_model() is what _log_likelihood() compares to
+    _allow_fourier_chi2 = True
+
+    # the circular PSF convolution of the Fourier space chi2 wraps model
+    # flux around the cutout edges; refuse it if more than this fraction
+    # of the stacked data flux is within this many pixels of the edges
+    _fourier_edge_width = 2
+    _fourier_max_edge_frac = 0.01
+
     def _log_likelihood(self, theta, datacube, model):
         '''
         theta: list
             Sampled parameters, order defined by pars_order
         datacube: DataCube
             The datacube datavector, truncated to desired lambda bounds
-        model: DataCube
-            The model datacube object, truncated to desired lambda bounds
+        model: DataCube, np.ndarray
+            The model datacube object, truncated to desired lambda bounds.
+            If using the compiled (native) path, this is instead the
+            (Nspec, Nx, Ny) model buffer from the likelihood arena
         '''
 
+        if isinstance(model, np.ndarray):
+            native = self._native
+            pipeline = native['pipeline']
+
+            # a revisited (or unchanged) cube doesn't need a new chi2
+            key = None
+            if (pipeline is not None) and \
+               (model is pipeline.output('cube')[0]):
+                key = (pipeline.version('cube'), id(datacube))
+                cached = native['chi2_cache']
+                if (cached is not None) and (cached[0] == key):
+                    return cached[1]
+
+            continuum = self._get_continuum_setup(datacube)
+
+            if continuum is not None:
+                loglike = -0.5*self._compute_continuum_chi2(
+                    datacube, model, continuum
+                    )
+            elif native['fourier'] is not None:
+                loglike = -0.5*self._compute_fourier_chi2(datacube, model)
+            else:
+                chi2 = nlike._compute_chi2(
+                    datacube.data, model, datacube.weights
+                    )
+                loglike = -0.5*chi2
+
+            if key is not None:
+                native['chi2_cache'] = (key, loglike)
+
+            return loglike
+
+        continuum = self._get_continuum_setup(datacube)
+        if continuum is not None:
+            return -0.5*self._compute_continuum_chi2(
+                datacube, model.data, continuum
+                )
+
         Nspec = datacube.Nspec
         Nx, Ny = datacube.Nx, datacube.Ny
 
@@ -445,6 +541,9 @@ class DataCubeLikelihood(LogLikelihood):
             Datavector datacube truncated to desired lambda bounds
         '''
 
+        if self._use_native() is True:
+            return self._setup_native_model(theta_pars, datacube)
+
         Nx, Ny = datacube.Nx, datacube.Ny
         Nspec = datacube.Nspec
 
@@ -480,6 +579,852 @@ class DataCubeLikelihood(LogLikelihood):
 
         return model_datacube
 
+    def _setup_native_model(self, theta_pars, datacube):
+        '''
+        Same as _setup_model(), but using the compiled kernels in
+        numba_likelihood.py. The buffers of the compiled kernels (velocity
+        map, redshift factor, SED table, and model cube) are drawn from a
+        per-worker LikelihoodArena & reused between samples
+
+        NOTE: The intensity map render, galsim PSF convolution, and the
+        stage caches of incremental evaluation are not drawn from the
+        arena, and still allocate on their own. For a static imap the
+        render is cached anyway
+
+        theta_pars: dict
+            Dictionary of sampled pars
+        datacube: DataCube
+            Datavector datacube truncated to desired lambda bounds
+
+        returns: model (np.ndarray)
+            The (Nspec, Nx, Ny) model buffer. Only valid until the next
+            likelihood evaluation in this process
+        '''
+
+        native = self._get_native_setup(datacube)
+
+        arena = native['arena']
+        arena.reset()
+
+        pipeline = native['pipeline']
+
+        if pipeline is None:
+            zfactor = self._native_zfactor(theta_pars, native)
+            sed_y = self._native_sed(theta_pars, native)
+            sigma = self._native_sigma(theta_pars, native)
+            i_array, cont_array, imap = self._native_imap(
+                theta_pars, datacube
+                )
+            model = self._native_model_cube(
+                native, zfactor, sed_y, i_array, sigma=sigma
+                )
+            cont_ft = self._native_finish(model, cont_array, datacube, native)
+        else:
+            # cached stage outputs are only valid for the same datavector
+            if native['pipeline_datacube'] is not datacube:
+                pipeline.clear()
+                native['pipeline_datacube'] = datacube
+
+            model, cont_ft = pipeline.evaluate('cube', theta_pars)
+
+            # the imap stage may have been a cache hit
+            self._current_imap = pipeline.output('imap')[2]
+
+        if native['fourier'] is not None:
+            native['fourier']['cont_ft'] = cont_ft
+
+        # the first evaluation sets the arena size
+        if arena.frozen is False:
+            arena.freeze()
+
+        return model
+
+    @staticmethod
+    def _native_vpars(theta_pars, native):
+        '''
+        The velocity pars in the order expected by numba_transformation.py,
+        in an arena buffer
+        '''
+
+        vpars = native['arena'].request((9,))
+        vpars[:] = 0.
+        for i, name in enumerate(native['vpar_names']):
+            if name in theta_pars:
+                vpars[i] = theta_pars[name]
+            else:
+                vpars[i] = native['vpar_fixed'][name]
+
+        return vpars
+
+    def _native_zfactor(self, theta_pars, native):
+        '''
+        Evaluate the velocity map & kinematic redshift factor at the
+        datacube pixel centers
+        '''
+
+        arena = native['arena']
+        Nx, Ny = native['X'].shape
+
+        vpars = self._native_vpars(theta_pars, native)
+
+        v_array = arena.request((Nx, Ny))
+        los = native['los']
+        harmonics = native['harmonics']
+        if harmonics is not None:
+            mmax, harmonic_pars = harmonics
+            amps = arena.request((2*mmax,))
+            amps[:] = 0.
+            for indx, name in harmonic_pars:
+                if name in theta_pars:
+                    amps[indx] = theta_pars[name]
+                else:
+                    amps[indx] = native['vpar_fixed'][name]
+            work = arena.request((2, Ny))
+            numba_transform._eval_harmonic_vmap_in_obs_plane(
+                vpars, native['X'], native['Y'], native['offset'], amps,
+                work, v_array
+                )
+        elif los is None:
+            numba_transform._eval_vmap_in_obs_plane(
+                vpars, native['X'], native['Y'], native['offset'], v_array
+                )
+        else:
+            dy = arena.request(los.nodes.shape)
+            numba_transform._eval_thick_vmap_in_obs_plane(
+                vpars, native['X'], native['Y'], los.nodes, los.weights, dy,
+                v_array, v_array, False
+                )
+
+        zfactor = arena.request((Nx, Ny))
+        nlike._compute_zfactor(v_array, native['vnorm'], zfactor)
+
+        return zfactor
+
+    def _native_sed(self, theta_pars, native):
+        '''
+        The SED table values, rebuilt only if SED pars are sampled. With a
+        velocity dispersion the line is integrated analytically instead,
+        so this is just its observed (mu, std)
+        '''
+
+        if native['dispersion'] is not None:
+            return self._native_line_pars(theta_pars, native)
+
+        sed_x = native['sed_x']
+        if native['sampled_sed'] is True:
+            sed_y = native['arena'].request(sed_x.shape)
+            self._build_native_sed(theta_pars, native, sed_y)
+        else:
+            sed_y = native['sed_y']
+
+        return sed_y
+
+    def _native_sigma(self, theta_pars, native):
+        '''
+        The velocity dispersion at the datacube pixel centers, or None if
+        no dispersion model is set. For a thick disk, the spread of the
+        velocities along each line of sight is added in quadrature
+        '''
+
+        dispersion = native['dispersion']
+        if dispersion is None:
+            return None
+
+        arena = native['arena']
+        Nx, Ny = native['X'].shape
+
+        if dispersion.radial is True:
+            vpars = self._native_vpars(theta_pars, native)
+            r = arena.request((Nx, Ny))
+            numba_transform._eval_disk_radius_in_obs_plane(
+                vpars, native['X'], native['Y'], native['offset'], r
+                )
+        else:
+            r = None
+
+        sigma = arena.request((Nx, Ny))
+        dispersion.eval(theta_pars, r, sigma)
+
+        los = native['los']
+        if los is not None:
+            vpars = self._native_vpars(theta_pars, native)
+            v_mean = arena.request((Nx, Ny))
+            v_std = arena.request((Nx, Ny))
+            dy = arena.request(los.nodes.shape)
+            numba_transform._eval_thick_vmap_in_obs_plane(
+                vpars, native['X'], native['Y'], los.nodes, los.weights, dy,
+                v_mean, v_std, True
+                )
+            sigma *= sigma
+            v_std *= v_std
+            sigma += v_std
+            np.sqrt(sigma, out=sigma)
+
+        return sigma
+
+    def _native_imap(self, theta_pars, datacube):
+        '''
+        Render the emission line & continuum intensity maps
+
+        returns: (i_array, cont_array, imap)
+        '''
+
+        imap = self.setup_imap(theta_pars, datacube)
+        i_array, cont_array = imap.render(
+            theta_pars, datacube, self.meta, im_type='both'
+            )
+
+        return i_array, cont_array, imap
+
+    def _native_model_cube(self, native, zfactor, sed_y, i_array,
+                           sigma=None):
+        '''
+        The (pre-PSF) model cube, in an arena buffer. If sigma is passed,
+        sed_y is the (mu, std) of the line instead of the SED table
+        '''
+
+        model = native['arena'].request(native['shape'])
+
+        if sigma is not None:
+            mu, std = sed_y
+            nlike._compute_model_cube_dispersion(
+                native['lambdas'], mu, std, native['sed_unit_factor'],
+                zfactor, sigma, native['vnorm'], i_array, model
+                )
+            return model
+
+        nlike._compute_model_cube(
+            native['lambdas'], native['sed_x'], sed_y, zfactor, i_array,
+            model
+            )
+
+        return model
+
+    def _native_finish(self, model, cont_array, datacube, native):
+        '''
+        Convolve a model cube by the PSF & add the continuum, in place
+
+        returns: np.ndarray, None
+            The rfft2 of the continuum if using the Fourier space chi2;
+            see _compute_fourier_chi2()
+        '''
+
+        fourier = native['fourier']
+        if fourier is None:
+            self._apply_psf(model, datacube)
+
+            # the imap continuum is lambda-independent; a low-rank
+            # continuum model is marginalized over in _log_likelihood()
+            if cont_array is not None:
+                model += cont_array
+
+            return None
+
+        # slices compared in Fourier space are left pre-PSF & w/o
+        # continuum; see _compute_fourier_chi2()
+        self._apply_psf(model, datacube, slices=fourier['real_slices'])
+
+        if cont_array is None:
+            return fourier['zero_ft']
+
+        for i in fourier['real_slices']:
+            model[i] += cont_array
+
+        return np.fft.rfft2(cont_array)
+
+    def _build_native_pipeline(self, native, cache_size):
+        '''
+        Build the dataflow graph used for incremental evaluation; see
+        pipeline.py. Each stage is only rerun if the sampled pars it
+        depends on (or an upstream stage) changed
+
+        native: dict
+            See _get_native_setup()
+        cache_size: int
+            The number of recent outputs each stage keeps
+        '''
+
+        # the imap may depend on anything but the pars that are only
+        # used by the velocity profile or SED
+        non_imap_pars = ['v0', 'vcirc', 'rscale', 'z', 'R']
+        imap_pars = [p for p in self.pars_order if p not in non_imap_pars]
+
+        sed_pars = [p for p in ['z', 'R'] if p in self.pars_order]
+
+        # some velocity pars (e.g. hz) may be fixed
+        vpar_names = [p for p in native['vpar_names']
+                      if p in self.pars_order]
+
+        if native['harmonics'] is None:
+            harmonic_names = []
+        else:
+            harmonic_names = [name for _, name in native['harmonics'][1]
+                              if name in self.pars_order]
+
+        # a radial dispersion profile also depends on the disk geometry,
+        # and the line of sight spread of a thick disk on all vmap pars
+        dispersion = native['dispersion']
+        if dispersion is None:
+            sigma_pars = []
+        else:
+            sigma_pars = dispersion.sampled_pars(self.pars_order)
+            if native['los'] is not None:
+                sigma_pars += vpar_names
+            elif dispersion.radial is True:
+                sigma_pars += [p for p in vpar_names
+                               if p not in ['v0', 'vcirc', 'rscale']]
+
+        def cube(theta_pars, model, imap_out):
+            # the cached pre-PSF model must not be changed in place
+            out = native['arena'].request(native['shape'])
+            np.copyto(out, model)
+            cont_ft = self._native_finish(
+                out, imap_out[1], native['pipeline_datacube'], native
+                )
+            return (out, cont_ft)
+
+        stages = [
+            Stage('zfactor',
+                  lambda tp: self._native_zfactor(tp, native),
+                  pars=vpar_names+harmonic_names, cache_size=cache_size),
+            Stage('sed',
+                  lambda tp: self._native_sed(tp, native),
+                  pars=sed_pars, cache_size=cache_size),
+            Stage('imap',
+                  lambda tp: self._native_imap(
+                      tp, native['pipeline_datacube']
+                      ),
+                  pars=imap_pars, cache_size=cache_size),
+            Stage('sigma',
+                  lambda tp: self._native_sigma(tp, native),
+                  pars=sigma_pars, cache_size=cache_size),
+            Stage('model',
+                  lambda tp, z, sed, imap_out, sigma: self._native_model_cube(
+                      native, z, sed, imap_out[0], sigma=sigma
+                      ),
+                  inputs=['zfactor', 'sed', 'imap', 'sigma'],
+                  cache_size=cache_size),
+            Stage('cube', cube, inputs=['model', 'imap'],
+                  cache_size=cache_size),
+            ]
+
+        return StagePipeline(stages)
+
+    def _get_native_setup(self, datacube):
+        '''
+        Build (once) everything needed by the compiled likelihood that
+        does not change between samples for the given datacube
+
+        datacube: DataCube
+            Datavector datacube truncated to desired lambda bounds
+        '''
+
+        native = getattr(self, '_native', None)
+        if (native is not None) and (native['shape'] == datacube.shape):
+            # the arena is owned by the worker process, not by us
+            native['arena'] = nlike.get_worker_arena(
+                native['arena_key'], native['capacity']
+                )
+            if (native['pipeline'] is None) and \
+               (native['cache_size'] is not None):
+                native['pipeline'] = self._build_native_pipeline(
+                    native, native['cache_size']
+                    )
+            return native
+
+        try:
+            model_name = self.pars['velocity']['model']
+        except KeyError:
+            model_name = 'default'
+
+        if model_name not in self._native_vmodels:
+            raise ValueError(f'The {model_name} velocity model is not ' +\
+                             'supported by the compiled likelihood! Must ' +\
+                             f'be one of {self._native_vmodels}')
+
+        offset = (model_name == 'offset')
+
+        vpar_names = ['g1', 'g2', 'theta_int', 'sini',
+                      'v0', 'vcirc', 'rscale']
+        if offset is True:
+            vpar_names += ['x0', 'y0']
+
+        # any velocity pars that aren't sampled
+        try:
+            vpar_fixed = {name: val for name, val in
+                          self.meta['velocity'].items() if name != 'model'}
+        except KeyError:
+            vpar_fixed = {}
+
+        # the thick disk scale height takes the place of x0, & the
+        # optional radial emission scale length that of y0
+        if model_name == 'thick':
+            vpar_names += ['hz']
+            if ('rd' in self.pars_order) or ('rd' in vpar_fixed):
+                vpar_names += ['rd']
+            los = LOSKernel(vpar_fixed.get('Nlos', 4))
+        else:
+            los = None
+
+        if model_name == 'harmonic':
+            try:
+                orders = get_harmonic_orders(vpar_fixed['harmonics'])
+            except KeyError:
+                raise KeyError('The harmonic velocity model needs the ' +\
+                               'harmonics in the velocity meta pars!')
+            # the kernel takes the amplitudes of every order up to the max
+            harmonics = (max(orders), get_harmonic_pars(orders))
+        else:
+            harmonics = None
+
+        Nspec, Nx, Ny = datacube.shape
+        X, Y = utils.build_map_grid(Nx, Ny)
+
+        vnorm = 1. / const.c.to(Unit(self.meta['units']['v_unit'])).value
+
+        sed = self._setup_sed({}, datacube)
+        sed_x = np.ascontiguousarray(sed[0])
+        sed_y = np.ascontiguousarray(sed[1])
+
+        sampled_sed = ('z' in self.pars_order) or ('R' in self.pars_order)
+
+        # see emission.EmissionLine._build_sed()
+        line = datacube.pars['emission_lines'][0]
+        sed_unit = Unit(line.sed_pars['unit'])
+        line_unit = Unit(line.line_pars['unit'])
+        sed_unit_factor = sed_unit.to(line_unit)
+        wlam = np.mean((sed_x[1:] - sed_x[:-1]) / 2.)
+
+        # pars, v_array, zfactor, sed, model
+        capacity = 9 + 2*Nx*Ny + len(sed_x) + Nspec*Nx*Ny
+        arena_key = datacube.shape + (len(sed_x),)
+
+        # plus the line of sight scratch of a thick disk
+        if los is not None:
+            capacity += len(los.nodes)
+            arena_key += ('thick', len(los.nodes))
+
+        # plus the harmonic amplitudes & row scratch
+        if harmonics is not None:
+            capacity += 2*harmonics[0] + 2*Ny
+            arena_key += ('harmonic', harmonics[0])
+
+        # the dispersion model needs vpars, radius & sigma buffers
+        dispersion_pars = self._get_dispersion_pars()
+        if dispersion_pars is not None:
+            dispersion = build_dispersion_model(
+                dispersion_pars.get('model', 'default'), dispersion_pars
+                )
+            capacity += 9 + 2*Nx*Ny
+            arena_key += ('dispersion',)
+            # plus the line of sight mean, spread & scratch of a thick
+            # disk
+            if los is not None:
+                capacity += 9 + 2*Nx*Ny + len(los.nodes)
+        else:
+            dispersion = None
+
+        # the incremental pipeline also needs a post-PSF model buffer
+        cache_size = self._get_incremental_cache_size()
+        if cache_size is not None:
+            capacity += Nspec*Nx*Ny
+            arena_key += ('incremental',)
+
+        arena = nlike.get_worker_arena(arena_key, capacity)
+
+        if self._use_fourier_chi2() is True:
+            fourier = self._setup_fourier_chi2(datacube)
+        else:
+            fourier = None
+
+        native = {
+            'shape': datacube.shape,
+            'X': X,
+            'Y': Y,
+            'offset': offset,
+            'vpar_names': vpar_names,
+            'vpar_fixed': vpar_fixed,
+            'los': los,
+            'harmonics': harmonics,
+            'vnorm': vnorm,
+            'lambdas': np.array(datacube.lambdas, dtype=float),
+            'sed_x': sed_x,
+            'sed_y': sed_y,
+            'sampled_sed': sampled_sed,
+            'line_pars': line.line_pars,
+            'sed_unit_factor': sed_unit_factor,
+            'wlam': wlam,
+            'dispersion': dispersion,
+            'capacity': capacity,
+            'arena_key': arena_key,
+            'fourier': fourier,
+            'arena': arena,
+            'pipeline': None,
+            'pipeline_datacube': None,
+            'cache_size': cache_size,
+            'chi2_cache': None,
+        }
+
+        if native['cache_size'] is not None:
+            native['pipeline'] = self._build_native_pipeline(
+                native, native['cache_size']
+                )
+
+        self._native = native
+
+        return native
+
+    def _get_continuum_setup(self, datacube):
+        '''
+        Build (once) what is needed to marginalize over the amplitudes of
+        the low-rank continuum model of the datacube, if it has one. See
+        continuum.ContinuumModel
+
+        datacube: DataCube
+            Datavector datacube truncated to desired lambda bounds
+
+        returns: dict, None
+            None if the datacube has no continuum model
+        '''
+
+        cmodel = datacube.get_continuum_model()
+        if cmodel is None:
+            return None
+
+        setup = getattr(self, '_continuum', None)
+        if (setup is not None) and (setup['shape'] == datacube.shape):
+            return setup
+
+        if self._use_fourier_chi2() is True:
+            raise ValueError('The run option fourier_chi2 cannot be used ' +\
+                             'with a low-rank continuum model!')
+
+        try:
+            use_cont = self.meta['intensity']['basis_kwargs'][
+                'use_continuum_template'
+                ]
+        except KeyError:
+            use_cont = False
+        if use_cont is True:
+            raise ValueError('Cannot use both a continuum template in the ' +\
+                             'intensity map and a low-rank continuum model!')
+
+        Nspec, Nx, Ny = datacube.shape
+
+        templates, cont, finv = cmodel.get_marginal_setup(
+            np.array(datacube.lambdas, dtype=float), datacube.weights
+            )
+
+        setup = {
+            'shape': datacube.shape,
+            # the amplitudes are marginalized about the side-band fit
+            'data': np.ascontiguousarray(datacube.data - cont),
+            'templates': np.ascontiguousarray(templates),
+            'finv': finv,
+            'b': np.empty((Nx, Ny, cmodel.Ntemplates)),
+        }
+
+        self._continuum = setup
+
+        return setup
+
+    def _compute_continuum_chi2(self, datacube, model, continuum):
+        '''
+        chi2 of a model cube w/ the continuum amplitudes marginalized
+
+        datacube: DataCube
+            The datacube datavector
+        model: np.ndarray
+            The (Nspec, Nx, Ny) model cube, w/o the low-rank continuum
+        continuum: dict
+            See _get_continuum_setup()
+        '''
+
+        return nlike._compute_chi2_continuum(
+            continuum['data'], model, datacube.weights,
+            continuum['templates'], continuum['finv'], continuum['b']
+            )
+
+    def _use_native(self):
+        '''
+        Whether to evaluate the model w/ the compiled pipeline; see
+        _setup_native_model(). Set by the run option native, & needed for
+        the Fourier space chi2, incremental evaluation, and velocity
+        dispersion, which are only implemented there
+
+        NOTE: The run option use_numba only switches the velocity map to
+        the numba transformations of the python path
+        '''
+
+        try:
+            native = self.meta['run_options']['native']
+        except KeyError:
+            native = False
+
+        return (native is True) or (self._use_fourier_chi2() is True) or \
+            (self._get_incremental_cache_size() is not None) or \
+            (self._get_dispersion_pars() is not None)
+
+    def _get_incremental_cache_size(self):
+        '''
+        The run option incremental can be True (keep the last output of
+        each pipeline stage) or an int (keep that many). Returns None if
+        incremental evaluation is off
+        '''
+
+        try:
+            incremental = self.meta['run_options']['incremental']
+        except KeyError:
+            incremental = False
+
+        if incremental is True:
+            return 1
+        elif (incremental is False) or (incremental is None):
+            return None
+        elif isinstance(incremental, int):
+            if incremental < 1:
+                raise ValueError('run_options incremental must be a ' +\
+                                 'bool or a positive int!')
+            return incremental
+        else:
+            raise TypeError('run_options incremental must be a bool or int!')
+
+    def _get_dispersion_pars(self):
+        '''
+        The velocity dispersion meta pars, e.g.
+
+            'dispersion': {'model': 'exponential', 'sigma0': 20.}
+
+        See dispersion.py. Returns None if no dispersion is modeled
+        '''
+
+        try:
+            return self.meta['dispersion']
+        except KeyError:
+            return None
+
+    def _use_fourier_chi2(self):
+        '''
+        Whether the run options ask for the Fourier space chi2, and this
+        likelihood can use it
+        '''
+
+        try:
+            fourier_chi2 = self.meta['run_options']['fourier_chi2']
+        except KeyError:
+            fourier_chi2 = False
+
+        return (fourier_chi2 is True) and (self._allow_fourier_chi2 is True)
+
+    @classmethod
+    def _setup_fourier_chi2(cls, datacube):
+        '''
+        Precompute what is needed for the Fourier space chi2 of the slices
+        with spatially uniform weights: the rfft2 of their data and the
+        circular transfer function of their PSF. Slices w/ non-uniform
+        weights are still compared in real space
+
+        NOTE: The circular PSF convolution is only accurate if the model
+        is ~0 near the cutout edges, so this raises if the stacked data
+        has significant flux there; see get_edge_flux_fraction()
+
+        datacube: DataCube
+            Datavector datacube truncated to desired lambda bounds
+
+        returns: dict, None
+            None if no slice has uniform weights
+        '''
+
+        Nspec, Nx, Ny = datacube.shape
+        weights = datacube.weights
+
+        uniform = [i for i in range(Nspec)
+                   if np.all(weights[i] == weights[i].flat[0])]
+        real = [i for i in range(Nspec) if i not in uniform]
+
+        if len(uniform) == 0:
+            return None
+
+        edge_frac = cls.get_edge_flux_fraction(datacube, uniform)
+        if edge_frac > cls._fourier_max_edge_frac:
+            raise ValueError('The run option fourier_chi2 needs the flux ' +\
+                             'to be ~0 near the cutout edges, but ' +\
+                             f'{100*edge_frac:.1f}% of the stacked flux ' +\
+                             f'is within {cls._fourier_edge_width} pixels ' +\
+                             'of them; use a larger cutout or the real ' +\
+                             'space chi2')
+
+        psf = datacube.get_psf()
+
+        # one transfer function per distinct slice PSF
+        tf, tf_index, tf_keys = [], [], {}
+        for i in uniform:
+            if psf is None:
+                key = None
+            elif isinstance(psf, ChromaticPSF):
+                lam = np.mean(datacube.lambdas[i])
+                lam = (lam * datacube.lambda_unit).to(psf.wav_unit).value
+                key = psf.get_bin(lam)
+            else:
+                key = 0
+
+            if key not in tf_keys:
+                tf_keys[key] = len(tf)
+                if key is None:
+                    tf.append(np.ones((Nx, Ny//2 + 1), dtype=np.complex128))
+                else:
+                    if isinstance(psf, ChromaticPSF):
+                        slice_psf = psf.get_psf(psf.get_bin_wavelength(key))
+                    else:
+                        slice_psf = psf
+                    tf.append(build_transfer_function(
+                        slice_psf, (Nx, Ny), datacube.pix_scale, pad=False
+                        ))
+
+            tf_index.append(tf_keys[key])
+
+        fourier = {
+            'uniform_slices': np.array(uniform, dtype=np.int64),
+            'real_slices': real,
+            'data_ft': np.fft.rfft2(datacube.data[uniform]),
+            'w2': np.array([weights[i].flat[0]**2 for i in uniform]),
+            'tf': np.array(tf),
+            'tf_index': np.array(tf_index, dtype=np.int64),
+            'mult': nlike.get_rfft_multiplicity(Ny),
+            'zero_ft': np.zeros((Nx, Ny//2 + 1), dtype=np.complex128),
+            'cont_ft': None,
+        }
+
+        return fourier
+
+    @classmethod
+    def get_edge_flux_fraction(cls, datacube, slices=None):
+        '''
+        Fraction of the flux of the stacked data within
+        _fourier_edge_width pixels of the cutout edges
+
+        datacube: DataCube
+            Datavector datacube truncated to desired lambda bounds
+        slices: list
+            Indices of the slices to stack; all if None
+
+        returns: float
+        '''
+
+        if slices is None:
+            slices = range(datacube.shape[0])
+
+        stack = np.sum(datacube.data[list(slices)], axis=0)
+
+        width = cls._fourier_edge_width
+        edge = np.ones(stack.shape, dtype=bool)
+        edge[width:-width, width:-width] = False
+
+        total = np.sum(stack)
+        if total <= 0:
+            return 1.
+
+        return np.sum(stack[edge]) / total
+
+    def _compute_fourier_chi2(self, datacube, model):
+        '''
+        chi2 of a compiled model cube when using the Fourier space chi2
+        for the uniform-weight slices. See _setup_fourier_chi2()
+
+        datacube: DataCube
+            The datacube datavector
+        model: np.ndarray
+            The (Nspec, Nx, Ny) model buffer, whose uniform-weight slices
+            are pre-PSF & w/o continuum
+        '''
+
+        fourier = self._native['fourier']
+
+        Nspec, Nx, Ny = datacube.shape
+
+        chi2 = 0.
+        for i in fourier['real_slices']:
+            chi2 += nlike._compute_chi2(
+                datacube.data[i:i+1], model[i:i+1], datacube.weights[i:i+1]
+                )
+
+        model_ft = np.fft.rfft2(model[fourier['uniform_slices']])
+
+        chi2 += nlike._compute_fourier_chi2(
+            fourier['data_ft'], fourier['tf'], fourier['tf_index'],
+            model_ft, fourier['cont_ft'], fourier['mult'], fourier['w2']
+            ) / (Nx*Ny)
+
+        return chi2
+
+    @classmethod
+    def _native_line_pars(cls, theta_pars, native):
+        '''
+        The observed line center & width (in the line unit) for the
+        sampled SED pars, matching emission.EmissionLine._build_sed()
+
+        returns: (mu, std)
+        '''
+
+        line_pars = native['line_pars']
+
+        if 'z' in theta_pars:
+            z = theta_pars['z']
+        else:
+            z = line_pars['z']
+        if 'R' in theta_pars:
+            R = theta_pars['R']
+        else:
+            R = line_pars['R']
+
+        obs_val = line_pars['value'] * (1.+z)
+        obs_std = obs_val / R
+        std = np.sqrt(obs_std**2 + native['wlam']**2)
+
+        return obs_val, std
+
+    @classmethod
+    def _build_native_sed(cls, theta_pars, native, out):
+        '''
+        Fill the SED table for sampled SED pars, matching
+        emission.EmissionLine._build_sed()
+        '''
+
+        obs_val, std = cls._native_line_pars(theta_pars, native)
+
+        nlike._build_gauss_sed(
+            native['sed_x'], obs_val, std, native['sed_unit_factor'], out
+            )
+
+        return out
+
+    @property
+    def arena_overflows(self):
+        '''
+        The number of buffer requests that overflowed the likelihood
+        arenas of this process after their first evaluation. Should be 0
+        for well-sized arenas; it doesn't count the allocations made
+        outside of the arenas
+        '''
+
+        return nlike.get_arena_overflows()
+
+    def __getstate__(self):
+        # the arena & pipeline belong to the worker process; don't ship
+        # them around
+        state = self.__dict__.copy()
+        if '_native' in state:
+            state['_native'] = state['_native'].copy()
+            for name in ['arena', 'pipeline', 'pipeline_datacube',
+                         'chi2_cache']:
+                state['_native'][name] = None
+
+        # rebuilt by each worker from the datacube
+        if '_continuum' in state:
+            state['_continuum'] = None
+
+        return state
+
     def setup_imap(self, theta_pars, datacube):
         '''
         theta_pars: dict
@@ -570,23 +1515,15 @@ class DataCubeLikelihood(LogLikelihood):
             Datavector datacube truncated to desired lambda bounds
         '''
 
-        Nspec, Nx, Ny = datacube.shape
-
-        data = np.zeros(datacube.shape)
-
         lambdas = np.array(datacube.lambdas)
 
         sed_array = self._setup_sed(theta_pars, datacube)
 
-        psf = datacube.get_psf()
-
         # get kinematic redshift correct per imap image pixel
         zfactor = 1. / (1 + v_array)
 
-        for i in range(Nspec):
-            data[i,:,:] = self._compute_slice_model(
-                lambdas[i], sed_array, zfactor, i_array, cont_array,
-                psf=psf, pix_scale=datacube.pix_scale
+        data = self._build_model_cube(
+            lambdas, sed_array, zfactor, i_array, cont_array, datacube
             )
 
         model_datacube = DataCube(
@@ -595,6 +1532,43 @@ class DataCubeLikelihood(LogLikelihood):
 
         return model_datacube
 
+    @classmethod
+    def _build_model_cube(cls, lambdas, sed, zfactor, imap, continuum,
+                          datacube):
+        '''
+        Compute the pre-PSF model slices, convolve them by the datacube
+        PSF w/ _apply_psf() & add the (post-PSF) continuum
+
+        lambdas: np.ndarray
+            The (Nspec, 2) wavelength bounds of the slices
+        sed: np.ndarray
+            The SED interpolation table; see _compute_slice_model()
+        zfactor: np.ndarray (2D)
+            The per pixel redshift factor 1 / (1 + v/c)
+        imap: np.ndarray (2D)
+            The intensity map at the emission line
+        continuum: np.ndarray (2D)
+            The imap of the fitted or modeled continuum, or None
+        datacube: DataCube
+            Datavector datacube truncated to desired lambda bounds
+
+        returns: np.ndarray of shape (Nspec, Nx, Ny)
+        '''
+
+        data = np.zeros(datacube.shape)
+
+        for i in range(datacube.shape[0]):
+            data[i,:,:] = cls._compute_slice_model(
+                lambdas[i], sed, zfactor, imap, None
+                )
+
+        cls._apply_psf(data, datacube)
+
+        if continuum is not None:
+            data += continuum
+
+        return data
+
     @classmethod
     def _compute_slice_model(cls, lambdas, sed, zfactor, imap, continuum,
                              psf=None, pix_scale=None):
@@ -648,16 +1622,7 @@ class DataCubeLikelihood(LogLikelihood):
             # plt.imshow(model, origin='lower')
             # plt.colorbar()
             # plt.title('pre-psf model')
-            # This fails if the model has no flux, which
-            # can happen for very wrong redshift samples
-            nx, ny = imap.shape[0], imap.shape[1]
-            model_im = gs.Image(model, scale=pix_scale)
-            gal = gs.InterpolatedImage(model_im)
-            conv = gs.Convolve([psf, gal])
-
-            model = conv.drawImage(
-                nx=ny, ny=nx, method='no_pixel', scale=pix_scale
-                ).array
+            model = cls._convolve_psf(model, psf, pix_scale)
             # plt.subplot(132)
             # plt.imshow(pmodel, origin='lower')
             # plt.colorbar()
@@ -668,7 +1633,8 @@ class DataCubeLikelihood(LogLikelihood):
             # plt.title('post-pre psf model')
             # plt.show()
 
-        # for now, continuum is modeled as lambda-independent
+        # the imap continuum is lambda-independent; see
+        # _get_continuum_setup() for a wavelength-dependent one
         # TODO: This assumes that the continuum template (if passed)
         #       is *post* psf-convolution
         if continuum is not None:
@@ -676,6 +1642,66 @@ class DataCubeLikelihood(LogLikelihood):
 
         return model
 
+    @classmethod
+    def _apply_psf(cls, model, datacube, slices=None):
+        '''
+        Convolve each slice of a (pre-PSF) model cube in place by the
+        datacube PSF, if there is one
+
+        model: np.ndarray (3D)
+            The (Nspec, Nx, Ny) model cube
+        datacube: DataCube
+            The datacube whose PSF (and cached PSF transfer functions,
+            if chromatic) to use
+        slices: list of ints
+            The slice indices to convolve. Defaults to all
+        '''
+
+        psf = datacube.get_psf()
+
+        if psf is None:
+            return model
+
+        if slices is None:
+            slices = range(model.shape[0])
+
+        if isinstance(psf, ChromaticPSF):
+            for i in slices:
+                model[i] = convolve_transfer(
+                    model[i], datacube.get_psf_transfer(i)
+                    )
+        else:
+            for i in slices:
+                model[i] = cls._convolve_psf(
+                    model[i], psf, datacube.pix_scale
+                    )
+
+        return model
+
+    @classmethod
+    def _convolve_psf(cls, model, psf, pix_scale):
+        '''
+        Convolve a model slice by the PSF
+
+        model: np.ndarray (2D)
+            The model slice image
+        psf: galsim.GSObject
+            A galsim object representing the PSF to convolve by
+        pix_scale: float
+            The image pixel scale
+        '''
+
+        # This fails if the model has no flux, which
+        # can happen for very wrong redshift samples
+        nx, ny = model.shape[0], model.shape[1]
+        model_im = gs.Image(model, scale=pix_scale)
+        gal = gs.InterpolatedImage(model_im)
+        conv = gs.Convolve([psf, gal])
+
+        return conv.drawImage(
+            nx=ny, ny=nx, method='no_pixel', scale=pix_scale
+            ).array
+
     def _setup_inv_cov_list(self, datacube):
         '''
         Build inverse covariance matrices for slice images
@@ -689,13 +1715,452 @@ class DataCubeLikelihood(LogLikelihood):
 
         return datacube.get_inv_cov_list()
 
+class MultiExposureLikelihood(DataCubeLikelihood):
+    '''
+    An implementation of a LogLikelihood for a MultiExposureCube
+    datavector
+
+    The intrinsic (pre-PSF) model cube is evaluated once per sample on
+    the reference exposure grid, and is then resampled, PSF-convolved,
+    and compared to each exposure in turn. Adding an exposure then only
+    costs its resampling & convolution
+
+    NOTE: The compiled pipeline works on a single cube, so the run
+    options that need it (native, fourier_chi2, incremental & a velocity
+    dispersion model) are not implemented here & raise an error. Neither
+    are the numba transformations of use_numba
+    '''
+
+    # each exposure is compared to its own resampled model, not to the
+    # model from _setup_model()
+    _allow_fourier_chi2 = False
+
+    def __init__(self, parameters, datavector):
+        '''
+        See LogLikelihood
+        '''
+
+        super(MultiExposureLikelihood, self).__init__(parameters, datavector)
+
+        self._check_run_options()
+
+        return
+
+    def _check_run_options(self):
+        '''
+        Fail early on the run options that would otherwise be ignored
+        '''
+
+        try:
+            run_options = self.meta['run_options']
+        except KeyError:
+            run_options = {}
+
+        unsupported = []
+        for name in ['native', 'use_numba', 'fourier_chi2']:
+            if run_options.get(name, False) is True:
+                unsupported.append(f'the run option {name}')
+        if self._get_incremental_cache_size() is not None:
+            unsupported.append('the run option incremental')
+        if self._get_dispersion_pars() is not None:
+            unsupported.append('a velocity dispersion model')
+
+        if len(unsupported) > 0:
+            raise ValueError('The multi_exposure likelihood does not ' +\
+                             f'implement {", ".join(unsupported)}!')
+
+        return
+
+    def _setup_model(self, theta_pars, mexp):
+        '''
+        Setup the model cube for each exposure
+
+        theta_pars: dict
+            Dictionary of sampled pars
+        mexp: MultiExposureCube
+            The multi-exposure datavector
+
+        returns: list of np.ndarray's
+            The (Nspec, Nx, Ny) model cube for each exposure
+        '''
+
+        Nx, Ny = mexp.Nx, mexp.Ny
+
+        X, Y = utils.build_map_grid(Nx, Ny)
+
+        vmap = self.setup_vmap(theta_pars)
+        imap = self.setup_imap(theta_pars, mexp)
+
+        v_array = vmap('obs', X, Y, normalized=True)
+
+        i_array, cont_array = imap.render(
+            theta_pars, mexp, self.meta, im_type='both'
+            )
+
+        # mexp.get_psf() is None, so this is the intrinsic model;
+        # continuum is added per exposure below
+        intrinsic = self._construct_model_datacube(
+            theta_pars, v_array, i_array, None, mexp
+            ).data
+
+        models = []
+        for i in range(mexp.Nexp):
+            exp = mexp.get_exposure(i)
+            model = mexp.resample(intrinsic, i)
+
+            self._apply_psf(model, exp)
+
+            # continuum is modeled as lambda-independent & post-PSF
+            if cont_array is not None:
+                model += mexp.resample(cont_array, i)
+
+            models.append(model)
+
+        return models
+
+    def _log_likelihood(self, theta, mexp, models):
+        '''
+        theta: list
+            Sampled parameters, order defined by pars_order
+        mexp: MultiExposureCube
+            The multi-exposure datavector
+        models: list of np.ndarray's
+            The model cube for each exposure
+        '''
+
+        loglike = 0
+        for i in range(mexp.Nexp):
+            exp = mexp.get_exposure(i)
+            chi2 = nlike._compute_chi2(exp.data, models[i], exp.weights)
+            loglike += -0.5*chi2
+
+        return loglike
+
+class GrismLikelihood(DataCubeLikelihood):
+    '''
+    An implementation of a LogLikelihood for a GrismDataVector
+
+    The model cube is built exactly as for DataCubeLikelihood on the
+    grism template cube, and is then projected through the (sparse)
+    dispersion operator of each grism configuration
+    '''
+
+    # the template model cube is not what is compared to the data
+    _allow_fourier_chi2 = False
+
+    def _setup_model(self, theta_pars, grism):
+        '''
+        Setup the dispersed model image for each grism configuration
+
+        theta_pars: dict
+            Dictionary of sampled pars
+        grism: GrismDataVector
+            The grism datavector
+
+        returns: list of np.ndarray's
+            The dispersed model image for each configuration
+        '''
+
+        model = super(GrismLikelihood, self)._setup_model(
+            theta_pars, grism.template
+            )
+
+        # the compiled path returns the model cube array directly
+        if isinstance(model, DataCube):
+            model = model.data
+
+        return [grism.disperse(model, i) for i in range(grism.Nimages)]
+
+    def _log_likelihood(self, theta, grism, models):
+        '''
+        theta: list
+            Sampled parameters, order defined by pars_order
+        grism: GrismDataVector
+            The grism datavector
+        models: list of np.ndarray's
+            The dispersed model image for each configuration
+        '''
+
+        loglike = 0
+        for i in range(grism.Nimages):
+            diff = grism.images[i] - models[i]
+            chi2 = np.sum(diff**2 * grism.weights[i]**2)
+            loglike += -0.5*chi2
+
+        return loglike
+
+class CubeImageLikelihood(DataCubeLikelihood):
+    '''
+    An implementation of a LogLikelihood for a broadband.CubeImageDataVector
+
+    The model datacube is built exactly as for DataCubeLikelihood, with
+    the intensity map fit to the broadband image (see
+    intensity.ImageBasisIntensityMap). The chi2 of that fit is added to
+    the datacube likelihood, so that the image constrains the shape pars
+    when the basis is not defined in the obs plane
+    '''
+
+    def setup_imap(self, theta_pars, datacube):
+        '''
+        See DataCubeLikelihood.setup_imap(). Keeps track of the imap for
+        the current sample, for its broadband image chi2
+        '''
+
+        imap = super(CubeImageLikelihood, self).setup_imap(
+            theta_pars, datacube
+            )
+
+        self._current_imap = imap
+
+        return imap
+
+    def _log_likelihood(self, theta, composite, model):
+        '''
+        theta: list
+            Sampled parameters, order defined by pars_order
+        composite: CubeImageDataVector
+            The datacube & broadband image
+        model: DataCube, np.ndarray
+            The model datacube; see DataCubeLikelihood._log_likelihood()
+        '''
+
+        loglike = super(CubeImageLikelihood, self)._log_likelihood(
+            theta, composite, model
+            )
+
+        imap = self._current_imap
+
+        # constant for a static imap, so no need to add it
+        if (imap.is_static is False) and (imap.image_chi2 is not None):
+            loglike += -0.5*imap.image_chi2
+
+        return loglike
+
+class SlitLikelihood(DataCubeLikelihood):
+    '''
+    An implementation of a LogLikelihood for a slit.SlitSpectrum
+
+    Rather than building a model datacube and collapsing it through a
+    slit mask, the velocity map & intensity profile are only evaluated at
+    the (Nslit, Nquad) sample points of the slit geometry and integrated
+    across the slit width by quadrature. The spectral model reuses the
+    compiled kernels of the datacube likelihood, so the cost per sample
+    scales with Nslit*Nquad instead of Nx*Ny
+
+    NOTE: Only the thin disk velocity models ('default', 'centered' &
+    'offset'; see _native_vmodels) can be evaluated at the slit samples,
+    and the intensity profile must be the analytic thin inclined
+    exponential, set by the flux & hlr (in arcsec) of the 'inclined_exp'
+    intensity meta pars; other intensity maps are rendered on a pixel
+    grid & are not supported. Seeing is only applied along the slit (see
+    SlitSpectrum); light scattered across the slit edges is ignored
+    '''
+
+    # the slit samples use the thin disk velocity kernel
+    _native_vmodels = ['default', 'centered', 'offset']
+
+    def _setup_model(self, theta_pars, slit):
+        '''
+        Setup the (Nspec, Nslit) model PV spectrum
+
+        theta_pars: dict
+            Dictionary of sampled pars
+        slit: SlitSpectrum
+            The slit datavector
+
+        returns: model (np.ndarray)
+            The model buffer. Only valid until the next likelihood
+            evaluation in this process
+        '''
+
+        native = self._get_slit_setup(slit)
+
+        arena = native['arena']
+        arena.reset()
+
+        Nspec = slit.Nspec
+        shape = native['x'].shape
+
+        vpars = arena.request((9,))
+        vpars[7:] = 0.
+        for i, name in enumerate(native['vpar_names']):
+            vpars[i] = theta_pars[name]
+
+        v_array = arena.request(shape)
+        numba_transform._eval_vmap_in_obs_plane(
+            vpars, native['x'], native['y'], native['offset'], v_array
+            )
+
+        zfactor = arena.request(shape)
+        nlike._compute_zfactor(v_array, native['vnorm'], zfactor)
+
+        sed_x = native['sed_x']
+        if native['sampled_sed'] is True:
+            sed_y = arena.request(sed_x.shape)
+            self._build_native_sed(theta_pars, native, sed_y)
+        else:
+            sed_y = native['sed_y']
+
+        # flux in each sample's area of the slit
+        i_array = arena.request(shape)
+        i_array[:] = eval_inclined_exp(
+            theta_pars, native['x'], native['y'], native['flux'],
+            native['hlr'], slit.pix_scale
+            )
+        i_array *= native['area']
+
+        samples = arena.request((Nspec,) + shape)
+        nlike._compute_model_cube(
+            native['lambdas'], sed_x, sed_y, zfactor, i_array, samples
+            )
+
+        model = arena.request(slit.shape)
+        np.sum(samples, axis=2, out=model)
+
+        seeing_T = native['seeing_T']
+        if seeing_T is not None:
+            seen = arena.request(slit.shape)
+            np.dot(model, seeing_T, out=seen)
+            model = seen
+
+        if arena.frozen is False:
+            arena.freeze()
+
+        return model
+
+    def _get_slit_setup(self, slit):
+        '''
+        Build (once) everything needed by the slit model that does not
+        change between samples. Same as _get_native_setup(), but for the
+        slit sample points
+
+        slit: SlitSpectrum
+            The slit datavector
+        '''
+
+        geom = slit.geometry
+
+        native = getattr(self, '_native', None)
+        if (native is not None) and (native['shape'] == slit.shape) and \
+           (native['seeing'] is slit.seeing_matrix):
+            Nsed = len(native['sed_x'])
+            native['arena'] = nlike.get_worker_arena(
+                ('slit',) + slit.shape + (geom.Nquad, Nsed),
+                native['capacity']
+                )
+            return native
+
+        try:
+            model_name = self.pars['velocity']['model']
+        except KeyError:
+            model_name = 'default'
+
+        if model_name not in self._native_vmodels:
+            raise ValueError(f'The {model_name} velocity model is not ' +\
+                             'supported by the slit likelihood! Must ' +\
+                             f'be one of {self._native_vmodels}')
+
+        try:
+            imap_pars = self.meta['intensity']
+        except KeyError:
+            raise KeyError('The slit likelihood needs intensity meta pars!')
+
+        if imap_pars['type'] != 'inclined_exp':
+            raise ValueError('The slit likelihood only supports the ' +\
+                             'inclined_exp intensity map for now!')
+
+        offset = (model_name == 'offset')
+
+        vpar_names = ['g1', 'g2', 'theta_int', 'sini',
+                      'v0', 'vcirc', 'rscale']
+        if offset is True:
+            vpar_names += ['x0', 'y0']
+
+        vnorm = 1. / const.c.to(Unit(self.meta['units']['v_unit'])).value
+
+        sed = self._setup_sed({}, slit)
+        sed_x = np.ascontiguousarray(sed[0])
+        sed_y = np.ascontiguousarray(sed[1])
+        Nsed = len(sed_x)
+
+        sampled_sed = ('z' in self.pars_order) or ('R' in self.pars_order)
+
+        # see emission.EmissionLine._build_sed()
+        line = slit.pars['emission_lines'][0]
+        sed_unit = Unit(line.sed_pars['unit'])
+        line_unit = Unit(line.line_pars['unit'])
+        sed_unit_factor = sed_unit.to(line_unit)
+        wlam = np.mean((sed_x[1:] - sed_x[:-1]) / 2.)
+
+        Nspec, Nslit = slit.shape
+        Nsamp = Nslit * geom.Nquad
+
+        # the seeing is applied w/ a matmul into an arena buffer
+        if slit.seeing_matrix is not None:
+            seeing_T = np.ascontiguousarray(slit.seeing_matrix.T)
+        else:
+            seeing_T = None
+
+        # pars, v_array, zfactor, sed, imap, samples, model & seeing
+        capacity = 9 + 3*Nsamp + Nsed + Nspec*Nsamp + 2*Nspec*Nslit
+
+        arena = nlike.get_worker_arena(
+            ('slit',) + slit.shape + (geom.Nquad, Nsed), capacity
+            )
+
+        native = {
+            'shape': slit.shape,
+            'x': geom.x,
+            'y': geom.y,
+            'area': geom.area,
+            'offset': offset,
+            'vpar_names': vpar_names,
+            'vnorm': vnorm,
+            'flux': imap_pars['flux'],
+            'hlr': imap_pars['hlr'],
+            'lambdas': np.array(slit.lambdas, dtype=float),
+            'sed_x': sed_x,
+            'sed_y': sed_y,
+            'sampled_sed': sampled_sed,
+            'line_pars': line.line_pars,
+            'sed_unit_factor': sed_unit_factor,
+            'wlam': wlam,
+            'seeing': slit.seeing_matrix,
+            'seeing_T': seeing_T,
+            'capacity': capacity,
+            'arena': arena
+        }
+
+        self._native = native
+
+        return native
+
+    def _log_likelihood(self, theta, slit, model):
+        '''
+        theta: list
+            Sampled parameters, order defined by pars_order
+        slit: SlitSpectrum
+            The slit datavector
+        model: np.ndarray
+            The (Nspec, Nslit) model PV spectrum
+        '''
+
+        diff = slit.data - model
+        chi2 = np.sum(diff**2 * slit.weights**2)
+
+        return -0.5*chi2
+
 def get_likelihood_types():
     return LIKELIHOOD_TYPES
 
 # NOTE: This is where you must register a new likelihood model
 LIKELIHOOD_TYPES = {
     'default': DataCubeLikelihood,
-    'datacube': DataCubeLikelihood
+    'datacube': DataCubeLikelihood,
+    'multi_exposure': MultiExposureLikelihood,
+    'grism': GrismLikelihood,
+    'cube_image': CubeImageLikelihood,
+    'slit': SlitLikelihood
     }
 
 def build_likelihood_model(name, parameters, datavector):
@@ -791,6 +2256,47 @@ def main(args):
     print('Calling Logposterior w/ random theta')
     theta = np.random.rand(len(sampled_pars))
 
+    # imported here as mocks imports this module
+    import mocks
+
+    print('Comparing the Fourier & real space chi2 on a mock datacube')
+    fourier_pars = deepcopy(mcmc_pars)
+    fourier_pars['priors'] = {
+        name: priors.UniformPrior(-10, 300) for name in true_pars
+        }
+    for hlr, compact in [(1., True), (3.5, False)]:
+        datacube_pars = {
+            'Nx': 30, 'Ny': 30, 'pix_scale': 0.5, 'true_flux': 3.8e4,
+            'true_hlr': hlr, 'v_model': 'centered', 'v_unit': Unit('km/s'),
+            'r_unit': Unit('kpc'), 'z': 0.3, 'R': 5000., 'sky_sigma': 0.5,
+            'psf': gs.Gaussian(fwhm=1.),
+            }
+        np.random.seed(1)
+        mock, _, _ = mocks.setup_likelihood_test(true_pars, datacube_pars)
+        mock.set_psf(datacube_pars['psf'])
+        fourier_pars['intensity']['hlr'] = hlr
+
+        loglike = []
+        for fourier_chi2 in [False, True]:
+            fourier_pars['run_options'] = {
+                'native': True, 'fourier_chi2': fourier_chi2
+                }
+            fpars = Pars(sampled_pars, fourier_pars)
+            post = LogPosterior(fpars, mock, likelihood='datacube')
+            ftheta = fpars.pars2theta(true_pars)
+            try:
+                loglike.append(post(ftheta, mock, fpars)[1][1])
+            except ValueError:
+                # the edge flux guard; only expected for the wide profile
+                assert (fourier_chi2 is True) and (compact is False)
+
+        if compact is True:
+            dchi2 = 2 * abs(loglike[1] - loglike[0])
+            print(f'|chi2_fourier - chi2_real| = {dchi2:.3f}')
+            assert dchi2 < 1.
+        else:
+            assert len(loglike) == 1
+
     return 0
 
 if __name__ == '__main__':
@@ -2,6 +2,9 @@ from abc import abstractmethod
 import types
 import numpy as np
 import os
+import sys
+from copy import deepcopy
+from contextlib import nullcontext
 from multiprocessing import Pool
 import schwimmbad
 # from schwimmbad import SerialPool, MultiPool, MPIPool
@@ -13,11 +16,18 @@ from corner import corner
 import zeus
 import emcee
 import pocomc as pc
+import dynesty
 
 import utils
 import priors
-from likelihood import DataCubeLikelihood
+from parameters import Pars
+from likelihood import DataCubeLikelihood, LogPosterior
 from velocity import VelocityMap
+from predictive import posterior_predictive
+from numba_ensemble import NativeEnsembleSampler
+import chainstore
+from warmstart import FlowLibrary, PriorStandardizer, StandardizedFunction, \
+    get_prior_ranges, get_datacube_features
 
 import ipdb
 
@@ -117,6 +127,9 @@ class MCMCRunner(object):
         self.has_run = False
         self.has_MAP = False
 
+        # set by run(); see get_pool_size()
+        self.queue_size = None
+
         self.burn_in = None
 
         # Are set after a run with `compute_MAP()`
@@ -231,7 +244,7 @@ class MCMCRunner(object):
         return outliers, Noutliers
 
     def run(self, pool, nsteps=None, start=None, return_sampler=False,
-            vb=True):
+            vb=True, close_pool=True, queue_size=None):
         '''
         pool: Pool
             A pool object returned from schwimmbad. Can be SerialPool,
@@ -245,6 +258,12 @@ class MCMCRunner(object):
             Set to True if you want the sampler returned
         vb: bool
             Will print out zeus summary if True
+        close_pool: bool
+            Set to False to keep the pool open for later runs
+        queue_size: int
+            The number of workers of the pool, for the samplers that
+            batch their evaluations over it. Needed for pools that don't
+            report a size, e.g. a MultiPool; see get_pool_size()
 
         returns: zeus.EnsembleSampler object that contains the chains
         '''
@@ -265,7 +284,12 @@ class MCMCRunner(object):
                       f'set to {omp}. If not set to 1, this will ' +\
                       'degrade perfomance for parallel processing.')
 
-        with pool:
+        if close_pool is True:
+            context = pool
+        else:
+            context = nullcontext(pool)
+
+        with context:
             pt = type(pool)
             print(f'Pool: {pool}')
 
@@ -274,6 +298,7 @@ class MCMCRunner(object):
                     pool.wait()
                     sys.exit(0)
 
+            self.queue_size = queue_size
             self.sampler = self._initialize_sampler(pool=pool)
 
             self._run_sampler(start, nsteps=nsteps, progress=progress)
@@ -304,6 +329,14 @@ class MCMCRunner(object):
 
         return
 
+    def get_ncall(self):
+        '''
+        The number of log probability evaluations made by the sampler.
+        Must be implemented by each sampler type
+        '''
+        raise NotImplementedError('get_ncall() is not implemented for ' +\
+                                  f'{type(self).__name__}!')
+
     def set_burn_in(burn_in):
         self.burn_in = burn_in
 
@@ -408,6 +441,155 @@ class MCMCRunner(object):
 
         return
 
+    def _get_names(self):
+        names = self.ndim*['']
+        for name, indx in self.pars_order.items():
+            names[indx] = name
+
+        return names
+
+    def save_chain(self, directory, chunk_steps=1000):
+        '''
+        Write the chain (& log probs) to a memory-mapped chain store, for
+        the binned plots
+
+        directory: str
+            The store directory. Must not already hold a chain
+        chunk_steps: int
+            The number of steps per chunk file
+
+        returns: chainstore.ChainStore
+        '''
+
+        if self.has_run is not True:
+            raise ValueError('Cannot save the chain until mcmc has been run!')
+
+        store = chainstore.ChainStore(
+            directory, self.nwalkers, self.ndim, names=self._get_names()
+            )
+        if store.nsteps > 0:
+            raise ValueError(f'The store at {directory} already has a chain!')
+
+        chain = self.sampler.get_chain()
+        try:
+            log_prob = self.sampler.get_log_prob()
+        except AttributeError:
+            log_prob = None
+
+        for s in range(0, len(chain), chunk_steps):
+            store.append(
+                chain[s:s+chunk_steps],
+                log_prob[s:s+chunk_steps] if log_prob is not None else None
+                )
+
+        return store
+
+    def _get_chain_store(self, store):
+        if store is not None:
+            return store
+
+        store = getattr(self.sampler, 'chain_store', None)
+        if store is None:
+            raise ValueError('Must pass a chain store, as the sampler ' +\
+                             'did not write to one! See save_chain()')
+
+        return store
+
+    def plot_binned_chains(self, store=None, nbins=200, reference=None,
+                           show=True, close=True, outfile=None, size=None):
+        '''
+        As plot_chains(), but w/ walker quantile bands over bins of steps
+        read from a chain store, so it runs in bounded memory
+
+        store: chainstore.ChainStore
+            The chain store. Defaults to the one the sampler wrote to
+        nbins: int
+            The number of bins of steps
+        '''
+
+        store = self._get_chain_store(store)
+        trace = chainstore.compute_binned_trace(store, nbins=nbins)
+
+        chainstore.plot_binned_trace(
+            trace, names=store.names, reference=reference, show=show,
+            close=close, outfile=outfile, size=size
+            )
+
+        return
+
+    def plot_binned_corner(self, store=None, reference=None, discard=None,
+                           thin=1, bins=50, crange=None, show=True,
+                           close=True, outfile=None, size=None, title=None,
+                           use_derived=True):
+        '''
+        As plot_corner(), but from 1D & 2D histograms accumulated over
+        blocks of a chain store, so it runs in bounded memory
+
+        store: chainstore.ChainStore
+            The chain store. Defaults to the one the sampler wrote to
+        bins: int
+            The number of bins per parameter
+        crange: list
+            A list of (min, max) tuples of the parameter ranges. Defaults
+            to the full range of the samples. If use_derived is set, the
+            range of sini*vcirc may be left off
+        use_derived: bool
+            Turn on to plot the derived sini*vcirc as well, computed for
+            each block as it is read
+
+        See plot_corner() for the rest
+        '''
+
+        if discard is None:
+            if self.burn_in is not None:
+                discard = self.burn_in
+            else:
+                raise ValueError('Must passs a value for discard if ' +\
+                                 'burn_in is not set!')
+
+        store = self._get_chain_store(store)
+        names = store.names
+
+        derived = None
+        if use_derived is True:
+            if ('sini' not in self.pars_order) or \
+               ('vcirc' not in self.pars_order):
+                raise ValueError('use_derived needs both sini & vcirc ' +\
+                                 'to be sampled!')
+            i1, i2 = self.pars_order['sini'], self.pars_order['vcirc']
+            derived = lambda samples: samples[:,i1] * samples[:,i2]
+            names = names + ['sini*vcirc']
+
+            if reference is not None:
+                if len(reference) != self.ndim:
+                    raise ValueError('Length of reference list must be ' +\
+                                     'same as Ndim!')
+                reference = list(reference) + \
+                    [reference[i1]*reference[i2]]
+
+            if (crange is not None) and (len(crange) == self.ndim):
+                # the extreme products are at the corners of the box
+                corners = np.outer(crange[i1], crange[i2])
+                crange = list(crange) + [(np.min(corners), np.max(corners))]
+
+        stats = chainstore.compute_binned_stats(
+            store, discard=discard, thin=thin, bins=bins, ranges=crange,
+            derived=derived
+            )
+
+        title_suffix = f'Burn in = {discard}'
+        if title is None:
+            title = title_suffix
+        else:
+            title += f'\n{title_suffix}'
+
+        chainstore.plot_binned_corner(
+            stats, names=names, reference=reference, show=show,
+            close=close, outfile=outfile, size=size, title=title
+            )
+
+        return
+
     def plot_corner(self, reference=None, discard=None, thin=1, crange=None,
                     show=True, close=True, outfile=None, size=(20,20),
                     show_titles=True, title=None, use_derived=True,
@@ -533,6 +715,10 @@ class ZeusRunner(MCMCRunner):
     def meta(self):
         return self.pars.meta.pars
 
+    def get_ncall(self):
+        # zeus slice sampling makes a variable number of calls per step
+        return int(self.sampler.ncall)
+
 class KLensZeusRunner(ZeusRunner):
     '''
     Main difference is that we assume args=[datacube] and
@@ -673,8 +859,11 @@ class KLensZeusRunner(ZeusRunner):
 
         Nspec = datacube.Nspec
 
-        # grab psf if present
-        psf = datacube.get_psf()
+        # same model cube as the likelihood, incl. the datacube PSF
+        model_cube = DataCubeLikelihood._build_model_cube(
+            np.array(lambdas), sed_array, zfactor, intensity, continuum,
+            datacube
+            )
 
         fig, axs = plt.subplots(4, Nspec, sharex=True, sharey=True,)
         for i in range(Nspec):
@@ -692,10 +881,7 @@ class KLensZeusRunner(ZeusRunner):
 
             # second, model
             ax = axs[1,i]
-            model = DataCubeLikelihood._compute_slice_model(
-                lambdas[i], sed_array, zfactor, intensity, continuum,
-                psf=psf, pix_scale=datacube.pix_scale
-                )
+            model = model_cube[i]
             im = ax.imshow(model, origin='lower')
             if i == 0:
                 ax.set_ylabel('Model')
@@ -740,6 +926,47 @@ class KLensZeusRunner(ZeusRunner):
 
         return
 
+    def posterior_predictive(self, pool=None, nsamples=200, discard=None,
+                             thin=1, likelihood='datacube', **kwargs):
+        '''
+        Posterior-predictive summaries of the fit, over random samples of
+        the chain. See predictive.posterior_predictive()
+
+        pool: schwimmbad pool
+            The pool to render the model cubes in. Runs serially if None
+        nsamples: int
+            The number of chain samples to use
+        discard: int
+            The number of samples to discard, from 0:discard. Defaults to
+            burn_in
+        thin: int
+            The factor by which to thin out the samples by
+        likelihood: str
+            The registered likelihood type used for the fit
+        kwargs: dict
+            Passed to predictive.posterior_predictive()
+
+        returns: predictive.PredictiveStats
+        '''
+
+        if self.has_run is not True:
+            raise ValueError('Cannot run a posterior-predictive check ' +\
+                             'until the mcmc has been run!')
+
+        if discard is None:
+            if self.burn_in is not None:
+                discard = self.burn_in
+            else:
+                raise ValueError('Must passs a value for discard if ' +\
+                                 'burn_in is not set!')
+
+        samples = self.sampler.get_chain(flat=True, discard=discard, thin=thin)
+
+        return posterior_predictive(
+            samples, self.pars, self.datacube, pool=pool,
+            likelihood=likelihood, nsamples=nsamples, **kwargs
+            )
+
 class KLensEmceeRunner(KLensZeusRunner):
 
     def _initialize_sampler(self, pool=None):
@@ -750,8 +977,84 @@ class KLensEmceeRunner(KLensZeusRunner):
 
         return sampler
 
+    def get_ncall(self):
+        # one call per walker per step
+        return int(self.sampler.iteration * self.nwalkers)
+
+class KLensNativeRunner(KLensZeusRunner):
+    '''
+    An ensemble runner w/ a compiled step loop; see numba_ensemble.py.
+    The proposals of each half of the walkers are evaluated in one batch,
+    split into one chunk per pool worker
+    '''
+
+    # stretch move scale & fraction of differential evolution moves
+    a = 2.
+    de_fraction = 0.1
+
+    def __init__(self, nwalkers, ndim, pfunc, datacube, pars,
+                 checkpoint_every=100, checkpoint_file=None, chain_store=None,
+                 seed=None):
+        '''
+        checkpoint_every: int
+            The number of steps between handing the chain back to python
+        checkpoint_file: str
+            If set, the chain so far is saved to this .npz file at each
+            checkpoint
+        chain_store: str
+            If set, the chain is written to a chainstore.ChainStore in
+            this directory at each checkpoint instead of kept in memory
+        seed: int
+            The random seed of the moves. Seeded runs are reproducible
+            for any number of threads
+
+        See KLensZeusRunner for the rest
+        '''
+
+        super(KLensNativeRunner, self).__init__(
+            nwalkers, ndim, pfunc, datacube, pars
+            )
+
+        self.checkpoint_every = checkpoint_every
+        self.checkpoint_file = checkpoint_file
+        self.chain_store = chain_store
+        self.seed = seed
+
+        return
+
+    def _initialize_sampler(self, pool=None):
+        if isinstance(pool, schwimmbad.SerialPool):
+            pool = None
+
+        if self.chain_store is not None:
+            store = chainstore.ChainStore(
+                self.chain_store, self.nwalkers, self.ndim,
+                names=self._get_names()
+                )
+        else:
+            store = None
+
+        sampler = NativeEnsembleSampler(
+            self.nwalkers, self.ndim, self.pfunc,
+            args=self.args, kwargs=self.kwargs, pool=pool,
+            nchunks=get_pool_size(pool, self.queue_size), a=self.a,
+            de_fraction=self.de_fraction,
+            checkpoint_every=self.checkpoint_every,
+            checkpoint_file=self.checkpoint_file, chain_store=store,
+            seed=self.seed
+            )
+
+        return sampler
+
+    def get_ncall(self):
+        return int(self.sampler.ncall)
+
 class PocoRunner(MCMCRunner):
 
+    # set by subclasses to pass a flow or training config to pocomc
+    flow_config = None
+    train_config = None
+
     def _initialize_sampler(self, pool=None):
         sampler = pc.Sampler(
             self.nparticles, self.ndim,
@@ -762,6 +1065,8 @@ class PocoRunner(MCMCRunner):
             log_prior_args=self.logprior_args,
             log_prior_kwargs=self.logprior_kwargs,
             pool=pool,
+            flow_config=self.flow_config,
+            train_config=self.train_config,
             infer_vectorization=False
             # NOTE: wes bounds as we implement this in our priors
             #bounds=bounds
@@ -777,7 +1082,9 @@ class KLensPocoRunner(PocoRunner):
     def __init__(self, nparticles, ndim, loglike, logprior,
                  datacube, pars,
                  loglike_args=None, loglike_kwargs=None,
-                 logprior_args=None, logprior_kwargs=None):
+                 logprior_args=None, logprior_kwargs=None,
+                 library=None, standardize=False, flow_config=None,
+                 train_config=None):
         '''
         nparticles: int
             Number of MCMC particles. Recommended to be at least 100
@@ -805,6 +1112,18 @@ class KLensPocoRunner(PocoRunner):
         logprior_kwargs: dict
             List of additional kwargs needed to evaluate log prior,
             such as meta parameters, etc.
+        library: FlowLibrary, str
+            A library (or its directory) of flows trained on previous
+            objects. If a similar object is found, its flow is used to
+            warm-start this run. See warmstart.FlowLibrary
+        standardize: bool
+            Set to sample in the prior-standardized space; see
+            warmstart.PriorStandardizer. Flows can then be shared
+            between objects w/ different prior ranges
+        flow_config: dict
+            pocomc flow config
+        train_config: dict
+            pocomc flow training config
 
         NOTE: to make this consistent w/ the other mcmc runner classes,
         you must pass datacube & pars separately from the rest of the
@@ -816,6 +1135,13 @@ class KLensPocoRunner(PocoRunner):
         else:
             loglike_args = [datacube]
 
+        if standardize is True:
+            standardizer = PriorStandardizer.from_pars(pars)
+            loglike = StandardizedFunction(loglike, standardizer)
+            logprior = StandardizedFunction(logprior, standardizer)
+        else:
+            standardizer = None
+
         super(KLensPocoRunner, self).__init__(
             nparticles, ndim,
             loglike=loglike, logprior=logprior,
@@ -830,7 +1156,28 @@ class KLensPocoRunner(PocoRunner):
 
         self.MAP_vmap = None
 
-        #...
+        self.standardizer = standardizer
+        self.flow_config = flow_config
+        self.train_config = train_config
+
+        # what is needed to match this object to a library entry
+        self.pars_names = sorted(self.pars_order, key=self.pars_order.get)
+        self.prior_ranges = get_prior_ranges(pars)
+        self.features = get_datacube_features(datacube)
+
+        if isinstance(library, str):
+            library = FlowLibrary(library)
+        self.library = library
+
+        if library is not None:
+            self.warm_start = library.match(
+                self.pars_names, self.prior_ranges, self.features,
+                standardized=standardize
+                )
+        else:
+            self.warm_start = None
+
+        return
 
     @property
     def nparticles(self):
@@ -848,6 +1195,17 @@ class KLensPocoRunner(PocoRunner):
     def meta(self):
         return self.pars.meta.pars
 
+    def _initialize_sampler(self, pool=None):
+        sampler = super(KLensPocoRunner, self)._initialize_sampler(pool=pool)
+
+        # only the initial flow weights change, not the target
+        if self.warm_start is not None:
+            entry = self.library.load(self.warm_start)
+            sampler.flow.load_state_dict(entry['flow_state'])
+            print(f'Warm-starting pocomc flow from {self.warm_start}')
+
+        return sampler
+
     def _run_sampler(self, start, nsteps=None, progress=True):
         '''
         The poco-specific way to run the sampler object
@@ -856,12 +1214,373 @@ class KLensPocoRunner(PocoRunner):
         if self.sampler is None:
             raise AttributeError('sampler has not yet been initialized!')
 
+        if self.standardizer is not None:
+            start = self.standardizer.forward(start)
+
         self.sampler.run(
             start, progress=progress
             )
 
         return
 
+    def get_ncall(self):
+        return int(self.sampler.ncall)
+
+    def get_particles(self):
+        '''
+        The final particles of the run, in theta
+        '''
+
+        if self.has_run is not True:
+            raise AttributeError('Cannot get particles until poco has run!')
+
+        particles = np.array(self.sampler.results['samples'])
+
+        if self.standardizer is not None:
+            particles = self.standardizer.inverse(particles)
+
+        return particles
+
+    def save_flow(self, name, library=None, overwrite=False):
+        '''
+        Save the trained flow & final particles to a flow library, so
+        that later runs on similar objects can warm-start from them
+
+        name: str
+            The library entry name, e.g. an object ID
+        library: FlowLibrary, str
+            The library (or its directory). Defaults to the library
+            passed to the constructor
+        overwrite: bool
+            Set to replace an existing entry
+        '''
+
+        if library is None:
+            library = self.library
+        elif isinstance(library, str):
+            library = FlowLibrary(library)
+
+        if library is None:
+            raise ValueError('Must pass a library if one was not set!')
+
+        library.save(
+            name, self.sampler.flow.state_dict(), self.get_particles(),
+            self.pars_names, self.prior_ranges, self.features,
+            standardizer=self.standardizer, overwrite=overwrite
+            )
+
+        return
+
+class NestedRunner(MCMCRunner):
+    '''
+    Nested sampling w/ dynesty, which unlike the MCMC runners also
+    estimates the evidence. The prior must be a LogPrior, as dynesty
+    samples the unit cube through its prior_transform()
+
+    Live point replacements are proposed in batches the size of the
+    pool & their likelihoods evaluated in parallel
+    '''
+
+    # see the dynesty docs for these choices
+    bound = 'multi'
+    sample = 'rwalk'
+    dlogz = 0.1
+
+    def _initialize_sampler(self, pool=None):
+        queue_size = get_pool_size(pool, self.queue_size)
+        if queue_size == 1:
+            pool = None
+
+        sampler = dynesty.NestedSampler(
+            self.loglike, self.prior_transform, self.ndim,
+            nlive=self.nlive, bound=self.bound, sample=self.sample,
+            logl_args=self.loglike_args, logl_kwargs=self.loglike_kwargs,
+            pool=pool, queue_size=queue_size,
+            # only the transform of the initial live points stays on the
+            # master; w/ rwalk the whole proposal, incl. its prior
+            # transforms, is mapped to the pool
+            use_pool={'prior_transform': False}
+            )
+
+        return sampler
+
+    @property
+    def nlive(self):
+        return self.nwalkers
+
+    def _initialize_walkers(self, scale=0.1):
+        # live points are drawn from the prior by dynesty
+        self.start = None
+
+        return
+
+    @property
+    def prior_transform(self):
+        return self.logprior.prior_transform
+
+    @property
+    def args(self):
+        return self.loglike_args
+
+    @property
+    def kwargs(self):
+        return self.loglike_kwargs
+
+    def _run_sampler(self, start, nsteps=None, progress=True):
+        '''
+        The dynesty-specific way to run the sampler object. start is not
+        used; nsteps is the max number of iterations, if set
+        '''
+
+        if self.sampler is None:
+            raise AttributeError('sampler has not yet been initialized!')
+
+        self.sampler.run_nested(
+            dlogz=self.dlogz, maxiter=nsteps, print_progress=progress
+            )
+
+        return
+
+    def get_ncall(self):
+        return int(np.sum(self.sampler.results.ncall))
+
+    @property
+    def logz(self):
+        if self.has_run is not True:
+            raise AttributeError('Cannot get the evidence until the ' +\
+                                 'sampler has run!')
+        return self.sampler.results.logz[-1]
+
+    @property
+    def logzerr(self):
+        if self.has_run is not True:
+            raise AttributeError('Cannot get the evidence until the ' +\
+                                 'sampler has run!')
+        return self.sampler.results.logzerr[-1]
+
+    def get_samples(self):
+        '''
+        Equally-weighted posterior samples
+        '''
+
+        if self.has_run is not True:
+            raise AttributeError('Cannot get samples until the sampler ' +\
+                                 'has run!')
+
+        results = self.sampler.results
+        weights = np.exp(results.logwt - results.logz[-1])
+
+        return dynesty.utils.resample_equal(
+            results.samples, weights / np.sum(weights)
+            )
+
+class KLensNestedRunner(NestedRunner):
+    '''
+    As for KLensPocoRunner, we assume loglike_args=[datacube]
+    '''
+
+    def __init__(self, nlive, ndim, loglike, logprior, datacube, pars,
+                 loglike_args=None, loglike_kwargs=None, dlogz=None):
+        '''
+        nlive: int
+            Number of live points. Should be at least a few times ndim
+        ndim: int
+            Number of sampled dimensions
+        loglike: LogLikelihood
+            Log likelihood to sample from
+        logprior: LogPrior
+            Log prior, which must implement prior_transform()
+        datacube: DataCube
+            A datacube object to fit a model to
+        pars: A Pars object containing the sampled pars and meta pars
+              needed to evaluate posterior, such as
+              covariance matrix, SED definition, etc.
+        loglike_args: list
+            List of additional args needed to evaluate log likelihood
+        loglike_kwargs: dict
+            List of additional kwargs needed to evaluate log likelihood
+        dlogz: float
+            The remaining evidence fraction at which to stop
+        '''
+
+        if not hasattr(logprior, 'prior_transform'):
+            raise TypeError('logprior must implement prior_transform()!')
+
+        if loglike_args is not None:
+            loglike_args = [datacube] + loglike_args
+        else:
+            loglike_args = [datacube]
+
+        super(KLensNestedRunner, self).__init__(
+            nlive, ndim, loglike=loglike, logprior=logprior,
+            loglike_args=loglike_args, loglike_kwargs=loglike_kwargs
+            )
+
+        self.datacube = datacube
+        self.pars = pars
+
+        self.pars_order = self.pars.sampled.pars_order
+
+        if dlogz is not None:
+            self.dlogz = dlogz
+
+        return
+
+    @property
+    def meta(self):
+        return self.pars.meta.pars
+
+def get_pool_size(pool, queue_size=None):
+    '''
+    The number of workers of a pool, i.e. how many evaluations to hand
+    it at once
+
+    pool: Pool
+        A schwimmbad pool, or None
+    queue_size: int
+        The number of workers, if known. Required for pools that don't
+        report a size, e.g. a MultiPool
+
+    returns: int
+    '''
+
+    if queue_size is not None:
+        if queue_size < 1:
+            raise ValueError('queue_size must be at least 1!')
+        return int(queue_size)
+
+    if (pool is None) or isinstance(pool, schwimmbad.SerialPool):
+        return 1
+
+    size = getattr(pool, 'size', None)
+    if size is None:
+        raise ValueError(f'Cannot get the number of workers of a ' +\
+                         f'{type(pool).__name__}; pass queue_size!')
+
+    return max(int(size), 1)
+
+def build_sweep_configs(sampled_pars, meta, velocity=None, intensity=None):
+    '''
+    Build the Pars for a grid of velocity & intensity configurations,
+    for model comparison w/ run_nested_sweep()
+
+    sampled_pars: list
+        The sampled parameters common to all configurations
+    meta: dict
+        The meta pars common to all configurations. The priors must
+        include those of any extra sampled parameters
+    velocity: dict
+        name -> (velocity meta pars, list of extra sampled pars). If None,
+        the velocity meta pars are used as-is
+    intensity: dict
+        name -> intensity meta pars. If None, the intensity meta pars
+        are used as-is
+
+    returns: dict
+        '{velocity}/{intensity}' -> Pars
+    '''
+
+    if velocity is None:
+        velocity = {'base': (meta.get('velocity', None), [])}
+    if intensity is None:
+        intensity = {'base': meta.get('intensity', None)}
+
+    configs = {}
+    for vname, (vmeta, extra) in velocity.items():
+        for iname, imeta in intensity.items():
+            sampled = list(sampled_pars) + list(extra)
+
+            config_meta = deepcopy(meta)
+            if vmeta is not None:
+                config_meta['velocity'] = deepcopy(vmeta)
+            if imeta is not None:
+                config_meta['intensity'] = deepcopy(imeta)
+
+            # LogPrior needs exactly the priors of the sampled pars
+            try:
+                config_meta['priors'] = {
+                    name: meta['priors'][name] for name in sampled
+                    }
+            except KeyError as e:
+                raise KeyError(f'No prior set for sampled parameter {e} ' +\
+                               f'of the {vname} velocity configuration!')
+
+            configs[f'{vname}/{iname}'] = Pars(sampled, config_meta)
+
+    return configs
+
+def run_nested_sweep(configs, datacube, pool, nlive=500, likelihood='datacube',
+                     dlogz=None, nsteps=None, vb=True, queue_size=None):
+    '''
+    Run nested sampling for each configuration in a single job, sharing
+    one pool, and compare their evidences
+
+    configs: dict
+        name -> Pars for each configuration; see build_sweep_configs()
+    datacube: DataCube
+        The datavector to fit
+    pool: Pool
+        A schwimmbad pool, used for every configuration
+    nlive: int
+        Number of live points
+    likelihood: str
+        The registered likelihood type
+    dlogz: float
+        The remaining evidence fraction at which to stop
+    nsteps: int
+        Max number of iterations per configuration
+    vb: bool
+        Set to print progress & a summary
+    queue_size: int
+        The number of workers of the pool; see get_pool_size()
+
+    returns: dict
+        name -> dict of logz, logzerr, delta_logz (relative to the
+        best configuration) & the runner, ordered by evidence
+    '''
+
+    if isinstance(pool, schwimmbad.MPIPool):
+        if not pool.is_master():
+            pool.wait()
+            sys.exit(0)
+
+    results = {}
+    with pool:
+        for name, pars in configs.items():
+            if vb is True:
+                print(f'Running nested sampling for {name}')
+
+            log_posterior = LogPosterior(pars, datacube, likelihood=likelihood)
+
+            runner = KLensNestedRunner(
+                nlive, len(pars.sampled), log_posterior.log_likelihood,
+                log_posterior.log_prior, datacube, pars, dlogz=dlogz
+                )
+            runner.run(pool, nsteps=nsteps, vb=vb, close_pool=False,
+                       queue_size=queue_size)
+
+            results[name] = {
+                'logz': runner.logz,
+                'logzerr': runner.logzerr,
+                'runner': runner
+                }
+
+    best = max(results.values(), key=lambda r: r['logz'])['logz']
+    for res in results.values():
+        res['delta_logz'] = res['logz'] - best
+
+    results = dict(
+        sorted(results.items(), key=lambda item: -item[1]['logz'])
+        )
+
+    if vb is True:
+        print('config: logz +/- err (delta logz)')
+        for name, res in results.items():
+            print(f'{name}: {res["logz"]:.2f} +/- {res["logzerr"]:.2f} ' +\
+                  f'({res["delta_logz"]:.2f})')
+
+    return results
+
 def get_runner_types():
     return RUNNER_TYPES
 
@@ -870,9 +1589,15 @@ RUNNER_TYPES = {
     'default': None,
     'emcee': KLensEmceeRunner,
     'zeus': KLensZeusRunner,
+    'native': KLensNativeRunner,
     'poco': KLensPocoRunner,
+    'nested': KLensNestedRunner,
     }
 
+# the registered runners that take a fixed number of steps of an ensemble
+# of walkers & take a posterior, rather than a likelihood & prior
+ENSEMBLE_RUNNERS = ['zeus', 'emcee', 'native']
+
 def build_mcmc_runner(name, args, kwargs):
     '''
     name: str
@@ -907,6 +1632,51 @@ def main(args):
     kwargs = None
     # runner = ZeusRunner(nwalkers, ndims, log_posterior, args=args, kwargs=kwargs)
 
+    print('Testing nested sampling prior transform')
+    from likelihood import LogPrior
+    meta = {
+        'priors': {
+            'g1': priors.GaussPrior(0., 0.1, clip_sigmas=2),
+            'sini': priors.UniformPrior(0., 1.),
+            'vcirc': priors.GaussPrior(200, 20, zero_boundary='positive'),
+            }
+        }
+    pars = Pars(['g1', 'sini', 'vcirc'], meta)
+    log_prior = LogPrior(pars)
+    u = np.random.rand(1000, 3)
+    theta = np.array([log_prior.prior_transform(ui) for ui in u])
+    assert np.all(np.isfinite([log_prior(t) for t in theta]))
+    assert np.allclose(theta[:,1], u[:,1])
+    assert np.allclose(log_prior.prior_transform([0.5, 0.5, 0.5]),
+                       [0., 0.5, 200.])
+
+    print('Testing pool sizes')
+    assert get_pool_size(None) == 1
+    assert get_pool_size(schwimmbad.SerialPool()) == 1
+    with schwimmbad.MultiPool(processes=2) as pool:
+        assert get_pool_size(pool, queue_size=2) == 2
+        # a MultiPool doesn't report its size
+        try:
+            get_pool_size(pool)
+            raise AssertionError('get_pool_size() must need a queue_size!')
+        except ValueError:
+            pass
+
+    print('Testing model comparison sweep configs')
+    meta['priors']['x0'] = priors.UniformPrior(-1., 1.)
+    meta['priors']['y0'] = priors.UniformPrior(-1., 1.)
+    configs = build_sweep_configs(
+        ['g1', 'sini', 'vcirc'], meta,
+        velocity={'centered': ({'model': 'centered'}, []),
+                  'offset': ({'model': 'offset'}, ['x0', 'y0'])},
+        intensity={'exp': {'type': 'inclined_exp'},
+                   'basis': {'type': 'basis', 'basis_type': 'sersiclets'}}
+        )
+    assert len(configs) == 4
+    assert len(configs['offset/basis'].sampled) == 5
+    assert 'x0' not in configs['centered/exp'].meta['priors']
+    assert configs['offset/exp'].meta['velocity']['model'] == 'offset'
+
     return 0
 
 if __name__ == '__main__':
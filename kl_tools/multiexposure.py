@@ -0,0 +1,369 @@
+import numpy as np
+import os
+from argparse import ArgumentParser
+from scipy.sparse import csr_matrix
+
+import utils
+from datavector import DataVector
+from cube import DataCube, setup_simple_bandpasses
+
+import ipdb
+
+'''
+This file defines a datavector for the same object observed in several
+exposures (pointings), each with its own PSF, dither offset, and
+orientation.
+
+The model is evaluated once per sample on the grid of a reference
+exposure (without any PSF), and then resampled onto each exposure's pixel
+grid with precomputed, subpixel averaged bilinear weights before being
+convolved by that exposure's PSF. See likelihood.MultiExposureLikelihood
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class MultiExposureCube(DataVector):
+    '''
+    A set of DataCube exposures of the same object
+
+    The model frame is defined by the reference exposure: its shape, pixel
+    scale, and wavelength slices. The model is intrinsic, so get_psf()
+    returns None; each exposure keeps its own PSF in its datacube pars.
+    For everything else this class behaves like the reference DataCube,
+    e.g. for intensity map fitting
+    '''
+
+    def __init__(self, datacubes, offsets=None, rotations=None,
+                 reference=0):
+        '''
+        datacubes: list of DataCube's
+            The exposures, truncated to the same wavelength slices
+        offsets: list of (float, float) tuples
+            The position of each exposure's image center relative to the
+            reference image center, in reference pixels. Defaults to 0
+        rotations: list of floats
+            The angle (in radians, counter-clockwise) of each exposure's
+            x-axis relative to the reference x-axis. Defaults to 0
+        reference: int
+            The index of the exposure that defines the model frame
+        '''
+
+        utils.check_type(datacubes, 'datacubes', list)
+        for dc in datacubes:
+            utils.check_type(dc, 'datacube', DataCube)
+
+        Nexp = len(datacubes)
+        if Nexp == 0:
+            raise ValueError('Must pass at least one exposure!')
+
+        if (reference < 0) or (reference >= Nexp):
+            raise ValueError(f'reference must be in [0, {Nexp})!')
+
+        if offsets is None:
+            offsets = Nexp * [(0., 0.)]
+        if rotations is None:
+            rotations = Nexp * [0.]
+
+        for name, l in {'offsets': offsets, 'rotations': rotations}.items():
+            if len(l) != Nexp:
+                raise ValueError(f'{name} must have the same len as ' +\
+                                 f'datacubes ({Nexp})!')
+
+        self.exposures = datacubes
+        self.offsets = [tuple(float(o) for o in off) for off in offsets]
+        self.rotations = [float(r) for r in rotations]
+        self.reference = reference
+        self.Nexp = Nexp
+
+        self._check_wavelengths()
+
+        self._build_resample_ops()
+
+        return
+
+    def _check_wavelengths(self):
+        '''
+        The model is evaluated once for all exposures, so they must share
+        the same wavelength slices
+        '''
+
+        ref_lambdas = np.array(self.ref.lambdas)
+
+        for i, dc in enumerate(self.exposures):
+            lambdas = np.array(dc.lambdas)
+            if (lambdas.shape != ref_lambdas.shape) or \
+               (not np.allclose(lambdas, ref_lambdas)):
+                raise ValueError(f'Exposure {i} does not have the same ' +\
+                                 'wavelength slices as the reference! ' +\
+                                 'Make sure all are truncated the same way')
+
+        return
+
+    def _build_resample_ops(self):
+        '''
+        Build the (sparse) resampling operator from the model
+        grid to each exposure's pixel grid. These only depend on the
+        exposure geometry, so they are computed once
+        '''
+
+        self.resample_ops = []
+        for i in range(self.Nexp):
+            self.resample_ops.append(self._build_resample_op(i))
+
+        return
+
+    def _build_resample_op(self, indx):
+        '''
+        Returns a (Npix_exp, Npix_model) csr_matrix R such that the
+        flattened exposure image is R.dot(flattened model image)
+
+        Each exposure pixel is split into n x n subpixels, w/ n the
+        ceiling of the exposure to model pixel scale ratio, and the model
+        is bilinearly interpolated at the subpixel centers & averaged.
+        This integrates the model over exposure pixels larger than the
+        model pixels instead of point sampling (and aliasing) it
+
+        indx: int
+            The exposure index
+        '''
+
+        ref = self.ref
+        exp = self.exposures[indx]
+
+        Nx, Ny = ref.Nx, ref.Ny
+        ex_Nx, ex_Ny = exp.Nx, exp.Ny
+
+        # exposure pixel centers, in exposure pixels
+        Xe, Ye = utils.build_map_grid(ex_Nx, ex_Ny)
+
+        scale = exp.pix_scale / ref.pix_scale
+        theta = self.rotations[indx]
+        c, s = np.cos(theta), np.sin(theta)
+        dx, dy = self.offsets[indx]
+
+        # subpixel center offsets, in exposure pixels
+        Nsub = max(1, int(np.ceil(scale - 1e-8)))
+        sub = (np.arange(Nsub) + 0.5) / Nsub - 0.5
+
+        # fractional array indices on the model grid; see build_map_grid()
+        Rx = (Nx // 2) - 0.5 * ((Nx-1) % 2)
+        Ry = (Ny // 2) - 0.5 * ((Ny-1) % 2)
+
+        rows, cols, vals = [], [], []
+        pix = np.arange(ex_Nx*ex_Ny)
+
+        for u in sub:
+            for v in sub:
+                # subpixel centers in reference pixels
+                Xr = scale * (c*(Xe+u) - s*(Ye+v)) + dx
+                Yr = scale * (s*(Xe+u) + c*(Ye+v)) + dy
+
+                fi = (Xr + Rx).reshape(ex_Nx*ex_Ny)
+                fj = (Yr + Ry).reshape(ex_Nx*ex_Ny)
+
+                i0 = np.floor(fi).astype(int)
+                j0 = np.floor(fj).astype(int)
+                ti = fi - i0
+                tj = fj - j0
+
+                for di, dj, w in [(0, 0, (1.-ti)*(1.-tj)),
+                                  (1, 0, ti*(1.-tj)),
+                                  (0, 1, (1.-ti)*tj),
+                                  (1, 1, ti*tj)]:
+                    i = i0 + di
+                    j = j0 + dj
+
+                    # the model is 0 off of the reference grid
+                    good = (i >= 0) & (i < Nx) & (j >= 0) & (j < Ny) & \
+                        (w > 0)
+
+                    rows.append(pix[good])
+                    cols.append((i*Ny + j)[good])
+                    vals.append(w[good])
+
+        rows = np.concatenate(rows)
+        cols = np.concatenate(cols)
+
+        # the model is in flux per pixel, so scale by the pixel areas;
+        # duplicate entries are summed by csr_matrix
+        vals = scale**2 / Nsub**2 * np.concatenate(vals)
+
+        return csr_matrix(
+            (vals, (rows, cols)), shape=(ex_Nx*ex_Ny, Nx*Ny)
+            )
+
+    def resample(self, model, indx):
+        '''
+        Resample a model cube on the reference grid onto the pixel grid
+        of an exposure (without PSF convolution)
+
+        model: np.ndarray
+            A (Nspec, Nx, Ny) model cube (or (Nx, Ny) image) on the
+            reference grid
+        indx: int
+            The exposure index
+
+        returns: np.ndarray of shape (Nspec, Nx_exp, Ny_exp) or
+                 (Nx_exp, Ny_exp)
+        '''
+
+        exp = self.exposures[indx]
+        op = self.resample_ops[indx]
+
+        if len(model.shape) == 2:
+            return op.dot(model.reshape(-1)).reshape(exp.Nx, exp.Ny)
+
+        Nspec = model.shape[0]
+
+        # (Npix_exp, Nspec)
+        resampled = op.dot(model.reshape(Nspec, -1).T)
+
+        return resampled.T.reshape(Nspec, exp.Nx, exp.Ny)
+
+    def get_exposure(self, indx):
+        return self.exposures[indx]
+
+    def get_exposure_psf(self, indx):
+        return self.exposures[indx].get_psf()
+
+    @property
+    def ref(self):
+        return self.exposures[self.reference]
+
+    # The following make the model frame look like the reference
+    # exposure, for the parts of the code that expect a DataCube
+
+    @property
+    def pars(self):
+        return self.ref.pars
+
+    @property
+    def shape(self):
+        return self.ref.shape
+
+    @property
+    def Nspec(self):
+        return self.ref.Nspec
+
+    @property
+    def Nx(self):
+        return self.ref.Nx
+
+    @property
+    def Ny(self):
+        return self.ref.Ny
+
+    @property
+    def pix_scale(self):
+        return self.ref.pix_scale
+
+    @property
+    def lambdas(self):
+        return self.ref.lambdas
+
+    @property
+    def data(self):
+        return self.ref.data
+
+    @property
+    def weights(self):
+        return self.ref.weights
+
+    def get_sed(self, line_index=None, line_pars_update=None):
+        return self.ref.get_sed(
+            line_index=line_index, line_pars_update=line_pars_update
+            )
+
+    def get_psf(self, wavelength=None, wav_unit=None):
+        '''
+        The model frame is intrinsic; see get_exposure_psf() for the
+        PSF of each exposure
+        '''
+        return None
+
+    def get_continuum(self):
+        return self.ref.get_continuum()
+
+    def get_continuum_model(self):
+        return self.ref.get_continuum_model()
+
+    def stack(self):
+        return self.ref.stack()
+
+def main(args):
+    '''
+    For now, just used for testing the resampling operators
+    '''
+
+    Nspec, Nx, Ny = 5, 30, 30
+    pix_scale = 0.5
+
+    bandpasses = setup_simple_bandpasses(500, 505, 1)
+    pars = {'pix_scale': pix_scale, 'bandpasses': bandpasses}
+
+    X, Y = utils.build_map_grid(Nx, Ny)
+    gauss = np.exp(-0.5*(X**2 + Y**2) / 3.**2)
+    model = np.array([gauss for i in range(Nspec)])
+
+    ref = DataCube(data=model.copy(), pars=pars)
+
+    print('Testing identity resampling')
+    mexp = MultiExposureCube([ref, ref])
+    assert np.allclose(mexp.resample(model, 1), model)
+
+    print('Testing integer pixel shift')
+    mexp = MultiExposureCube([ref, ref], offsets=[(0, 0), (2, -1)])
+    shifted = mexp.resample(model, 1)
+    assert np.allclose(shifted[:, 2:-2, 2:-2], model[:, 4:, 1:-3])
+
+    print('Testing 90 deg rotation')
+    mexp = MultiExposureCube([ref, ref], rotations=[0, np.pi/2])
+    # an off-center source, so that the direction matters
+    source = lambda x, y: np.exp(-0.5*((x - 5.)**2 + y**2) / 2.**2)
+    rotated = mexp.resample(source(X, Y), 1)
+    # the exposure x-axis is the reference y-axis, so an exposure pixel
+    # at (x, y) sees the reference position (-y, x)
+    assert np.allclose(rotated, source(-Y, X), atol=1e-10)
+    # which for (x, y) array indices is a clockwise array rotation
+    assert np.allclose(rotated, np.rot90(source(X, Y), k=-1), atol=1e-10)
+
+    print('Testing flux conservation for a coarser exposure')
+    coarse_pars = {'pix_scale': 2*pix_scale, 'bandpasses': bandpasses}
+    coarse = DataCube(data=np.zeros((Nspec, Nx//2, Ny//2)), pars=coarse_pars)
+    mexp = MultiExposureCube([ref, coarse], offsets=[(0, 0), (0.5, 0.5)])
+    resampled = mexp.resample(model, 1)
+    assert np.isclose(np.sum(resampled[0]), np.sum(model[0]), rtol=1e-2)
+
+    print('Testing a coarser exposure against an analytic rebin')
+    # a compact, off-center source that point sampling would alias
+    source = np.exp(-0.5*((X - 2.)**2 + (Y + 1.)**2) / 0.7**2)
+    # w/o an offset each coarse pixel covers a 2x2 block of model pixels
+    mexp = MultiExposureCube([ref, coarse])
+    rebinned = source.reshape(Nx//2, 2, Ny//2, 2).sum(axis=(1, 3))
+    assert np.allclose(mexp.resample(source, 1), rebinned)
+
+    # ...& 3x3 blocks for a 3x coarser one
+    coarse3_pars = {'pix_scale': 3*pix_scale, 'bandpasses': bandpasses}
+    coarse3 = DataCube(data=np.zeros((Nspec, Nx//3, Ny//3)), pars=coarse3_pars)
+    mexp = MultiExposureCube([ref, coarse3])
+    rebinned = source.reshape(Nx//3, 3, Ny//3, 3).sum(axis=(1, 3))
+    assert np.allclose(mexp.resample(source, 1), rebinned)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
@@ -16,6 +16,7 @@ import astropy.units as u
 from argparse import ArgumentParser
 
 import utils
+from continuum import fit_continuum_model
 from emission import EmissionLine, LINE_LAMBDAS
 
 import ipdb
@@ -203,11 +204,30 @@ class MuseDataCube(cube.DataCube):
         return
 
     def set_continuum(self, lmin_line, lmax_line, lmin_cont, lmax_cont,
-                      method='sum'):
+                      method='sum', Ntemplates=2, order=3):
         '''
         Build a 2d template for the continuum from the spectrum near the line.
+
+        method: str
+            Either 'sum' for only the 2d template, or 'lowrank' to also
+            fit a low-rank, wavelength-dependent continuum model to the
+            side-bands. See continuum.fit_continuum_model()
+        Ntemplates: int
+            Number of spectral templates of the lowrank model
+        order: int
+            Legendre order of the side-band fits of the lowrank model
         '''
 
+        if method not in ['sum', 'lowrank']:
+            raise ValueError(f'{method} is not a valid continuum method! ' +\
+                             'Must be one of [sum, lowrank]')
+
+        if method == 'lowrank':
+            self._continuum_model = fit_continuum_model(
+                self, lmin_line, lmax_line, lmin_cont, lmax_cont,
+                Ntemplates=Ntemplates, order=order
+                )
+
         # Make a new cube object for the blue continuum and the red continuum.
         lblue = lmin_cont
         lred = lmin_line
@@ -229,10 +249,14 @@ class MuseDataCube(cube.DataCube):
 
         return
 
-    def set_line(self, line_choice='strongest', truncate=True):
+    def set_line(self, line_choice='strongest', truncate=True,
+                 continuum='sum'):
         '''
         Set the emission line actually used in an analysis of a datacube,
         and possibly truncate it to slices near the line
+
+        continuum: str
+            The continuum method; see set_continuum()
         '''
 
         # If no line indicated, set parameters for fitting the strongest emission line.
@@ -257,11 +281,13 @@ class MuseDataCube(cube.DataCube):
             self.pars['emission_lines'][0].sed_pars['lblue'],
             self.pars['emission_lines'][0].sed_pars['lred'],
             self.pars['emission_lines'][0].sed_pars['lblue'] - boxwidth,
-            self.pars['emission_lines'][0].sed_pars['lred'] + boxwidth
+            self.pars['emission_lines'][0].sed_pars['lred'] + boxwidth,
+            method=continuum
             )
 
         # have to store it temporarily, and then set it after truncation
         continuum_template = self._continuum_template
+        continuum_model = self._continuum_model
 
         # create new truncated datacube around line, if desired
         if truncate is True:
@@ -271,6 +297,7 @@ class MuseDataCube(cube.DataCube):
             super(MuseDataCube, self).__init__(*args, **kwargs)
 
             self._continuum_template = continuum_template
+            self._continuum_model = continuum_model
 
         return
 
@@ -0,0 +1,169 @@
+import numpy as np
+# must come before any kernel is compiled
+import numba_isa
+from numba import njit
+from argparse import ArgumentParser
+from time import time
+from scipy.special import eval_hermitenorm, factorial
+
+import ipdb
+
+'''
+This file contains compiled (numba) kernels for evaluating basis functions
+on the full pixel grid at once. All orders are built per pixel from a
+single recurrence, rather than one scipy call per basis function.
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+@njit(cache=True)
+def _eval_shapelet_design(x, y, beta, nmax, nx_of_n, ny_of_n, out):
+    '''
+    Fill the (npix, N) design matrix of Cartesian shapelets, matching
+    ShapeletBasis._eval_basis_function() for each column
+
+    The 1D basis functions of all orders up to nmax are built for each
+    pixel with the (probabilist's) Hermite recurrence
+
+        He_{k+1}(u) = u He_k(u) - k He_{k-1}(u)
+
+    along with the normalization recurrence c_k = c_{k-1} / sqrt(2k)
+
+    x, y: np.ndarray (1D)
+        The pixel positions in the basis plane
+    beta: float
+        The shapelet scale factor
+    nmax: int
+        The maximum shapelet order Nx+Ny
+    nx_of_n, ny_of_n: np.ndarray (1D, int)
+        The (Nx, Ny) order of the nth basis function
+    out: np.ndarray (2D)
+        The buffer the design matrix is written to
+    '''
+
+    npix = len(x)
+    N = len(nx_of_n)
+
+    c0 = 1. / np.sqrt(np.sqrt(np.pi) * beta)
+
+    # 1D basis functions for each order
+    hx = np.empty(nmax+1)
+    hy = np.empty(nmax+1)
+
+    for p in range(npix):
+        u = x[p] / beta
+        w = y[p] / beta
+
+        gx = c0 * np.exp(-0.5*u*u)
+        gy = c0 * np.exp(-0.5*w*w)
+
+        # He_0 & He_1
+        hx[0] = gx
+        hy[0] = gy
+        if nmax > 0:
+            hx[1] = u * gx / np.sqrt(2.)
+            hy[1] = w * gy / np.sqrt(2.)
+
+        # both the polynomial & the norm recurrences, folded together;
+        # h_k = c_k He_k exp(-u^2/2)
+        for k in range(1, nmax):
+            a = 1. / np.sqrt(2.*(k+1))
+            b = k / np.sqrt(4.*k*(k+1))
+            hx[k+1] = a * u * hx[k] - b * hx[k-1]
+            hy[k+1] = a * w * hy[k] - b * hy[k-1]
+
+        for n in range(N):
+            out[p,n] = hx[nx_of_n[n]] * hy[ny_of_n[n]]
+
+    return out
+
+def eval_shapelet_design(x, y, beta, nmax, nx_of_n, ny_of_n, out=None):
+    '''
+    Evaluate all shapelet basis functions at positions (x,y)
+
+    x, y: np.ndarray (1D)
+        The pixel positions in the basis plane
+    beta: float
+        The shapelet scale factor
+    nmax: int
+        The maximum shapelet order
+    nx_of_n, ny_of_n: np.ndarray (1D, int)
+        The (Nx, Ny) order of the nth basis function
+    out: np.ndarray (2D)
+        A (len(x), N) buffer to write the design matrix to. Allocated if
+        not passed
+
+    returns: out
+    '''
+
+    if out is None:
+        out = np.empty((len(x), len(nx_of_n)))
+
+    return _eval_shapelet_design(
+        x, y, float(beta), nmax, nx_of_n, ny_of_n, out
+        )
+
+def main(args):
+    '''
+    For now, just used for testing the kernels against the scipy
+    implementation in basis.py
+    '''
+
+    print(numba_isa.isa_summary())
+
+    beta = 3.
+
+    # the ordering of the basis funcs doesn't matter for the test
+    def get_orders(nmax):
+        nx_of_n, ny_of_n = [], []
+        for i in range(nmax+1):
+            for j in range(nmax+1-i):
+                nx_of_n.append(i)
+                ny_of_n.append(j)
+        return np.array(nx_of_n), np.array(ny_of_n)
+
+    for (nx, ny), nmax in [((30, 30), 6), ((40, 40), 10), ((25, 35), 7)]:
+        print(f'Testing shapelet design kernel for {(nx, ny)}, nmax={nmax}')
+
+        X, Y = np.meshgrid(
+            np.arange(nx) - nx/2. + 0.5, np.arange(ny) - ny/2. + 0.5,
+            indexing='ij'
+            )
+        x, y = X.reshape(nx*ny), Y.reshape(nx*ny)
+
+        nx_of_n, ny_of_n = get_orders(nmax)
+        design = eval_shapelet_design(x, y, beta, nmax, nx_of_n, ny_of_n)
+
+        for n in range(len(nx_of_n)):
+            Nx, Ny = nx_of_n[n], ny_of_n[n]
+            x_norm = 1. / np.sqrt(2**Nx * np.sqrt(np.pi) * factorial(Nx) * beta)
+            y_norm = 1. / np.sqrt(2**Ny * np.sqrt(np.pi) * factorial(Ny) * beta)
+            phi_x = x_norm * eval_hermitenorm(Nx, x/beta) * np.exp(-(x/beta)**2/2.)
+            phi_y = y_norm * eval_hermitenorm(Ny, y/beta) * np.exp(-(y/beta)**2/2.)
+            assert np.allclose(design[:,n], phi_x * phi_y)
+
+        N = 50
+        start = time()
+        for i in range(N):
+            eval_shapelet_design(x, y, beta, nmax, nx_of_n, ny_of_n, design)
+        t = (time() - start) / N
+        print(f'The design kernel took {1e3*t:.3f} ms')
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
@@ -0,0 +1,601 @@
+import numpy as np
+import math
+# must come before any kernel is compiled
+import numba_isa
+from numba import njit, prange
+from numba.core.registry import CPUDispatcher
+from argparse import ArgumentParser
+from time import time
+
+import ipdb
+
+'''
+This file contains an ensemble sampler w/ the affine-invariant stretch
+move (Goodman & Weare 2010) & a differential evolution move, whose step
+loop runs in compiled code. The walkers are split into two halves that
+are updated in turn, as in emcee & zeus.
+
+There are two ways the log probability is evaluated:
+    - compiled: if the log probability is itself a numba @njit function
+      of theta alone, the entire loop between checkpoints is one compiled
+      call, w/ the walkers of each half updated in parallel threads
+    - batched: otherwise (e.g. for LogPosterior, whose imap render & PSF
+      convolution are not compiled), proposals & acceptance are compiled
+      & the proposals of each half are evaluated in one batch, split into
+      one chunk per worker of the pool
+
+Either way the chain is kept in preallocated arrays & is only handed
+back to python at checkpoints. W/ a chainstore.ChainStore, each
+checkpoint block is appended to the store & dropped from memory. See
+mcmc.KLensNativeRunner
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+@njit(cache=True)
+def _seed(seed):
+    # numba keeps its own random state
+    np.random.seed(seed)
+
+@njit(cache=True)
+def _draw(Nother, a, de_fraction, z, jk, noise, logu):
+    '''
+    The random numbers of the moves of a half of the walkers. They are
+    drawn in order on the calling thread, as numba's worker threads each
+    have their own (unseeded) random state; this keeps runs reproducible
+    for any number of threads
+
+    Nother: int
+        The number of complementary walkers
+    a: float
+        The stretch move scale
+    de_fraction: float
+        The probability of a differential evolution move
+    z: np.ndarray
+        The (Nhalf,) stretch factors, or 0 for a differential evolution
+        move
+    jk: np.ndarray
+        The (Nhalf, 2) indices of the complementary walkers of each move
+    noise: np.ndarray
+        The (Nhalf, Ndim) jitter of the differential evolution scale
+    logu: np.ndarray
+        The (Nhalf,) log uniforms of the acceptance
+    '''
+
+    for i in range(z.shape[0]):
+        if np.random.random() < de_fraction:
+            z[i] = 0.
+            j = np.random.randint(Nother)
+            k = np.random.randint(Nother - 1)
+            if k >= j:
+                k += 1
+            jk[i,0], jk[i,1] = j, k
+            for p in range(noise.shape[1]):
+                noise[i,p] = np.random.standard_normal()
+        else:
+            z[i] = ((a - 1.)*np.random.random() + 1.)**2 / a
+            jk[i,0], jk[i,1] = np.random.randint(Nother), -1
+        logu[i] = math.log(np.random.random())
+
+    return
+
+@njit(inline='always', cache=True)
+def _propose_one(x, xo, gamma, z, j, k, noise, out):
+    '''
+    Propose a move for one walker w/ the walkers of the other half, from
+    the random numbers of _draw()
+
+    x: np.ndarray
+        The (Ndim,) walker
+    xo: np.ndarray
+        The (Nother, Ndim) complementary walkers
+    gamma: float
+        The differential evolution scale
+    z: float
+        The stretch factor, or 0 for a differential evolution move
+    j, k: int
+        The complementary walkers of the move
+    noise: np.ndarray
+        The (Ndim,) jitter of the differential evolution scale
+    out: np.ndarray
+        The (Ndim,) proposal
+
+    returns: float
+        The log of the proposal asymmetry factor
+    '''
+
+    d = x.shape[0]
+
+    if z == 0.:
+        for p in range(d):
+            diff = xo[j,p] - xo[k,p]
+            out[p] = x[p] + gamma*diff*(1. + 1e-4*noise[p])
+        return 0.
+
+    for p in range(d):
+        out[p] = xo[j,p] + z*(x[p] - xo[j,p])
+
+    return (d - 1.)*math.log(z)
+
+@njit(cache=True)
+def _propose(xs, xo, gamma, z, jk, noise, out, logz):
+    '''
+    Proposals for a half of the walkers; see _propose_one()
+    '''
+
+    for i in range(xs.shape[0]):
+        logz[i] = _propose_one(xs[i], xo, gamma, z[i], jk[i,0], jk[i,1],
+                               noise[i], out[i])
+
+    return
+
+@njit(cache=True)
+def _accept(xs, lps, proposal, lp_proposal, logz, logu, accepted):
+    '''
+    Metropolis acceptance of the proposals for a half of the walkers, in
+    place
+
+    returns: int
+        The number of accepted proposals
+    '''
+
+    Naccepted = 0
+    for i in range(xs.shape[0]):
+        lp = lp_proposal[i]
+        if not np.isfinite(lp):
+            continue
+        if logu[i] < logz[i] + lp - lps[i]:
+            xs[i,:] = proposal[i]
+            lps[i] = lp
+            accepted[i] += 1
+            Naccepted += 1
+
+    return Naccepted
+
+@njit(parallel=True)
+def _run_compiled(log_prob, x, lp, a, gamma, de_fraction, chain, lnprob,
+                  accepted):
+    '''
+    The full step loop for a compiled log probability. Not cached, as it
+    is specialized on log_prob
+
+    log_prob: numba dispatcher
+        The compiled log probability of theta
+    x, lp: np.ndarray
+        The (Nwalkers, Ndim) walkers & their (Nwalkers,) log probs. Are
+        updated in place
+    chain, lnprob: np.ndarray
+        The (Nsteps, Nwalkers, Ndim) chain & (Nsteps, Nwalkers) log probs
+        to fill
+    accepted: np.ndarray
+        The (Nwalkers,) accepted proposal counts. Updated in place
+    '''
+
+    Nsteps = chain.shape[0]
+    Nwalkers, d = x.shape
+    half = Nwalkers // 2
+
+    proposal = np.empty((Nwalkers, d))
+    z = np.empty(half)
+    jk = np.empty((half, 2), dtype=np.int64)
+    noise = np.empty((half, d))
+    logu = np.empty(half)
+
+    for step in range(Nsteps):
+        for s in range(2):
+            if s == 0:
+                start, ostart, oend = 0, half, Nwalkers
+            else:
+                start, ostart, oend = half, 0, half
+            xo = x[ostart:oend]
+
+            # serial, so the moves don't depend on the number of threads
+            _draw(oend - ostart, a, de_fraction, z, jk, noise, logu)
+
+            # the walkers of a half only move w/ respect to the other
+            for n in prange(half):
+                i = start + n
+                logz = _propose_one(x[i], xo, gamma, z[n], jk[n,0], jk[n,1],
+                                    noise[n], proposal[i])
+                lp_new = log_prob(proposal[i])
+                if np.isfinite(lp_new):
+                    if logu[n] < logz + lp_new - lp[i]:
+                        x[i,:] = proposal[i]
+                        lp[i] = lp_new
+                        accepted[i] += 1
+
+        chain[step] = x
+        lnprob[step] = lp
+
+    return
+
+class _BatchLogProb(object):
+    '''
+    The log probability of a chunk of walkers. Defined as a class so
+    that it can be pickled for the pools
+    '''
+
+    def __init__(self, log_prob, args, kwargs):
+        self.log_prob = log_prob
+        self.args = args
+        self.kwargs = kwargs
+
+        return
+
+    def __call__(self, thetas):
+        lps = np.empty(len(thetas))
+        for i, theta in enumerate(thetas):
+            lp = self.log_prob(theta, *self.args, **self.kwargs)
+            # e.g. LogPosterior returns (logpost, blob)
+            if isinstance(lp, tuple):
+                lp = lp[0]
+            lps[i] = lp
+
+        return lps
+
+class NativeEnsembleSampler(object):
+    '''
+    An ensemble sampler w/ a compiled step loop, w/ the parts of the
+    emcee interface used by the runners
+    '''
+
+    def __init__(self, nwalkers, ndim, log_prob, args=None, kwargs=None,
+                 pool=None, nchunks=1, a=2., de_fraction=0.,
+                 checkpoint_every=100, checkpoint_file=None, chain_store=None,
+                 seed=None):
+        '''
+        nwalkers: int
+            Number of walkers. Must be even & at least 2*ndim
+        ndim: int
+            Number of sampled dimensions
+        log_prob: function, callable()
+            The log probability. If a numba @njit function of theta alone,
+            the whole loop is compiled
+        args, kwargs: list, dict
+            Extra args of log_prob, for the batched evaluation
+        pool: schwimmbad pool
+            The pool for the batched evaluation. Runs serially if None
+        nchunks: int
+            The number of chunks each batch is split into; usually the
+            number of pool workers
+        a: float
+            The stretch move scale
+        de_fraction: float
+            The fraction of differential evolution moves
+        checkpoint_every: int
+            The number of steps between checkpoints
+        checkpoint_file: str
+            If set, the chain so far is saved to this .npz file at each
+            checkpoint
+        chain_store: chainstore.ChainStore
+            If set, each checkpoint block is appended to this store
+            instead of being kept in memory
+        seed: int
+            The random seed. Every random number is drawn on the main
+            thread, so a seeded run is reproducible for any number of
+            threads & the same on the compiled & batched paths
+        '''
+
+        if (nwalkers % 2 != 0) or (nwalkers < 2*ndim):
+            raise ValueError('nwalkers must be even and at least 2*ndim!')
+        if a <= 1:
+            raise ValueError('The stretch scale a must be greater than 1!')
+        if not (0 <= de_fraction <= 1):
+            raise ValueError('de_fraction must be in [0, 1]!')
+        if checkpoint_every < 1:
+            raise ValueError('checkpoint_every must be positive!')
+
+        self.nwalkers = nwalkers
+        self.ndim = ndim
+        self.log_prob = log_prob
+        self.args = args if args is not None else []
+        self.kwargs = kwargs if kwargs is not None else {}
+        self.pool = pool
+        self.nchunks = max(int(nchunks), 1)
+
+        self.a = float(a)
+        self.gamma = 2.38 / np.sqrt(2.*ndim)
+        self.de_fraction = float(de_fraction)
+
+        self.checkpoint_every = checkpoint_every
+        self.checkpoint_file = checkpoint_file
+        self.chain_store = chain_store
+
+        if chain_store is not None:
+            if (chain_store.nwalkers, chain_store.ndim) != (nwalkers, ndim):
+                raise ValueError('The chain store must have the same ' +\
+                                 'nwalkers & ndim as the sampler!')
+            if chain_store.nsteps > 0:
+                raise ValueError('The chain store must be empty!')
+
+        self.compiled = isinstance(log_prob, CPUDispatcher) and \
+                        (len(self.args) == 0) and (len(self.kwargs) == 0)
+
+        if seed is not None:
+            _seed(seed)
+
+        self._chain = []
+        self._lnprob = []
+        # the current walkers & their log probs
+        self._x = None
+        self._lp = None
+        self.accepted = np.zeros(nwalkers, dtype=np.int64)
+        self.iteration = 0
+        self.ncall = 0
+
+        self._batch = _BatchLogProb(log_prob, self.args, self.kwargs)
+
+        return
+
+    def _evaluate(self, thetas):
+        '''
+        The log probs of a batch of walkers, one chunk per worker
+        '''
+
+        self.ncall += len(thetas)
+
+        if (self.pool is None) or (self.nchunks == 1):
+            return self._batch(thetas)
+
+        chunks = np.array_split(thetas, min(self.nchunks, len(thetas)))
+
+        return np.concatenate(list(self.pool.map(self._batch, chunks)))
+
+    def _run_batched(self, x, lp, chain, lnprob):
+        Nwalkers = self.nwalkers
+        half = Nwalkers // 2
+
+        proposal = np.empty((half, self.ndim))
+        logz = np.empty(half)
+        z = np.empty(half)
+        jk = np.empty((half, 2), dtype=np.int64)
+        noise = np.empty((half, self.ndim))
+        logu = np.empty(half)
+
+        halves = [(slice(0, half), slice(half, Nwalkers)),
+                  (slice(half, Nwalkers), slice(0, half))]
+
+        for step in range(len(chain)):
+            for s, o in halves:
+                xs, lps = x[s], lp[s]
+                _draw(half, self.a, self.de_fraction, z, jk, noise, logu)
+                _propose(xs, x[o], self.gamma, z, jk, noise, proposal, logz)
+                lp_proposal = self._evaluate(proposal)
+                _accept(xs, lps, proposal, lp_proposal, logz, logu,
+                        self.accepted[s])
+
+            chain[step] = x
+            lnprob[step] = lp
+
+        return
+
+    def run_mcmc(self, start, nsteps, progress=False):
+        '''
+        start: np.ndarray
+            The (Nwalkers, Ndim) starting walkers. Ignored when continuing
+            a previous run
+        nsteps: int
+            Number of steps
+        progress: bool
+            Set to print progress at each checkpoint
+        '''
+
+        if self.iteration > 0:
+            x, lp = self._x, self._lp
+        else:
+            x = np.array(start, dtype=float)
+            if x.shape != (self.nwalkers, self.ndim):
+                raise ValueError('start must have shape ' +\
+                                 f'({self.nwalkers}, {self.ndim})!')
+            x = np.ascontiguousarray(x)
+            lp = self._evaluate(x)
+            if not np.all(np.isfinite(lp)):
+                raise ValueError('Every starting walker must have a ' +\
+                                 'finite log probability!')
+
+        done = 0
+        while done < nsteps:
+            Nblock = min(self.checkpoint_every, nsteps - done)
+            chain = np.empty((Nblock, self.nwalkers, self.ndim))
+            lnprob = np.empty((Nblock, self.nwalkers))
+
+            if self.compiled is True:
+                _run_compiled(self.log_prob, x, lp, self.a, self.gamma,
+                              self.de_fraction, chain, lnprob, self.accepted)
+                self.ncall += Nblock * self.nwalkers
+            else:
+                self._run_batched(x, lp, chain, lnprob)
+
+            if self.chain_store is None:
+                self._chain.append(chain)
+                self._lnprob.append(lnprob)
+            else:
+                self.chain_store.append(chain, lnprob)
+            self._x, self._lp = x, lp
+            self.iteration += Nblock
+            done += Nblock
+
+            self.checkpoint()
+
+            if progress is True:
+                print(f'Step {self.iteration}: mean acceptance ' +\
+                      f'{np.mean(self.acceptance_fraction):.2f}')
+
+        return
+
+    def checkpoint(self):
+        '''
+        Save the chain so far, if there is a checkpoint file
+        '''
+
+        # the store is already written at each checkpoint
+        if (self.checkpoint_file is None) or (self.chain_store is not None):
+            return
+
+        np.savez(
+            self.checkpoint_file, chain=self.get_chain(),
+            log_prob=self.get_log_prob(), accepted=self.accepted,
+            iteration=self.iteration
+            )
+
+        return
+
+    @property
+    def acceptance_fraction(self):
+        return self.accepted / max(self.iteration, 1)
+
+    def _get(self, arrays, flat, discard, thin):
+        if self.iteration == 0:
+            raise AttributeError('The sampler has not been run yet!')
+
+        values = np.concatenate(arrays)[discard::thin]
+        if flat is True:
+            values = values.reshape((-1,) + values.shape[2:])
+
+        return values
+
+    def get_chain(self, flat=False, discard=0, thin=1):
+        '''
+        returns: np.ndarray
+            The (Nsteps, Nwalkers, Ndim) chain, or (Nsteps*Nwalkers, Ndim)
+            if flat
+        '''
+        if self.chain_store is not None:
+            return self.chain_store.get_chain(flat, discard, thin)
+        return self._get(self._chain, flat, discard, thin)
+
+    def get_log_prob(self, flat=False, discard=0, thin=1):
+        if self.chain_store is not None:
+            return self.chain_store.get_log_prob(flat, discard, thin)
+        return self._get(self._lnprob, flat, discard, thin)
+
+@njit(cache=True)
+def _test_log_prob(theta):
+    # a correlated Gaussian w/ unit variances
+    rho = 0.8
+    d = theta.shape[0]
+    chi2 = 0.
+    for i in range(0, d-1, 2):
+        x, y = theta[i], theta[i+1]
+        chi2 += (x*x - 2.*rho*x*y + y*y) / (1. - rho*rho)
+    if d % 2 == 1:
+        chi2 += theta[d-1]**2
+    return -0.5*chi2
+
+def main(args):
+    '''
+    For now, just used for testing the sampler
+    '''
+
+    import tempfile
+    import os
+
+    ndim, nwalkers = 4, 32
+    np.random.seed(42)
+    start = 0.1*np.random.randn(nwalkers, ndim)
+
+    print('Testing the compiled loop on a correlated Gaussian')
+    outfile = os.path.join(tempfile.mkdtemp(), 'chain.npz')
+    sampler = NativeEnsembleSampler(
+        nwalkers, ndim, _test_log_prob, de_fraction=0.1,
+        checkpoint_every=500, checkpoint_file=outfile, seed=1
+        )
+    assert sampler.compiled is True
+
+    t0 = time()
+    sampler.run_mcmc(start, 2000)
+    print(f'2000 steps took {time()-t0:.2f} s (incl. compilation)')
+
+    samples = sampler.get_chain(flat=True, discard=500)
+    assert samples.shape == (1500*nwalkers, ndim)
+    assert np.allclose(np.mean(samples, axis=0), 0., atol=0.1)
+    assert np.allclose(np.std(samples, axis=0), 1., atol=0.1)
+    assert abs(np.corrcoef(samples[:,0], samples[:,1])[0,1] - 0.8) < 0.05
+    assert np.all((sampler.acceptance_fraction > 0.2) &
+                  (sampler.acceptance_fraction < 0.9))
+    assert sampler.ncall == (2000 + 1) * nwalkers
+
+    with np.load(outfile) as saved:
+        assert saved['chain'].shape == (2000, nwalkers, ndim)
+        assert int(saved['iteration']) == 2000
+
+    # continuing a run
+    sampler.run_mcmc(None, 100)
+    assert sampler.get_chain().shape == (2100, nwalkers, ndim)
+
+    print('Testing a run into a chain store')
+    from chainstore import ChainStore
+    reference = NativeEnsembleSampler(
+        nwalkers, ndim, _test_log_prob, checkpoint_every=250, seed=3
+        )
+    reference.run_mcmc(start, 600)
+    store = ChainStore(os.path.join(tempfile.mkdtemp(), 'store'),
+                       nwalkers, ndim)
+    stored = NativeEnsembleSampler(
+        nwalkers, ndim, _test_log_prob, checkpoint_every=250,
+        chain_store=store, seed=3
+        )
+    stored.run_mcmc(start, 400)
+    stored.run_mcmc(None, 200)
+    assert len(stored._chain) == 0
+    assert store.meta['chunks'] == [250, 150, 200]
+    assert np.allclose(stored.get_chain(), reference.get_chain())
+    assert np.allclose(stored.get_log_prob(discard=100, flat=True),
+                       reference.get_log_prob(discard=100, flat=True))
+
+    print('Testing that the compiled & batched loops match')
+    compiled = NativeEnsembleSampler(
+        nwalkers, ndim, _test_log_prob, de_fraction=0.5,
+        checkpoint_every=50, seed=4
+        )
+    compiled.run_mcmc(start, 100)
+    batched = NativeEnsembleSampler(
+        nwalkers, ndim, lambda theta, scale: _test_log_prob(theta / scale),
+        args=[1.], de_fraction=0.5, checkpoint_every=50, seed=4
+        )
+    batched.run_mcmc(start, 100)
+    assert np.allclose(compiled.get_chain(), batched.get_chain())
+
+    print('Testing the batched loop against the same target')
+    log_prob = lambda theta, scale: _test_log_prob(theta / scale)
+    batched = NativeEnsembleSampler(
+        nwalkers, ndim, log_prob, args=[2.], de_fraction=0.1,
+        checkpoint_every=300, seed=2
+        )
+    assert batched.compiled is False
+    batched.run_mcmc(start, 1000)
+    samples = batched.get_chain(flat=True, discard=300)
+    assert np.allclose(np.std(samples, axis=0), 2., atol=0.25)
+    assert batched.get_log_prob().shape == (1000, nwalkers)
+
+    print('Testing bad setups')
+    try:
+        NativeEnsembleSampler(2*ndim - 2, ndim, _test_log_prob)
+        raise AssertionError('Too few walkers was not caught!')
+    except ValueError:
+        pass
+    try:
+        sampler = NativeEnsembleSampler(nwalkers, ndim, _test_log_prob)
+        bad = start.copy()
+        bad[0] = np.inf
+        sampler.run_mcmc(bad, 10)
+        raise AssertionError('A bad start was not caught!')
+    except ValueError:
+        pass
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
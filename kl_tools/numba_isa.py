@@ -0,0 +1,240 @@
+import numpy as np
+import os
+import platform
+from argparse import ArgumentParser
+
+import numba
+import llvmlite.binding as ll
+
+'''
+This file chooses the instruction set (ISA) that the numba kernels in
+numba_transformation.py, numba_basis.py, and numba_likelihood.py are
+compiled for. It must be imported before any of those kernels are
+compiled, which each of those modules does at the top.
+
+Our cluster mixes AVX2 and AVX-512 nodes, and the kernel cache on the
+shared filesystem has to serve both. numba keys its on-disk cache by the
+target CPU name & features, so by pinning the target to one of a few
+named variants (instead of the exact host CPU) each node type compiles
+its variant once and all later runs on that node type reuse it.
+
+The variant is picked from the host CPU features at import, unless
+overridden by the KL_TOOLS_ISA environment variable (one of ISA_VARIANTS,
+or 'host' to let numba target the exact host CPU). An explicit
+NUMBA_CPU_NAME setting is always respected. Use get_kernel_isa() to
+report the active variant.
+
+The compiled kernels are cached outside of the source tree, so that
+machine code for one node type is never picked up from (or committed
+to) a checkout. The cache is in NUMBA_CACHE_DIR if set, else in
+DEFAULT_CACHE_DIR; point NUMBA_CACHE_DIR at the shared filesystem to
+share it across nodes.
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+ISA_ENV_VAR = 'KL_TOOLS_ISA'
+
+DEFAULT_CACHE_DIR = os.path.join(
+    os.path.expanduser('~'), '.cache', 'kl_tools', 'numba'
+    )
+
+# name: (llvm cpu name, llvm cpu features, required host features)
+# from most to least capable
+ISA_VARIANTS = {
+    'avx512': (
+        'skylake-avx512',
+        '+avx512f,+avx512cd,+avx512bw,+avx512dq,+avx512vl,+avx2,+avx,+fma,'
+        '+sse4.2,+sse4.1,+ssse3,+sse3,+popcnt,+bmi,+bmi2,+lzcnt,+f16c',
+        ['avx512f', 'avx512cd', 'avx512bw', 'avx512dq', 'avx512vl']
+        ),
+    'avx2': (
+        'haswell',
+        '+avx2,+avx,+fma,+sse4.2,+sse4.1,+ssse3,+sse3,+popcnt,+bmi,+bmi2,'
+        '+lzcnt,+f16c',
+        ['avx2', 'fma']
+        ),
+    'generic': (
+        'x86-64',
+        '',
+        []
+        ),
+    }
+
+# set by _select_isa() at import
+_ACTIVE = {}
+
+def get_host_features():
+    '''
+    The CPU features of the current host, as a list of names
+    '''
+
+    features = ll.get_host_cpu_features()
+
+    return [name for name, on in features.items() if on is True]
+
+def get_supported_isas():
+    '''
+    The ISA variants that can run on the current host, from most to
+    least capable
+    '''
+
+    if platform.machine() not in ['x86_64', 'AMD64']:
+        return []
+
+    host = get_host_features()
+
+    supported = []
+    for name, (cpu, features, required) in ISA_VARIANTS.items():
+        if all([f in host for f in required]):
+            supported.append(name)
+
+    return supported
+
+def _select_isa():
+    '''
+    Pick the ISA variant & set the numba target config accordingly
+    '''
+
+    host_cpu = ll.get_host_cpu_name()
+
+    # the user (or a parent process) already pinned the numba target
+    if os.environ.get('NUMBA_CPU_NAME') is not None:
+        _ACTIVE.update({
+            'isa': 'numba',
+            'source': 'NUMBA_CPU_NAME',
+            'cpu_name': numba.config.CPU_NAME,
+            'cpu_features': numba.config.CPU_FEATURES,
+            'host_cpu': host_cpu,
+        })
+        return
+
+    supported = get_supported_isas()
+
+    requested = os.environ.get(ISA_ENV_VAR)
+    if requested == '':
+        requested = None
+
+    if requested is not None:
+        requested = requested.lower()
+        source = ISA_ENV_VAR
+
+        if requested == 'host':
+            isa = 'host'
+        elif requested not in ISA_VARIANTS:
+            raise ValueError(f'{ISA_ENV_VAR}={requested} is not a valid ' +\
+                             f'ISA! Must be one of {list(ISA_VARIANTS)} ' +\
+                             'or host')
+        elif requested not in supported:
+            # running unsupported instructions would crash the worker
+            print(f'WARNING: {ISA_ENV_VAR}={requested} is not supported ' +\
+                  f'on this host ({host_cpu}); falling back to the best ' +\
+                  'supported variant')
+            isa = supported[0] if len(supported) > 0 else 'host'
+            source = 'detected'
+        else:
+            isa = requested
+    else:
+        isa = supported[0] if len(supported) > 0 else 'host'
+        source = 'detected'
+
+    if isa == 'host':
+        cpu_name, cpu_features = None, None
+    else:
+        cpu_name, cpu_features = ISA_VARIANTS[isa][0], ISA_VARIANTS[isa][1]
+
+    # only read by numba when the CPU codegen is first created
+    numba.config.CPU_NAME = cpu_name
+    numba.config.CPU_FEATURES = cpu_features
+
+    _ACTIVE.update({
+        'isa': isa,
+        'source': source,
+        'cpu_name': cpu_name if cpu_name is not None else host_cpu,
+        'cpu_features': cpu_features,
+        'host_cpu': host_cpu,
+    })
+
+    return
+
+def _select_cache_dir():
+    '''
+    Keep the kernel cache out of the __pycache__ dirs of the source tree
+    '''
+
+    if os.environ.get('NUMBA_CACHE_DIR', '') == '':
+        # only read by numba when a cached kernel is first compiled
+        numba.config.CACHE_DIR = DEFAULT_CACHE_DIR
+
+    _ACTIVE['cache_dir'] = numba.config.CACHE_DIR
+
+    return
+
+def get_kernel_isa():
+    '''
+    Return a dict describing the ISA variant the compiled kernels
+    are built for. Include this in any benchmark output so that
+    timings are comparable across nodes
+    '''
+
+    return dict(_ACTIVE)
+
+def isa_summary():
+    '''
+    One line summary of get_kernel_isa(), for printing
+    '''
+
+    isa = _ACTIVE
+
+    return f"kernel ISA: {isa['isa']} (cpu={isa['cpu_name']}, " +\
+           f"host={isa['host_cpu']}, from {isa['source']})"
+
+_select_isa()
+_select_cache_dir()
+
+def main(args):
+    '''
+    Report the selected ISA variant & check it is runnable here
+    '''
+
+    print(isa_summary())
+
+    isa = get_kernel_isa()
+    supported = get_supported_isas()
+
+    print(f'Supported variants on this host: {supported}')
+
+    if isa['isa'] in ISA_VARIANTS:
+        assert isa['isa'] in supported
+
+    # make sure the pinned target actually compiles & runs
+    @numba.njit
+    def _sum(x):
+        s = 0.
+        for i in range(len(x)):
+            s += x[i]
+        return s
+
+    x = np.random.rand(1000)
+    assert np.isclose(_sum(x), np.sum(x))
+
+    # cached kernels are not written next to the source
+    here = os.path.dirname(os.path.abspath(__file__))
+    assert not os.path.abspath(isa['cache_dir']).startswith(here)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
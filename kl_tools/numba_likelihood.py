@@ -0,0 +1,594 @@
+import numpy as np
+import math
+# must come before any kernel is compiled
+import numba_isa
+from numba import njit
+from argparse import ArgumentParser
+from time import time
+
+import ipdb
+
+'''
+This file contains the compiled (numba) core of the datacube likelihood,
+along with the scratch memory that it draws its per-sample buffers from.
+
+The kernels here never allocate; every array they produce is written into
+an `out` array that is handed to them by a LikelihoodArena. The arena is
+sized once at setup for a given datacube shape and is reset in O(1)
+between likelihood evaluations, so the kernel buffers are reused from
+sample to sample. Only those buffers come from the arena; the steps that
+are still in python (e.g. the imap render & galsim PSF convolution)
+allocate on their own.
+
+Each worker process keeps its own arenas (see get_worker_arena()), as the
+likelihood objects themselves are re-pickled by most pools for every map
+call and so can't be trusted to hold on to memory between samples.
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class LikelihoodArena(object):
+    '''
+    A bump allocator over a single contiguous block of float64 memory.
+    Buffers are handed out as views into the block and are only valid
+    until the next call to reset()
+
+    If a request can't be served from the block, a fresh array is
+    allocated instead and the block is grown to the high-water mark on
+    the next reset(). Any such overflow after freeze() is counted in
+    overflows, which stays at 0 for a well-sized arena. It only counts
+    requests made of the arena, not allocations made elsewhere
+    '''
+
+    def __init__(self, capacity):
+        '''
+        capacity: int
+            The number of float64 elements to reserve
+        '''
+
+        if not isinstance(capacity, (int, np.integer)):
+            raise TypeError('capacity must be an int!')
+        if capacity < 0:
+            raise ValueError('capacity must be non-negative!')
+
+        self._block = np.empty(capacity)
+        self._offset = 0
+        self._high_water = 0
+
+        self.frozen = False
+        self.overflows = 0
+
+        return
+
+    @property
+    def capacity(self):
+        return len(self._block)
+
+    @property
+    def used(self):
+        return self._offset
+
+    def request(self, shape):
+        '''
+        Return an (uninitialized) float64 buffer of the given shape
+
+        shape: tuple
+            The shape of the requested buffer
+        '''
+
+        size = 1
+        for n in shape:
+            size *= n
+
+        start = self._offset
+        end = start + size
+
+        self._offset = end
+        if end > self._high_water:
+            self._high_water = end
+
+        if end > len(self._block):
+            # out of room; serve from the heap for now and grow later
+            if self.frozen is True:
+                self.overflows += 1
+            return np.empty(shape)
+
+        return self._block[start:end].reshape(shape)
+
+    def reset(self):
+        '''
+        Release all handed-out buffers. Only grows the block if a previous
+        evaluation needed more room than was reserved
+        '''
+
+        if self._high_water > len(self._block):
+            self._block = np.empty(self._high_water)
+
+        self._offset = 0
+
+        return
+
+    def freeze(self):
+        '''
+        Mark the end of setup / warm-up; any request that overflows the
+        block after this point is counted in overflows
+        '''
+
+        self.frozen = True
+
+        return
+
+# per-process arenas, keyed by the buffer layout they were sized for
+_WORKER_ARENAS = {}
+
+def get_worker_arena(key, capacity):
+    '''
+    Return the arena of the current worker process for the given key,
+    creating it if needed
+
+    key: hashable
+        A description of the buffer layout, e.g. (Nspec, Nx, Ny, Nsed)
+    capacity: int
+        The number of float64 elements needed per evaluation
+    '''
+
+    if key not in _WORKER_ARENAS:
+        _WORKER_ARENAS[key] = LikelihoodArena(capacity)
+
+    return _WORKER_ARENAS[key]
+
+def get_arena_overflows():
+    '''
+    The total number of requests that overflowed an arena after its
+    first evaluation, for all arenas in the current process
+    '''
+
+    return sum([a.overflows for a in _WORKER_ARENAS.values()])
+
+@njit(cache=True)
+def _interp(xp, fp, x):
+    '''
+    Same as np.interp() for a single value x & increasing xp, but
+    without building any temporary arrays
+    '''
+
+    N = len(xp)
+
+    if x <= xp[0]:
+        return fp[0]
+    if x >= xp[N-1]:
+        return fp[N-1]
+
+    # binary search for xp[lo] <= x < xp[hi]
+    lo, hi = 0, N-1
+    while hi - lo > 1:
+        mid = (lo + hi) // 2
+        if xp[mid] <= x:
+            lo = mid
+        else:
+            hi = mid
+
+    t = (x - xp[lo]) / (xp[hi] - xp[lo])
+
+    return fp[lo] + t * (fp[hi] - fp[lo])
+
+@njit(cache=True)
+def _compute_zfactor(v_array, norm, out):
+    '''
+    Kinematic redshift factor 1 / (1 + v/c) per pixel
+
+    v_array: np.ndarray (2D)
+        The velocity map
+    norm: float
+        The normalization 1/c, in the velocity map unit
+    out: np.ndarray (2D)
+        The buffer the zfactor is written to
+    '''
+
+    N1, N2 = v_array.shape
+    for i in range(N1):
+        for j in range(N2):
+            out[i,j] = 1. / (1. + norm * v_array[i,j])
+
+    return out
+
+@njit(cache=True)
+def _build_gauss_sed(sed_x, mu, std, unit_factor, out):
+    '''
+    Fill the emission line SED table for a gaussian line; same as
+    EmissionLine._build_sed() but written into a preallocated array
+
+    sed_x: np.ndarray
+        The (fixed) wavelengths of the SED table, in the SED unit
+    mu: float
+        The observed line center, in the line unit
+    std: float
+        The total line width, in the line unit
+    unit_factor: float
+        Conversion from the SED wavelength unit to the line unit
+    out: np.ndarray
+        The buffer the SED values are written to
+    '''
+
+    norm = 1. / (std * np.sqrt(2.*np.pi))
+
+    for i in range(len(sed_x)):
+        chi = (sed_x[i]*unit_factor - mu) / std
+        out[i] = norm * np.exp(-0.5*chi**2)
+
+    return out
+
+@njit(cache=True)
+def _compute_model_cube(lambdas, sed_x, sed_y, zfactor, imap, out):
+    '''
+    Compute all (pre-PSF) model slices in one pass. Matches
+    DataCubeLikelihood._compute_slice_model() for each slice, but without
+    the sed_b / sed_r / mean_sed / int_sed temporaries
+
+    lambdas: np.ndarray
+        A (Nspec, 2) array of the (lambda_blue, lambda_red) slice bounds
+    sed_x: np.ndarray
+        The lambda values of the SED interpolation table
+    sed_y: np.ndarray
+        The SED values of the interpolation table
+    zfactor: np.ndarray (2D)
+        The kinematic redshift factor per pixel
+    imap: np.ndarray (2D)
+        The emission line intensity map
+    out: np.ndarray (3D)
+        The (Nspec, Nx, Ny) buffer the model slices are written to
+    '''
+
+    Nspec = lambdas.shape[0]
+    N1, N2 = zfactor.shape
+
+    for k in range(Nspec):
+        lblue, lred = lambdas[k,0], lambdas[k,1]
+        dlam = lred - lblue
+        for i in range(N1):
+            for j in range(N2):
+                z = zfactor[i,j]
+                sed_b = _interp(sed_x, sed_y, lblue*z)
+                sed_r = _interp(sed_x, sed_y, lred*z)
+                out[k,i,j] = imap[i,j] * dlam * (sed_b + sed_r) / 2.
+
+    return out
+
+@njit(cache=True)
+def _compute_chi2(data, model, weights):
+    '''
+    chi2 of a (Nspec, Nx, Ny) model for a diagonal inverse covariance
+    given by the squared weight maps, as in DataCube.get_inv_cov_list()
+    '''
+
+    Nspec, N1, N2 = data.shape
+
+    chi2 = 0.
+    for k in range(Nspec):
+        for i in range(N1):
+            for j in range(N2):
+                diff = data[k,i,j] - model[k,i,j]
+                chi2 += diff * diff * weights[k,i,j]**2
+
+    return chi2
+
+@njit(cache=True)
+def _compute_chi2_continuum(data, model, weights, templates, finv, b):
+    '''
+    chi2 of a (Nspec, Nx, Ny) model plus a low-rank continuum, minimized
+    analytically over the per-pixel template amplitudes. This is the
+    marginal likelihood up to a constant, as the weights are fixed. See
+    continuum.ContinuumModel.get_marginal_setup()
+
+    data: np.ndarray
+        The (Nspec, Nx, Ny) data minus the side-band fit of the continuum
+    templates: np.ndarray
+        The (Nspec, Ntemplates) continuum templates
+    finv: np.ndarray
+        The (Nx, Ny, Ntemplates, Ntemplates) inverse Fisher matrices of
+        the amplitudes
+    b: np.ndarray
+        A (Nx, Ny, Ntemplates) scratch buffer for the projected residuals
+    '''
+
+    Nspec, N1, N2 = data.shape
+    Nt = templates.shape[1]
+
+    b[:] = 0.
+
+    chi2 = 0.
+    for k in range(Nspec):
+        for i in range(N1):
+            for j in range(N2):
+                diff = data[k,i,j] - model[k,i,j]
+                wdiff = diff * weights[k,i,j]**2
+                chi2 += diff * wdiff
+                for t in range(Nt):
+                    b[i,j,t] += templates[k,t] * wdiff
+
+    # minus the part of the residual absorbed by the continuum
+    for i in range(N1):
+        for j in range(N2):
+            for t in range(Nt):
+                bf = 0.
+                for u in range(Nt):
+                    bf += finv[i,j,t,u] * b[i,j,u]
+                chi2 -= b[i,j,t] * bf
+
+    return chi2
+
+@njit(cache=True)
+def _compute_model_cube_dispersion(lambdas, mu, std, unit_factor, zfactor,
+                                   sigma, vnorm, imap, out):
+    '''
+    Compute all (pre-PSF) model slices for a gaussian line whose width
+    in each pixel is the instrumental width std plus the velocity
+    dispersion sigma in quadrature. The slice integral of the line
+    profile is done analytically with erf's, so no SED table is needed.
+    Matches _compute_model_cube() for sigma=0, up to its trapezoid rule
+
+    lambdas: np.ndarray
+        A (Nspec, 2) array of the (lambda_blue, lambda_red) slice bounds
+    mu: float
+        The observed line center, in the line unit
+    std: float
+        The instrumental line width, in the line unit
+    unit_factor: float
+        Conversion from the slice wavelength unit to the line unit
+    zfactor: np.ndarray (2D)
+        The kinematic redshift factor per pixel
+    sigma: np.ndarray (2D)
+        The velocity dispersion per pixel
+    vnorm: float
+        The normalization 1/c, in the velocity unit of sigma
+    imap: np.ndarray (2D)
+        The emission line intensity map
+    out: np.ndarray (3D)
+        The (Nspec, Nx, Ny) buffer the model slices are written to
+    '''
+
+    Nspec = lambdas.shape[0]
+    N1, N2 = zfactor.shape
+
+    inv_sqrt2 = 1. / np.sqrt(2.)
+
+    for i in range(N1):
+        for j in range(N2):
+            z = zfactor[i,j]
+            sv = mu * sigma[i,j] * vnorm
+            s = np.sqrt(std*std + sv*sv)
+
+            scale = z * unit_factor * inv_sqrt2 / s
+            offset = mu * inv_sqrt2 / s
+            norm = 0.5 * imap[i,j] / (z * unit_factor)
+
+            # contiguous slices share their bounds, so reuse the erf
+            prev_lam = np.nan
+            prev_erf = 0.
+            for k in range(Nspec):
+                lblue, lred = lambdas[k,0], lambdas[k,1]
+
+                if lblue == prev_lam:
+                    erf_b = prev_erf
+                else:
+                    erf_b = math.erf(lblue*scale - offset)
+                erf_r = math.erf(lred*scale - offset)
+
+                out[k,i,j] = norm * (erf_r - erf_b)
+
+                prev_lam = lred
+                prev_erf = erf_r
+
+    return out
+
+def get_rfft_multiplicity(ny):
+    '''
+    The number of times each column of an rfft2 along an axis of len ny
+    appears in the full 2D spectrum, for Parseval sums
+    '''
+
+    mult = 2. * np.ones(ny//2 + 1)
+    mult[0] = 1.
+    if ny % 2 == 0:
+        mult[-1] = 1.
+
+    return mult
+
+@njit(cache=True)
+def _compute_fourier_chi2(data_ft, tf, tf_index, model_ft, cont_ft, mult,
+                          w2):
+    '''
+    chi2 of uniform-weight slices in Fourier space (Parseval), where the
+    PSF convolution of the model is a pointwise multiply by its (circular)
+    transfer function. Returns the sum over slices of
+    w2[k] * sum_{ij} mult[j] * |data_ft - tf*model_ft - cont_ft|^2, which
+    must be divided by Nx*Ny for the real space chi2
+
+    data_ft: np.ndarray (3D, complex)
+        The rfft2 of each uniform-weight data slice
+    tf: np.ndarray (3D, complex)
+        The distinct (circular) PSF transfer functions
+    tf_index: np.ndarray (1D, int)
+        The index into tf for each slice
+    model_ft: np.ndarray (3D, complex)
+        The rfft2 of each pre-PSF model slice
+    cont_ft: np.ndarray (2D, complex)
+        The rfft2 of the (post-PSF) continuum model
+    mult: np.ndarray (1D)
+        See get_rfft_multiplicity()
+    w2: np.ndarray (1D)
+        The squared (uniform) weight of each slice
+    '''
+
+    Nk, N1, N2 = data_ft.shape
+
+    chi2 = 0.
+    for k in range(Nk):
+        t = tf_index[k]
+        slice_chi2 = 0.
+        for i in range(N1):
+            for j in range(N2):
+                r = data_ft[k,i,j] - tf[t,i,j]*model_ft[k,i,j] - cont_ft[i,j]
+                slice_chi2 += mult[j] * (r.real*r.real + r.imag*r.imag)
+        chi2 += w2[k] * slice_chi2
+
+    return chi2
+
+def main(args):
+    '''
+    For now, just used for testing the arena & kernels against the
+    numpy implementations in likelihood.py
+    '''
+
+    print('Testing arena requests & resets')
+    arena = LikelihoodArena(100)
+    a = arena.request((5, 10))
+    b = arena.request((50,))
+    assert arena.used == 100
+    assert np.shares_memory(a, arena._block)
+    arena.reset()
+    assert arena.used == 0
+    c = arena.request((5, 10))
+    assert np.shares_memory(a, c)
+
+    print('Testing arena growth & overflow counter')
+    arena.reset()
+    arena.freeze()
+    arena.request((100,))
+    d = arena.request((10,))
+    assert not np.shares_memory(d, arena._block)
+    assert arena.overflows == 1
+    arena.reset()
+    assert arena.capacity == 110
+    arena.request((110,))
+    assert arena.overflows == 1
+
+    print('Testing interpolation kernel')
+    xp = np.linspace(0., 1., 17)
+    fp = np.sin(3.*xp)
+    for x in [-1., 0., 0.33, 0.5, 1., 2.]:
+        assert np.isclose(_interp(xp, fp, x), np.interp(x, xp, fp))
+
+    print('Testing model cube kernel')
+    Nspec, Nx, Ny = 10, 30, 30
+    sed_x = np.linspace(850., 855., 101)
+    sed_y = np.exp(-0.5*((sed_x - 852.5) / 0.3)**2)
+    lambdas = np.array([(l, l+0.5) for l in np.arange(850., 855., 0.5)])
+    zfactor = 1. / (1. + 1e-4*np.random.randn(Nx, Ny))
+    imap = np.random.rand(Nx, Ny)
+
+    model = np.empty((Nspec, Nx, Ny))
+    _compute_model_cube(lambdas, sed_x, sed_y, zfactor, imap, model)
+
+    for k in range(Nspec):
+        lblue, lred = lambdas[k]
+        sed_b = np.interp(lblue*zfactor, sed_x, sed_y)
+        sed_r = np.interp(lred*zfactor, sed_x, sed_y)
+        truth = imap * (lred - lblue) * (sed_b + sed_r) / 2.
+        assert np.allclose(model[k], truth)
+
+    print('Testing chi2 kernel')
+    data = np.random.randn(Nspec, Nx, Ny)
+    weights = np.random.rand(Nspec, Nx, Ny)
+    chi2 = _compute_chi2(data, model, weights)
+    assert np.isclose(chi2, np.sum((data-model)**2 * weights**2))
+
+    print('Testing continuum marginalized chi2 kernel')
+    Nt = 2
+    templates = np.array([np.ones(Nspec), np.linspace(-1., 1., Nspec)]).T
+    prior = np.random.rand(Nx, Ny, 1, 1) * np.eye(Nt)
+    fisher = prior + np.einsum('st,sxy,su->xytu', templates, weights**2,
+                               templates)
+    finv = np.linalg.inv(fisher)
+    b = np.empty((Nx, Ny, Nt))
+    cchi2 = _compute_chi2_continuum(data, model, weights, templates, finv, b)
+    # the chi2 absorbed by the best-fit amplitudes, incl. their prior
+    cchi2_pix = np.sum((data-model)**2 * weights**2) - cchi2
+    resid = (data - model) * weights**2
+    truth = 0.
+    for i in range(Nx):
+        for j in range(Ny):
+            bij = templates.T.dot(resid[:,i,j])
+            amps = np.linalg.solve(fisher[i,j], bij)
+            truth += bij.dot(amps)
+    assert np.isclose(cchi2_pix, truth)
+    # an injected continuum is absorbed, up to the prior
+    amps = np.random.randn(Nx, Ny, Nt)
+    cont = np.einsum('st,xyt->sxy', templates, amps)
+    prior[:] = 0.
+    finv = np.linalg.inv(prior + np.einsum('st,sxy,su->xytu', templates,
+                                           weights**2, templates))
+    assert np.isclose(
+        _compute_chi2_continuum(data + cont, model, weights, templates,
+                                finv, b),
+        _compute_chi2_continuum(data, model, weights, templates, finv, b)
+        )
+
+    print('Testing dispersion model cube kernel')
+    mu, std = 852.5, 0.3
+    # fine slices, so that the trapezoid rule of the SED table is accurate
+    fine = np.array([(l, l+0.01) for l in np.arange(850., 855., 0.01)])
+    Nfine = len(fine)
+    sigma = np.zeros((Nx, Ny))
+    disp_model = np.empty((Nfine, Nx, Ny))
+    _compute_model_cube_dispersion(
+        fine, mu, std, 1., zfactor, sigma, 1./3e5, imap, disp_model
+        )
+    norm_model = np.empty((Nfine, Nx, Ny))
+    _compute_model_cube(
+        fine, sed_x, sed_y / (std*np.sqrt(2.*np.pi)), zfactor, imap, norm_model
+        )
+    assert np.allclose(disp_model, norm_model, atol=1e-2*np.max(norm_model))
+    # adding dispersion conserves flux & broadens the line
+    sigma[:] = 100.
+    wide = np.empty((Nfine, Nx, Ny))
+    _compute_model_cube_dispersion(
+        fine, mu, std, 1., zfactor, sigma, 1./3e5, imap, wide
+        )
+    assert np.allclose(np.sum(wide, axis=0), np.sum(disp_model, axis=0),
+                       rtol=1e-3)
+    assert np.max(wide) < np.max(disp_model)
+
+    print('Testing Fourier chi2 kernel')
+    for ny in [Ny, Ny-1]:
+        d = data[:, :, :ny]
+        m = model[:, :, :ny]
+        w2 = np.random.rand(Nspec)
+        d_ft = np.fft.rfft2(d)
+        m_ft = np.fft.rfft2(m)
+        tf = np.ones((1,) + d_ft.shape[1:], dtype=np.complex128)
+        cont_ft = np.zeros(d_ft.shape[1:], dtype=np.complex128)
+        fchi2 = _compute_fourier_chi2(
+            d_ft, tf, np.zeros(Nspec, dtype=np.int64), m_ft, cont_ft,
+            get_rfft_multiplicity(ny), w2
+            ) / (Nx*ny)
+        truth = np.sum(w2[:,None,None] * (d - m)**2)
+        assert np.isclose(fchi2, truth)
+
+    print(f'Timing model cube kernel; {numba_isa.isa_summary()}')
+    N = 100
+    start = time()
+    for i in range(N):
+        _compute_model_cube(lambdas, sed_x, sed_y, zfactor, imap, model)
+    t = (time() - start) / N
+    print(f'The model cube kernel took {1e3*t:.3f} ms for shape ' +\
+          f'{model.shape}')
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
@@ -1,4 +1,6 @@
 import numpy as np
+# must come before any kernel is compiled
+import numba_isa
 from numba import njit
 from numba import types
 from numba.typed import Dict
@@ -28,7 +30,7 @@ the pars list. This is a dict in no_numba_transformation.py to be flexible on
 models.
 '''
 
-@njit
+@njit(cache=True)
 def transform_coords(x, y, plane1, plane2, pars):
     '''
     Transform coords (x,y) defined in plane1 into plane2
@@ -73,7 +75,7 @@ def transform_coords(x, y, plane1, plane2, pars):
 
     return x, y
 
-@njit
+@njit(cache=True)
 def _multiply(transform, pos):
     '''
     transform: a (2x2) coordinate transformation matrix
@@ -146,7 +148,7 @@ def _multiply(transform, pos):
 # TODO: Could try to work out these inv transforms analytically
 #       for faster eval
 
-@njit
+@njit(cache=True)
 def _transform_obs2source(pars):
     '''
     Lensing transformation from obs to source plane
@@ -171,7 +173,7 @@ def _transform_obs2source(pars):
 
     return transform
 
-@njit
+@njit(cache=True)
 def _transform_source2gal(pars):
     '''
     Rotation by intrinsic angle
@@ -195,7 +197,7 @@ def _transform_source2gal(pars):
 
     return transform
 
-@njit
+@njit(cache=True)
 def _transform_gal2disk(pars):
     '''
     Account for inclination angle
@@ -215,7 +217,7 @@ def _transform_gal2disk(pars):
 
     return transform
 
-@njit
+@njit(cache=True)
 def _obs2source(pars, x, y):
     '''
     pars is a list
@@ -228,7 +230,7 @@ def _obs2source(pars, x, y):
 
     return _multiply(transform, x, y)
 
-@njit
+@njit(cache=True)
 def _source2gal(pars, x, y):
     '''
     pars is an array
@@ -241,7 +243,7 @@ def _source2gal(pars, x, y):
 
     return _multiply(transform, x, y)
 
-@njit
+@njit(cache=True)
 def _gal2disk(pars, x, y):
     '''
     pars is an array
@@ -254,7 +256,7 @@ def _gal2disk(pars, x, y):
 
     return _multiply(transform, x, y)
 
-@njit
+@njit(cache=True)
 def _source2obs(pars, x, y):
     '''
     pars is an array
@@ -269,7 +271,7 @@ def _source2obs(pars, x, y):
 
     return _multiply(transform, x, y)
 
-@njit
+@njit(cache=True)
 def _gal2source(pars, x, y):
     '''
     pars is an array
@@ -284,7 +286,7 @@ def _gal2source(pars, x, y):
 
     return _multiply(transform, x, y)
 
-@njit
+@njit(cache=True)
 def _disk2gal(pars, x, y):
     '''
     pars is an array
@@ -299,7 +301,7 @@ def _disk2gal(pars, x, y):
 
     return _multiply(transform, x, y)
 
-@njit
+@njit(cache=True)
 def _eval_in_obs_plane(pars, x, y, speed=False):
     '''
     pars is an array
@@ -312,7 +314,7 @@ def _eval_in_obs_plane(pars, x, y, speed=False):
 
     return _eval_in_source_plane(pars, xp, yp, speed=speed)
 
-@njit
+@njit(cache=True)
 def _eval_in_source_plane(pars, x, y, speed=False):
     '''
     pars is an array
@@ -325,7 +327,7 @@ def _eval_in_source_plane(pars, x, y, speed=False):
 
     return _eval_in_gal_plane(pars, xp, yp, speed=speed)
 
-@njit
+@njit(cache=True)
 def _eval_in_gal_plane(pars, x, y, speed=False):
     '''
     pars is an array
@@ -348,7 +350,7 @@ def _eval_in_gal_plane(pars, x, y, speed=False):
 
         return sini * np.cos(phi) * speed_map
 
-@njit
+@njit(cache=True)
 def _eval_in_disk_plane(pars, x, y, speed=False):
     '''
     Evaluates model at posiiton array in the galaxy plane, where
@@ -381,6 +383,282 @@ def _eval_in_disk_plane(pars, x, y, speed=False):
 
     return v_r
 
+@njit(cache=True)
+def _eval_vmap_in_obs_plane(pars, x, y, offset, out):
+    '''
+    Evaluates the default velocity model at obs plane positions in a
+    single pass over pixels, writing into a preallocated array. Unlike
+    the functions above, this does not build any intermediate coordinate
+    arrays for each transformation step
+
+    pars is an array with model parameters
+    (see PARS_ORDER; x0, y0 are at indices 7, 8 if offset is True)
+    (x,y) are the (2D) positions in the obs plane
+    out is an array of the same shape as x that the velocity map
+    (in the same unit as v0 & vcirc) is written to
+    '''
+
+    g1, g2 = pars[0], pars[1]
+    theta_int = pars[2]
+    sini = pars[3]
+    v0 = pars[4]
+    vcirc = pars[5]
+    rscale = pars[6]
+
+    if offset:
+        x0, y0 = pars[7], pars[8]
+    else:
+        x0, y0 = 0., 0.
+
+    # source2gal rotates by -theta_int
+    c, s = np.cos(-theta_int), np.sin(-theta_int)
+    inv_cosi = 1. / np.sqrt(1. - sini**2)
+    vnorm = (2. / np.pi) * vcirc
+
+    N1, N2 = x.shape
+    for i in range(N1):
+        for j in range(N2):
+            # obs2cen
+            xc = x[i,j] - x0
+            yc = y[i,j] - y0
+
+            # cen2source
+            xs = (1.-g1)*xc - g2*yc
+            ys = -g2*xc + (1.+g1)*yc
+
+            # source2gal
+            xg = c*xs - s*ys
+            yg = s*xs + c*ys
+
+            # gal2disk
+            xd = xg
+            yd = yg * inv_cosi
+
+            r = np.sqrt(xd**2 + yd**2)
+
+            if r > 0:
+                cos_phi = xd / r
+            else:
+                cos_phi = 1.
+
+            out[i,j] = v0 + sini * cos_phi * vnorm * np.arctan(r / rscale)
+
+    return out
+
+@njit(cache=True)
+def _eval_disk_radius_in_obs_plane(pars, x, y, offset, out):
+    '''
+    Same as _eval_vmap_in_obs_plane(), but writes the disk plane radius
+    of each obs plane position instead of the velocity
+    '''
+
+    g1, g2 = pars[0], pars[1]
+    theta_int = pars[2]
+    sini = pars[3]
+
+    if offset:
+        x0, y0 = pars[7], pars[8]
+    else:
+        x0, y0 = 0., 0.
+
+    c, s = np.cos(-theta_int), np.sin(-theta_int)
+    inv_cosi = 1. / np.sqrt(1. - sini**2)
+
+    N1, N2 = x.shape
+    for i in range(N1):
+        for j in range(N2):
+            xc = x[i,j] - x0
+            yc = y[i,j] - y0
+
+            xs = (1.-g1)*xc - g2*yc
+            ys = -g2*xc + (1.+g1)*yc
+
+            xg = c*xs - s*ys
+            yg = s*xs + c*ys
+
+            out[i,j] = np.sqrt(xg**2 + (yg * inv_cosi)**2)
+
+    return out
+
+@njit(cache=True)
+def _eval_thick_vmap_in_obs_plane(pars, x, y, nodes, weights, dy, out,
+                                  out_std, with_std):
+    '''
+    Same as _eval_vmap_in_obs_plane(), but for the thick disk velocity
+    model. The velocity is averaged along each line of sight with the
+    quadrature of velocity.LOSKernel
+
+    pars is an array with model parameters
+    (see PARS_ORDER; the thick disk scale hz is at index 7 & the radial
+    emission scale length rd at index 8, or 0 to weight by the vertical
+    profile only)
+    nodes & weights are the LOSKernel quadrature nodes & weights
+    dy is a scratch array of the same length as nodes
+    out is written the mean velocity along each line of sight. If
+    with_std is True, out_std is written its spread (w/o v0)
+    '''
+
+    g1, g2 = pars[0], pars[1]
+    theta_int = pars[2]
+    sini = pars[3]
+    v0 = pars[4]
+    vcirc = pars[5]
+    rscale = pars[6]
+    hz = pars[7]
+    rd = pars[8]
+
+    c, s = np.cos(-theta_int), np.sin(-theta_int)
+    cosi = np.sqrt(1. - sini**2)
+    inv_cosi = 1. / cosi
+    vnorm = (2. / np.pi) * vcirc
+
+    # the kernel for this inclination
+    Nlos = len(nodes)
+    for k in range(Nlos):
+        dy[k] = hz * (sini / cosi) * nodes[k]
+
+    N1, N2 = x.shape
+    for i in range(N1):
+        for j in range(N2):
+            # obs2source
+            xs = (1.-g1)*x[i,j] - g2*y[i,j]
+            ys = -g2*x[i,j] + (1.+g1)*y[i,j]
+
+            # source2gal
+            xg = c*xs - s*ys
+            yg = s*xs + c*ys
+
+            # gal2disk at the midplane
+            xd = xg
+            yd0 = yg * inv_cosi
+
+            r0 = np.sqrt(xd**2 + yd0**2)
+
+            wsum = 0.
+            m1 = 0.
+            m2 = 0.
+            for k in range(Nlos):
+                yd = yd0 + dy[k]
+                r = np.sqrt(xd**2 + yd**2)
+
+                if r > 0:
+                    cos_phi = xd / r
+                else:
+                    cos_phi = 1.
+
+                # the radial surface brightness at the node, relative
+                # to the midplane crossing
+                w = weights[k]
+                if rd > 0:
+                    w *= np.exp(-(r - r0) / rd)
+
+                v = sini * cos_phi * vnorm * np.arctan(r / rscale)
+                wsum += w
+                m1 += w * v
+                m2 += w * v * v
+
+            m1 /= wsum
+            m2 /= wsum
+
+            out[i,j] = v0 + m1
+
+            if with_std:
+                var = m2 - m1*m1
+                if var > 0:
+                    out_std[i,j] = np.sqrt(var)
+                else:
+                    out_std[i,j] = 0.
+
+    return out
+
+@njit(cache=True)
+def _eval_harmonic_vmap_in_obs_plane(pars, x, y, offset, amps, work, out):
+    '''
+    Same as _eval_vmap_in_obs_plane(), but for the harmonic velocity
+    model. The cos(m*phi) & sin(m*phi) terms are built up by recurrence
+    from cos(phi) & sin(phi), so the only extra cost per pixel over the
+    circular model is a few multiply-adds per order
+
+    amps holds the (vc_m, vs_m) amplitudes of every order m=1..mmax in
+    turn, w/ 0 for the orders that aren't modeled; see
+    velocity.get_harmonic_pars(). vcirc is added to vc_1 here. work is a
+    (2, Ny) scratch buffer for the cos(phi) & sin(phi) of a row
+    '''
+
+    g1, g2 = pars[0], pars[1]
+    theta_int = pars[2]
+    sini = pars[3]
+    v0 = pars[4]
+    vcirc = pars[5]
+    rscale = pars[6]
+
+    if offset:
+        x0, y0 = pars[7], pars[8]
+    else:
+        x0, y0 = 0., 0.
+
+    c, s = np.cos(-theta_int), np.sin(-theta_int)
+    inv_cosi = 1. / np.sqrt(1. - sini**2)
+    pnorm = 2. / np.pi
+
+    mmax = len(amps) // 2
+    ac1 = amps[0] + vcirc
+    as1 = amps[1]
+
+    N1, N2 = x.shape
+    for i in range(N1):
+        # the geometry of a row first, w/o the order loop, so that it
+        # vectorizes across pixels
+        for j in range(N2):
+            # obs2cen
+            xc = x[i,j] - x0
+            yc = y[i,j] - y0
+
+            # cen2source
+            xs = (1.-g1)*xc - g2*yc
+            ys = -g2*xc + (1.+g1)*yc
+
+            # source2gal
+            xg = c*xs - s*ys
+            yg = s*xs + c*ys
+
+            # gal2disk
+            xd = xg
+            yd = yg * inv_cosi
+
+            r = np.sqrt(xd**2 + yd**2)
+
+            if r > 0:
+                work[0,j] = xd / r
+                work[1,j] = yd / r
+            else:
+                work[0,j] = 1.
+                work[1,j] = 0.
+
+            # the radial profile is applied at the end
+            out[i,j] = sini * pnorm * np.arctan(r / rscale)
+
+        for j in range(N2):
+            cos_phi = work[0,j]
+            sin_phi = work[1,j]
+
+            v = ac1 * cos_phi + as1 * sin_phi
+
+            # cos & sin of (m-1)*phi and m*phi, starting at m=1
+            cos_prev, sin_prev = 1., 0.
+            cos_m, sin_m = cos_phi, sin_phi
+            for m in range(1, mmax):
+                cos_next = 2.*cos_phi*cos_m - cos_prev
+                sin_next = 2.*cos_phi*sin_m - sin_prev
+                cos_prev, sin_prev = cos_m, sin_m
+                cos_m, sin_m = cos_next, sin_next
+
+                v += amps[2*m] * cos_m + amps[2*m+1] * sin_m
+
+            out[i,j] = v0 + out[i,j] * v
+
+    return out
+
 def main():
     print('Starting multiply test')
     x = np.random.randn(10, 10)
@@ -0,0 +1,334 @@
+import numpy as np
+from collections import OrderedDict
+from argparse import ArgumentParser
+
+import ipdb
+
+'''
+This file contains a small dataflow graph for incremental likelihood
+evaluation. Each Stage declares the sampled parameters and upstream
+stages it depends on, and keeps its last few outputs keyed by those. A
+stage is only recomputed if one of its parameters changed, or if an
+upstream stage produced a new output.
+
+For the datacube likelihood the graph is
+
+    zfactor (vmap pars) ---\
+    sed (z, R) -------------\
+    imap (shape pars) ------> model --> cube --> chi2
+    sigma (dispersion pars) /
+
+so e.g. a move in v0 only reruns zfactor, model, cube & chi2. See
+DataCubeLikelihood._build_native_pipeline()
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+def _copy_output(output, buffer=None):
+    '''
+    Copy a stage output (an array, None, or tuple of them) so that it
+    doesn't change if the buffers it was computed in are reused. Reuses
+    the arrays of an evicted output if they match
+    '''
+
+    if output is None:
+        return None
+
+    if isinstance(output, tuple):
+        if not isinstance(buffer, tuple):
+            buffer = len(output) * (None,)
+        return tuple(_copy_output(o, b) for o, b in zip(output, buffer))
+
+    if isinstance(output, np.ndarray):
+        if isinstance(buffer, np.ndarray) and \
+           (buffer.shape == output.shape) and (buffer.dtype == output.dtype):
+            np.copyto(buffer, output)
+            return buffer
+        return output.copy()
+
+    # scalars, etc.
+    return output
+
+class Stage(object):
+    '''
+    A node of a StagePipeline
+    '''
+
+    def __init__(self, name, func, pars=(), inputs=(), cache_size=1,
+                 copy=True):
+        '''
+        name: str
+            The stage name
+        func: callable
+            Computes the stage output as func(theta_pars, *input_outputs)
+        pars: list of str's
+            The sampled pars the output depends on
+        inputs: list of str's
+            The names of the upstream stages, whose outputs are passed
+            to func in this order
+        cache_size: int
+            The number of most recent outputs to keep
+        copy: bool
+            Set to False if func already returns arrays that it owns, so
+            that they don't need to be copied before caching
+        '''
+
+        if not isinstance(cache_size, int):
+            raise TypeError('cache_size must be an int!')
+        if cache_size < 1:
+            raise ValueError('cache_size must be positive!')
+
+        self.name = name
+        self.func = func
+        self.pars = list(pars)
+        self.inputs = list(inputs)
+        self.cache_size = cache_size
+        self.copy = copy
+
+        # key -> (version, output)
+        self._cache = OrderedDict()
+        self._next_version = 0
+
+        self.hits = 0
+        self.misses = 0
+
+        return
+
+    def get(self, key):
+        '''
+        Return the cached (version, output) for key, or None
+        '''
+
+        if key in self._cache:
+            self._cache.move_to_end(key)
+            self.hits += 1
+            return self._cache[key]
+
+        return None
+
+    def put(self, key, output):
+        '''
+        Cache a newly computed output and return its (version, output)
+        '''
+
+        self.misses += 1
+
+        evicted = None
+        if len(self._cache) >= self.cache_size:
+            evicted = self._cache.popitem(last=False)[1][1]
+
+        if self.copy is True:
+            output = _copy_output(output, evicted)
+
+        entry = (self._next_version, output)
+        self._next_version += 1
+
+        self._cache[key] = entry
+
+        return entry
+
+    def clear(self):
+        self._cache.clear()
+
+        return
+
+class StagePipeline(object):
+    '''
+    A set of Stages that are evaluated lazily & incrementally
+    '''
+
+    def __init__(self, stages):
+        '''
+        stages: list of Stage's
+            The stages, in any order. Inputs must refer to stages in the
+            list, and there can't be any cycles
+        '''
+
+        self.stages = OrderedDict()
+        for stage in stages:
+            if stage.name in self.stages:
+                raise ValueError(f'Stage {stage.name} passed more than once!')
+            self.stages[stage.name] = stage
+
+        for stage in stages:
+            for name in stage.inputs:
+                if name not in self.stages:
+                    raise ValueError(f'Stage {stage.name} depends on ' +\
+                                     f'unknown stage {name}!')
+
+        self._check_for_cycles()
+
+        # (version, output) of each stage for the last evaluated theta
+        self._current = {}
+
+        return
+
+    def _check_for_cycles(self):
+
+        visiting, done = set(), set()
+
+        def visit(name):
+            if name in done:
+                return
+            if name in visiting:
+                raise ValueError(f'Stage {name} is part of a cycle!')
+            visiting.add(name)
+            for upstream in self.stages[name].inputs:
+                visit(upstream)
+            visiting.remove(name)
+            done.add(name)
+
+        for name in self.stages:
+            visit(name)
+
+        return
+
+    def evaluate(self, name, theta_pars):
+        '''
+        Return the output of a stage for theta_pars, recomputing only the
+        stages (upstream of it) whose dependencies changed
+
+        name: str
+            The stage name
+        theta_pars: dict
+            The sampled pars
+        '''
+
+        return self._evaluate(name, theta_pars, {})[1]
+
+    def _evaluate(self, name, theta_pars, evaluated):
+        '''
+        Returns (version, output). evaluated holds the stages already
+        evaluated for this theta_pars
+        '''
+
+        if name in evaluated:
+            return evaluated[name]
+
+        stage = self.stages[name]
+
+        upstream = [self._evaluate(n, theta_pars, evaluated)
+                    for n in stage.inputs]
+
+        key = tuple(float(theta_pars[p]) for p in stage.pars) + \
+              tuple(u[0] for u in upstream)
+
+        entry = stage.get(key)
+        if entry is None:
+            output = stage.func(theta_pars, *[u[1] for u in upstream])
+            entry = stage.put(key, output)
+
+        evaluated[name] = entry
+        self._current[name] = entry
+
+        return entry
+
+    def version(self, name):
+        '''
+        The output version of a stage for the last evaluated theta_pars
+        '''
+
+        if name not in self._current:
+            return None
+
+        return self._current[name][0]
+
+    def output(self, name):
+        '''
+        The output of a stage for the last evaluated theta_pars
+        '''
+
+        if name not in self._current:
+            return None
+
+        return self._current[name][1]
+
+    def clear(self):
+        for stage in self.stages.values():
+            stage.clear()
+        self._current = {}
+
+        return
+
+    def summary(self):
+        '''
+        The number of cache hits & misses of each stage
+        '''
+
+        return {name: {'hits': s.hits, 'misses': s.misses}
+                for name, s in self.stages.items()}
+
+def main(args):
+    '''
+    For now, just used for testing the stage caching
+    '''
+
+    calls = {'a': 0, 'b': 0, 'c': 0}
+
+    def a(theta_pars):
+        calls['a'] += 1
+        return np.array([theta_pars['x']])
+
+    def b(theta_pars):
+        calls['b'] += 1
+        return np.array([theta_pars['y']])
+
+    def c(theta_pars, a_out, b_out):
+        calls['c'] += 1
+        return a_out + b_out
+
+    print('Testing only changed stages are recomputed')
+    pipe = StagePipeline([
+        Stage('c', c, inputs=['a', 'b']),
+        Stage('a', a, pars=['x']),
+        Stage('b', b, pars=['y'], cache_size=2),
+        ])
+
+    assert pipe.evaluate('c', {'x': 1., 'y': 2.})[0] == 3.
+    assert calls == {'a': 1, 'b': 1, 'c': 1}
+
+    assert pipe.evaluate('c', {'x': 1., 'y': 2.})[0] == 3.
+    assert calls == {'a': 1, 'b': 1, 'c': 1}
+
+    assert pipe.evaluate('c', {'x': 1., 'y': 5.})[0] == 6.
+    assert calls == {'a': 1, 'b': 2, 'c': 2}
+
+    print('Testing LRU revisits')
+    # b keeps both y's, but c only its last output
+    assert pipe.evaluate('c', {'x': 1., 'y': 2.})[0] == 3.
+    assert calls == {'a': 1, 'b': 2, 'c': 3}
+
+    print('Testing cached outputs are not aliased')
+    buf = np.zeros(1)
+    def d(theta_pars):
+        buf[0] = theta_pars['x']
+        return buf
+    pipe = StagePipeline([Stage('d', d, pars=['x'], cache_size=2)])
+    d1 = pipe.evaluate('d', {'x': 1.})
+    d2 = pipe.evaluate('d', {'x': 2.})
+    assert (d1[0] == 1.) and (d2[0] == 2.)
+
+    print('Testing cycle detection')
+    try:
+        StagePipeline([Stage('e', d, inputs=['f']),
+                       Stage('f', d, inputs=['e'])])
+        raise AssertionError('Cycle was not detected!')
+    except ValueError:
+        pass
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
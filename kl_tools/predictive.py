@@ -0,0 +1,487 @@
+import numpy as np
+from scipy.special import erfc
+from scipy.stats import chi2 as chi2_dist
+from argparse import ArgumentParser
+
+from likelihood import build_likelihood_model
+
+import ipdb
+
+'''
+This file contains posterior-predictive checks of a datacube fit. The
+model cubes of many posterior samples are rendered in parallel and
+reduced on the fly into per-voxel, per-pixel & per-slice summaries, so
+that only a batch of model cubes is in memory at a time (unless the full
+set is asked for)
+
+The p-values are posterior-predictive p-values of the chi2 discrepancy.
+Given a model, the replicated chi2 of N independent voxels follows a chi2
+distribution w/ N dof, so the p-value of each sample is its chi2 survival
+function & no noise realizations need to be drawn; the reported p-value
+is its average over the samples
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+class ModelCubeRenderer(object):
+    '''
+    Renders the model cubes of a batch of samples. A renderer is sent to
+    each worker w/ its batch, & the likelihood geometry (grids, arena,
+    PSF & continuum setup) is built once per batch and shared across its
+    samples
+    '''
+
+    def __init__(self, pars, datacube, likelihood='datacube'):
+        '''
+        pars: Pars
+            The sampled & meta pars
+        datacube: DataCube
+            The datacube datavector, truncated to desired lambda bounds
+        likelihood: str
+            A registered likelihood type w/ a single model cube for the
+            datavector; see likelihood.LIKELIHOOD_TYPES
+        '''
+
+        self.loglike = build_likelihood_model(likelihood, pars, datacube)
+        self.datacube = datacube
+
+        # slices compared in Fourier space are left pre-PSF
+        if self.loglike._use_fourier_chi2() is True:
+            raise ValueError('Posterior-predictive cubes cannot be ' +\
+                             'rendered with the run option fourier_chi2!')
+
+        # the low-rank continuum is marginalized in the likelihood, so is
+        # added back at its side-band fit
+        cmodel = datacube.get_continuum_model()
+        if cmodel is not None:
+            self.continuum = cmodel.render(
+                np.array(datacube.lambdas, dtype=float)
+                )
+        else:
+            self.continuum = None
+
+        return
+
+    def render(self, theta):
+        '''
+        theta: np.ndarray
+            The sampled parameters, in sampled order
+
+        returns: np.ndarray
+            The (Nspec, Nx, Ny) model cube
+        '''
+
+        theta_pars = self.loglike.theta2pars(theta)
+        model = self.loglike._setup_model(theta_pars, self.datacube)
+
+        # the compiled path returns an arena buffer that is reused
+        if isinstance(model, np.ndarray):
+            model = model.copy()
+        else:
+            model = np.array(model.data)
+
+        if model.shape != self.datacube.shape:
+            raise ValueError(f'The model cube has shape {model.shape}, ' +\
+                             f'not that of the datacube ' +\
+                             f'{self.datacube.shape}!')
+
+        if self.continuum is not None:
+            model += self.continuum
+
+        return model
+
+    def __call__(self, thetas):
+        return np.array([self.render(theta) for theta in thetas])
+
+class PredictiveStats(object):
+    '''
+    Streaming summaries of the model cubes of posterior samples, w/
+    Welford's algorithm for the mean & variance. Quantiles are computed
+    from a uniform reservoir of the samples, & are exact if there are no
+    more samples than the reservoir size
+    '''
+
+    def __init__(self, datacube, quantiles=(0.16, 0.5, 0.84),
+                 reservoir_size=200, keep_cubes=False, seed=None):
+        '''
+        datacube: DataCube
+            The datacube the models are compared to
+        quantiles: list
+            The quantiles of the model cubes to compute, in [0, 1]
+        reservoir_size: int
+            The max number of model cubes kept for the quantiles. Set to 0
+            to skip the quantiles
+        keep_cubes: bool
+            Set to keep every model cube in memory
+        seed: int
+            The seed of the reservoir sampling
+        '''
+
+        quantiles = np.atleast_1d(np.array(quantiles, dtype=float))
+        if np.any((quantiles < 0) | (quantiles > 1)):
+            raise ValueError('quantiles must be in [0, 1]!')
+        if reservoir_size < 0:
+            raise ValueError('reservoir_size must be non-negative!')
+
+        self.shape = datacube.shape
+        self.data = np.array(datacube.data, dtype=float)
+        self.weights = np.array(datacube.weights, dtype=float)
+
+        self.quantiles = quantiles
+        self.reservoir_size = reservoir_size
+        self.keep_cubes = keep_cubes
+        self.rng = np.random.default_rng(seed)
+
+        Nspec, Nx, Ny = self.shape
+
+        # voxels w/ zero weight are masked & don't count as dof
+        used = self.weights != 0
+        self.dof_pixel = np.sum(used, axis=0)
+        self.dof_slice = np.sum(used, axis=(1,2))
+        self.dof = np.sum(used)
+
+        self.n = 0
+        self._mean = np.zeros(self.shape)
+        self._M2 = np.zeros(self.shape)
+
+        self._chi2_pixel = np.zeros((Nx, Ny))
+        self._chi2_slice = np.zeros(Nspec)
+        self._chi2 = 0.
+
+        self._pvalue_voxel = np.zeros(self.shape)
+        self._pvalue_pixel = np.zeros((Nx, Ny))
+        self._pvalue_slice = np.zeros(Nspec)
+        self._pvalue = 0.
+
+        self._reservoir = []
+        self._cubes = []
+
+        return
+
+    def update(self, model):
+        '''
+        Add the model cube of one posterior sample
+
+        model: np.ndarray
+            The (Nspec, Nx, Ny) model cube
+        '''
+
+        if model.shape != self.shape:
+            raise ValueError(f'model must have shape {self.shape}; got ' +\
+                             f'{model.shape}!')
+
+        self.n += 1
+        delta = model - self._mean
+        self._mean += delta / self.n
+        self._M2 += delta * (model - self._mean)
+
+        chi = (self.data - model) * self.weights
+        chi2 = chi**2
+
+        chi2_pixel = np.sum(chi2, axis=0)
+        chi2_slice = np.sum(chi2, axis=(1,2))
+        chi2_total = np.sum(chi2)
+
+        self._chi2_pixel += chi2_pixel
+        self._chi2_slice += chi2_slice
+        self._chi2 += chi2_total
+
+        # masked voxels have chi = 0 & so a p-value of 1
+        self._pvalue_voxel += erfc(np.abs(chi) / np.sqrt(2.))
+        self._pvalue_pixel += chi2_dist.sf(chi2_pixel, self.dof_pixel)
+        self._pvalue_slice += chi2_dist.sf(chi2_slice, self.dof_slice)
+        self._pvalue += chi2_dist.sf(chi2_total, self.dof)
+
+        if self.reservoir_size > 0:
+            if len(self._reservoir) < self.reservoir_size:
+                self._reservoir.append(model.copy())
+            else:
+                i = self.rng.integers(self.n)
+                if i < self.reservoir_size:
+                    self._reservoir[i] = model.copy()
+
+        if self.keep_cubes is True:
+            self._cubes.append(model.copy())
+
+        return
+
+    def _check_samples(self):
+        if self.n == 0:
+            raise ValueError('No model cubes have been added yet!')
+
+        return
+
+    @property
+    def mean(self):
+        self._check_samples()
+        return self._mean.copy()
+
+    @property
+    def std(self):
+        self._check_samples()
+        if self.n < 2:
+            return np.zeros(self.shape)
+        return np.sqrt(self._M2 / (self.n - 1))
+
+    def get_quantiles(self):
+        '''
+        returns: np.ndarray
+            The (Nquantiles, Nspec, Nx, Ny) quantile cubes
+        '''
+
+        self._check_samples()
+        if self.reservoir_size == 0:
+            raise ValueError('Quantiles need a reservoir_size > 0!')
+
+        return np.quantile(np.array(self._reservoir), self.quantiles, axis=0)
+
+    @property
+    def cubes(self):
+        '''
+        returns: np.ndarray
+            The (Nsamples, Nspec, Nx, Ny) model cubes
+        '''
+
+        if self.keep_cubes is False:
+            raise ValueError('The model cubes were not kept! Set ' +\
+                             'keep_cubes=True')
+        self._check_samples()
+
+        return np.array(self._cubes)
+
+    def summary(self):
+        '''
+        returns: dict
+            nsamples: The number of posterior samples
+            mean, std: The (Nspec, Nx, Ny) model mean & std cubes
+            quantiles: The (Nquantiles, Nspec, Nx, Ny) model quantile
+                       cubes, if a reservoir is kept
+            chi: The (Nspec, Nx, Ny) residual of the mean model, in sigmas
+            chi2_pixel: The (Nx, Ny) mean chi2 of each pixel spectrum
+            chi2_slice: The (Nspec,) mean chi2 of each slice
+            chi2: The mean chi2 of the cube
+            pvalue_voxel, pvalue_pixel, pvalue_slice, pvalue: The
+                posterior-predictive p-values of the same chi2's
+            cubes: The model cubes, if kept
+        '''
+
+        self._check_samples()
+
+        n = self.n
+        summary = {
+            'nsamples': n,
+            'mean': self.mean,
+            'std': self.std,
+            'chi': (self.data - self._mean) * self.weights,
+            'chi2_pixel': self._chi2_pixel / n,
+            'chi2_slice': self._chi2_slice / n,
+            'chi2': self._chi2 / n,
+            'pvalue_voxel': self._pvalue_voxel / n,
+            'pvalue_pixel': self._pvalue_pixel / n,
+            'pvalue_slice': self._pvalue_slice / n,
+            'pvalue': self._pvalue / n,
+            }
+
+        if self.reservoir_size > 0:
+            summary['quantiles'] = self.get_quantiles()
+        if self.keep_cubes is True:
+            summary['cubes'] = self.cubes
+
+        return summary
+
+def _get_nworkers(pool):
+    '''
+    The number of workers of a schwimmbad pool, or 1
+    '''
+
+    size = getattr(pool, '_processes', None)
+    if size is None:
+        size = getattr(pool, 'size', 1)
+
+    return max(int(size), 1)
+
+def posterior_predictive(samples, pars, datacube, pool=None,
+                         likelihood='datacube', nsamples=None,
+                         batch_size=None, quantiles=(0.16, 0.5, 0.84),
+                         reservoir_size=200, keep_cubes=False, seed=None,
+                         vb=False):
+    '''
+    Render the model cubes of posterior samples in parallel, & reduce them
+    into predictive summaries as they come in
+
+    samples: np.ndarray
+        The (Nsamples, Ndim) flat chain, in sampled order
+    pars: Pars
+        The sampled & meta pars
+    datacube: DataCube
+        The datacube datavector, truncated to desired lambda bounds
+    pool: schwimmbad pool
+        The pool to render in. Runs serially if None
+    likelihood: str
+        The registered likelihood type used for the fit
+    nsamples: int
+        If set, a random subset of this many samples is used
+    batch_size: int
+        The number of samples rendered per pool map, which bounds the
+        number of model cubes in memory. Defaults to 8 per worker
+    quantiles, reservoir_size, keep_cubes: see PredictiveStats
+    seed: int
+        The seed for the choice of samples & the quantile reservoir
+    vb: bool
+        Set to print progress
+
+    returns: PredictiveStats
+    '''
+
+    samples = np.atleast_2d(np.asarray(samples, dtype=float))
+
+    ndim = len(pars.sampled)
+    if samples.shape[1] != ndim:
+        raise ValueError(f'samples must have {ndim} columns; got shape ' +\
+                         f'{samples.shape}!')
+
+    rng = np.random.default_rng(seed)
+
+    if (nsamples is not None) and (nsamples < len(samples)):
+        indx = rng.choice(len(samples), size=nsamples, replace=False)
+        samples = samples[np.sort(indx)]
+
+    renderer = ModelCubeRenderer(pars, datacube, likelihood=likelihood)
+    stats = PredictiveStats(
+        datacube, quantiles=quantiles, reservoir_size=reservoir_size,
+        keep_cubes=keep_cubes, seed=rng.integers(2**32)
+        )
+
+    nworkers = _get_nworkers(pool)
+    if batch_size is None:
+        batch_size = 8 * nworkers
+
+    Nsamples = len(samples)
+    for start in range(0, Nsamples, batch_size):
+        batch = samples[start:start+batch_size]
+
+        # one chunk per worker, so that each shares its setup
+        chunks = np.array_split(batch, min(nworkers, len(batch)))
+        if pool is None:
+            models = map(renderer, chunks)
+        else:
+            models = pool.map(renderer, chunks)
+
+        for chunk in models:
+            for model in chunk:
+                stats.update(model)
+
+        if vb is True:
+            print(f'Rendered {stats.n}/{Nsamples} posterior samples')
+
+    return stats
+
+def main(args):
+    '''
+    For now, just used for testing the predictive summaries
+    '''
+
+    import schwimmbad
+    from astropy.units import Unit
+    import priors
+    import mocks
+    from parameters import Pars
+
+    true_pars = {
+        'g1': 0.025,
+        'g2': -0.0125,
+        'theta_int': np.pi / 6.,
+        'sini': 0.7,
+        'v0': 5.,
+        'vcirc': 200.,
+        'rscale': 3.,
+        }
+    meta = {
+        'units': {'v_unit': Unit('km/s'), 'r_unit': Unit('kpc')},
+        'priors': {name: priors.UniformPrior(-1e3, 1e3) for name in true_pars},
+        'intensity': {'type': 'inclined_exp', 'flux': 3.8e4, 'hlr': 3.5},
+        'velocity': {'model': 'centered'},
+        'run_options': {'native': True},
+        }
+    datacube_pars = {
+        'Nx': 12,
+        'Ny': 12,
+        'pix_scale': 0.5,
+        'true_flux': 3.8e4,
+        'true_hlr': 3.5,
+        'v_model': 'centered',
+        'v_unit': Unit('km/s'),
+        'r_unit': Unit('kpc'),
+        'z': 0.3,
+        'R': 5000.,
+        'sky_sigma': 0.5,
+        }
+
+    datacube, _, _ = mocks.setup_likelihood_test(true_pars, datacube_pars)
+    pars = Pars(list(true_pars.keys()), meta)
+
+    np.random.seed(42)
+    theta0 = pars.pars2theta(true_pars)
+    samples = theta0 + 1e-3*np.abs(theta0)*np.random.randn(30, len(theta0))
+
+    print('Testing the streamed summaries against the full cubes')
+    stats = posterior_predictive(samples, pars, datacube, batch_size=7,
+                                 reservoir_size=50, keep_cubes=True, seed=1)
+    summary = stats.summary()
+    cubes = summary['cubes']
+    assert summary['nsamples'] == len(samples)
+    assert cubes.shape == (len(samples),) + datacube.shape
+    assert np.allclose(summary['mean'], np.mean(cubes, axis=0))
+    assert np.allclose(summary['std'], np.std(cubes, axis=0, ddof=1))
+    assert np.allclose(summary['quantiles'],
+                       np.quantile(cubes, stats.quantiles, axis=0))
+
+    chi2 = ((datacube.data - cubes) * datacube.weights)**2
+    assert np.allclose(summary['chi2_pixel'], np.mean(np.sum(chi2, axis=1),
+                                                      axis=0))
+    assert np.isclose(summary['chi2'], np.mean(np.sum(chi2, axis=(1,2,3))))
+    for key in ['pvalue_voxel', 'pvalue_pixel', 'pvalue_slice', 'pvalue']:
+        assert np.all((summary[key] >= 0) & (summary[key] <= 1))
+
+    # the mock is a noisy realization of the true model
+    assert summary['pvalue'] > 1e-3
+    assert np.abs(np.mean(summary['chi'])) < 0.2
+
+    print('Testing a parallel render w/ a subset of samples')
+    with schwimmbad.MultiPool(processes=2) as pool:
+        pstats = posterior_predictive(samples, pars, datacube, pool=pool,
+                                      nsamples=20, reservoir_size=5, seed=2)
+    psummary = pstats.summary()
+    assert psummary['nsamples'] == 20
+    assert psummary['quantiles'].shape == (3,) + datacube.shape
+    assert 'cubes' not in psummary
+    try:
+        pstats.cubes
+        raise AssertionError('Unkept cubes were not caught!')
+    except ValueError:
+        pass
+
+    # a poor model should be flagged
+    bad = samples.copy()
+    bad[:, pars.sampled.pars_order['vcirc']] *= 1.5
+    bstats = posterior_predictive(bad, pars, datacube, reservoir_size=0)
+    bsummary = bstats.summary()
+    assert bsummary['pvalue'] < summary['pvalue']
+    assert bsummary['chi2'] > summary['chi2']
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
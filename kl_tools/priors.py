@@ -1,5 +1,6 @@
 from abc import ABC, abstractmethod
 import numpy as np
+from scipy.special import ndtr, ndtri
 
 # def log_prior(theta):
 #     '''
@@ -17,6 +18,17 @@ class Prior(object):
     def __call__(self):
         pass
 
+    def ppf(self, u):
+        '''
+        The inverse of the prior CDF, mapping u in [0, 1] to the prior.
+        Needed by the nested sampling prior transform
+
+        u: float, np.ndarray
+            Quantile(s) of the prior
+        '''
+        raise NotImplementedError(f'{type(self).__name__} does not ' +\
+                                  'implement ppf()!')
+
 class UniformPrior(Prior):
     def __init__(self, left, right, inclusive=False):
         '''
@@ -68,6 +80,9 @@ class UniformPrior(Prior):
             else:
                 return np.log(val)
 
+    def ppf(self, u):
+        return self.left + u * (self.right - self.left)
+
 class GaussPrior(Prior):
     def __init__(self, mu, sigma, clip_sigmas=None, zero_boundary=None):
         '''
@@ -134,3 +149,23 @@ class GaussPrior(Prior):
             return np.log(self.norm) + base
         else:
             return norm * np.exp(base)
+
+    def ppf(self, u):
+        '''
+        The clip & zero boundary make this a truncated normal
+        '''
+
+        lower, upper = -np.inf, np.inf
+        if self.clip_sigmas is not None:
+            lower, upper = -self.clip_sigmas, self.clip_sigmas
+
+        if self.zero_boundary == 'positive':
+            lower = max(lower, -self.mu / self.sigma)
+        elif self.zero_boundary == 'negative':
+            upper = min(upper, -self.mu / self.sigma)
+
+        cdf_lower, cdf_upper = ndtr(lower), ndtr(upper)
+
+        return self.mu + self.sigma * ndtri(
+            cdf_lower + u * (cdf_upper - cdf_lower)
+            )
@@ -0,0 +1,630 @@
+import numpy as np
+import os
+import pickle
+import schwimmbad
+from scipy.special import logsumexp
+from argparse import ArgumentParser
+
+import utils
+from parameters import Pars
+from likelihood import LogPrior, LogPosterior, build_likelihood_model
+from mcmc import build_mcmc_runner, get_pool_size, ENSEMBLE_RUNNERS
+
+import ipdb
+
+'''
+This file contains an importance-reweighting engine to reuse a stored
+chain under a changed target, e.g. a new prior width, a new meta setting,
+or a datacube w/ a different PSF or noise. Each sample gets the weight
+
+    log w = log p_new(theta) - log p_old(theta)
+
+If only the priors changed, the likelihood terms cancel & the weights
+are free. Otherwise the new likelihood is evaluated for every sample, in
+parallel batches. If the effective sample size of the weights drops
+below a threshold, the chain is refreshed w/ a short MCMC run of the new
+target started from a weighted resample of the old chain
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+def compute_ess(log_weights):
+    '''
+    Kish's effective sample size of a set of importance weights
+
+    log_weights: np.ndarray
+        The (unnormalized) log weights
+
+    returns: float
+    '''
+
+    log_weights = np.asarray(log_weights, dtype=float)
+
+    if not np.any(np.isfinite(log_weights)):
+        return 0.
+
+    return float(np.exp(
+        2.*logsumexp(log_weights) - logsumexp(2.*log_weights)
+        ))
+
+class _LikelihoodBatch(object):
+    '''
+    The log likelihood of a chunk of samples. Defined as a class so
+    that it can be pickled for the pools
+    '''
+
+    def __init__(self, loglike, datavector):
+        self.loglike = loglike
+        self.datavector = datavector
+
+        return
+
+    def __call__(self, thetas):
+        return np.array([self.loglike(theta, self.datavector)
+                         for theta in thetas])
+
+class ReweightResult(object):
+    '''
+    The reweighted (or refreshed) samples of a new target
+    '''
+
+    def __init__(self, samples, log_weights, logprior, loglike,
+                 refreshed=False, runner=None):
+        '''
+        samples: np.ndarray
+            The (Nsamples, Ndim) samples
+        log_weights: np.ndarray
+            The (Nsamples,) unnormalized log importance weights
+        logprior, loglike: np.ndarray
+            The (Nsamples,) log prior & likelihood under the new target.
+            loglike is None if it was not needed
+        refreshed: bool
+            Whether the samples come from a refresh run
+        runner: MCMCRunner
+            The refresh run, if any
+        '''
+
+        self.samples = samples
+        self.log_weights = log_weights
+        self.logprior = logprior
+        self.loglike = loglike
+        self.refreshed = refreshed
+        self.runner = runner
+
+        return
+
+    @property
+    def weights(self):
+        '''
+        The normalized importance weights
+        '''
+
+        if not np.any(np.isfinite(self.log_weights)):
+            raise ValueError('No sample has a finite weight under the ' +\
+                             'new target!')
+
+        return np.exp(self.log_weights - logsumexp(self.log_weights))
+
+    @property
+    def ess(self):
+        return compute_ess(self.log_weights)
+
+    @property
+    def ess_fraction(self):
+        return self.ess / len(self.samples)
+
+    def mean(self):
+        return np.sum(self.weights[:,None] * self.samples, axis=0)
+
+    def cov(self):
+        return np.cov(self.samples, rowvar=False, aweights=self.weights)
+
+    def resample(self, nsamples=None, seed=None):
+        '''
+        Equally weighted samples, drawn w/ replacement
+
+        nsamples: int
+            The number of samples. Defaults to the ESS, rounded up
+        seed: int
+            The random seed
+
+        returns: np.ndarray
+        '''
+
+        if nsamples is None:
+            nsamples = int(np.ceil(self.ess))
+
+        rng = np.random.default_rng(seed)
+        indx = rng.choice(len(self.samples), size=nsamples, p=self.weights)
+
+        return self.samples[indx]
+
+class ImportanceReweighter(object):
+    '''
+    Reweights a stored chain to new priors, meta pars, or datavector
+    '''
+
+    def __init__(self, samples, pars, datavector, loglike=None,
+                 likelihood='datacube'):
+        '''
+        samples: np.ndarray
+            The (Nsamples, Ndim) flat chain, in sampled order
+        pars: Pars
+            The sampled & meta pars the chain was run with
+        datavector: DataCube, etc.
+            The datavector the chain was run with
+        loglike: np.ndarray
+            The (Nsamples,) stored log likelihoods of the chain, e.g. from
+            the LogPosterior blobs. Computed if needed & not passed
+        likelihood: str
+            The registered likelihood type the chain was run with
+        '''
+
+        utils.check_type(pars, 'pars', Pars)
+
+        samples = np.atleast_2d(np.asarray(samples, dtype=float))
+        ndim = len(pars.sampled)
+        if samples.shape[1] != ndim:
+            raise ValueError(f'samples must have {ndim} columns; got ' +\
+                             f'shape {samples.shape}!')
+
+        if loglike is not None:
+            loglike = np.asarray(loglike, dtype=float)
+            if loglike.shape != (len(samples),):
+                raise ValueError('loglike must have one value per sample!')
+
+        self.samples = samples
+        self.pars = pars
+        self.datavector = datavector
+        self.likelihood = likelihood
+
+        self._loglike = loglike
+
+        self._logprior = self._compute_logprior(pars)
+
+        return
+
+    @classmethod
+    def from_runner(cls, runner, discard=None, thin=1, likelihood='datacube'):
+        '''
+        Build from a zeus or emcee KLens runner that has been run. The
+        stored log likelihoods are taken from the LogPosterior blobs, if
+        the sampler kept them
+
+        runner: KLensZeusRunner, KLensEmceeRunner
+            The run to reuse
+        discard: int
+            The number of samples to discard, from 0:discard. Defaults to
+            burn_in
+        thin: int
+            The factor by which to thin out the samples by
+        likelihood: str
+            The registered likelihood type the chain was run with
+        '''
+
+        if runner.has_run is not True:
+            raise ValueError('The runner has not been run yet!')
+
+        if discard is None:
+            if runner.burn_in is not None:
+                discard = runner.burn_in
+            else:
+                raise ValueError('Must passs a value for discard if ' +\
+                                 'burn_in is not set!')
+
+        samples = runner.sampler.get_chain(
+            flat=True, discard=discard, thin=thin
+            )
+
+        # blobs are the (logprior, loglike) of each sample
+        loglike = None
+        try:
+            blobs = runner.sampler.get_blobs(
+                flat=True, discard=discard, thin=thin
+                )
+            blobs = np.asarray(blobs, dtype=float)
+            if blobs.shape == (len(samples), 2):
+                loglike = blobs[:,1]
+        except (AttributeError, TypeError, ValueError):
+            pass
+
+        return cls(samples, runner.pars, runner.datacube, loglike=loglike,
+                   likelihood=likelihood)
+
+    def _compute_logprior(self, pars):
+        log_prior = LogPrior(pars)
+
+        return np.array([log_prior(theta) for theta in self.samples])
+
+    def _compute_loglike(self, pars, datavector, likelihood, pool=None,
+                         batch_size=None, queue_size=None):
+        '''
+        The log likelihood of every sample, in parallel batches of one
+        chunk per worker
+        '''
+
+        batch = _LikelihoodBatch(
+            build_likelihood_model(likelihood, pars, datavector), datavector
+            )
+
+        nworkers = get_pool_size(pool, queue_size)
+        if batch_size is None:
+            batch_size = 64 * nworkers
+
+        loglike = []
+        for start in range(0, len(self.samples), batch_size):
+            samples = self.samples[start:start+batch_size]
+            chunks = np.array_split(samples, min(nworkers, len(samples)))
+            if pool is None:
+                results = map(batch, chunks)
+            else:
+                results = pool.map(batch, chunks)
+            loglike += [r for r in results]
+
+        return np.concatenate(loglike)
+
+    @staticmethod
+    def _same_meta(pars, new_pars, ignore=('priors', '_likelihood')):
+        '''
+        Whether the meta pars of two runs are the same, except for the
+        ignored fields. '_likelihood' is the likelihood's own cache (e.g.
+        the imap), which is filled in once the likelihood is evaluated
+        '''
+
+        meta = {k: v for k, v in pars.meta.items() if k not in ignore}
+        new_meta = {k: v for k, v in new_pars.meta.items() if k not in ignore}
+
+        if meta.keys() != new_meta.keys():
+            return False
+
+        try:
+            return pickle.dumps(meta) == pickle.dumps(new_meta)
+        except (pickle.PicklingError, TypeError, AttributeError):
+            return False
+
+    def get_old_loglike(self, pool=None, batch_size=None, queue_size=None):
+        '''
+        The log likelihood of the chain under its own target
+        '''
+
+        if self._loglike is None:
+            self._loglike = self._compute_loglike(
+                self.pars, self.datavector, self.likelihood, pool=pool,
+                batch_size=batch_size, queue_size=queue_size
+                )
+
+        return self._loglike
+
+    def reweight(self, new_pars=None, new_datavector=None,
+                 new_likelihood=None, pool=None, recompute_likelihood=None,
+                 batch_size=None, queue_size=None):
+        '''
+        new_pars: Pars
+            The new sampled & meta pars. Must sample the same parameters
+            in the same order. Defaults to the old ones
+        new_datavector: DataCube, etc.
+            The new datavector, e.g. w/ a different PSF. Defaults to the
+            old one
+        new_likelihood: str
+            The new registered likelihood type. Defaults to the old one
+        pool: schwimmbad pool
+            The pool for the likelihood batches. Runs serially if None
+        recompute_likelihood: bool
+            Whether the likelihood changed. By default it is recomputed
+            if the datavector, likelihood type, or any meta pars other
+            than the priors changed
+        batch_size: int
+            The number of samples per pool map. Defaults to 64 per worker
+        queue_size: int
+            The number of workers of the pool; see mcmc.get_pool_size()
+
+        returns: ReweightResult
+        '''
+
+        if new_pars is None:
+            new_pars = self.pars
+        if new_datavector is None:
+            new_datavector = self.datavector
+        if new_likelihood is None:
+            new_likelihood = self.likelihood
+
+        utils.check_type(new_pars, 'new_pars', Pars)
+        if new_pars.sampled.pars_order != self.pars.sampled.pars_order:
+            raise ValueError('Can only reweight to a target that samples ' +\
+                             'the same parameters in the same order!')
+
+        if recompute_likelihood is None:
+            recompute_likelihood = \
+                (new_datavector is not self.datavector) or \
+                (new_likelihood != self.likelihood) or \
+                (not self._same_meta(self.pars, new_pars))
+
+        logprior = self._compute_logprior(new_pars)
+        log_weights = logprior - self._logprior
+
+        if recompute_likelihood is True:
+            old_loglike = self.get_old_loglike(
+                pool=pool, batch_size=batch_size, queue_size=queue_size
+                )
+            loglike = self._compute_loglike(
+                new_pars, new_datavector, new_likelihood, pool=pool,
+                batch_size=batch_size, queue_size=queue_size
+                )
+            log_weights = log_weights + loglike - old_loglike
+        else:
+            loglike = self._loglike
+
+        # samples outside of the new support
+        log_weights[~np.isfinite(log_weights)] = -np.inf
+
+        return ReweightResult(self.samples, log_weights, logprior, loglike)
+
+    def refresh(self, result, new_pars=None, new_datavector=None,
+                new_likelihood=None, pool=None, nsteps=200, nwalkers=None,
+                sampler='emcee', seed=None, vb=False, queue_size=None):
+        '''
+        Run a short MCMC of the new target, started from a weighted
+        resample of the chain
+
+        result: ReweightResult
+            The reweighting of the chain to the new target
+        nsteps: int
+            The number of steps of the refresh run. The first half is
+            discarded as burn-in
+        nwalkers: int
+            The number of walkers. Defaults to 4*Ndim
+        sampler: str
+            The runner type; one of mcmc.ENSEMBLE_RUNNERS
+        seed: int
+            The seed of the resample
+
+        See reweight() for the rest; the run is serial if pool is None
+
+        returns: ReweightResult
+            Equally weighted samples from the refresh run
+        '''
+
+        if pool is None:
+            pool = schwimmbad.SerialPool()
+
+        if sampler not in ENSEMBLE_RUNNERS:
+            raise ValueError(f'Can only refresh w/ one of the ' +\
+                             f'{ENSEMBLE_RUNNERS} runners, not {sampler}!')
+
+        if new_pars is None:
+            new_pars = self.pars
+        if new_datavector is None:
+            new_datavector = self.datavector
+        if new_likelihood is None:
+            new_likelihood = self.likelihood
+
+        ndim = len(new_pars.sampled)
+        if nwalkers is None:
+            nwalkers = 4*ndim
+
+        # distinct walkers, as the ensemble moves can't leave a
+        # degenerate start
+        rng = np.random.default_rng(seed)
+        weights = result.weights
+        Nnonzero = np.sum(weights > 0)
+        indx = rng.choice(
+            len(self.samples), size=nwalkers, p=weights,
+            replace=Nnonzero < nwalkers
+            )
+        start = self.samples[indx].copy()
+        scale = np.sqrt(np.clip(np.diag(np.atleast_2d(result.cov())), 0, None))
+        start += 1e-3 * scale * rng.standard_normal(start.shape)
+
+        log_posterior = LogPosterior(
+            new_pars, new_datavector, likelihood=new_likelihood
+            )
+        runner = build_mcmc_runner(
+            sampler, [nwalkers, ndim, log_posterior, new_datavector, new_pars],
+            {}
+            )
+        runner.run(pool, nsteps=nsteps, start=start, vb=vb,
+                   close_pool=False, queue_size=queue_size)
+
+        samples = runner.sampler.get_chain(flat=True, discard=nsteps//2)
+
+        return ReweightResult(
+            samples, np.zeros(len(samples)), None, None, refreshed=True,
+            runner=runner
+            )
+
+    def run(self, new_pars=None, new_datavector=None, new_likelihood=None,
+            pool=None, min_ess_fraction=0.1, refresh_steps=200,
+            refresh_walkers=None, sampler='emcee', recompute_likelihood=None,
+            batch_size=None, seed=None, vb=False, queue_size=None):
+        '''
+        Reweight the chain to the new target, refreshing it w/ a short
+        MCMC only if the ESS fraction of the weights is below
+        min_ess_fraction. See reweight() & refresh()
+
+        returns: ReweightResult
+        '''
+
+        result = self.reweight(
+            new_pars=new_pars, new_datavector=new_datavector,
+            new_likelihood=new_likelihood, pool=pool,
+            recompute_likelihood=recompute_likelihood, batch_size=batch_size,
+            queue_size=queue_size
+            )
+
+        ess = result.ess
+        if vb is True:
+            print(f'Reweighted ESS: {ess:.1f} of {len(self.samples)} samples')
+
+        if ess >= min_ess_fraction * len(self.samples):
+            return result
+
+        if ess == 0:
+            raise ValueError('No sample has a finite weight under the new ' +\
+                             'target; cannot refresh from the chain!')
+
+        if vb is True:
+            print(f'ESS fraction below {min_ess_fraction}; refreshing w/ ' +\
+                  f'{refresh_steps} steps of {sampler}')
+
+        return self.refresh(
+            result, new_pars=new_pars, new_datavector=new_datavector,
+            new_likelihood=new_likelihood, pool=pool, nsteps=refresh_steps,
+            nwalkers=refresh_walkers, sampler=sampler, seed=seed, vb=vb,
+            queue_size=queue_size
+            )
+
+def main(args):
+    '''
+    For now, just used for testing the reweighting
+    '''
+
+    from copy import deepcopy
+    from astropy.units import Unit
+    import priors
+    import mocks
+
+    print('Testing the ESS')
+    assert np.isclose(compute_ess(np.zeros(100)), 100.)
+    assert np.isclose(compute_ess([0., -np.inf, -np.inf]), 1.)
+    assert compute_ess([-np.inf, -np.inf]) == 0.
+
+    true_pars = {
+        'g1': 0.025,
+        'g2': -0.0125,
+        'theta_int': np.pi / 6.,
+        'sini': 0.7,
+        'v0': 5.,
+        'vcirc': 200.,
+        'rscale': 3.,
+        }
+    meta = {
+        'units': {'v_unit': Unit('km/s'), 'r_unit': Unit('kpc')},
+        'priors': {
+            'g1': priors.GaussPrior(0., 0.1),
+            'g2': priors.GaussPrior(0., 0.1),
+            'theta_int': priors.UniformPrior(0., np.pi),
+            'sini': priors.UniformPrior(0., 1.),
+            'v0': priors.UniformPrior(0, 20),
+            'vcirc': priors.GaussPrior(200, 20),
+            'rscale': priors.UniformPrior(0, 10),
+            },
+        'intensity': {'type': 'inclined_exp', 'flux': 3.8e4, 'hlr': 3.5},
+        'velocity': {'model': 'centered'},
+        'run_options': {'native': True},
+        }
+    datacube_pars = {
+        'Nx': 12,
+        'Ny': 12,
+        'pix_scale': 0.5,
+        'true_flux': 3.8e4,
+        'true_hlr': 3.5,
+        'v_model': 'centered',
+        'v_unit': Unit('km/s'),
+        'r_unit': Unit('kpc'),
+        'z': 0.3,
+        'R': 5000.,
+        'sky_sigma': 0.5,
+        }
+
+    datacube, _, _ = mocks.setup_likelihood_test(true_pars, datacube_pars)
+    pars = Pars(list(true_pars.keys()), deepcopy(meta))
+
+    # a stand-in for a chain about the truth
+    np.random.seed(42)
+    theta0 = pars.pars2theta(true_pars)
+    sigmas = np.array([0.02, 0.02, 0.05, 0.05, 1., 10., 0.3])
+    samples = theta0 + sigmas*np.random.randn(200, len(theta0))
+    samples[:,3] = np.clip(samples[:,3], 0.01, 0.99)
+
+    reweighter = ImportanceReweighter(samples, pars, datacube)
+
+    print('Testing a prior-only reweight')
+    new_meta = deepcopy(meta)
+    new_meta['priors']['vcirc'] = priors.GaussPrior(210, 10)
+    new_pars = Pars(list(true_pars.keys()), new_meta)
+    result = reweighter.reweight(new_pars=new_pars)
+    assert result.loglike is None
+    vcirc = samples[:, pars.sampled.pars_order['vcirc']]
+    expected = new_meta['priors']['vcirc'](vcirc, log=True) - \
+        meta['priors']['vcirc'](vcirc, log=True)
+    assert np.allclose(result.log_weights - result.log_weights[0],
+                       expected - expected[0])
+    assert 0 < result.ess < len(samples)
+    assert result.mean()[5] > np.mean(vcirc)
+    assert result.resample(50, seed=1).shape == (50, len(theta0))
+
+    # a prior that excludes some samples
+    new_meta['priors']['sini'] = priors.UniformPrior(0., 0.7)
+    result = reweighter.reweight(
+        new_pars=Pars(list(true_pars.keys()), new_meta)
+        )
+    sini = samples[:, pars.sampled.pars_order['sini']]
+    assert np.all(result.weights[sini >= 0.7] == 0)
+
+    print('Testing a likelihood reweight in a pool')
+    # e.g. a re-estimated sky noise
+    new_datacube = deepcopy(datacube)
+    new_datacube.set_weights(1. / (1.2*datacube_pars['sky_sigma']))
+    with schwimmbad.MultiPool(processes=2) as pool:
+        result = reweighter.reweight(new_datavector=new_datacube, pool=pool,
+                                     batch_size=64, queue_size=2)
+    assert result.loglike is not None
+    old_loglike = reweighter.get_old_loglike()
+    assert np.allclose(result.log_weights, result.loglike - old_loglike)
+    # less the constant log det term of LogLikelihood
+    assert np.allclose(result.loglike + 0.5, (old_loglike + 0.5) / 1.2**2)
+
+    # an unchanged target has uniform weights
+    same = reweighter.reweight(recompute_likelihood=True)
+    assert np.allclose(same.log_weights, 0.)
+    assert np.isclose(same.ess, len(samples))
+
+    # the likelihood's cache in the meta doesn't force a recompute of a
+    # prior-only reweight
+    assert '_likelihood' in reweighter.pars.meta
+    new_meta = deepcopy(meta)
+    new_meta['priors']['vcirc'] = priors.GaussPrior(210, 10)
+    new_pars = Pars(list(true_pars.keys()), new_meta)
+    compute_loglike = reweighter._compute_loglike
+    def fail(*args, **kwargs):
+        raise AssertionError('A prior-only reweight recomputed the ' +\
+                             'likelihood!')
+    reweighter._compute_loglike = fail
+    result = reweighter.reweight(new_pars=new_pars)
+    reweighter._compute_loglike = compute_loglike
+    assert result.loglike is old_loglike
+
+    print('Testing a refresh')
+    new_meta = deepcopy(meta)
+    new_meta['priors']['vcirc'] = priors.GaussPrior(260, 2)
+    new_pars = Pars(list(true_pars.keys()), new_meta)
+    # w/ the default pool, which must not need OMP_NUM_THREADS
+    omp_threads = os.environ.pop('OMP_NUM_THREADS', None)
+    try:
+        result = reweighter.run(
+            new_pars=new_pars, min_ess_fraction=0.5, refresh_steps=4,
+            refresh_walkers=16, seed=3
+            )
+    finally:
+        if omp_threads is not None:
+            os.environ['OMP_NUM_THREADS'] = omp_threads
+    assert result.refreshed is True
+    assert result.samples.shape == (2*16, len(theta0))
+    assert np.isclose(result.ess, len(result.samples))
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
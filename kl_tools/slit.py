@@ -0,0 +1,314 @@
+import numpy as np
+import os
+from copy import deepcopy
+from argparse import ArgumentParser
+
+import utils
+from datavector import DataVector
+from cube import CubePars, setup_simple_bandpasses
+from transformation import transform_coords
+
+import ipdb
+
+'''
+This file defines a datavector for long-slit spectroscopy: a 2D
+position-velocity (PV) spectrum of shape (Nspec, Nslit), along with the
+slit geometry needed to forward model it.
+
+Instead of building a full model datacube and collapsing it through a
+slit mask (as in TNGsimulation.to_slit()), the slit likelihood evaluates
+the velocity and intensity models only at a fixed set of sample points
+along the slit. Across the slit width these are Gauss-Legendre nodes, so
+the integral over the width is a weighted sum with precomputed weights.
+See likelihood.SlitLikelihood
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--show', action='store_true', default=False,
+                    help='Set to show test plots')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+# ratio of half-light radius to scale radius for an exponential profile
+EXP_HLR_FACTOR = 1.6783469900166605
+
+class SlitGeometry(object):
+    '''
+    The geometry & spatial sampling of a slit on the obs plane
+    '''
+
+    def __init__(self, angle, width, Nslit, pix_scale, offset=(0., 0.),
+                 Nquad=4):
+        '''
+        angle: float
+            The slit position angle, in radians, counter-clockwise from
+            the obs plane x-axis (array axis 0)
+        width: float
+            The slit width, in arcsec
+        Nslit: int
+            The number of spatial samples (pixels) along the slit
+        pix_scale: float
+            The spatial sampling along the slit, in arcsec. This also sets
+            the pixel unit of the model positions (e.g. x0, y0, rscale)
+        offset: tuple
+            The (x,y) position of the slit center relative to the obs
+            plane origin, in arcsec
+        Nquad: int
+            The number of quadrature nodes across the slit width
+        '''
+
+        for name, val in {'angle': angle, 'width': width,
+                          'pix_scale': pix_scale}.items():
+            if not isinstance(val, (int, float)):
+                raise TypeError(f'{name} must be an int or float!')
+        for name, val in {'Nslit': Nslit, 'Nquad': Nquad}.items():
+            if not isinstance(val, int):
+                raise TypeError(f'{name} must be an int!')
+            if val < 1:
+                raise ValueError(f'{name} must be positive!')
+        if (width <= 0) or (pix_scale <= 0):
+            raise ValueError('width & pix_scale must be positive!')
+
+        self.angle = float(angle)
+        self.width = float(width)
+        self.Nslit = Nslit
+        self.pix_scale = float(pix_scale)
+        self.offset = tuple(float(o) for o in offset)
+        self.Nquad = Nquad
+
+        self._setup_samples()
+
+        return
+
+    def _setup_samples(self):
+        '''
+        Precompute the (Nslit, Nquad) sample positions (in pixels of size
+        pix_scale) and the area (in arcsec^2) each one represents
+        '''
+
+        ps = self.pix_scale
+
+        # along the slit, at pixel centers
+        t = (np.arange(self.Nslit) - (self.Nslit-1) / 2.) * ps
+
+        # across the slit, at Gauss-Legendre nodes
+        nodes, weights = np.polynomial.legendre.leggauss(self.Nquad)
+        u = nodes * self.width / 2.
+        w = weights * self.width / 2.
+
+        c, s = np.cos(self.angle), np.sin(self.angle)
+        T, U = np.meshgrid(t, u, indexing='ij')
+
+        x = self.offset[0] + c*T - s*U
+        y = self.offset[1] + s*T + c*U
+
+        self.x = np.ascontiguousarray(x / ps)
+        self.y = np.ascontiguousarray(y / ps)
+
+        self.area = np.ascontiguousarray(np.tile(w * ps, (self.Nslit, 1)))
+
+        return
+
+    def get_seeing_matrix(self, fwhm):
+        '''
+        A (Nslit, Nslit) matrix that convolves a profile along the slit by
+        a 1D Gaussian seeing kernel, normalized to conserve flux
+
+        fwhm: float
+            The seeing FWHM, in arcsec
+        '''
+
+        sigma = fwhm / (2. * np.sqrt(2. * np.log(2.))) / self.pix_scale
+
+        i = np.arange(self.Nslit)
+        d = i[:,np.newaxis] - i[np.newaxis,:]
+        kernel = np.exp(-0.5 * (d / sigma)**2)
+
+        return kernel / np.sum(kernel, axis=0)
+
+class SlitSpectrum(DataVector):
+    '''
+    A position-velocity slit spectrum
+
+    The metadata (pixel scale, bandpasses, and emission lines) is stored
+    in a CubePars, in the same way as for a DataCube
+    '''
+
+    def __init__(self, data, geometry, pars, weights=None, seeing=None):
+        '''
+        data: np.ndarray
+            The (Nspec, Nslit) PV spectrum
+        geometry: SlitGeometry
+            The slit geometry
+        pars: dict, CubePars
+            The spectral metadata; see CubePars. The pix_scale should
+            match the slit sampling
+        weights: float, np.ndarray
+            The inverse-sigma weights of the PV spectrum. Defaults to 1
+        seeing: float
+            The FWHM (in arcsec) of the seeing along the slit. If None,
+            no seeing is applied
+        '''
+
+        utils.check_type(geometry, 'geometry', SlitGeometry)
+
+        if not isinstance(pars, CubePars):
+            pars = CubePars(pars)
+
+        if len(data.shape) != 2:
+            raise ValueError('Slit data must be 2D (Nspec, Nslit)!')
+
+        if data.shape[1] != geometry.Nslit:
+            raise ValueError(f'Slit data has {data.shape[1]} spatial ' +\
+                             f'samples, but the geometry has {geometry.Nslit}!')
+
+        if data.shape[0] != len(pars.lambdas):
+            raise ValueError('The first data dimension must match the ' +\
+                             'number of bandpasses!')
+
+        self.data = data
+        self.geometry = geometry
+        self.pars = pars
+        self.shape = data.shape
+        self.Nspec, self.Nslit = data.shape
+        self.pix_scale = pars['pix_scale']
+
+        if weights is None:
+            weights = 1.
+        if isinstance(weights, (int, float)):
+            weights = weights * np.ones(self.shape)
+        elif weights.shape != self.shape:
+            raise ValueError('weights must have the same shape as data!')
+        self.weights = weights
+
+        self.seeing = seeing
+        if seeing is not None:
+            self.seeing_matrix = geometry.get_seeing_matrix(seeing)
+        else:
+            self.seeing_matrix = None
+
+        return
+
+    @property
+    def lambdas(self):
+        return self.pars.lambdas
+
+    @property
+    def lambda_unit(self):
+        return self.pars._lambda_unit
+
+    def get_sed(self, line_index=None, line_pars_update=None):
+        '''
+        Get emission line SED, or modify if needed. Same as
+        DataCube.get_sed()
+        '''
+
+        try:
+            if line_index is None:
+                if len(self.pars['emission_lines']) == 1:
+                    line_index = 0
+                else:
+                    raise ValueError('Must pass a line_index if more than ' +\
+                                     'one line are stored!')
+
+            line = self.pars['emission_lines'][line_index]
+            if line_pars_update is None:
+                sed = line.sed
+            else:
+                line_pars = deepcopy(line.line_pars)
+                line_pars.update(line_pars_update)
+                sed = line._build_sed(line_pars, line.sed_pars)
+
+            return sed
+
+        except KeyError:
+            raise AttributeError('Emission lines never set for slit!')
+
+    def stack(self):
+        '''
+        The spatial profile along the slit
+        '''
+        return np.sum(self.data, axis=0)
+
+def eval_inclined_exp(theta_pars, x, y, flux, hlr, pix_scale):
+    '''
+    Evaluate the surface brightness (per arcsec^2) of an infinitely thin
+    inclined exponential disk at obs plane positions (x,y), using the
+    same plane transformations as the velocity map. The lensing
+    magnification is divided out, so that the total flux is flux as for
+    the galsim profile in intensity.InclinedExponential
+
+    theta_pars: dict
+        The sampled (transformation) pars
+    x, y: np.ndarray
+        The obs plane positions, in pixels
+    flux: float
+        The total flux
+    hlr: float
+        The face-on half-light radius, in arcsec
+    pix_scale: float
+        The pixel scale of (x,y), in arcsec
+    '''
+
+    xd, yd = transform_coords(x, y, 'obs', 'disk', theta_pars)
+
+    r = pix_scale * np.sqrt(xd**2 + yd**2)
+    rd = hlr / EXP_HLR_FACTOR
+
+    cosi = np.sqrt(1. - theta_pars['sini']**2)
+    det = 1. - theta_pars['g1']**2 - theta_pars['g2']**2
+
+    return det * flux / (2.*np.pi * rd**2 * cosi) * np.exp(-r / rd)
+
+def main(args):
+    '''
+    For now, just used for testing the slit geometry
+    '''
+
+    print('Testing slit sample positions & areas')
+    geom = SlitGeometry(0., 1., 21, 0.25, Nquad=5)
+    assert geom.x.shape == (21, 5)
+    assert np.allclose(geom.x[:,0], np.arange(21) - 10)
+    assert np.allclose(np.sum(geom.area, axis=1), 1. * 0.25)
+    assert np.all(np.abs(geom.y * 0.25) <= 0.5)
+
+    print('Testing rotated & offset slit')
+    geom = SlitGeometry(np.pi/2, 0.5, 11, 0.5, offset=(1., -1.))
+    assert np.allclose(np.mean(geom.x, axis=1), 2.)
+    assert np.allclose(np.mean(geom.y, axis=1), np.arange(11) - 5 - 2)
+
+    print('Testing seeing matrix conserves flux')
+    S = geom.get_seeing_matrix(1.)
+    profile = np.zeros(11)
+    profile[5] = 1.
+    assert np.isclose(np.sum(S.dot(profile)), 1.)
+
+    print('Testing inclined exponential flux integral')
+    pars = {'g1': 0.05, 'g2': -0.1, 'theta_int': 0.3, 'sini': 0.5}
+    X, Y = utils.build_map_grid(201, 201)
+    ps = 0.1
+    im = eval_inclined_exp(pars, X, Y, 10., 1., ps)
+    assert np.isclose(np.sum(im) * ps**2, 10., rtol=1e-2)
+
+    print('Testing SlitSpectrum')
+    bandpasses = setup_simple_bandpasses(500, 510, 1)
+    geom = SlitGeometry(0., 1., 21, 0.25)
+    slit = SlitSpectrum(np.zeros((10, 21)), geom,
+                        {'pix_scale': 0.25, 'bandpasses': bandpasses},
+                        seeing=0.8)
+    assert slit.stack().shape == (21,)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
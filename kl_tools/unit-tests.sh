@@ -1,7 +1,28 @@
+python numba_isa.py --test
+python chromatic_psf.py --test
 python cube.py --test
+python multiexposure.py --test
+python grism.py --test
+python slit.py --test
+python broadband.py --test
 python muse.py --test
 python velocity.py --test
+python dispersion.py --test
+python continuum.py --test
 python basis.py --test
+python numba_basis.py --test
+python gaussmix.py --test
 python intensity.py --test
+python pipeline.py --test
+python warmstart.py --test
 python likelihood.py --test
+python numba_likelihood.py --test
+python numba_ensemble.py --test
+python chainstore.py --test
+python predictive.py --test
+python hierarchical.py --test
+python joint.py --test
+python workerpool.py --test
+python bench_samplers.py --test
+python reweight.py --test
 python tngsim.py
@@ -107,6 +107,13 @@ class VelocityModel(object):
 
         return pars
 
+    def get_eval_kwargs(self):
+        '''
+        Any extra kwargs a model needs passed down to the VelocityMap
+        plane evaluations, e.g. the LOSKernel of a thick disk
+        '''
+        return {}
+
 class OffsetVelocityModel(VelocityModel):
     '''
     Same as default velocity model, but w/ a 2D centroid offset
@@ -132,6 +139,168 @@ class OffsetVelocityModel(VelocityModel):
 
         return pars
 
+class ThickDiskVelocityModel(VelocityModel):
+    '''
+    Same as default velocity model, but for a disk w/ an exponential
+    vertical emission profile of scale height hz (in the same unit as
+    rscale). The observed velocity is the emission-weighted mean along
+    each line of sight; see LOSKernel
+
+    If the optional rd is set (also in the unit of rscale), the emission
+    also falls off radially as exp(-r/rd), & each point along the line
+    of sight is weighted by it as well. Otherwise only the vertical
+    profile weights the mean
+    '''
+
+    name = 'thick'
+    _model_params = ['v0', 'vcirc', 'rscale', 'sini', 'hz',
+                     'theta_int', 'g1', 'g2', 'r_unit', 'v_unit']
+
+    _ignore_params = ['beta', 'flux', 'Nlos', 'rd']
+
+    def __init__(self, model_pars):
+        super(ThickDiskVelocityModel, self).__init__(model_pars)
+
+        if 'Nlos' in model_pars:
+            Nlos = model_pars['Nlos']
+        else:
+            Nlos = 4
+
+        self.los = LOSKernel(Nlos)
+
+        return
+
+    def get_eval_kwargs(self):
+        return {'los': self.los}
+
+class HarmonicVelocityModel(VelocityModel):
+    '''
+    Same as default velocity model, but w/ a set of azimuthal harmonics
+    of the disk plane angle phi added to the circular rotation:
+
+    v = v0 + sini * [vcirc * f(r) * cos(phi) +
+                     f(r) * sum_m (vc_m * cos(m*phi) + vs_m * sin(m*phi))]
+
+    where f(r) = (2/pi) * arctan(r / rscale) is the shared radial profile.
+    The orders are set by the 'harmonics' model par (e.g. [1, 2, 3]). For
+    m=1 only the sin term (vs1, e.g. radial inflow) is added, as the cos
+    term is the rotation. All amplitudes are in v_unit
+    '''
+
+    name = 'harmonic'
+    _base_params = ['v0', 'vcirc', 'rscale', 'sini',
+                    'theta_int', 'g1', 'g2', 'r_unit', 'v_unit']
+
+    _ignore_params = ['beta', 'flux', 'harmonics']
+
+    def __init__(self, model_pars):
+        if 'harmonics' not in model_pars:
+            raise AttributeError('harmonics must be in passed parameters ' +\
+                                 'to instantiate harmonic velocity model!')
+
+        self.harmonics = get_harmonic_orders(model_pars['harmonics'])
+        self.harmonic_pars = get_harmonic_pars(self.harmonics)
+
+        self._model_params = self._base_params + \
+            [name for _, name in self.harmonic_pars]
+
+        super(HarmonicVelocityModel, self).__init__(model_pars)
+
+        return
+
+    def get_eval_kwargs(self):
+        return {'harmonics': (self.harmonics, self.harmonic_pars)}
+
+def get_harmonic_orders(harmonics):
+    '''
+    Check & sort a list of harmonic orders
+    '''
+
+    orders = sorted(set(harmonics))
+
+    if len(orders) != len(harmonics):
+        raise ValueError('harmonics can not have repeated orders!')
+
+    for m in orders:
+        if not isinstance(m, (int, np.integer)):
+            raise TypeError('harmonic orders must be ints!')
+        if m < 1:
+            raise ValueError('harmonic orders must be positive!')
+
+    return [int(m) for m in orders]
+
+def get_harmonic_pars(harmonics):
+    '''
+    The amplitude par names of a set of (sorted) harmonic orders, along
+    with their index in the amplitude array of the compiled kernel, which
+    stores (vc_m, vs_m) for every m from 1 to the max order in turn
+
+    returns: list of (index, name) tuples
+    '''
+
+    pars = []
+    for m in harmonics:
+        # the m=1 cos term is the circular rotation
+        if m > 1:
+            pars.append((2*(m-1), f'vc{m}'))
+        pars.append((2*(m-1)+1, f'vs{m}'))
+
+    return pars
+
+class LOSKernel(object):
+    '''
+    Quadrature of the line of sight through a thick disk
+
+    A line of sight through the gal plane position (x,y) crosses the
+    disk midplane at (x, y/cosi), and reaches height z at a disk plane
+    position shifted along y by z*tan(i). For an exponential vertical
+    profile the emission-weighted average along it is a Gauss-Laguerre
+    sum over heights z = +/- hz * t_k, so for a given inclination the
+    kernel is just the 2*Nlos shifts & weights, which are shared by
+    every pixel
+
+    For a radial profile as well, each node's weight is also scaled by
+    the surface brightness at its shifted position, & the weights of
+    each pixel are renormalized
+    '''
+
+    def __init__(self, Nlos=4):
+        '''
+        Nlos: int
+            The number of Gauss-Laguerre nodes on each side of the
+            midplane
+        '''
+
+        if not isinstance(Nlos, int):
+            raise TypeError('Nlos must be an int!')
+        if Nlos < 1:
+            raise ValueError('Nlos must be positive!')
+
+        self.Nlos = Nlos
+
+        t, w = np.polynomial.laguerre.laggauss(Nlos)
+
+        # above & below the midplane; weights sum to 1
+        self.nodes = np.concatenate([t, -t])
+        self.weights = np.concatenate([w, w]) / 2.
+
+        return
+
+    def get_offsets(self, sini, hz):
+        '''
+        The disk plane y shifts of the quadrature nodes for a given
+        inclination, along with their weights
+
+        sini: float
+            sin(inclination)
+        hz: float
+            The disk scale height
+        '''
+
+        tan_i = sini / np.sqrt(1. - sini**2)
+
+        return hz * tan_i * self.nodes, self.weights
+
 class VelocityMap(TransformableImage):
     '''
     Base class for a velocity map
@@ -223,15 +392,22 @@ class VelocityMap(TransformableImage):
             Set to True to use numba versions of transformations
         '''
 
+        # e.g. the line of sight quadrature of a thick disk
+        extra_kwargs = self.model.get_eval_kwargs()
+
         # Need to use array for numba
         if use_numba is True:
+            if len(extra_kwargs) > 0:
+                raise ValueError(f'The {self.model.name} velocity model is ' +\
+                                 'not implemented for the numba ' +\
+                                 'transformations!')
             pars = self.model.pars_arr
         else:
             pars = self.model.pars
 
         func = self._get_plane_eval_func(plane, use_numba=use_numba)
 
-        return func(pars, x, y, speed=speed, offset=offset)
+        return func(pars, x, y, speed=speed, offset=offset, **extra_kwargs)
 
     @classmethod
     def _eval_in_obs_plane(cls, pars, x, y, **kwargs):
@@ -287,13 +463,52 @@ class VelocityMap(TransformableImage):
         if speed is True:
             return speed_map
 
-        else:
-            # euler angles which handle the vector aspect of velocity transform
-            sini = pars['sini']
+        # euler angles which handle the vector aspect of velocity transform
+        sini = pars['sini']
+
+        harmonics = kwargs.get('harmonics', None)
+        if harmonics is not None:
+            phi = np.arctan2(yp, xp)
+            r = np.sqrt(xp**2 + yp**2)
+            profile = (2. / np.pi) * np.arctan(r / pars['rscale'])
+
+            vmap = speed_map * np.cos(phi)
+            orders, harmonic_pars = harmonics
+            for indx, name in harmonic_pars:
+                m = indx // 2 + 1
+                if indx % 2 == 0:
+                    vmap += pars[name] * profile * np.cos(m*phi)
+                else:
+                    vmap += pars[name] * profile * np.sin(m*phi)
+
+            return sini * vmap
+
+        los = kwargs.get('los', None)
+        if los is None:
             phi = np.arctan2(yp, xp)
 
             return sini * np.cos(phi) * speed_map
 
+        # thick disk; average over the line of sight
+        dy, weights = los.get_offsets(sini, pars['hz'])
+        rd = pars.get('rd', None)
+        r0 = np.sqrt(xp**2 + yp**2)
+
+        vmap = np.zeros(np.shape(xp))
+        wsum = np.zeros(np.shape(xp))
+        for dyk, wk in zip(dy, weights):
+            yk = yp + dyk
+            speed_k = cls._eval_in_disk_plane(pars, xp, yk, **kwargs)
+            phi = np.arctan2(yk, xp)
+            if rd is not None:
+                # the radial surface brightness, relative to the midplane
+                rk = np.sqrt(xp**2 + yk**2)
+                wk = wk * np.exp(-(rk - r0) / rd)
+            vmap += wk * sini * np.cos(phi) * speed_k
+            wsum += wk
+
+        return vmap / wsum
+
     @classmethod
     def _eval_in_disk_plane(cls, pars, x, y, **kwargs):
         '''
@@ -551,7 +766,9 @@ def get_model_types():
 MODEL_TYPES = {
     'default': VelocityModel,
     'centered': VelocityModel,
-    'offset': OffsetVelocityModel
+    'offset': OffsetVelocityModel,
+    'thick': ThickDiskVelocityModel,
+    'harmonic': HarmonicVelocityModel,
     }
 
 def build_model(name, pars, logger=None):
@@ -675,6 +892,92 @@ def main(args):
         plot_kwargs=plot_kwargs, show=show, outfile=outfile, center=center,
         )
 
+    print('Testing thick disk model')
+    model_pars = {
+        'g1': 0.1,
+        'g2': -0.075,
+        'theta_int': np.pi / 3,
+        'sini': 0.8,
+        'v0': 10.,
+        'vcirc': 200,
+        'rscale': 5,
+        'hz': 1e-6,
+        'r_unit': units.Unit('pixel'),
+        'v_unit': units.km / units.s,
+    }
+    X, Y = utils.build_map_grid(30, 30)
+    thin = VelocityMap('centered', model_pars)('obs', X, Y)
+
+    # a thin thick disk is a thin disk
+    thick = VelocityMap('thick', model_pars)
+    assert np.allclose(thick('obs', X, Y), thin)
+
+    # thickness lowers the observed rotation
+    model_pars['hz'] = 2.
+    thick = VelocityMap('thick', model_pars)
+    V = thick('obs', X, Y)
+    assert np.max(np.abs(V - 10.)) < np.max(np.abs(thin - 10.))
+
+    # a radial emission profile weights the inner side of each line of
+    # sight, & a very long one is no weighting at all
+    model_pars['rd'] = 1e10
+    assert np.allclose(VelocityMap('thick', model_pars)('obs', X, Y), V)
+    model_pars['rd'] = 3.
+    V_rd = VelocityMap('thick', model_pars)('obs', X, Y)
+    assert not np.allclose(V_rd, V)
+
+    print('Testing compiled thick disk kernel')
+    los = thick.model.los
+    dy = np.empty(len(los.nodes))
+    out = np.empty(X.shape)
+    std = np.empty(X.shape)
+    for rd, expected in [(0., V), (3., V_rd)]:
+        pars = np.array([model_pars[name] for name in
+                         ['g1', 'g2', 'theta_int', 'sini', 'v0', 'vcirc',
+                          'rscale', 'hz']] + [rd])
+        numba_transform._eval_thick_vmap_in_obs_plane(
+            pars, X, Y, los.nodes, los.weights, dy, out, std, True
+            )
+        assert np.allclose(out, expected)
+        assert np.all(std >= 0.)
+    del model_pars['rd']
+
+    print('Testing harmonic model')
+    model_pars['harmonics'] = [1, 2, 3]
+    for name in ['vs1', 'vc2', 'vs2', 'vc3', 'vs3']:
+        model_pars[name] = 0.
+    harmonic = VelocityMap('harmonic', model_pars)
+    assert np.allclose(harmonic('obs', X, Y), thin)
+
+    model_pars.update({'vs1': 10., 'vc2': -20., 'vs2': 5., 'vs3': 15.})
+    harmonic = VelocityMap('harmonic', model_pars)
+    V = harmonic('obs', X, Y)
+    assert not np.allclose(V, thin)
+
+    print('Testing compiled harmonic kernel')
+    pars = np.array([model_pars[name] for name in
+                     ['g1', 'g2', 'theta_int', 'sini', 'v0', 'vcirc',
+                      'rscale']] + [0., 0.])
+    amps = np.zeros(2*max(harmonic.model.harmonics))
+    work = np.empty((2, X.shape[1]))
+    for indx, name in harmonic.model.harmonic_pars:
+        amps[indx] = model_pars[name]
+    numba_transform._eval_harmonic_vmap_in_obs_plane(
+        pars, X, Y, False, amps, work, out
+        )
+    assert np.allclose(out, V)
+
+    # the orders w/o an amplitude par are 0
+    model_pars['harmonics'] = [3]
+    sparse = VelocityMap('harmonic', model_pars)
+    amps = np.zeros(6)
+    for indx, name in sparse.model.harmonic_pars:
+        amps[indx] = model_pars[name]
+    numba_transform._eval_harmonic_vmap_in_obs_plane(
+        pars, X, Y, False, amps, work, out
+        )
+    assert np.allclose(out, sparse('obs', X, Y))
+
     return 0
 
 if __name__ == '__main__':
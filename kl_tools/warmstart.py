@@ -0,0 +1,407 @@
+import numpy as np
+import os
+import pickle
+from argparse import ArgumentParser
+
+import utils
+import priors
+
+import ipdb
+
+'''
+This file contains a library of trained pocoMC normalizing flows, so
+that a run on a new object can warm-start from the flow (and see the
+final particles) of a run on a similar one. See KLensPocoRunner
+
+Objects are matched on their sampled parameters & prior ranges, along
+with simple summaries of the datacube: its S/N and the size of its
+stacked image. A warm-start only changes the initial weights of the
+flow preconditioner, not the posterior that is sampled.
+
+Optionally, runs can sample in a standardized space defined by the
+priors, u = (theta - cen) / width. As the map is affine, the posterior
+is unchanged up to a constant, but flows trained for objects with
+different prior ranges can then be shared
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+def get_prior_range(prior, nsigma=5.):
+    '''
+    A finite (lower, upper) range for a prior
+
+    prior: priors.Prior
+        The prior
+    nsigma: float
+        The number of sigmas used for Gaussian priors w/o a clip
+    '''
+
+    if isinstance(prior, priors.UniformPrior):
+        return (float(prior.left), float(prior.right))
+
+    elif isinstance(prior, priors.GaussPrior):
+        if prior.clip_sigmas is not None:
+            nsigma = prior.clip_sigmas
+        lower = prior.mu - nsigma*prior.sigma
+        upper = prior.mu + nsigma*prior.sigma
+
+        if prior.zero_boundary == 'positive':
+            lower = max(lower, 0.)
+        elif prior.zero_boundary == 'negative':
+            upper = min(upper, 0.)
+
+        return (float(lower), float(upper))
+
+    else:
+        raise TypeError(f'No range defined for a prior of type ' +\
+                        f'{type(prior)}!')
+
+def get_prior_ranges(pars):
+    '''
+    The prior range of each sampled parameter, in sampled order
+
+    pars: parameters.Pars
+        The sampled & meta pars
+
+    returns: np.ndarray
+        The (Ndim, 2) prior ranges
+    '''
+
+    pars_order = pars.sampled.pars_order
+    meta_priors = pars.meta['priors']
+
+    ranges = np.empty((len(pars_order), 2))
+    for name, indx in pars_order.items():
+        ranges[indx] = get_prior_range(meta_priors[name])
+
+    return ranges
+
+def get_datacube_features(datacube):
+    '''
+    The summaries of a datacube used to match similar objects
+
+    datacube: DataCube
+        The datacube datavector
+
+    returns: dict
+        snr: The S/N of the cube, given its weights
+        size: The flux-weighted rms radius of the stacked image, in
+              arcsec
+    '''
+
+    snr = np.sqrt(np.sum((datacube.data * datacube.weights)**2))
+
+    image = np.clip(datacube.stack(), 0., None)
+    X, Y = utils.build_map_grid(datacube.Nx, datacube.Ny)
+    flux = np.sum(image)
+    if flux > 0:
+        size = np.sqrt(np.sum(image * (X**2 + Y**2)) / flux)
+    else:
+        size = 0.
+    size *= datacube.pix_scale
+
+    return {'snr': float(snr), 'size': float(size)}
+
+class PriorStandardizer(object):
+    '''
+    The affine map u = (theta - loc) / scale, w/ loc & scale set by the
+    centers & widths of the prior ranges
+    '''
+
+    def __init__(self, loc, scale):
+        '''
+        loc: np.ndarray
+            The (Ndim,) center of each parameter
+        scale: np.ndarray
+            The (Ndim,) width of each parameter
+        '''
+
+        loc = np.array(loc, dtype=float)
+        scale = np.array(scale, dtype=float)
+
+        if loc.shape != scale.shape:
+            raise ValueError('loc & scale must have the same shape!')
+        if np.any(scale <= 0):
+            raise ValueError('scale must be positive!')
+
+        self.loc = loc
+        self.scale = scale
+
+        return
+
+    @classmethod
+    def from_pars(cls, pars):
+        '''
+        pars: parameters.Pars
+            The sampled & meta pars
+        '''
+
+        ranges = get_prior_ranges(pars)
+
+        return cls(np.mean(ranges, axis=1), ranges[:,1] - ranges[:,0])
+
+    def forward(self, theta):
+        return (np.asarray(theta) - self.loc) / self.scale
+
+    def inverse(self, u):
+        return self.loc + np.asarray(u) * self.scale
+
+class StandardizedFunction(object):
+    '''
+    A log probability of theta, evaluated at the standardized u. As the
+    map is affine, its Jacobian is a constant & is ignored
+
+    Defined as a class so that it can be pickled for the pools
+    '''
+
+    def __init__(self, func, standardizer):
+        '''
+        func: callable
+            The log probability function of theta
+        standardizer: PriorStandardizer
+            The map from theta to u
+        '''
+
+        self.func = func
+        self.standardizer = standardizer
+
+        return
+
+    def __call__(self, u, *args, **kwargs):
+        return self.func(self.standardizer.inverse(u), *args, **kwargs)
+
+class FlowLibrary(object):
+    '''
+    A directory of trained flows. Each entry is a pickle w/ the flow
+    weights, the final particles & what is needed to match it; an index
+    of the matching info is kept so that entries are only loaded when
+    used
+    '''
+
+    _index_file = 'index.pkl'
+
+    def __init__(self, directory):
+        '''
+        directory: str
+            The library directory. Is created if it doesn't exist
+        '''
+
+        utils.make_dir(directory)
+        self.directory = directory
+
+        index_file = os.path.join(directory, self._index_file)
+        if os.path.exists(index_file):
+            with open(index_file, 'rb') as f:
+                self.index = pickle.load(f)
+        else:
+            self.index = {}
+
+        return
+
+    def __len__(self):
+        return len(self.index)
+
+    def _entry_file(self, name):
+        return os.path.join(self.directory, f'{name}.pkl')
+
+    def save(self, name, flow_state, particles, pars_names, prior_ranges,
+             features, standardizer=None, overwrite=False):
+        '''
+        name: str
+            The entry name, e.g. an object ID
+        flow_state: dict
+            The state_dict() of the trained flow
+        particles: np.ndarray
+            The (Nparticles, Ndim) final particles, in theta
+        pars_names: list
+            The sampled parameter names, in sampled order
+        prior_ranges: np.ndarray
+            The (Ndim, 2) prior ranges; see get_prior_ranges()
+        features: dict
+            See get_datacube_features()
+        standardizer: PriorStandardizer
+            The standardizing transform the flow was trained with, if any
+        overwrite: bool
+            Set to replace an existing entry
+        '''
+
+        if (name in self.index) and (overwrite is False):
+            raise ValueError(f'{name} is already in the flow library! ' +\
+                             'Set overwrite=True to replace it')
+
+        particles = np.asarray(particles)
+        if particles.shape[1] != len(pars_names):
+            raise ValueError('particles must have one column per sampled ' +\
+                             'parameter!')
+
+        info = {
+            'pars_names': list(pars_names),
+            'prior_ranges': np.array(prior_ranges, dtype=float),
+            'features': dict(features),
+            'standardized': standardizer is not None,
+        }
+
+        entry = dict(info)
+        entry['flow_state'] = flow_state
+        entry['particles'] = particles
+        entry['standardizer'] = standardizer
+
+        with open(self._entry_file(name), 'wb') as f:
+            pickle.dump(entry, f)
+
+        self.index[name] = info
+        with open(os.path.join(self.directory, self._index_file), 'wb') as f:
+            pickle.dump(self.index, f)
+
+        return
+
+    def load(self, name):
+        '''
+        name: str
+            The entry name
+
+        returns: dict
+        '''
+
+        if name not in self.index:
+            raise KeyError(f'{name} is not in the flow library!')
+
+        with open(self._entry_file(name), 'rb') as f:
+            entry = pickle.load(f)
+
+        return entry
+
+    def match(self, pars_names, prior_ranges, features, standardized=False,
+              range_tol=0.1, max_distance=np.log(2.)):
+        '''
+        Find the most similar entry for a new object
+
+        pars_names: list
+            The sampled parameter names, in sampled order. Must match
+        prior_ranges: np.ndarray
+            The (Ndim, 2) prior ranges. Unless standardized, the bounds
+            must each match to within range_tol of the prior width
+        features: dict
+            See get_datacube_features()
+        standardized: bool
+            Whether the new run samples in the standardized space. Must
+            match the entry
+        range_tol: float
+            The allowed prior range mismatch, as a fraction of the width
+        max_distance: float
+            The largest allowed distance, summed over the log ratios of
+            the features
+
+        returns: str, None
+            The name of the closest entry, or None if no entry matches
+        '''
+
+        prior_ranges = np.asarray(prior_ranges, dtype=float)
+        width = prior_ranges[:,1] - prior_ranges[:,0]
+
+        best, best_distance = None, np.inf
+        for name, info in self.index.items():
+            if info['pars_names'] != list(pars_names):
+                continue
+            if info['standardized'] != standardized:
+                continue
+            if standardized is False:
+                diff = np.abs(info['prior_ranges'] - prior_ranges)
+                if np.any(diff > range_tol*width[:,None]):
+                    continue
+
+            distance = 0.
+            for key, val in features.items():
+                ref = info['features'].get(key)
+                if (ref is None) or (ref <= 0) or (val <= 0):
+                    distance = np.inf
+                    break
+                distance += abs(np.log(val / ref))
+
+            if (distance <= max_distance) and (distance < best_distance):
+                best, best_distance = name, distance
+
+        return best
+
+def main(args):
+    '''
+    For now, just used for testing the library
+    '''
+
+    import tempfile
+    from parameters import Pars
+
+    meta = {
+        'priors': {
+            'g1': priors.GaussPrior(0., 0.1, clip_sigmas=2),
+            'sini': priors.UniformPrior(0., 1.),
+            'vcirc': priors.GaussPrior(200, 20, zero_boundary='positive'),
+            }
+        }
+    pars = Pars(['g1', 'sini', 'vcirc'], meta)
+
+    print('Testing prior ranges & standardizer')
+    ranges = get_prior_ranges(pars)
+    assert np.allclose(ranges, [[-0.2, 0.2], [0., 1.], [100., 300.]])
+    standardizer = PriorStandardizer.from_pars(pars)
+    theta = np.array([[0.01, 0.7, 210.], [-0.1, 0.2, 150.]])
+    u = standardizer.forward(theta)
+    assert np.all(np.abs(u) <= 0.5)
+    assert np.allclose(standardizer.inverse(u), theta)
+    func = StandardizedFunction(lambda x, a: np.sum(x) + a, standardizer)
+    assert np.isclose(func(u[0], 1.), np.sum(theta[0]) + 1.)
+
+    print('Testing library save, match & load')
+    directory = tempfile.mkdtemp()
+    library = FlowLibrary(directory)
+    names = list(pars.sampled.pars_order.keys())
+    flow_state = {'weight': np.random.randn(4, 4)}
+    library.save('obj-1', flow_state, theta, names, ranges,
+                 {'snr': 50., 'size': 1.})
+    library.save('obj-2', flow_state, theta, names, ranges,
+                 {'snr': 200., 'size': 1.2})
+    library.save('obj-3', flow_state, theta, names, ranges,
+                 {'snr': 60., 'size': 1.}, standardizer=standardizer)
+
+    try:
+        library.save('obj-1', flow_state, theta, names, ranges, {})
+        raise AssertionError('Overwriting an entry was not caught!')
+    except ValueError:
+        pass
+
+    # reopened from disk
+    library = FlowLibrary(directory)
+    assert len(library) == 3
+    assert library.match(names, ranges, {'snr': 70., 'size': 1.1}) == 'obj-1'
+    assert library.match(names, ranges, {'snr': 150., 'size': 1.1}) == 'obj-2'
+    assert library.match(names, ranges, {'snr': 1e4, 'size': 1.}) is None
+    assert library.match(names[::-1], ranges, {'snr': 50., 'size': 1.}) is None
+
+    # different prior ranges only match when standardized
+    wide = ranges.copy()
+    wide[2] = [0., 400.]
+    assert library.match(names, wide, {'snr': 50., 'size': 1.}) is None
+    assert library.match(names, wide, {'snr': 50., 'size': 1.},
+                         standardized=True) == 'obj-3'
+
+    entry = library.load('obj-3')
+    assert np.allclose(entry['flow_state']['weight'], flow_state['weight'])
+    assert np.allclose(entry['particles'], theta)
+    assert np.allclose(entry['standardizer'].loc, standardizer.loc)
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
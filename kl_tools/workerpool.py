@@ -0,0 +1,934 @@
+# This is to ensure that numpy doesn't have
+# OpenMP optimizations clobber our own multiprocessing
+import os
+os.environ['MKL_NUM_THREADS'] = '1'
+os.environ['NUMEXPR_NUM_THREADS'] = '1'
+os.environ['OMP_NUM_THREADS'] = '1'
+
+import numpy as np
+import pickle
+import queue
+import secrets
+import tempfile
+import threading
+import traceback
+import uuid
+import multiprocessing as mp
+from multiprocessing.connection import Listener, Client
+from time import time
+from argparse import ArgumentParser
+from astropy.units import Unit
+import schwimmbad
+
+import priors
+import mocks
+from parameters import Pars
+from likelihood import LogPosterior
+from mcmc import build_mcmc_runner, ENSEMBLE_RUNNERS
+
+import ipdb
+
+'''
+This file contains a long-lived pool of warm worker processes, so that
+short fits don't each pay for worker startup: module imports, loading
+the compiled kernels & unpickling the datacube.
+
+A WarmPool can be used in-process, or served over a local socket w/
+serve() & reached from other processes w/ a WorkerClient. Jobs refer
+to a posterior (datacube, pars & likelihood type) by the handle
+returned when it is registered. Each worker unpickles & sets up a
+registered posterior only once, the first time it is sent a job for it.
+
+There are two kinds of jobs:
+    - likelihood batches: the log likelihood or posterior of a set of
+      samples, or of one sample for each of a set of posteriors, split
+      across the idle workers
+    - fits: a full run of one of the mcmc.py runners on a single worker,
+      so that several fits can run at once
+
+Run as a daemon w/
+    python workerpool.py -nworkers 8 -address /tmp/kl_tools-pool.sock
+
+Jobs are pickled, so a client that can authenticate can run arbitrary
+code in the pool. Unless a -keyfile is passed, the daemon makes a random
+key & writes it to {address}.key, readable only by its owner, which is
+where WorkerClient looks for it by default. The socket itself is also
+only accessible by its owner
+'''
+
+parser = ArgumentParser()
+
+parser.add_argument('-nworkers', type=int, default=None,
+                    help='Number of worker processes. Defaults to the ' +\
+                    'number of cores')
+parser.add_argument('-address', type=str, default=None,
+                    help='Unix socket path to serve on')
+parser.add_argument('-keyfile', type=str, default=None,
+                    help='File w/ the key clients must use. Must only be ' +\
+                    'accessible by its owner. Defaults to a new random ' +\
+                    'key written to {address}.key')
+parser.add_argument('--test', action='store_true', default=False,
+                    help='Set to run tests')
+
+# the number of consecutive failed accept()'s before serve() gives up
+MAX_ACCEPT_ERRORS = 10
+
+def default_keyfile(address):
+    '''
+    The key file of a pool served on a unix socket, if none is passed
+    '''
+
+    if not isinstance(address, str):
+        raise ValueError('Must pass an authkey for a pool served on ' +\
+                         f'{address}!')
+
+    return address + '.key'
+
+def write_authkey(keyfile):
+    '''
+    Write a new random key to a file only its owner can access
+
+    returns: bytes
+        The key
+    '''
+
+    authkey = secrets.token_bytes(32)
+
+    fd = os.open(keyfile, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o600)
+    try:
+        # in case the file already existed w/ looser permissions
+        os.fchmod(fd, 0o600)
+        os.write(fd, authkey)
+    finally:
+        os.close(fd)
+
+    return authkey
+
+def read_authkey(keyfile):
+    '''
+    Read a key, refusing files that others can access
+
+    returns: bytes
+        The key
+    '''
+
+    mode = os.stat(keyfile).st_mode
+    if mode & 0o077:
+        raise ValueError(f'{keyfile} must only be accessible by its ' +\
+                         f'owner; has permissions {oct(mode & 0o777)}!')
+
+    with open(keyfile, 'rb') as f:
+        authkey = f.read()
+
+    if len(authkey) == 0:
+        raise ValueError(f'{keyfile} is empty!')
+
+    return authkey
+
+def _warm_worker():
+    '''
+    Import everything & load the compiled likelihood kernels by
+    evaluating a small mock posterior
+    '''
+
+    true_pars = {
+        'g1': 0.025,
+        'g2': -0.0125,
+        'theta_int': np.pi / 6.,
+        'sini': 0.7,
+        'v0': 5.,
+        'vcirc': 200.,
+        'rscale': 3.,
+        }
+    meta = {
+        'units': {'v_unit': Unit('km/s'), 'r_unit': Unit('kpc')},
+        'priors': {name: priors.UniformPrior(-1e3, 1e3) for name in true_pars},
+        'intensity': {'type': 'inclined_exp', 'flux': 1e4, 'hlr': 3.},
+        'velocity': {'model': 'centered'},
+        'run_options': {'native': True},
+        }
+    datacube_pars = {
+        'Nx': 8,
+        'Ny': 8,
+        'pix_scale': 0.5,
+        'true_flux': 1e4,
+        'true_hlr': 3.,
+        'v_model': 'centered',
+        'v_unit': Unit('km/s'),
+        'r_unit': Unit('kpc'),
+        'z': 0.3,
+        'R': 5000.,
+        'sky_sigma': 0.5,
+        }
+
+    datacube, _, _ = mocks.setup_likelihood_test(true_pars, datacube_pars)
+    pars = Pars(list(true_pars.keys()), meta)
+    log_posterior = LogPosterior(pars, datacube, likelihood='datacube')
+    log_posterior(pars.pars2theta(true_pars), datacube, pars)
+
+    return
+
+def _run_fit(log_posterior, datacube, pars, sampler, nwalkers, nsteps):
+    '''
+    Run one of the mcmc.py runners serially & return its samples
+
+    returns: dict
+    '''
+
+    ndim = len(pars.sampled)
+    if sampler in ENSEMBLE_RUNNERS:
+        args = [nwalkers, ndim, log_posterior, datacube, pars]
+    else:
+        args = [nwalkers, ndim, log_posterior.log_likelihood,
+                log_posterior.log_prior, datacube, pars]
+
+    runner = build_mcmc_runner(sampler, args, {})
+
+    start = time()
+    runner.run(schwimmbad.SerialPool(), nsteps=nsteps, vb=False)
+    wall_time = time() - start
+
+    result = {
+        'sampler': sampler,
+        'wall_time': wall_time,
+        'ncall': runner.get_ncall(),
+        }
+
+    if sampler in ENSEMBLE_RUNNERS:
+        result['chain'] = runner.sampler.get_chain()
+    elif sampler == 'poco':
+        result['samples'] = runner.get_particles()
+    else:
+        result['samples'] = runner.get_samples()
+        result['logz'] = runner.logz
+        result['logzerr'] = runner.logzerr
+
+    return result
+
+def _worker_loop(conn, warm=True):
+    '''
+    The main loop of a worker process. Each message is a tuple of
+    (kind, *args) & is answered w/ (status, reply)
+
+    conn: multiprocessing.Connection
+        The worker end of its pipe to the pool
+    warm: bool
+        Set to warm up the worker before taking jobs
+    '''
+
+    if warm is True:
+        _warm_worker()
+
+    # handle -> (log_posterior, datacube, pars)
+    posteriors = {}
+
+    while True:
+        try:
+            msg = conn.recv()
+        except EOFError:
+            break
+
+        kind = msg[0]
+        if kind == 'stop':
+            break
+
+        try:
+            if kind == 'ping':
+                reply = os.getpid()
+
+            elif kind == 'register':
+                handle, payload = msg[1:]
+                datacube, pars, likelihood = pickle.loads(payload)
+                log_posterior = LogPosterior(
+                    pars, datacube, likelihood=likelihood
+                    )
+                posteriors[handle] = (log_posterior, datacube, pars)
+                reply = None
+
+            elif kind == 'drop':
+                posteriors.pop(msg[1], None)
+                reply = None
+
+            elif kind == 'loglike':
+                handle, thetas = msg[1:]
+                log_posterior, datacube, pars = posteriors[handle]
+                reply = np.array([
+                    log_posterior.log_likelihood(theta, datacube)
+                    for theta in thetas
+                    ])
+
+            elif kind == 'loglike_each':
+                jobs = msg[1]
+                reply = []
+                for handle, theta in jobs:
+                    log_posterior, datacube, pars = posteriors[handle]
+                    reply.append(log_posterior.log_likelihood(theta, datacube))
+                reply = np.array(reply)
+
+            elif kind == 'logpost':
+                handle, thetas = msg[1:]
+                log_posterior, datacube, pars = posteriors[handle]
+                reply = np.array([
+                    log_posterior(theta, datacube, pars)[0]
+                    for theta in thetas
+                    ])
+
+            elif kind == 'fit':
+                handle, sampler, nwalkers, nsteps = msg[1:]
+                log_posterior, datacube, pars = posteriors[handle]
+                reply = _run_fit(
+                    log_posterior, datacube, pars, sampler, nwalkers, nsteps
+                    )
+
+            else:
+                raise ValueError(f'{kind} is not a valid worker job!')
+
+            conn.send(('ok', reply))
+
+        except Exception:
+            conn.send(('error', traceback.format_exc()))
+
+    conn.close()
+
+    return
+
+class _Worker(object):
+    '''
+    The pool's view of a worker process
+    '''
+
+    def __init__(self, index, warm=True):
+        self.index = index
+        self.conn, child_conn = mp.Pipe()
+        self.process = mp.Process(
+            target=_worker_loop, args=(child_conn, warm), daemon=True
+            )
+        self.process.start()
+        child_conn.close()
+
+        # the handles this worker has set up
+        self.handles = set()
+
+        return
+
+    def request(self, *msg):
+        self.conn.send(msg)
+        status, reply = self.conn.recv()
+
+        if status == 'error':
+            raise RuntimeError(f'Worker {self.index} failed:\n{reply}')
+
+        return reply
+
+class WarmPool(object):
+    '''
+    A fixed set of warm worker processes that outlive individual fits.
+    Safe to use from several threads, e.g. the connections of serve()
+    '''
+
+    def __init__(self, nworkers=None, warm=True):
+        '''
+        nworkers: int
+            Number of worker processes. Defaults to the number of cores
+        warm: bool
+            Set to warm up each worker before it takes jobs
+        '''
+
+        if nworkers is None:
+            nworkers = mp.cpu_count()
+        if nworkers < 1:
+            raise ValueError('nworkers must be positive!')
+
+        self.nworkers = nworkers
+        self.workers = [_Worker(i, warm=warm) for i in range(nworkers)]
+
+        self._idle = queue.Queue()
+        for worker in self.workers:
+            self._idle.put(worker)
+
+        # handle -> pickled (datacube, pars, likelihood)
+        self._registry = {}
+        self._lock = threading.Lock()
+
+        self.closed = False
+
+        return
+
+    @property
+    def size(self):
+        return self.nworkers
+
+    def register(self, datacube, pars, likelihood='datacube'):
+        '''
+        Register a posterior for later jobs
+
+        datacube: DataCube
+            The datavector
+        pars: Pars
+            The sampled & meta pars
+        likelihood: str
+            The registered likelihood type
+
+        returns: str
+            The handle of the posterior
+        '''
+
+        payload = pickle.dumps((datacube, pars, likelihood))
+        handle = uuid.uuid4().hex
+
+        with self._lock:
+            self._registry[handle] = payload
+
+        return handle
+
+    def drop(self, handle):
+        '''
+        Forget a registered posterior. Workers free it the next time
+        they are used
+        '''
+
+        with self._lock:
+            if handle not in self._registry:
+                raise KeyError(f'{handle} is not a registered handle!')
+            del self._registry[handle]
+
+        return
+
+    @property
+    def handles(self):
+        with self._lock:
+            return list(self._registry.keys())
+
+    def _acquire(self, n):
+        '''
+        Wait for one idle worker, then take up to n-1 more that are idle.
+        Never waiting on more than one avoids deadlocks between jobs
+        '''
+
+        if self.closed is True:
+            raise RuntimeError('The pool has been closed!')
+
+        workers = [self._idle.get()]
+        while len(workers) < n:
+            try:
+                workers.append(self._idle.get_nowait())
+            except queue.Empty:
+                break
+
+        return workers
+
+    def _release(self, workers):
+        for worker in workers:
+            self._idle.put(worker)
+
+        return
+
+    def _prepare(self, worker, handle):
+        '''
+        Make sure the worker has set up the posterior, & free any that
+        were dropped
+        '''
+
+        with self._lock:
+            payload = self._registry.get(handle)
+            dropped = [h for h in worker.handles if h not in self._registry]
+
+        for h in dropped:
+            worker.request('drop', h)
+            worker.handles.discard(h)
+
+        if payload is None:
+            raise KeyError(f'{handle} is not a registered handle!')
+
+        if handle not in worker.handles:
+            worker.request('register', handle, payload)
+            worker.handles.add(handle)
+
+        return
+
+    def _gather(self, workers):
+        '''
+        Receive the reply of each worker that was sent a job. All are
+        received before raising, so that no reply is left in a pipe
+        '''
+
+        results, errors = [], []
+        for worker in workers:
+            status, reply = worker.conn.recv()
+            if status == 'error':
+                errors.append(f'Worker {worker.index} failed:\n{reply}')
+            else:
+                results.append(reply)
+
+        if len(errors) > 0:
+            raise RuntimeError('\n'.join(errors))
+
+        return results
+
+    def _batch(self, kind, handle, thetas):
+        thetas = np.atleast_2d(np.asarray(thetas, dtype=float))
+
+        workers = self._acquire(len(thetas))
+        try:
+            # set up every worker before any is sent a job
+            for worker in workers:
+                self._prepare(worker, handle)
+
+            chunks = np.array_split(thetas, len(workers))
+            for worker, chunk in zip(workers, chunks):
+                worker.conn.send((kind, handle, chunk))
+
+            results = self._gather(workers)
+        finally:
+            self._release(workers)
+
+        return np.concatenate(results)
+
+    def loglike(self, handle, thetas):
+        '''
+        The log likelihood of a batch of samples, split across the idle
+        workers
+
+        handle: str
+            The registered posterior
+        thetas: np.ndarray
+            The (Nsamples, Ndim) samples
+
+        returns: np.ndarray
+        '''
+        return self._batch('loglike', handle, thetas)
+
+    def logpost(self, handle, thetas):
+        '''
+        As loglike(), for the log posterior
+        '''
+        return self._batch('logpost', handle, thetas)
+
+    def loglike_each(self, handles, thetas):
+        '''
+        The log likelihood of one sample for each of several posteriors,
+        e.g. the per-galaxy terms of a joint posterior, split across the
+        idle workers
+
+        handles: list
+            The registered posteriors
+        thetas: list
+            The sample of each posterior, in its own sampled order
+
+        returns: np.ndarray
+        '''
+
+        if len(handles) != len(thetas):
+            raise ValueError('Must pass one sample per handle!')
+
+        jobs = [(handle, np.asarray(theta, dtype=float))
+                for handle, theta in zip(handles, thetas)]
+
+        workers = self._acquire(len(jobs))
+        try:
+            chunks = np.array_split(np.arange(len(jobs)), len(workers))
+            for worker, chunk in zip(workers, chunks):
+                for i in chunk:
+                    self._prepare(worker, jobs[i][0])
+
+            for worker, chunk in zip(workers, chunks):
+                worker.conn.send(('loglike_each', [jobs[i] for i in chunk]))
+
+            results = self._gather(workers)
+        finally:
+            self._release(workers)
+
+        return np.concatenate(results)
+
+    def fit(self, handle, sampler, nwalkers, nsteps=None):
+        '''
+        Run a fit on a single worker
+
+        handle: str
+            The registered posterior
+        sampler: str
+            A registered runner type; see mcmc.RUNNER_TYPES
+        nwalkers: int
+            Number of walkers / particles / live points
+        nsteps: int
+            Number of steps, if needed by the sampler
+
+        returns: dict
+            The run summary & the chain or samples
+        '''
+
+        workers = self._acquire(1)
+        try:
+            self._prepare(workers[0], handle)
+            result = workers[0].request(
+                'fit', handle, sampler, nwalkers, nsteps
+                )
+        finally:
+            self._release(workers)
+
+        return result
+
+    def ping(self):
+        '''
+        The pids of the workers, once each is idle
+        '''
+
+        workers = [self._idle.get() for i in range(self.nworkers)]
+        try:
+            pids = [worker.request('ping') for worker in workers]
+        finally:
+            self._release(workers)
+
+        return pids
+
+    def close(self):
+        if self.closed is True:
+            return
+
+        self.closed = True
+        for worker in self.workers:
+            try:
+                worker.conn.send(('stop',))
+            except (OSError, BrokenPipeError):
+                pass
+        for worker in self.workers:
+            worker.process.join(timeout=10)
+            if worker.process.is_alive():
+                worker.process.terminate()
+
+        return
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def serve(self, address, authkey=None, ready=None):
+        '''
+        Serve the pool on a local socket until a client asks for a
+        shutdown. Each client connection is handled by its own thread
+
+        address: str, tuple
+            A unix socket path, or a ('localhost', port) tuple
+        authkey: bytes
+            The shared key clients must use. If None, a random key is
+            written to default_keyfile(address) & removed on shutdown
+        ready: threading.Event
+            Set once the pool is accepting connections, if passed
+        '''
+
+        family = 'AF_UNIX' if isinstance(address, str) else 'AF_INET'
+
+        keyfile = None
+        if authkey is None:
+            keyfile = default_keyfile(address)
+            authkey = write_authkey(keyfile)
+
+        if family == 'AF_UNIX':
+            # no window where the socket is open to other users
+            umask = os.umask(0o177)
+            try:
+                listener = Listener(address, family=family, authkey=authkey)
+            finally:
+                os.umask(umask)
+            os.chmod(address, 0o600)
+        else:
+            listener = Listener(address, family=family, authkey=authkey)
+
+        stop = threading.Event()
+
+        def handle_client(conn):
+            while not stop.is_set():
+                try:
+                    msg = conn.recv()
+                except (EOFError, OSError):
+                    break
+
+                kind, args = msg[0], msg[1:]
+                try:
+                    if kind == 'shutdown':
+                        stop.set()
+                        conn.send(('ok', None))
+                        # unblock the accept() below
+                        try:
+                            Client(address, family=family,
+                                   authkey=authkey).close()
+                        except OSError:
+                            pass
+                        break
+                    elif kind in ['register', 'drop', 'loglike', 'logpost',
+                                  'loglike_each', 'fit', 'ping']:
+                        reply = getattr(self, kind)(*args)
+                    elif kind == 'handles':
+                        reply = self.handles
+                    else:
+                        raise ValueError(f'{kind} is not a valid request!')
+                    conn.send(('ok', reply))
+                except Exception:
+                    conn.send(('error', traceback.format_exc()))
+
+            conn.close()
+
+            return
+
+        if ready is not None:
+            ready.set()
+
+        try:
+            Nerrors = 0
+            while not stop.is_set():
+                try:
+                    conn = listener.accept()
+                except mp.AuthenticationError as e:
+                    print(f'Warning: rejected a client connection: {e}')
+                    continue
+                except OSError as e:
+                    if stop.is_set():
+                        break
+                    Nerrors += 1
+                    if Nerrors >= MAX_ACCEPT_ERRORS:
+                        raise
+                    print(f'Warning: accept() failed ({e}); retrying')
+                    stop.wait(min(0.1 * 2**Nerrors, 5.))
+                    continue
+                Nerrors = 0
+                if stop.is_set():
+                    conn.close()
+                    break
+                thread = threading.Thread(
+                    target=handle_client, args=(conn,), daemon=True
+                    )
+                thread.start()
+        finally:
+            listener.close()
+            if keyfile is not None:
+                os.remove(keyfile)
+
+        return
+
+class WorkerClient(object):
+    '''
+    A connection to a WarmPool served by WarmPool.serve(), w/ the same
+    job interface
+    '''
+
+    def __init__(self, address, authkey=None):
+        '''
+        address: str, tuple
+            The unix socket path, or ('localhost', port) tuple
+        authkey: bytes
+            The shared key of the pool. If None, read from
+            default_keyfile(address)
+        '''
+
+        if authkey is None:
+            authkey = read_authkey(default_keyfile(address))
+
+        family = 'AF_UNIX' if isinstance(address, str) else 'AF_INET'
+        self.conn = Client(address, family=family, authkey=authkey)
+
+        return
+
+    def _request(self, *msg):
+        self.conn.send(msg)
+        status, reply = self.conn.recv()
+
+        if status == 'error':
+            raise RuntimeError(f'Worker pool request failed:\n{reply}')
+
+        return reply
+
+    def register(self, datacube, pars, likelihood='datacube'):
+        return self._request('register', datacube, pars, likelihood)
+
+    def drop(self, handle):
+        return self._request('drop', handle)
+
+    def loglike(self, handle, thetas):
+        return self._request('loglike', handle, thetas)
+
+    def logpost(self, handle, thetas):
+        return self._request('logpost', handle, thetas)
+
+    def loglike_each(self, handles, thetas):
+        return self._request('loglike_each', handles, thetas)
+
+    def fit(self, handle, sampler, nwalkers, nsteps=None):
+        return self._request('fit', handle, sampler, nwalkers, nsteps)
+
+    def ping(self):
+        return self._request('ping')
+
+    @property
+    def handles(self):
+        return self._request('handles')
+
+    def shutdown(self):
+        '''
+        Stop the server from accepting requests. The pool itself is
+        closed by the serving process
+        '''
+        return self._request('shutdown')
+
+    def close(self):
+        self.conn.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+def main(args):
+    '''
+    For now, just used for testing the pool & client
+    '''
+
+    true_pars = {
+        'g1': 0.025,
+        'g2': -0.0125,
+        'theta_int': np.pi / 6.,
+        'sini': 0.7,
+        'v0': 5.,
+        'vcirc': 200.,
+        'rscale': 3.,
+        }
+    meta = {
+        'units': {'v_unit': Unit('km/s'), 'r_unit': Unit('kpc')},
+        'priors': {
+            'g1': priors.GaussPrior(0., 0.1),
+            'g2': priors.GaussPrior(0., 0.1),
+            'theta_int': priors.UniformPrior(0., np.pi),
+            'sini': priors.UniformPrior(0., 1.),
+            'v0': priors.UniformPrior(0, 20),
+            'vcirc': priors.GaussPrior(200, 20),
+            'rscale': priors.UniformPrior(0, 10),
+            },
+        'intensity': {'type': 'inclined_exp', 'flux': 3.8e4, 'hlr': 3.5},
+        'velocity': {'model': 'centered'},
+        'run_options': {'native': True},
+        }
+    datacube_pars = {
+        'Nx': 16,
+        'Ny': 16,
+        'pix_scale': 0.5,
+        'true_flux': 3.8e4,
+        'true_hlr': 3.5,
+        'v_model': 'centered',
+        'v_unit': Unit('km/s'),
+        'r_unit': Unit('kpc'),
+        'z': 0.3,
+        'R': 5000.,
+        'sky_sigma': 0.5,
+        }
+
+    datacube, _, _ = mocks.setup_likelihood_test(true_pars, datacube_pars)
+    pars = Pars(list(true_pars.keys()), meta)
+    log_posterior = LogPosterior(pars, datacube, likelihood='datacube')
+
+    theta0 = pars.pars2theta(true_pars)
+    thetas = theta0 + 0.01*np.random.randn(10, len(theta0))
+    truth = np.array([log_posterior.log_likelihood(t, datacube)
+                      for t in thetas])
+
+    print('Testing the in-process pool')
+    with WarmPool(nworkers=2) as pool:
+        assert len(set(pool.ping())) == 2
+        handle = pool.register(datacube, pars)
+        assert np.allclose(pool.loglike(handle, thetas), truth)
+        logpost = pool.logpost(handle, thetas)
+        assert np.allclose(
+            logpost, [log_posterior(t, datacube, pars)[0] for t in thetas]
+            )
+
+        # a second batch reuses the set up posteriors
+        start = time()
+        pool.loglike(handle, thetas)
+        print(f'A batch of {len(thetas)} took {1e3*(time()-start):.1f} ms')
+
+        # one sample for each of several posteriors
+        other = pool.register(datacube, pars)
+        each = pool.loglike_each([handle, other, handle], thetas[:3])
+        assert np.allclose(each, truth[:3])
+
+        pool.drop(handle)
+        try:
+            pool.loglike(handle, thetas)
+            raise AssertionError('A dropped handle was not caught!')
+        except KeyError:
+            pass
+
+    print('Testing the served pool')
+    address = os.path.join(tempfile.mkdtemp(), 'pool.sock')
+    pool = WarmPool(nworkers=2)
+    ready = threading.Event()
+    server = threading.Thread(target=pool.serve, args=(address,),
+                              kwargs={'ready': ready})
+    server.start()
+    ready.wait()
+
+    assert os.stat(address).st_mode & 0o077 == 0
+    assert os.stat(default_keyfile(address)).st_mode & 0o077 == 0
+
+    # a client w/ the wrong key is turned away & the server keeps going
+    try:
+        WorkerClient(address, authkey=b'not-the-key')
+        raise AssertionError('A bad key was not caught!')
+    except mp.AuthenticationError:
+        pass
+
+    with WorkerClient(address) as client:
+        handle = client.register(datacube, pars)
+        assert client.handles == [handle]
+        assert np.allclose(client.loglike(handle, thetas), truth)
+
+        try:
+            client.loglike('not-a-handle', thetas)
+            raise AssertionError('A bad handle was not caught!')
+        except RuntimeError:
+            pass
+
+        result = client.fit(handle, 'emcee', 16, nsteps=5)
+        assert result['chain'].shape == (5, 16, len(theta0))
+        assert result['ncall'] == 5*16
+
+        client.shutdown()
+
+    server.join()
+    pool.close()
+    assert not os.path.exists(default_keyfile(address))
+
+    keyfile = os.path.join(tempfile.mkdtemp(), 'key')
+    write_authkey(keyfile)
+    os.chmod(keyfile, 0o644)
+    try:
+        read_authkey(keyfile)
+        raise AssertionError('A readable key file was not caught!')
+    except ValueError:
+        pass
+
+    return 0
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    if args.test is True:
+        print('Starting tests')
+        rc = main(args)
+
+        if rc == 0:
+            print('All tests ran succesfully')
+        else:
+            print(f'Tests failed with return code of {rc}')
+    else:
+        if args.address is None:
+            raise ValueError('Must pass an address to serve the pool on!')
+        if args.keyfile is not None:
+            authkey = read_authkey(args.keyfile)
+        else:
+            authkey = None
+        with WarmPool(nworkers=args.nworkers) as pool:
+            print(f'Serving a pool of {pool.size} warm workers on ' +\
+                  f'{args.address}')
+            pool.serve(args.address, authkey=authkey)